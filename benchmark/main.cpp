@@ -0,0 +1,565 @@
+// Headless benchmark: renders recorded camera views of models and prints statistics of every counter.
+// It only needs the rasterizer and the renderer, so it can run on machines without a display.
+//
+// usage: benchmark -camera <file> [-warmup N] [-frames M] [-size W H] [-assets dir] [-optimize] [-nocull] [-copies N] [-threads N] [-format csv|json] [-out file] model...
+// the camera file is the viewer's recording format: a uint32 number of views, then that many int32[16] s15.16 view matrices.
+// every model is loaded from <assets>/<model>/<model>.obj and benchmarked on its own.
+
+#include <renderer.h>
+#include <rasterizer.h>
+#include <s1516.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <chrono>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+const char* instruction_set_name(instructionset_t instruction_set)
+{
+    switch (instruction_set)
+    {
+    case instructionset_scalar: return "Scalar";
+    case instructionset_avx2: return "AVX2";
+    case instructionset_avx512: return "AVX-512";
+    default: return "Unknown";
+    }
+}
+
+std::string cpu_name()
+{
+    char cpuname[0x40];
+    memset(cpuname, 0, sizeof(cpuname));
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        uint32_t regs[4];
+#ifdef _MSC_VER
+        __cpuid((int*)regs, 0x80000002 + i);
+#else
+        __get_cpuid(0x80000002 + i, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        memcpy(cpuname + 16 * i, regs, sizeof(regs));
+    }
+
+    return cpuname;
+}
+
+typedef struct counter_t
+{
+    std::string name;
+    const char* unit;
+    // one value per measured frame
+    std::vector<double> values;
+} counter_t;
+
+typedef struct counter_summary_t
+{
+    double min;
+    double median;
+    double p99;
+    double mean;
+    double stddev;
+} counter_summary_t;
+
+counter_summary_t summarize(const std::vector<double>& values)
+{
+    counter_summary_t summary;
+    memset(&summary, 0, sizeof(summary));
+
+    if (values.empty())
+    {
+        return summary;
+    }
+
+    std::vector<double> sorted = values;
+    std::sort(begin(sorted), end(sorted));
+    size_t n = sorted.size();
+
+    summary.min = sorted[0];
+
+    if (n % 2 == 1)
+        summary.median = sorted[n / 2];
+    else
+        summary.median = (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+
+    // nearest rank
+    size_t p99_rank = (n * 99 + 99) / 100;
+    summary.p99 = sorted[p99_rank - 1];
+
+    double total = 0.0;
+    for (double v : sorted)
+        total += v;
+    summary.mean = total / n;
+
+    double total_squared_deviation = 0.0;
+    for (double v : sorted)
+        total_squared_deviation += (v - summary.mean) * (v - summary.mean);
+    summary.stddev = sqrt(total_squared_deviation / n);
+
+    return summary;
+}
+
+typedef struct model_result_t
+{
+    std::string name;
+    float acmr_before;
+    float acmr_after;
+    std::vector<counter_t> counters;
+} model_result_t;
+
+// renders the warmup frames, then the measured frames while recording every counter of every frame
+bool benchmark_model(
+    renderer_t* rd, const std::string& assets_path, const std::string& model_name,
+    const std::vector<std::array<int32_t, 16>>& views, int warmup_frames, int measured_frames,
+    const int32_t proj[16], const model_load_config_t* model_load_config, int copies, model_result_t* result)
+{
+    framebuffer_t* fb = renderer_get_framebuffer(rd);
+
+    scene_t* sc = new_scene();
+    scene_set_projection(sc, (int32_t*)proj);
+
+    std::string filename = assets_path + model_name + "/" + model_name + ".obj";
+    std::string mtl_basepath = assets_path + model_name + "/";
+    uint32_t first_model_id, num_model_ids;
+    if (!scene_add_models_ex(sc, filename.c_str(), mtl_basepath.c_str(), model_load_config, &first_model_id, &num_model_ids))
+    {
+        fprintf(stderr, "Failed to load %s\n", filename.c_str());
+        delete_scene(sc);
+        return false;
+    }
+
+    // a crowd of copies*copies scaled down copies on a grid over the original footprint, so the recorded views still frame it
+    int32_t min_position[3] = { INT32_MAX, INT32_MAX, INT32_MAX };
+    int32_t max_position[3] = { INT32_MIN, INT32_MIN, INT32_MIN };
+    for (uint32_t model_id = first_model_id; model_id < first_model_id + num_model_ids; model_id++)
+    {
+        int32_t model_min[3], model_max[3];
+        scene_get_model_bounds(sc, model_id, model_min, model_max);
+        for (int32_t i = 0; i < 3; i++)
+        {
+            min_position[i] = std::min(min_position[i], model_min[i]);
+            max_position[i] = std::max(max_position[i], model_max[i]);
+        }
+    }
+
+    float center[3], extent[3];
+    for (int32_t i = 0; i < 3; i++)
+    {
+        center[i] = ((float)min_position[i] + (float)max_position[i]) / 2.0f / 65536.0f;
+        extent[i] = ((float)max_position[i] - (float)min_position[i]) / 65536.0f;
+    }
+
+    float scale = 1.0f / copies;
+    for (int grid_z = 0; grid_z < copies; grid_z++)
+    {
+        for (int grid_x = 0; grid_x < copies; grid_x++)
+        {
+            float x = center[0] + ((grid_x + 0.5f) / copies - 0.5f) * extent[0];
+            float z = center[2] + ((grid_z + 0.5f) / copies - 0.5f) * extent[2];
+            int32_t transform[16] = {
+                s1516_flt(scale), 0, 0, 0,
+                0, s1516_flt(scale), 0, 0,
+                0, 0, s1516_flt(scale), 0,
+                s1516_flt(x - scale * center[0]), s1516_flt(center[1] - scale * center[1]), s1516_flt(z - scale * center[2]), s1516_int(1)
+            };
+
+            for (uint32_t model_id = first_model_id; model_id < first_model_id + num_model_ids; model_id++)
+            {
+                uint32_t instance_id;
+                scene_add_instance(sc, model_id, &instance_id);
+                scene_set_instance_transform(sc, instance_id, transform);
+            }
+        }
+    }
+
+    int32_t num_renderer_pcs = renderer_get_num_perfcounters(rd);
+    int32_t num_framebuffer_pcs = framebuffer_get_num_perfcounters(fb);
+    int32_t num_tile_pcs = framebuffer_get_num_tile_perfcounters(fb);
+    int32_t num_renderer_stats = renderer_get_num_stats(rd);
+    int32_t num_stats = framebuffer_get_num_stats(fb);
+    int32_t num_tiles = framebuffer_get_total_num_tiles(fb);
+
+    std::vector<const char*> renderer_pc_names(num_renderer_pcs);
+    std::vector<const char*> framebuffer_pc_names(num_framebuffer_pcs);
+    std::vector<const char*> tile_pc_names(num_tile_pcs);
+    std::vector<const char*> renderer_stat_names(num_renderer_stats);
+    std::vector<const char*> stat_names(num_stats);
+    renderer_get_perfcounter_names(rd, renderer_pc_names.data());
+    framebuffer_get_perfcounter_names(fb, framebuffer_pc_names.data());
+    framebuffer_get_tile_perfcounter_names(fb, tile_pc_names.data());
+    renderer_get_stat_names(rd, renderer_stat_names.data());
+    framebuffer_get_stat_names(fb, stat_names.data());
+
+    result->name = model_name;
+    result->counters.clear();
+    scene_get_model_acmr(sc, first_model_id, num_model_ids, &result->acmr_before, &result->acmr_after);
+
+    counter_t frame_counter;
+    frame_counter.name = "frame";
+    frame_counter.unit = "us";
+    result->counters.push_back(frame_counter);
+
+    for (const char* name : renderer_pc_names)
+    {
+        counter_t counter;
+        counter.name = name;
+        counter.unit = "us";
+        result->counters.push_back(counter);
+    }
+    for (const char* name : framebuffer_pc_names)
+    {
+        counter_t counter;
+        counter.name = name;
+        counter.unit = "us";
+        result->counters.push_back(counter);
+    }
+    for (const char* name : tile_pc_names)
+    {
+        counter_t counter;
+        counter.name = name;
+        counter.unit = "us";
+        result->counters.push_back(counter);
+    }
+    for (const char* name : renderer_stat_names)
+    {
+        counter_t counter;
+        counter.name = name;
+        counter.unit = "count";
+        result->counters.push_back(counter);
+    }
+    for (const char* name : stat_names)
+    {
+        counter_t counter;
+        counter.name = name;
+        counter.unit = "count";
+        result->counters.push_back(counter);
+    }
+
+    std::vector<uint64_t> renderer_pcs(num_renderer_pcs);
+    std::vector<uint64_t> framebuffer_pcs(num_framebuffer_pcs);
+    std::vector<uint64_t> tile_pcs(num_tiles * num_tile_pcs);
+    std::vector<uint64_t> renderer_stats(num_renderer_stats);
+    std::vector<uint64_t> stats(num_stats);
+
+    double renderer_us_per_tick = 1000000.0 / renderer_get_perfcounter_frequency(rd);
+    double framebuffer_us_per_tick = 1000000.0 / framebuffer_get_perfcounter_frequency(fb);
+
+    for (int frame_i = 0; frame_i < warmup_frames + measured_frames; frame_i++)
+    {
+        // the measured frames start over from the first view
+        int view_i = frame_i < warmup_frames ? frame_i : frame_i - warmup_frames;
+        scene_set_view(sc, (int32_t*)views[view_i % views.size()].data());
+
+        renderer_reset_perfcounters(rd);
+
+        auto frame_begin = std::chrono::steady_clock::now();
+        renderer_render_scene(rd, sc);
+        auto frame_end = std::chrono::steady_clock::now();
+
+        if (frame_i < warmup_frames)
+        {
+            continue;
+        }
+
+        renderer_get_perfcounters(rd, renderer_pcs.data());
+        framebuffer_get_perfcounters(fb, framebuffer_pcs.data());
+        framebuffer_get_tile_perfcounters(fb, tile_pcs.data());
+        renderer_get_stats(rd, renderer_stats.data());
+        framebuffer_get_stats(fb, stats.data());
+
+        size_t counter_i = 0;
+        result->counters[counter_i++].values.push_back(std::chrono::duration<double, std::micro>(frame_end - frame_begin).count());
+
+        for (uint64_t pc : renderer_pcs)
+            result->counters[counter_i++].values.push_back(pc * renderer_us_per_tick);
+
+        for (uint64_t pc : framebuffer_pcs)
+            result->counters[counter_i++].values.push_back(pc * framebuffer_us_per_tick);
+
+        // summed over all tiles
+        for (int32_t pc_i = 0; pc_i < num_tile_pcs; pc_i++)
+        {
+            uint64_t total = 0;
+            for (int32_t tile_id = 0; tile_id < num_tiles; tile_id++)
+                total += tile_pcs[tile_id * num_tile_pcs + pc_i];
+            result->counters[counter_i++].values.push_back(total * framebuffer_us_per_tick);
+        }
+
+        for (uint64_t stat : renderer_stats)
+            result->counters[counter_i++].values.push_back((double)stat);
+
+        for (uint64_t stat : stats)
+            result->counters[counter_i++].values.push_back((double)stat);
+    }
+
+    delete_scene(sc);
+    return true;
+}
+
+void print_usage()
+{
+    fprintf(stderr,
+        "usage: benchmark -camera <file> [options] model...\n"
+        "  -camera <file>     recorded camera views, as saved by the viewer\n"
+        "  -warmup <N>        frames rendered before measuring (default 10)\n"
+        "  -frames <M>        measured frames, cycling through the views (default: one per view)\n"
+        "  -size <W> <H>      framebuffer size (default 1280 720)\n"
+        "  -assets <dir>      where the models are (default ../viewer/assets/)\n"
+        "  -optimize          reorder the models' triangles and vertices for the vertex cache when loading them\n"
+        "  -nocull            don't cull clusters of triangles before transforming them, to compare with\n"
+        "  -shade             draw to a visibility buffer and shade the visible pixels from the models' texcoords and normals\n"
+        "  -msaa              4x multisampling (can't be combined with -shade)\n"
+        "  -copies <N>        render a grid of NxN scaled down copies of each model (default 1)\n"
+        "  -threads <N>       number of threads of the framebuffer (default: one per hardware thread)\n"
+        "  -format csv|json   output format (default csv)\n"
+        "  -out <file>        output file (default stdout)\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::string camera_filename;
+    std::string assets_path = "../viewer/assets/";
+    std::string format = "csv";
+    std::string out_filename;
+    int warmup_frames = 10;
+    int measured_frames = -1;
+    int fbwidth = 1280;
+    int fbheight = 720;
+    model_load_config_t model_load_config = {};
+    bool cull_clusters = true;
+    bool shade = false;
+    bool msaa = false;
+    int copies = 1;
+    int num_threads = 0;
+    std::vector<std::string> model_names;
+
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        std::string arg = argv[arg_i];
+        bool has_value = arg_i + 1 < argc;
+
+        if (arg == "-camera" && has_value)
+            camera_filename = argv[++arg_i];
+        else if (arg == "-warmup" && has_value)
+            warmup_frames = atoi(argv[++arg_i]);
+        else if (arg == "-frames" && has_value)
+            measured_frames = atoi(argv[++arg_i]);
+        else if (arg == "-size" && arg_i + 2 < argc)
+        {
+            fbwidth = atoi(argv[++arg_i]);
+            fbheight = atoi(argv[++arg_i]);
+        }
+        else if (arg == "-assets" && has_value)
+        {
+            assets_path = argv[++arg_i];
+            if (!assets_path.empty() && assets_path.back() != '/' && assets_path.back() != '\\')
+                assets_path += "/";
+        }
+        else if (arg == "-optimize")
+            model_load_config.optimize_vertex_order = 1;
+        else if (arg == "-nocull")
+            cull_clusters = false;
+        else if (arg == "-shade")
+            shade = true;
+        else if (arg == "-msaa")
+            msaa = true;
+        else if (arg == "-copies" && has_value)
+            copies = atoi(argv[++arg_i]);
+        else if (arg == "-threads" && has_value)
+            num_threads = atoi(argv[++arg_i]);
+        else if (arg == "-format" && has_value)
+            format = argv[++arg_i];
+        else if (arg == "-out" && has_value)
+            out_filename = argv[++arg_i];
+        else if (arg[0] == '-')
+        {
+            print_usage();
+            return 1;
+        }
+        else
+            model_names.push_back(arg);
+    }
+
+    if (camera_filename.empty() || model_names.empty() || (format != "csv" && format != "json") ||
+        warmup_frames < 0 || fbwidth <= 0 || fbheight <= 0 || copies <= 0 || num_threads < 0 || (shade && msaa))
+    {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<std::array<int32_t, 16>> views;
+    {
+        FILE* f = fopen(camera_filename.c_str(), "rb");
+        if (!f)
+        {
+            fprintf(stderr, "Failed to open %s\n", camera_filename.c_str());
+            return 1;
+        }
+
+        uint32_t num_views = 0;
+        bool ok = fread(&num_views, sizeof(num_views), 1, f) == 1 && num_views > 0;
+        if (ok)
+        {
+            views.resize(num_views);
+            ok = fread(views.data(), sizeof(views[0]), views.size(), f) == views.size();
+        }
+        fclose(f);
+
+        if (!ok)
+        {
+            fprintf(stderr, "Failed to read the views of %s\n", camera_filename.c_str());
+            return 1;
+        }
+    }
+
+    if (measured_frames <= 0)
+    {
+        measured_frames = (int)views.size();
+    }
+
+    // the same projection as the viewer's: 70 degrees of vertical field of view, from 0.5 to 10, left handed
+    int32_t proj[16];
+    {
+        float fovy = 70.0f * 3.14159265f / 180.0f;
+        float n = 0.5f, f = 10.0f;
+        float h = 1.0f / tanf(fovy / 2.0f);
+        float w = h / ((float)fbwidth / fbheight);
+        float q = f / (f - n);
+        float fproj[16] = {
+            w, 0, 0, 0,
+            0, h, 0, 0,
+            0, 0, q, 1,
+            0, 0, -n * q, 0
+        };
+        for (int32_t i = 0; i < 16; i++)
+        {
+            proj[i] = s1516_flt(fproj[i]);
+        }
+    }
+
+    // the same configuration as new_renderer's, apart from the number of threads, shading and multisampling
+    framebuffer_config_t fb_config;
+    fb_config.num_threads = num_threads;
+    fb_config.num_binners = 0;
+    fb_config.async_flush = 1;
+    fb_config.instruction_set = instructionset_auto;
+    fb_config.depth_only = 0;
+    fb_config.tile_flush_threshold_in_dwords = 0;
+    fb_config.command_memory_budget_in_kb = 0;
+    fb_config.tile_width_in_pixels = 0;
+    fb_config.visibility_buffer = shade ? 1 : 0;
+    fb_config.msaa = msaa ? 1 : 0;
+    fb_config.share_threads_with = NULL;
+
+    renderer_t* rd = new_renderer_ex(fbwidth, fbheight, &fb_config);
+    framebuffer_t* fb = renderer_get_framebuffer(rd);
+    framebuffer_enable_perfcounters(fb, 1);
+    renderer_set_cluster_culling(rd, cull_clusters);
+
+    std::vector<model_result_t> results;
+    for (const std::string& model_name : model_names)
+    {
+        model_result_t result;
+        if (!benchmark_model(rd, assets_path, model_name, views, warmup_frames, measured_frames, proj, &model_load_config, copies, &result))
+        {
+            delete_renderer(rd);
+            return 1;
+        }
+        results.push_back(result);
+    }
+
+    FILE* out = stdout;
+    if (!out_filename.empty())
+    {
+        out = fopen(out_filename.c_str(), "w");
+        if (!out)
+        {
+            fprintf(stderr, "Failed to open %s\n", out_filename.c_str());
+            delete_renderer(rd);
+            return 1;
+        }
+    }
+
+    std::string cpuname = cpu_name();
+    const char* isa = instruction_set_name(framebuffer_get_instruction_set(fb));
+
+    if (format == "csv")
+    {
+        fprintf(out, "cpu,%s\n", cpuname.c_str());
+        fprintf(out, "instruction set,%s\n", isa);
+        fprintf(out, "size,%dx%d\n", fbwidth, fbheight);
+        fprintf(out, "frames,%d\n", measured_frames);
+        fprintf(out, "optimized vertex order,%d\n", model_load_config.optimize_vertex_order);
+        fprintf(out, "cluster culling,%d\n", cull_clusters ? 1 : 0);
+        fprintf(out, "shading,%d\n", shade ? 1 : 0);
+        fprintf(out, "msaa,%d\n", msaa ? 1 : 0);
+        fprintf(out, "copies,%d\n", copies * copies);
+        fprintf(out, "threads,%d\n", framebuffer_get_num_threads(fb));
+        for (const model_result_t& result : results)
+        {
+            fprintf(out, "acmr,%s,%f,%f\n", result.name.c_str(), result.acmr_before, result.acmr_after);
+        }
+        fprintf(out, "\n");
+        fprintf(out, "model,counter,unit,min,median,p99,mean,stddev\n");
+        for (const model_result_t& result : results)
+        {
+            for (const counter_t& counter : result.counters)
+            {
+                counter_summary_t s = summarize(counter.values);
+                fprintf(out, "%s,%s,%s,%lf,%lf,%lf,%lf,%lf\n",
+                    result.name.c_str(), counter.name.c_str(), counter.unit, s.min, s.median, s.p99, s.mean, s.stddev);
+            }
+        }
+    }
+    else
+    {
+        fprintf(out, "{\n");
+        fprintf(out, "  \"cpu\": \"%s\",\n", cpuname.c_str());
+        fprintf(out, "  \"instruction_set\": \"%s\",\n", isa);
+        fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n", fbwidth, fbheight);
+        fprintf(out, "  \"warmup_frames\": %d,\n  \"frames\": %d,\n", warmup_frames, measured_frames);
+        fprintf(out, "  \"optimized_vertex_order\": %s,\n", model_load_config.optimize_vertex_order ? "true" : "false");
+        fprintf(out, "  \"cluster_culling\": %s,\n", cull_clusters ? "true" : "false");
+        fprintf(out, "  \"shading\": %s,\n", shade ? "true" : "false");
+        fprintf(out, "  \"msaa\": %s,\n", msaa ? "true" : "false");
+        fprintf(out, "  \"copies\": %d,\n  \"threads\": %d,\n", copies * copies, framebuffer_get_num_threads(fb));
+        fprintf(out, "  \"models\": [\n");
+        for (size_t result_i = 0; result_i < results.size(); result_i++)
+        {
+            const model_result_t& result = results[result_i];
+            fprintf(out, "    {\n      \"name\": \"%s\",\n", result.name.c_str());
+            fprintf(out, "      \"acmr_before\": %f,\n      \"acmr_after\": %f,\n", result.acmr_before, result.acmr_after);
+            fprintf(out, "      \"counters\": [\n");
+            for (size_t counter_i = 0; counter_i < result.counters.size(); counter_i++)
+            {
+                const counter_t& counter = result.counters[counter_i];
+                counter_summary_t s = summarize(counter.values);
+                fprintf(out, "        { \"name\": \"%s\", \"unit\": \"%s\", \"min\": %lf, \"median\": %lf, \"p99\": %lf, \"mean\": %lf, \"stddev\": %lf }%s\n",
+                    counter.name.c_str(), counter.unit, s.min, s.median, s.p99, s.mean, s.stddev,
+                    counter_i + 1 < result.counters.size() ? "," : "");
+            }
+            fprintf(out, "      ]\n    }%s\n", result_i + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    delete_renderer(rd);
+    return 0;
+}
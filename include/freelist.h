@@ -338,6 +338,13 @@ public:
         return _max_objects;
     }
 
+    // the objects, packed in the same order as the iterator visits their IDs.
+    // erasing an object moves the last one into its place.
+    T* data() const
+    {
+        return _objects;
+    }
+
 private:
     allocation_t* insert_alloc()
     {
@@ -0,0 +1,760 @@
+// Microbenchmark of the rasterizer's kernels: draws synthetic workloads on single threaded framebuffers of every instruction set the CPU has,
+// and prints how fast each stage of the framebuffer went through them. Unlike the benchmark, no scene is involved, so a regression in one kernel
+// doesn't hide in the noise of the others.
+//
+// usage: microbenchmark [-iterations N] [-size W H] [-tile 32|64|128] [-seed N] [-format csv|json] [-out file] [workload...]
+// with no workloads, all of them are run. the edgemask workloads draw on a framebuffer of a single tile, so every triangle is one
+// command of the large triangle kernel for that mask of edges to test.
+// the indexed workloads draw with framebuffer_draw_indexed instead of framebuffer_draw, and the _msaa ones with 4x multisampling.
+//
+// the stages are the framebuffer's perfcounters (which include pushing the tile commands), along with packing the colors and the whole frame.
+// cycles are ticks of the time stamp counter, like the perfcounters. pixels are the pixels that passed the depth test, or the packed ones for pack.
+// the images drawn by every instruction set are compared with the scalar ones, and if any isn't bit-identical the microbenchmark fails.
+// it also fails if the scalar kernels cover different pixels with the other tile sizes.
+
+#include <rasterizer.h>
+#include <s1516.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <chrono>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+const char* instruction_set_name(instructionset_t instruction_set)
+{
+    switch (instruction_set)
+    {
+    case instructionset_scalar: return "Scalar";
+    case instructionset_avx2: return "AVX2";
+    case instructionset_avx512: return "AVX-512";
+    default: return "Unknown";
+    }
+}
+
+std::string cpu_name()
+{
+    char cpuname[0x40];
+    memset(cpuname, 0, sizeof(cpuname));
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        uint32_t regs[4];
+#ifdef _MSC_VER
+        __cpuid((int*)regs, 0x80000002 + i);
+#else
+        __get_cpuid(0x80000002 + i, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        memcpy(cpuname + 16 * i, regs, sizeof(regs));
+    }
+
+    return cpuname;
+}
+
+// appends a vertex at the window coordinates (x, y) of a width x height framebuffer, with w = 1 so z is also the depth
+void push_vertex(std::vector<int32_t>* vertices, float x, float y, float z, int32_t width, int32_t height)
+{
+    vertices->push_back(s1516_flt(2.0f * x / width - 1.0f));
+    vertices->push_back(s1516_flt(1.0f - 2.0f * y / height));
+    vertices->push_back(s1516_flt(z));
+    vertices->push_back(s1516_int(1));
+}
+
+// swaps two of the vertices if needed so the triangle isn't culled as a backface
+void make_front_facing(float xs[3], float ys[3])
+{
+    float triarea2 = (xs[1] - xs[0]) * (ys[2] - ys[0]) - (ys[1] - ys[0]) * (xs[2] - xs[0]);
+    if (triarea2 < 0.0f)
+    {
+        std::swap(xs[1], xs[2]);
+        std::swap(ys[1], ys[2]);
+    }
+}
+
+void push_triangle(std::vector<int32_t>* vertices, float xs[3], float ys[3], float z, int32_t width, int32_t height)
+{
+    make_front_facing(xs, ys);
+    for (int32_t v = 0; v < 3; v++)
+    {
+        push_vertex(vertices, xs[v], ys[v], z, width, height);
+    }
+}
+
+void push_quad(std::vector<int32_t>* vertices, float x0, float y0, float x1, float y1, float z, int32_t width, int32_t height)
+{
+    float xs0[3] = { x0, x1, x1 }, ys0[3] = { y0, y0, y1 };
+    float xs1[3] = { x0, x1, x0 }, ys1[3] = { y0, y1, y1 };
+    push_triangle(vertices, xs0, ys0, z, width, height);
+    push_triangle(vertices, xs1, ys1, z, width, height);
+}
+
+// what a workload draws. without indices, every 3 vertices are a triangle.
+typedef struct mesh_t
+{
+    std::vector<int32_t> vertices;
+    std::vector<uint32_t> indices;
+} mesh_t;
+
+typedef struct workload_config_t
+{
+    int32_t width;
+    int32_t height;
+    int32_t tile_width;
+    // which edges the edgemask workloads test
+    int32_t edge_mask;
+} workload_config_t;
+
+// random triangles of a pixel or two, at random depths. they're drawn by the small triangle kernel.
+void generate_tiny(std::mt19937* rng, const workload_config_t* config, mesh_t* mesh)
+{
+    std::uniform_real_distribution<float> xdist(0.0f, (float)config->width);
+    std::uniform_real_distribution<float> ydist(0.0f, (float)config->height);
+    std::uniform_real_distribution<float> offsetdist(-1.5f, 1.5f);
+    std::uniform_real_distribution<float> zdist(0.05f, 0.95f);
+
+    for (int32_t tri_i = 0; tri_i < 100000; tri_i++)
+    {
+        float x = xdist(*rng), y = ydist(*rng);
+        float xs[3], ys[3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            xs[v] = x + offsetdist(*rng);
+            ys[v] = y + offsetdist(*rng);
+        }
+        push_triangle(&mesh->vertices, xs, ys, zdist(*rng), config->width, config->height);
+    }
+}
+
+// screen covering quads, drawn back to front so every pixel of every quad passes the depth test
+void generate_fullscreen(std::mt19937* /*rng*/, const workload_config_t* config, mesh_t* mesh)
+{
+    int32_t num_quads = 16;
+    for (int32_t quad_i = 0; quad_i < num_quads; quad_i++)
+    {
+        float z = 0.9f - 0.8f * quad_i / num_quads;
+        push_quad(&mesh->vertices, 0.0f, 0.0f, (float)config->width, (float)config->height, z, config->width, config->height);
+    }
+}
+
+// long triangles a pixel or so wide, at random angles and depths. they cross many tiles while covering few pixels of each.
+void generate_slivers(std::mt19937* rng, const workload_config_t* config, mesh_t* mesh)
+{
+    std::uniform_real_distribution<float> xdist(0.0f, (float)config->width);
+    std::uniform_real_distribution<float> ydist(0.0f, (float)config->height);
+    std::uniform_real_distribution<float> angledist(0.0f, 2.0f * 3.14159265f);
+    std::uniform_real_distribution<float> lengthdist(2.0f * config->tile_width, 8.0f * config->tile_width);
+    std::uniform_real_distribution<float> thicknessdist(0.25f, 1.5f);
+    std::uniform_real_distribution<float> zdist(0.05f, 0.95f);
+
+    for (int32_t tri_i = 0; tri_i < 10000; tri_i++)
+    {
+        float x = xdist(*rng), y = ydist(*rng);
+        float angle = angledist(*rng);
+        float dx = cosf(angle), dy = sinf(angle);
+        float half_length = lengthdist(*rng) / 2.0f;
+        float thickness = thicknessdist(*rng);
+        float xs[3] = { x - dx * half_length, x + dx * half_length, x - dy * thickness };
+        float ys[3] = { y - dy * half_length, y + dy * half_length, y + dx * thickness };
+        push_triangle(&mesh->vertices, xs, ys, zdist(*rng), config->width, config->height);
+    }
+}
+
+// a deep stack of overlapping rectangles in random order of depth, so most of what's drawn is hidden
+void generate_overdraw(std::mt19937* rng, const workload_config_t* config, mesh_t* mesh)
+{
+    std::uniform_real_distribution<float> sizedist(0.5f, 1.0f);
+    std::uniform_real_distribution<float> unitdist(0.0f, 1.0f);
+    std::uniform_real_distribution<float> zdist(0.05f, 0.95f);
+
+    for (int32_t quad_i = 0; quad_i < 256; quad_i++)
+    {
+        float quad_width = sizedist(*rng) * config->width;
+        float quad_height = sizedist(*rng) * config->height;
+        float x0 = unitdist(*rng) * (config->width - quad_width);
+        float y0 = unitdist(*rng) * (config->height - quad_height);
+        push_quad(&mesh->vertices, x0, y0, x0 + quad_width, y0 + quad_height, zdist(*rng), config->width, config->height);
+    }
+}
+
+// a grid of vertices in perspective that the triangles of its cells share, drawn indexed to go through the batched triangle setup.
+// the grid goes past the sides of the screen, a few vertices are behind the near plane or far past the guard band,
+// and some of the cells face away, so clipping and culling get measured (and checked) along with the rest.
+void generate_indexed(std::mt19937* rng, const workload_config_t* /*config*/, mesh_t* mesh)
+{
+    int32_t grid_width = 256;
+    int32_t grid_height = 144;
+    std::uniform_real_distribution<float> jitterdist(-0.4f, 0.4f);
+    std::uniform_real_distribution<float> wdist(0.5f, 2.0f);
+    std::uniform_real_distribution<float> zdist(0.05f, 0.95f);
+    std::uniform_real_distribution<float> unitdist(0.0f, 1.0f);
+
+    for (int32_t y = 0; y <= grid_height; y++)
+    {
+        for (int32_t x = 0; x <= grid_width; x++)
+        {
+            // in normalized device coordinates, where y goes up
+            float ndc_x = 1.25f * (2.0f * (x + jitterdist(*rng)) / grid_width - 1.0f);
+            float ndc_y = 1.25f * (2.0f * (y + jitterdist(*rng)) / grid_height - 1.0f);
+            float w = wdist(*rng);
+            float z = zdist(*rng) * w;
+
+            float outlier = unitdist(*rng);
+            if (outlier < 0.01f)
+            {
+                z = -0.5f * w;
+            }
+            else if (outlier < 0.015f)
+            {
+                ndc_x *= 40.0f;
+                ndc_y *= 40.0f;
+            }
+
+            mesh->vertices.push_back(s1516_flt(ndc_x * w));
+            mesh->vertices.push_back(s1516_flt(ndc_y * w));
+            mesh->vertices.push_back(s1516_flt(z));
+            mesh->vertices.push_back(s1516_flt(w));
+        }
+    }
+
+    for (int32_t y = 0; y < grid_height; y++)
+    {
+        for (int32_t x = 0; x < grid_width; x++)
+        {
+            uint32_t i0 = y * (grid_width + 1) + x;
+            uint32_t i1 = i0 + 1;
+            uint32_t i2 = i0 + grid_width + 1;
+            uint32_t i3 = i2 + 1;
+
+            // windows go down where normalized device coordinates go up, so this winding faces the viewer
+            uint32_t cell_indices[6] = { i0, i3, i1, i0, i2, i3 };
+            if (unitdist(*rng) < 0.125f)
+            {
+                std::swap(cell_indices[1], cell_indices[2]);
+                std::swap(cell_indices[4], cell_indices[5]);
+            }
+
+            mesh->indices.insert(mesh->indices.end(), cell_indices, cell_indices + 6);
+        }
+    }
+}
+
+// triangles bigger than the single tile of the framebuffer, each testing exactly the edges of config->edge_mask over it.
+// they're picked at random out of triangles around the tile that cover some of it, skipping those with an edge too close to a corner of the tile to tell.
+void generate_edgemask(std::mt19937* rng, const workload_config_t* config, mesh_t* mesh)
+{
+    float tile_width = (float)config->tile_width;
+    std::uniform_real_distribution<float> dist(-2.0f * tile_width, 3.0f * tile_width);
+
+    int32_t num_tris = 2000;
+    for (int32_t tri_i = 0; tri_i < num_tris; )
+    {
+        float xs[3], ys[3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            xs[v] = dist(*rng);
+            ys[v] = dist(*rng);
+        }
+        make_front_facing(xs, ys);
+
+        // small triangles are binned differently
+        float bbox_width = std::max(xs[0], std::max(xs[1], xs[2])) - std::min(xs[0], std::min(xs[1], xs[2]));
+        float bbox_height = std::max(ys[0], std::max(ys[1], ys[2])) - std::min(ys[0], std::min(ys[1], ys[2]));
+        if (bbox_width < tile_width + 2.0f && bbox_height < tile_width + 2.0f)
+        {
+            continue;
+        }
+
+        // the edge equations are negative inside, like the rasterizer's.
+        // an edge needs testing when it's positive at a corner of the tile.
+        bool ambiguous = false;
+        int32_t edge_mask = 0;
+        for (int32_t v = 0; v < 3 && !ambiguous; v++)
+        {
+            int32_t v1 = (v + 1) % 3;
+            float edge_dx = ys[v1] - ys[v];
+            float edge_dy = xs[v] - xs[v1];
+            float margin = 2.0f * sqrtf(edge_dx * edge_dx + edge_dy * edge_dy);
+
+            float min_edge = INFINITY, max_edge = -INFINITY;
+            for (int32_t corner_i = 0; corner_i < 4; corner_i++)
+            {
+                float corner_x = (corner_i & 1) ? tile_width : 0.0f;
+                float corner_y = (corner_i & 2) ? tile_width : 0.0f;
+                float edge = (corner_x - xs[v]) * edge_dx + (corner_y - ys[v]) * edge_dy;
+                min_edge = std::min(min_edge, edge);
+                max_edge = std::max(max_edge, edge);
+            }
+
+            // also skip triangles with an edge that misses the tile, since they don't get binned to it
+            if (min_edge > -margin || fabsf(max_edge) < margin)
+                ambiguous = true;
+            else if (max_edge > 0.0f)
+                edge_mask |= 1 << v;
+        }
+
+        if (ambiguous || edge_mask != config->edge_mask)
+        {
+            continue;
+        }
+
+        // the lines of the edges crossing the tile don't mean the triangle does, so look for pixels it covers
+        bool covers_tile = false;
+        for (int32_t sample_i = 0; sample_i < 64 && !covers_tile; sample_i++)
+        {
+            float sample_x = ((sample_i % 8) + 0.5f) * tile_width / 8.0f;
+            float sample_y = ((sample_i / 8) + 0.5f) * tile_width / 8.0f;
+            covers_tile = true;
+            for (int32_t v = 0; v < 3; v++)
+            {
+                int32_t v1 = (v + 1) % 3;
+                float edge = (sample_x - xs[v]) * (ys[v1] - ys[v]) + (sample_y - ys[v]) * (xs[v] - xs[v1]);
+                covers_tile = covers_tile && edge < 0.0f;
+            }
+        }
+
+        if (!covers_tile)
+        {
+            continue;
+        }
+
+        // back to front, so all of them get drawn
+        float z = 0.9f - 0.8f * tri_i / num_tris;
+        for (int32_t v = 0; v < 3; v++)
+        {
+            push_vertex(&mesh->vertices, xs[v], ys[v], z, config->tile_width, config->tile_width);
+        }
+        tri_i++;
+    }
+}
+
+typedef struct workload_t
+{
+    std::string name;
+    void(*generate)(std::mt19937* rng, const workload_config_t* config, mesh_t* mesh);
+    // drawn on a framebuffer of a single tile instead of one of the -size
+    bool single_tile;
+    int32_t edge_mask;
+    // 4x multisampling
+    bool msaa;
+} workload_t;
+
+// the time of one stage of the framebuffer over one workload
+typedef struct stage_result_t
+{
+    std::string workload;
+    instructionset_t instruction_set;
+    std::string stage;
+    uint64_t triangles;
+    uint64_t pixels;
+    // the median over the iterations
+    double cycles;
+    double seconds;
+} stage_result_t;
+
+double median(std::vector<double> values)
+{
+    std::sort(begin(values), end(values));
+    size_t n = values.size();
+    return n % 2 == 1 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+int32_t find_name(const std::vector<const char*>& names, const char* name)
+{
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (strcmp(names[i], name) == 0)
+            return (int32_t)i;
+    }
+    return -1;
+}
+
+// one thread, so the perfcounters add up to the time of the frame
+framebuffer_config_t microbenchmark_framebuffer_config(instructionset_t instruction_set, int32_t tile_width, bool msaa)
+{
+    framebuffer_config_t fb_config;
+    fb_config.num_threads = 1;
+    fb_config.num_binners = 1;
+    fb_config.async_flush = 0;
+    fb_config.instruction_set = instruction_set;
+    fb_config.depth_only = 0;
+    fb_config.tile_flush_threshold_in_dwords = 0;
+    fb_config.command_memory_budget_in_kb = 0;
+    fb_config.tile_width_in_pixels = tile_width;
+    fb_config.visibility_buffer = 0;
+    fb_config.msaa = msaa ? 1 : 0;
+    fb_config.share_threads_with = NULL;
+    return fb_config;
+}
+
+// what packing the depth gives for pixels that nothing was drawn in
+const uint32_t kClearDepth = 0xFFFFFFFF;
+
+void draw_workload(framebuffer_t* fb, const mesh_t* mesh)
+{
+    framebuffer_clear(fb, 0xFF000000);
+    if (!mesh->indices.empty())
+        framebuffer_draw_indexed(fb, mesh->vertices.data(), mesh->indices.data(), (uint32_t)mesh->indices.size());
+    else
+        framebuffer_draw(fb, mesh->vertices.data(), (uint32_t)mesh->vertices.size() / 4);
+    framebuffer_resolve(fb);
+}
+
+// draws the workload iterations times after a warmup, and records the median time of every stage.
+// returns what the last iteration drew, to check against the other instruction sets.
+void benchmark_workload(
+    framebuffer_t* fb, int32_t width, int32_t height, const std::string& workload_name, const mesh_t* mesh, int iterations,
+    std::vector<stage_result_t>* results, std::vector<uint8_t>* color, std::vector<uint32_t>* depth)
+{
+    int32_t num_pcs = framebuffer_get_num_perfcounters(fb);
+    int32_t num_tile_pcs = framebuffer_get_num_tile_perfcounters(fb);
+    int32_t num_stats = framebuffer_get_num_stats(fb);
+    int32_t num_tiles = framebuffer_get_total_num_tiles(fb);
+
+    std::vector<const char*> pc_names(num_pcs);
+    std::vector<const char*> tile_pc_names(num_tile_pcs);
+    std::vector<const char*> stat_names(num_stats);
+    framebuffer_get_perfcounter_names(fb, pc_names.data());
+    framebuffer_get_tile_perfcounter_names(fb, tile_pc_names.data());
+    framebuffer_get_stat_names(fb, stat_names.data());
+
+    int32_t pixels_passed_i = find_name(stat_names, "pixels_passed");
+
+    std::vector<uint64_t> pcs(num_pcs);
+    std::vector<uint64_t> tile_pcs(num_tiles * num_tile_pcs);
+    std::vector<uint64_t> stats(num_stats);
+
+    // the perfcounters, then pack and frame
+    std::vector<std::vector<double>> stage_ticks(num_pcs + num_tile_pcs + 2);
+    std::vector<double> pack_seconds, frame_seconds;
+    uint64_t pixels_passed = 0;
+
+    color->resize(width * height * 4);
+    depth->resize(width * height);
+
+    uint32_t num_vertices = (uint32_t)mesh->vertices.size() / 4;
+    uint32_t num_indices = (uint32_t)mesh->indices.size();
+    uint32_t num_triangles = num_indices > 0 ? num_indices / 3 : num_vertices / 3;
+
+    for (int iteration_i = -1; iteration_i < iterations; iteration_i++)
+    {
+        framebuffer_reset_perfcounters(fb);
+
+        auto frame_begin = std::chrono::steady_clock::now();
+        draw_workload(fb, mesh);
+        auto frame_end = std::chrono::steady_clock::now();
+
+        framebuffer_pack_row_major(fb, attachment_color0, 0, 0, width, height, pixelformat_r8g8b8a8_unorm, color->data());
+        auto pack_end = std::chrono::steady_clock::now();
+
+        // the first iteration warms up the caches and the command memory
+        if (iteration_i < 0)
+        {
+            continue;
+        }
+
+        framebuffer_get_perfcounters(fb, pcs.data());
+        framebuffer_get_tile_perfcounters(fb, tile_pcs.data());
+        framebuffer_get_stats(fb, stats.data());
+        pixels_passed = stats[pixels_passed_i];
+
+        size_t stage_i = 0;
+        for (uint64_t pc : pcs)
+            stage_ticks[stage_i++].push_back((double)pc);
+
+        // summed over all tiles
+        for (int32_t pc_i = 0; pc_i < num_tile_pcs; pc_i++)
+        {
+            uint64_t total = 0;
+            for (int32_t tile_id = 0; tile_id < num_tiles; tile_id++)
+                total += tile_pcs[tile_id * num_tile_pcs + pc_i];
+            stage_ticks[stage_i++].push_back((double)total);
+        }
+
+        pack_seconds.push_back(std::chrono::duration<double>(pack_end - frame_end).count());
+        frame_seconds.push_back(std::chrono::duration<double>(frame_end - frame_begin).count());
+    }
+
+    // the frequency gets measured since the framebuffer was created, so it's only asked for once the frames took a while
+    double ticks_per_second = (double)framebuffer_get_perfcounter_frequency(fb);
+    for (size_t iteration_i = 0; iteration_i < frame_seconds.size(); iteration_i++)
+    {
+        stage_ticks[num_pcs + num_tile_pcs].push_back(pack_seconds[iteration_i] * ticks_per_second);
+        stage_ticks[num_pcs + num_tile_pcs + 1].push_back(frame_seconds[iteration_i] * ticks_per_second);
+    }
+
+    framebuffer_pack_row_major(fb, attachment_depth, 0, 0, width, height, pixelformat_r32_unorm, depth->data());
+
+    for (size_t stage_i = 0; stage_i < stage_ticks.size(); stage_i++)
+    {
+        stage_result_t result;
+        result.workload = workload_name;
+        result.instruction_set = framebuffer_get_instruction_set(fb);
+        result.triangles = num_triangles;
+        result.pixels = pixels_passed;
+
+        if (stage_i < pc_names.size())
+            result.stage = pc_names[stage_i];
+        else if (stage_i < pc_names.size() + tile_pc_names.size())
+            result.stage = tile_pc_names[stage_i - pc_names.size()];
+        else if (stage_i == pc_names.size() + tile_pc_names.size())
+        {
+            result.stage = "pack";
+            result.pixels = (uint64_t)width * height;
+        }
+        else
+            result.stage = "frame";
+
+        result.cycles = median(stage_ticks[stage_i]);
+        result.seconds = result.cycles / ticks_per_second;
+        results->push_back(result);
+    }
+}
+
+void print_usage()
+{
+    fprintf(stderr,
+        "usage: microbenchmark [options] [workload...]\n"
+        "  -iterations <N>    measured frames of every workload, after one to warm up (default 20)\n"
+        "  -size <W> <H>      framebuffer size (default 1280 720)\n"
+        "  -tile <N>          tile width of the framebuffers: 32, 64 or 128 (default 64)\n"
+        "  -seed <N>          seed of the random workloads (default 1)\n"
+        "  -format csv|json   output format (default csv)\n"
+        "  -out <file>        output file (default stdout)\n"
+        "workloads: tiny, fullscreen, slivers, overdraw, indexed, indexed_msaa, slivers_msaa, edgemask0 to edgemask7 (default: all)\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::string format = "csv";
+    std::string out_filename;
+    int iterations = 20;
+    int fbwidth = 1280;
+    int fbheight = 720;
+    int tile_width = 64;
+    int seed = 1;
+    std::vector<std::string> workload_names;
+
+    std::vector<workload_t> workloads;
+    workloads.push_back(workload_t{ "tiny", generate_tiny, false, 0, false });
+    workloads.push_back(workload_t{ "fullscreen", generate_fullscreen, false, 0, false });
+    workloads.push_back(workload_t{ "slivers", generate_slivers, false, 0, false });
+    workloads.push_back(workload_t{ "overdraw", generate_overdraw, false, 0, false });
+    workloads.push_back(workload_t{ "indexed", generate_indexed, false, 0, false });
+    workloads.push_back(workload_t{ "indexed_msaa", generate_indexed, false, 0, true });
+    workloads.push_back(workload_t{ "slivers_msaa", generate_slivers, false, 0, true });
+    for (int32_t edge_mask = 0; edge_mask < 8; edge_mask++)
+    {
+        workloads.push_back(workload_t{ "edgemask" + std::to_string(edge_mask), generate_edgemask, true, edge_mask, false });
+    }
+
+    for (int arg_i = 1; arg_i < argc; arg_i++)
+    {
+        std::string arg = argv[arg_i];
+        bool has_value = arg_i + 1 < argc;
+
+        if (arg == "-iterations" && has_value)
+            iterations = atoi(argv[++arg_i]);
+        else if (arg == "-size" && arg_i + 2 < argc)
+        {
+            fbwidth = atoi(argv[++arg_i]);
+            fbheight = atoi(argv[++arg_i]);
+        }
+        else if (arg == "-tile" && has_value)
+            tile_width = atoi(argv[++arg_i]);
+        else if (arg == "-seed" && has_value)
+            seed = atoi(argv[++arg_i]);
+        else if (arg == "-format" && has_value)
+            format = argv[++arg_i];
+        else if (arg == "-out" && has_value)
+            out_filename = argv[++arg_i];
+        else if (arg[0] == '-')
+        {
+            print_usage();
+            return 1;
+        }
+        else
+            workload_names.push_back(arg);
+    }
+
+    bool known_workloads = true;
+    for (const std::string& workload_name : workload_names)
+    {
+        bool known = false;
+        for (const workload_t& workload : workloads)
+            known = known || workload.name == workload_name;
+        known_workloads = known_workloads && known;
+    }
+
+    if ((format != "csv" && format != "json") || iterations <= 0 || fbwidth <= 0 || fbheight <= 0 ||
+        (tile_width != 32 && tile_width != 64 && tile_width != 128) || !known_workloads)
+    {
+        print_usage();
+        return 1;
+    }
+
+    // scalar goes first, to be the reference of the others
+    std::vector<instructionset_t> instruction_sets;
+    instruction_sets.push_back(instructionset_scalar);
+    instruction_sets.push_back(instructionset_avx2);
+    instruction_sets.push_back(instructionset_avx512);
+
+    std::vector<stage_result_t> results;
+    std::vector<std::string> mismatches;
+
+    for (const workload_t& workload : workloads)
+    {
+        if (!workload_names.empty() && std::find(begin(workload_names), end(workload_names), workload.name) == end(workload_names))
+        {
+            continue;
+        }
+
+        workload_config_t workload_config;
+        workload_config.width = workload.single_tile ? tile_width : fbwidth;
+        workload_config.height = workload.single_tile ? tile_width : fbheight;
+        workload_config.tile_width = tile_width;
+        workload_config.edge_mask = workload.edge_mask;
+
+        std::mt19937 rng(seed);
+        mesh_t mesh;
+        workload.generate(&rng, &workload_config, &mesh);
+
+        std::vector<uint8_t> reference_color;
+        std::vector<uint32_t> reference_depth;
+
+        for (instructionset_t instruction_set : instruction_sets)
+        {
+            framebuffer_config_t fb_config = microbenchmark_framebuffer_config(instruction_set, tile_width, workload.msaa);
+            framebuffer_t* fb = new_framebuffer_ex(workload_config.width, workload_config.height, &fb_config);
+
+            // not supported by the CPU
+            if (framebuffer_get_instruction_set(fb) != instruction_set)
+            {
+                delete_framebuffer(fb);
+                continue;
+            }
+
+            framebuffer_enable_perfcounters(fb, 1);
+
+            std::vector<uint8_t> color;
+            std::vector<uint32_t> depth;
+            benchmark_workload(fb, workload_config.width, workload_config.height, workload.name, &mesh, iterations, &results, &color, &depth);
+            delete_framebuffer(fb);
+
+            if (instruction_set == instructionset_scalar)
+            {
+                reference_color.swap(color);
+                reference_depth.swap(depth);
+            }
+            else if (color != reference_color || depth != reference_depth)
+            {
+                mismatches.push_back(workload.name + " " + instruction_set_name(instruction_set) + " didn't draw the same image as Scalar");
+            }
+        }
+
+        // the tile size changes how the depth gets interpolated, but not which pixels get covered
+        for (int32_t other_tile_width = 32; other_tile_width <= 128; other_tile_width *= 2)
+        {
+            if (other_tile_width == tile_width)
+            {
+                continue;
+            }
+
+            framebuffer_config_t fb_config = microbenchmark_framebuffer_config(instructionset_scalar, other_tile_width, workload.msaa);
+            framebuffer_t* fb = new_framebuffer_ex(workload_config.width, workload_config.height, &fb_config);
+
+            std::vector<uint32_t> depth(workload_config.width * workload_config.height);
+            draw_workload(fb, &mesh);
+            framebuffer_pack_row_major(fb, attachment_depth, 0, 0, workload_config.width, workload_config.height, pixelformat_r32_unorm, depth.data());
+            delete_framebuffer(fb);
+
+            bool same_coverage = true;
+            for (size_t pixel_i = 0; pixel_i < depth.size(); pixel_i++)
+            {
+                same_coverage = same_coverage && (depth[pixel_i] == kClearDepth) == (reference_depth[pixel_i] == kClearDepth);
+            }
+
+            if (!same_coverage)
+            {
+                mismatches.push_back(workload.name + " didn't cover the same pixels with " + std::to_string(other_tile_width) + " pixel tiles");
+            }
+        }
+    }
+
+    FILE* out = stdout;
+    if (!out_filename.empty())
+    {
+        out = fopen(out_filename.c_str(), "w");
+        if (!out)
+        {
+            fprintf(stderr, "Failed to open %s\n", out_filename.c_str());
+            return 1;
+        }
+    }
+
+    std::string cpuname = cpu_name();
+
+    if (format == "csv")
+    {
+        fprintf(out, "cpu,%s\n", cpuname.c_str());
+        fprintf(out, "size,%dx%d\n", fbwidth, fbheight);
+        fprintf(out, "tile,%d\n", tile_width);
+        fprintf(out, "iterations,%d\n", iterations);
+        fprintf(out, "identical to scalar,%d\n", mismatches.empty() ? 1 : 0);
+        fprintf(out, "\n");
+        fprintf(out, "workload,instruction set,stage,triangles,pixels,cycles,triangles per second,pixels per second,cycles per pixel\n");
+        for (const stage_result_t& result : results)
+        {
+            fprintf(out, "%s,%s,%s,%llu,%llu,%lf,%lf,%lf,%lf\n",
+                result.workload.c_str(), instruction_set_name(result.instruction_set), result.stage.c_str(),
+                (unsigned long long)result.triangles, (unsigned long long)result.pixels, result.cycles,
+                result.seconds > 0.0 ? result.triangles / result.seconds : 0.0,
+                result.seconds > 0.0 ? result.pixels / result.seconds : 0.0,
+                result.pixels > 0 ? result.cycles / result.pixels : 0.0);
+        }
+    }
+    else
+    {
+        fprintf(out, "{\n");
+        fprintf(out, "  \"cpu\": \"%s\",\n", cpuname.c_str());
+        fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n", fbwidth, fbheight);
+        fprintf(out, "  \"tile\": %d,\n  \"iterations\": %d,\n", tile_width, iterations);
+        fprintf(out, "  \"identical_to_scalar\": %s,\n", mismatches.empty() ? "true" : "false");
+        fprintf(out, "  \"results\": [\n");
+        for (size_t result_i = 0; result_i < results.size(); result_i++)
+        {
+            const stage_result_t& result = results[result_i];
+            fprintf(out, "    { \"workload\": \"%s\", \"instruction_set\": \"%s\", \"stage\": \"%s\", \"triangles\": %llu, \"pixels\": %llu, \"cycles\": %lf, "
+                "\"triangles_per_second\": %lf, \"pixels_per_second\": %lf, \"cycles_per_pixel\": %lf }%s\n",
+                result.workload.c_str(), instruction_set_name(result.instruction_set), result.stage.c_str(),
+                (unsigned long long)result.triangles, (unsigned long long)result.pixels, result.cycles,
+                result.seconds > 0.0 ? result.triangles / result.seconds : 0.0,
+                result.seconds > 0.0 ? result.pixels / result.seconds : 0.0,
+                result.pixels > 0 ? result.cycles / result.pixels : 0.0,
+                result_i + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    for (const std::string& mismatch : mismatches)
+    {
+        fprintf(stderr, "%s\n", mismatch.c_str());
+    }
+
+    return mismatches.empty() ? 0 : 1;
+}
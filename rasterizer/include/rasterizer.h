@@ -17,6 +17,7 @@ extern "C" {
 #endif
 
 struct framebuffer_t;
+struct texture_t;
 
 typedef enum attachment_t
 {
@@ -31,12 +32,113 @@ typedef enum pixelformat_t
     pixelformat_r32_unorm
 } pixelformat_t;
 
+typedef enum instructionset_t
+{
+    instructionset_auto,
+    instructionset_scalar,
+    instructionset_avx2,
+    instructionset_avx512
+} instructionset_t;
+
+typedef struct framebuffer_config_t
+{
+    // number of threads that resolve tiles, including the thread that calls framebuffer_resolve.
+    // 0 uses one thread per hardware thread. 1 resolves all tiles on the calling thread.
+    int32_t num_threads;
+
+    // number of threads that framebuffer_draw_indexed splits big draws across for triangle setup and binning.
+    // 0 uses all of num_threads. 1 bins on the calling thread.
+    int32_t num_binners;
+
+    // when a tile's command list fills up during binning, resolve it on a thread of the pool
+    // while binning carries on, instead of resolving it on the binning thread. needs num_threads > 1.
+    int32_t async_flush;
+
+    // which set of rasterization kernels to use. auto picks the best one the CPU supports.
+    // asking for more than the CPU supports falls back to the best one it does support.
+    instructionset_t instruction_set;
+
+    // only keep a depth buffer, for occlusion culling. there is no color attachment to pack.
+    int32_t depth_only;
+
+    // how many dwords of commands a tile's command list can hold before binning flushes it. 0 uses the default (1024).
+    // lower it for small framebuffers, raise it when a few hot tiles get flushed over and over.
+    int32_t tile_flush_threshold_in_dwords;
+
+    // commands are binned into memory that grows on demand. when more than this is in use as a draw starts,
+    // what was binned so far gets resolved first to give it back. a single draw can still go over it. 0 means no limit.
+    int32_t command_memory_budget_in_kb;
+
+    // 32, 64 or 128. 0 uses the default (64).
+    // bigger tiles spend less time binning, smaller ones spread over more threads and keep more of a tile in cache.
+    int32_t tile_width_in_pixels;
+
+    // the color attachment holds which triangle is visible in each pixel instead of a color,
+    // and framebuffer_shade turns that into colors once the frame is resolved. can't be combined with depth_only.
+    int32_t visibility_buffer;
+
+    // 4x multisampling: coverage and depth are tested at 4 points of every pixel, and packing the color averages them.
+    // the color is shaded once per pixel, and a fine block only stores a color per sample once a triangle edge crosses one of its pixels.
+    // packing the depth gives the farthest sample of each pixel. can't be combined with visibility_buffer.
+    int32_t msaa;
+
+    // runs on the threads of another framebuffer instead of starting its own, so framebuffers that get drawn one after the other
+    // (shadow maps, the faces of a cubemap) keep resolving the flushed tiles of each other while the next one bins. num_threads is ignored.
+    // framebuffers that share threads must only be used from one thread at a time. either one can be deleted first.
+    framebuffer_t* share_threads_with;
+} framebuffer_config_t;
+
+// the most floats of varyings a vertex can have
+#define FRAMEBUFFER_MAX_VARYINGS 16
+
+typedef struct framebuffer_varyings_t
+{
+    // num_varyings floats per vertex, indexed by the same indices as the vertices.
+    // they're copied for the triangles that get binned, so they only need to live until the draw returns.
+    const float* varyings;
+    int32_t num_varyings;
+
+    // handed to the shader along with the index of the triangle in the draw, to tell draws apart
+    uint32_t draw_id;
+} framebuffer_varyings_t;
+
+// 8 pixels of a visibility buffer: a 4x2 block, whose lane i is at (x + (i & 1) + ((i >> 1) & 2), y + ((i >> 1) & 1)).
+// bit i of mask is set when lane i shows a triangle. the other lanes hold garbage, and end up with the clear color.
+typedef struct framebuffer_pixels_t
+{
+    int32_t x, y;
+    uint32_t mask;
+    uint32_t draw_ids[8];
+    uint32_t triangle_indices[8];
+    // the perspective correct interpolation of the varyings of each lane's triangle at the center of its pixel, one varying after the other.
+    // the varyings past those of a lane's draw hold garbage.
+    float varyings[FRAMEBUFFER_MAX_VARYINGS][8];
+} framebuffer_pixels_t;
+
+// writes the colors of the lanes in pixels->mask, in the same format as framebuffer_clear's color.
+// called from the framebuffer's threads, so it must be safe to call concurrently.
+typedef void(*framebuffer_shader_fn_t)(void* ctx, const framebuffer_pixels_t* pixels, uint32_t colors[8]);
+
 RASTERIZER_API framebuffer_t* new_framebuffer(int32_t width, int32_t height);
+RASTERIZER_API framebuffer_t* new_framebuffer_ex(int32_t width, int32_t height, const framebuffer_config_t* config);
 RASTERIZER_API void delete_framebuffer(framebuffer_t* fb);
 
 RASTERIZER_API void framebuffer_clear(framebuffer_t* fb, uint32_t color);
+// runs every command binned since the last resolve. the memory holding the commands is only given back here,
+// so a whole frame can be drawn with a single resolve at the end.
 RASTERIZER_API void framebuffer_resolve(framebuffer_t* fb);
+// resolves every one of the framebuffers. the tiles of the ones that share threads are all submitted before waiting,
+// so the threads go on to the next framebuffer's tiles instead of waiting for the last tiles of each.
+RASTERIZER_API void framebuffer_resolve_many(framebuffer_t* const* fbs, int32_t num_fbs);
 RASTERIZER_API void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data);
+// same, but the rows of data are pitch bytes apart. rows of tiles are packed in parallel on the framebuffer's threads.
+// for bottom-up images (like OpenGL's), pass a pointer to the last row of data and a negative pitch.
+RASTERIZER_API void framebuffer_pack_row_major_pitched(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data, int32_t pitch);
+
+// occlusion query: returns 1 if anything at min_depth would be visible in the given rectangle of pixels, 0 if it's fully hidden.
+// min_depth is in the same units as the depth attachment (pixelformat_r32_unorm), eg: the closest z/w of an occludee in 16.16.
+// tests against what was drawn up to the last framebuffer_resolve.
+RASTERIZER_API int32_t framebuffer_test_bbox(framebuffer_t* fb, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t min_depth);
 
 RASTERIZER_API void framebuffer_draw(
     framebuffer_t* fb,
@@ -49,8 +151,58 @@ RASTERIZER_API void framebuffer_draw_indexed(
     const uint32_t* indices,
     uint32_t num_indices);
 
+// same, with varyings for framebuffer_shade to interpolate. null varyings are the same as framebuffer_draw_indexed,
+// whose triangles (and framebuffer_draw's) are shaded with no varyings and a draw_id of 0.
+RASTERIZER_API void framebuffer_draw_indexed_ex(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t num_indices,
+    const framebuffer_varyings_t* varyings);
+
+// runs the shader on every pixel of a visibility buffer that a triangle is visible in, 8 pixels at a time, in parallel on the framebuffer's threads.
+// only the pixels that are left visible get shaded, so overdraw costs nothing but the depth test.
+// call it once per frame, after the last framebuffer_resolve before the colors get packed.
+RASTERIZER_API void framebuffer_shade(framebuffer_t* fb, framebuffer_shader_fn_t shader, void* ctx);
+
+typedef struct texture_config_t
+{
+    // which sampling kernels to use, the same as framebuffer_config_t::instruction_set
+    instructionset_t instruction_set;
+} texture_config_t;
+
+// a read-only texture with all of its mips, for shaders to sample. the width and height must be powers of two.
+// colors are the width * height texels, one row after the other, in the same format as framebuffer_clear's color. they get copied.
+// the mips are made with a box filter. nothing changes a texture once it's made, so any number of threads can sample it at once.
+RASTERIZER_API texture_t* new_texture(int32_t width, int32_t height, const uint32_t* colors);
+RASTERIZER_API texture_t* new_texture_ex(int32_t width, int32_t height, const uint32_t* colors, const texture_config_t* config);
+RASTERIZER_API void delete_texture(texture_t* tex);
+RASTERIZER_API instructionset_t texture_get_instruction_set(texture_t* tex);
+
+// bilinear samples at the texcoords in the varyings u_varying and v_varying of pixels, which repeat outside of [0, 1).
+// u goes along the rows of the texture, and v from the first row to the last. every 2x2 quad of the pixels (lanes 0-3 and 4-7)
+// samples a single mip, picked from how far apart the texcoords of its lanes that show the same triangle are.
+// only the colors of the lanes in mask get written, and they must be in pixels->mask, so a shader can sample the lanes of different draws
+// from different textures.
+RASTERIZER_API void texture_sample(const texture_t* tex, const framebuffer_pixels_t* pixels, uint32_t mask, int32_t u_varying, int32_t v_varying, uint32_t colors[8]);
+
+RASTERIZER_API instructionset_t framebuffer_get_instruction_set(framebuffer_t* fb); // the kernels that were picked when the framebuffer was created
+
 RASTERIZER_API int32_t framebuffer_get_total_num_tiles(framebuffer_t* fb); // to know how big an array to pass to get_tile_perfcounters
-RASTERIZER_API uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb);
+RASTERIZER_API int32_t framebuffer_get_tile_width(framebuffer_t* fb); // in pixels, to map pixels to tile ids
+RASTERIZER_API int64_t framebuffer_get_peak_command_memory(framebuffer_t* fb); // the most bytes of command memory that were in use at once, to pick a budget
+
+// runs work of the caller on the framebuffer's threads: fn(ctx, task_id, worker_id) for every task_id in [0, num_tasks), and returns when they're all done.
+// worker_id is in [0, framebuffer_get_num_threads) and the calling thread is worker 0, so it can index per-thread scratch space.
+// only run tasks between draws, and don't draw from inside them.
+typedef void(*framebuffer_task_fn_t)(void* ctx, int32_t task_id, int32_t worker_id);
+RASTERIZER_API int32_t framebuffer_get_num_threads(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_run_tasks(framebuffer_t* fb, framebuffer_task_fn_t fn, void* ctx, int32_t num_tasks);
+
+// perfcounters are times in ticks of the CPU's time stamp counter, measured while they're enabled. they're off by default.
+// stats are counts of triangles and pixels, always kept. only toggle perfcounters or reset them between draws.
+RASTERIZER_API void framebuffer_enable_perfcounters(framebuffer_t* fb, int32_t enable);
+RASTERIZER_API uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb); // ticks per second, measured since the framebuffer was created
 RASTERIZER_API void framebuffer_reset_perfcounters(framebuffer_t* fb);
 RASTERIZER_API int32_t framebuffer_get_num_perfcounters(framebuffer_t* fb);
 RASTERIZER_API void framebuffer_get_perfcounters(framebuffer_t* fb, uint64_t* pcs);
@@ -58,6 +210,19 @@ RASTERIZER_API void framebuffer_get_perfcounter_names(framebuffer_t* fb, const c
 RASTERIZER_API int32_t framebuffer_get_num_tile_perfcounters(framebuffer_t* fb);
 RASTERIZER_API void framebuffer_get_tile_perfcounter_names(framebuffer_t* fb, const char** names);
 RASTERIZER_API void framebuffer_get_tile_perfcounters(framebuffer_t* fb, uint64_t* tile_pcs); // grabs perfcounters for ALL tiles: (total_num_tiles * num_tile_perfcounters) counters.
+RASTERIZER_API int32_t framebuffer_get_num_stats(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_get_stat_names(framebuffer_t* fb, const char** names);
+RASTERIZER_API void framebuffer_get_stats(framebuffer_t* fb, uint64_t* stats); // summed over the whole framebuffer
+
+// trace capture: records when every draw, binner, tile flush and tile resolve began and ended, and on which thread.
+// the capture is written as JSON in Chrome's trace event format, to be opened in chrome://tracing.
+// only begin or end a capture between draws.
+RASTERIZER_API void framebuffer_begin_trace_capture(framebuffer_t* fb);
+RASTERIZER_API void framebuffer_end_trace_capture(framebuffer_t* fb);
+RASTERIZER_API uint64_t framebuffer_get_trace_timestamp(framebuffer_t* fb); // in perfcounter ticks
+// adds an event of the thread that draws, such as the work of the code calling the framebuffer. the strings must outlive the capture.
+RASTERIZER_API void framebuffer_add_trace_event(framebuffer_t* fb, const char* name, const char* arg_name, int32_t arg, uint64_t begin_timestamp, uint64_t end_timestamp);
+RASTERIZER_API int32_t framebuffer_write_trace_capture(framebuffer_t* fb, const char* filename); // returns 0 if the file couldn't be written
 
 #ifdef __cplusplus
 } // end extern "C"
@@ -13,9 +13,23 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <math.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 #ifdef _MSC_VER
 #include <intrin.h>
+#else
+#include <immintrin.h>
+#include <x86intrin.h>
+#include <cpuid.h>
 #endif
 
 #ifdef _WIN32
@@ -26,20 +40,26 @@
 
 // Configuration
 // ------------------
-// Which instruction set to use
-// Haswell New Instructions (AVX2)
-#define USE_HSWni
-
-// Can disable perfcounters since they cost performance (QPC is slow)
-// #define ENABLE_PERFCOUNTERS
+// The instruction set is picked at runtime by new_framebuffer (see detect_instruction_set).
+// Only the kernels of the picked instruction set ever run, so the rest of the library only assumes x64.
+// The AVX-512 kernels need a compiler that knows the AVX-512 intrinsics (Visual Studio 2017 and up)
+#if !defined(_MSC_VER) || _MSC_VER >= 1910
+#define ENABLE_AVX512
+#endif
 // ------------------
 
 // Sized according to the Larrabee rasterizer's description
 // The tile size must be up to 128x128
 //    this is because any edge that isn't trivially accepted or rejected
 //    can be rasterized with 32 bits inside a 128x128 tile
-// moved it down to 64x64 since it allows more parallelism
-#define TILE_WIDTH_IN_PIXELS 64
+// The tile size is picked per framebuffer (see framebuffer_config_t::tile_width_in_pixels), out of 32x32, 64x64 and 128x128.
+// 64x64 is the default, since it allows more parallelism than 128x128.
+// Everything that depends on the tile size is templated on it, so the macros derived from the tile size
+// can only be used in code templated on "int32_t TileWidth". The rest uses the framebuffer's copy of the layout.
+#define TILE_WIDTH_IN_PIXELS TileWidth
+#define DEFAULT_TILE_WIDTH_IN_PIXELS 64
+#define MIN_TILE_WIDTH_IN_PIXELS 32
+#define MAX_TILE_WIDTH_IN_PIXELS 128
 #define COARSE_BLOCK_WIDTH_IN_PIXELS 16
 #define FINE_BLOCK_WIDTH_IN_PIXELS 4
 
@@ -61,27 +81,53 @@
 #define TILE_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_TILE - 1))
 #define TILE_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_TILE - 1))
 
-#define COARSE_BLOCK_X_SWIZZLE_MASK (TILE_X_SWIZZLE_MASK & (PIXELS_PER_COARSE_BLOCK - 1))
-#define COARSE_BLOCK_Y_SWIZZLE_MASK (TILE_Y_SWIZZLE_MASK & (PIXELS_PER_COARSE_BLOCK - 1))
+#define COARSE_BLOCK_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_COARSE_BLOCK - 1))
+#define COARSE_BLOCK_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_COARSE_BLOCK - 1))
 
-#define FINE_BLOCK_X_SWIZZLE_MASK (TILE_X_SWIZZLE_MASK & (PIXELS_PER_FINE_BLOCK - 1))
-#define FINE_BLOCK_Y_SWIZZLE_MASK (TILE_Y_SWIZZLE_MASK & (PIXELS_PER_FINE_BLOCK - 1))
+#define FINE_BLOCK_X_SWIZZLE_MASK (0x55555555 & (PIXELS_PER_FINE_BLOCK - 1))
+#define FINE_BLOCK_Y_SWIZZLE_MASK (0xAAAAAAAA & (PIXELS_PER_FINE_BLOCK - 1))
 
-// If there are too many commands and this buffer gets filled up,
-// then the command buffer for that tile must be flushed.
+// Multisampled framebuffers (see framebuffer_config_t::msaa) test this many samples per pixel.
+// The depths (and colors) of the samples of a fine block are stored one sample after the other, each one laid out like a fine block,
+// so the samples of a buffer are in the same order as its pixels, only 4x as many.
+#define MSAA_SAMPLES_PER_PIXEL 4
+
+// If there are too many commands queued up for a tile,
+// then the command list for that tile must be flushed.
+// This is the default, framebuffer_config_t::tile_flush_threshold_in_dwords overrides it.
 #define TILE_COMMAND_BUFFER_SIZE_IN_DWORDS 1024
 
-// parallel bit deposit low-order source bits according to mask bits
-#ifdef USE_HSWni
-__forceinline uint32_t pdep_u32(uint32_t source, uint32_t mask)
-{
-    // AVX2 implementation
-    return _pdep_u32(source, mask);
-}
+// Command lists are made of chunks allocated from an arena shared by all tiles.
+// A command never straddles two chunks.
+#define TILE_COMMAND_CHUNK_SIZE_IN_DWORDS 256
+
+// The arenas take chunks from the framebuffer's command pool this many at a time.
+#define TILE_COMMAND_SLAB_SIZE_IN_CHUNKS 64
+
+// Below this many triangles per thread, framebuffer_draw_indexed just bins on the calling thread.
+#define MIN_TRIANGLES_PER_BINNER 2048
+
+// Triangles are only clipped against the sides of a guard band around the viewport, rather than the sides of the viewport itself.
+// Window coordinates within the guard band stay within this many pixels of the origin,
+// which is as far as the viewport transform and the edge equations can go without overflowing.
+#define GUARD_BAND_IN_PIXELS 16384
+
+// Functions using instructions beyond x64's baseline are tagged with these.
+// GCC and Clang only allow the intrinsics in functions targeting the instruction set,
+// while MSVC allows them anywhere.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx2,avx512f")))
 #else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// parallel bit deposit low-order source bits according to mask bits
+// generic implementation, since it has to run on CPUs without BMI2.
+// it's only used for swizzle masks and once per row of a tile when packing, so it's not on a hot path.
 __forceinline uint32_t pdep_u32(uint32_t source, uint32_t mask)
 {
-    // generic implementation
     uint32_t temp = source;
     uint32_t dest = 0;
     uint32_t m = 0, k = 0;
@@ -96,16 +142,8 @@ __forceinline uint32_t pdep_u32(uint32_t source, uint32_t mask)
     }
     return dest;
 }
-#endif
 
 // parallel bit extract low-order source bits according to mask bits
-#ifdef USE_HSWni
-__forceinline uint32_t pext_u32(uint32_t source, uint32_t mask)
-{
-    // AVX2 implementation
-    return _pext_u32(source, mask);
-}
-#else
 __forceinline uint32_t pext_u32(uint32_t source, uint32_t mask)
 {
     // generic implementation
@@ -123,16 +161,10 @@ __forceinline uint32_t pext_u32(uint32_t source, uint32_t mask)
     }
     return dest;
 }
-#endif
 
 // count leading zeros (32 bits)
-#ifdef USE_HSWni
-__forceinline uint32_t lzcnt(uint32_t value)
-{
-    // AVX2 implementation
-    return __lzcnt(value);
-}
-#elif defined(_MSC_VER)
+// note: implemented with bit scan reverse rather than LZCNT, since BSR is available on every x64 CPU.
+#if defined(_MSC_VER)
 __forceinline uint32_t lzcnt(uint32_t value)
 {
     // MSVC implementation
@@ -146,6 +178,12 @@ __forceinline uint32_t lzcnt(uint32_t value)
         return 32;
     }
 }
+#elif defined(__GNUC__)
+__forceinline uint32_t lzcnt(uint32_t value)
+{
+    // GCC/Clang implementation
+    return value ? __builtin_clz(value) : 32;
+}
 #else
 __forceinline uint32_t lzcnt(uint32_t value)
 {
@@ -163,12 +201,7 @@ __forceinline uint32_t lzcnt(uint32_t value)
 #endif
 
 // count leading zeros (64 bits)
-#ifdef USE_HSWni
-__forceinline uint64_t lzcnt64(uint64_t value)
-{
-    return __lzcnt64(value);
-}
-#elif defined(_MSC_VER)
+#if defined(_MSC_VER)
 __forceinline uint64_t lzcnt64(uint64_t value)
 {
     // MSVC implementation
@@ -182,6 +215,12 @@ __forceinline uint64_t lzcnt64(uint64_t value)
         return 64;
     }
 }
+#elif defined(__GNUC__)
+__forceinline uint64_t lzcnt64(uint64_t value)
+{
+    // GCC/Clang implementation
+    return value ? __builtin_clzll(value) : 64;
+}
 #else
 __forceinline uint64_t lzcnt64(uint64_t value)
 {
@@ -198,30 +237,390 @@ __forceinline uint64_t lzcnt64(uint64_t value)
 }
 #endif
 
-#ifdef ENABLE_PERFCOUNTERS
-#ifdef _WIN32
-uint64_t qpc()
+// count trailing zeros (32 bits)
+#if defined(_MSC_VER)
+__forceinline uint32_t tzcnt(uint32_t value)
+{
+    // MSVC implementation
+    unsigned long index;
+    if (_BitScanForward(&index, value))
+    {
+        return index;
+    }
+    else
+    {
+        return 32;
+    }
+}
+#elif defined(__GNUC__)
+__forceinline uint32_t tzcnt(uint32_t value)
 {
-    LARGE_INTEGER pc;
-    QueryPerformanceCounter(&pc);
-    return pc.QuadPart;
+    // GCC/Clang implementation
+    return value ? __builtin_ctz(value) : 32;
 }
 #else
-"Missing QPC implementation for this platform!";
+__forceinline uint32_t tzcnt(uint32_t value)
+{
+    // generic implementation
+    uint32_t i;
+    for (i = 0; i < 32; i++)
+    {
+        if (value & 1)
+            break;
+
+        value = value >> 1;
+    }
+    return i;
+}
 #endif
 
-#ifdef _WIN32
-uint64_t qpf()
+// count trailing zeros (64 bits)
+#if defined(_MSC_VER)
+__forceinline uint64_t tzcnt64(uint64_t value)
+{
+    // MSVC implementation
+    unsigned long index;
+    if (_BitScanForward64(&index, value))
+    {
+        return index;
+    }
+    else
+    {
+        return 64;
+    }
+}
+#elif defined(__GNUC__)
+__forceinline uint64_t tzcnt64(uint64_t value)
+{
+    // GCC/Clang implementation
+    return value ? __builtin_ctzll(value) : 64;
+}
+#else
+__forceinline uint64_t tzcnt64(uint64_t value)
+{
+    // generic implementation
+    uint64_t i;
+    for (i = 0; i < 64; i++)
+    {
+        if (value & 1)
+            break;
+
+        value = value >> 1ULL;
+    }
+    return i;
+}
+#endif
+
+// count set bits (32 bits)
+// note: only used by code for AVX2 and AVX-512, since every CPU that has those also has POPCNT.
+#if defined(_MSC_VER)
+__forceinline uint32_t popcnt(uint32_t value)
+{
+    // MSVC implementation
+    return __popcnt(value);
+}
+#elif defined(__GNUC__)
+__forceinline uint32_t popcnt(uint32_t value)
+{
+    // GCC/Clang implementation
+    return __builtin_popcount(value);
+}
+#else
+__forceinline uint32_t popcnt(uint32_t value)
+{
+    // generic implementation
+    uint32_t count = 0;
+    for (; value; value &= value - 1)
+    {
+        count++;
+    }
+    return count;
+}
+#endif
+
+// the x coordinate of a morton code, from its even bits. shift the code right by one first for the y coordinate.
+// unlike pext_u32 this is cheap enough for the kernels, and it folds away for constants.
+__forceinline uint32_t morton_decode_x(uint32_t code)
+{
+    code &= 0x55555555;
+    code = (code | (code >> 1)) & 0x33333333;
+    code = (code | (code >> 2)) & 0x0F0F0F0F;
+    code = (code | (code >> 4)) & 0x00FF00FF;
+    code = (code | (code >> 8)) & 0x0000FFFF;
+    return code;
+}
+
+// the inverse of morton_decode_x: spreads the low 16 bits of x to the even bits. shift the result left by one for a y coordinate.
+__forceinline uint32_t morton_encode_x(uint32_t x)
+{
+    x &= 0x0000FFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
 {
-    LARGE_INTEGER pf;
-    QueryPerformanceFrequency(&pf);
-    return pf.QuadPart;
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
 }
+
+// reads XCR0, which says which register states the OS saves on context switches
+static uint64_t xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
 #else
-"Missing QPF implementation for this platform!";
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+// the best instruction set that both the CPU and the OS support
+static instructionset_t detect_instruction_set()
+{
+    uint32_t regs[4];
+
+    cpuid(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+    if (max_leaf < 7)
+    {
+        return instructionset_scalar;
+    }
+
+    // the OS has to support saving the AVX registers, otherwise AVX can't be used even if the CPU has it
+    cpuid(1, 0, regs);
+    bool has_osxsave = (regs[2] & (1 << 27)) != 0;
+    bool has_avx = (regs[2] & (1 << 28)) != 0;
+    if (!has_osxsave || !has_avx)
+    {
+        return instructionset_scalar;
+    }
+
+    uint64_t xcr0 = xgetbv0();
+    // XMM and YMM state
+    bool os_saves_ymm = (xcr0 & 0x6) == 0x6;
+    // XMM, YMM, opmask, upper ZMM and high ZMM state
+    bool os_saves_zmm = (xcr0 & 0xE6) == 0xE6;
+
+    cpuid(7, 0, regs);
+    bool has_avx2 = (regs[1] & (1 << 5)) != 0;
+    bool has_avx512f = (regs[1] & (1 << 16)) != 0;
+
+#ifdef ENABLE_AVX512
+    if (os_saves_zmm && has_avx2 && has_avx512f)
+    {
+        return instructionset_avx512;
+    }
 #endif
+
+    if (os_saves_ymm && has_avx2)
+    {
+        return instructionset_avx2;
+    }
+
+    return instructionset_scalar;
+}
+
+// read the time stamp counter
+// x64 CPUs from the last decade have an invariant TSC, which ticks at the same constant rate on every core,
+// and it's an order of magnitude cheaper to read than QueryPerformanceCounter.
+#if defined(_MSC_VER) || defined(__GNUC__)
+__forceinline uint64_t rdtsc()
+{
+    return __rdtsc();
+}
+#else
+"Missing RDTSC implementation for this compiler!";
 #endif
 
+// Thread pool
+// ------------------
+// Every thread owns a deque of tasks. A thread pops tasks from the front of its own deque,
+// and once it runs dry it steals from the back of the other threads' deques.
+// The thread that waits for a group of tasks also runs tasks while it waits, as worker 0.
+typedef void(*threadpool_task_fn_t)(void* ctx, int32_t arg, int32_t worker_id);
+
+typedef struct threadpool_task_t
+{
+    threadpool_task_fn_t fn;
+    void* ctx;
+    int32_t arg;
+    // decremented when the task is done, so the submitter can wait for it
+    std::atomic<int32_t>* group;
+} threadpool_task_t;
+
+typedef struct threadpool_queue_t
+{
+    std::mutex lock;
+    std::deque<threadpool_task_t> tasks;
+} threadpool_queue_t;
+
+typedef struct threadpool_t
+{
+    // includes the waiting thread, so there are (num_threads - 1) background workers
+    int32_t num_threads;
+    threadpool_queue_t* queues;
+    std::thread* workers;
+
+    // where the next submitted task goes, round robin
+    std::atomic<int32_t> next_queue;
+
+    // workers sleep when there's nothing left to run or steal
+    std::atomic<int32_t> num_queued;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    bool quit;
+
+    // the framebuffers running on the pool (see framebuffer_config_t::share_threads_with). the last one to be deleted deletes it.
+    std::atomic<int32_t> num_framebuffers;
+} threadpool_t;
+
+static bool threadpool_try_run_task(threadpool_t* tp, int32_t worker_id)
+{
+    threadpool_task_t task;
+    bool found = false;
+
+    // own tasks first, then steal from the others
+    for (int32_t i = 0; i < tp->num_threads && !found; i++)
+    {
+        threadpool_queue_t* queue = &tp->queues[(worker_id + i) % tp->num_threads];
+        std::lock_guard<std::mutex> lock(queue->lock);
+        if (!queue->tasks.empty())
+        {
+            if (i == 0)
+            {
+                task = queue->tasks.front();
+                queue->tasks.pop_front();
+            }
+            else
+            {
+                task = queue->tasks.back();
+                queue->tasks.pop_back();
+            }
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        return false;
+    }
+
+    tp->num_queued--;
+    task.fn(task.ctx, task.arg, worker_id);
+    task.group->fetch_sub(1, std::memory_order_release);
+    return true;
+}
+
+static void threadpool_worker_main(threadpool_t* tp, int32_t worker_id)
+{
+    for (;;)
+    {
+        if (threadpool_try_run_task(tp, worker_id))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(tp->sleep_lock);
+        tp->sleep_cv.wait(lock, [tp] { return tp->quit || tp->num_queued > 0; });
+        if (tp->quit && tp->num_queued == 0)
+        {
+            break;
+        }
+    }
+}
+
+static threadpool_t* new_threadpool(int32_t num_threads)
+{
+    assert(num_threads > 0);
+
+    threadpool_t* tp = new threadpool_t();
+    tp->num_threads = num_threads;
+    tp->queues = new threadpool_queue_t[num_threads];
+    tp->next_queue = 0;
+    tp->num_queued = 0;
+    tp->quit = false;
+    tp->num_framebuffers = 1;
+
+    tp->workers = new std::thread[num_threads - 1];
+    for (int32_t i = 1; i < num_threads; i++)
+    {
+        tp->workers[i - 1] = std::thread(threadpool_worker_main, tp, i);
+    }
+
+    return tp;
+}
+
+static void delete_threadpool(threadpool_t* tp)
+{
+    if (!tp)
+        return;
+
+    if (tp->num_framebuffers.fetch_sub(1) != 1)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(tp->sleep_lock);
+        tp->quit = true;
+    }
+    tp->sleep_cv.notify_all();
+
+    for (int32_t i = 1; i < tp->num_threads; i++)
+    {
+        tp->workers[i - 1].join();
+    }
+
+    delete[] tp->workers;
+    delete[] tp->queues;
+    delete tp;
+}
+
+static void threadpool_submit(threadpool_t* tp, threadpool_task_fn_t fn, void* ctx, int32_t arg, std::atomic<int32_t>* group)
+{
+    threadpool_task_t task;
+    task.fn = fn;
+    task.ctx = ctx;
+    task.arg = arg;
+    task.group = group;
+
+    group->fetch_add(1, std::memory_order_relaxed);
+
+    threadpool_queue_t* queue = &tp->queues[(uint32_t)tp->next_queue++ % (uint32_t)tp->num_threads];
+    {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        queue->tasks.push_back(task);
+    }
+
+    // taking the sleep lock makes sure a worker can't miss the wakeup between checking num_queued and going to sleep
+    {
+        std::lock_guard<std::mutex> lock(tp->sleep_lock);
+        tp->num_queued++;
+    }
+    tp->sleep_cv.notify_one();
+}
+
+// runs tasks on the calling thread until every task in the group is done
+static void threadpool_wait(threadpool_t* tp, std::atomic<int32_t>* group)
+{
+    while (group->load(std::memory_order_acquire) != 0)
+    {
+        if (!threadpool_try_run_task(tp, 0))
+        {
+            // the remaining tasks of the group are running on other threads
+            std::this_thread::yield();
+        }
+    }
+}
+
 static int32_t s1516_add(int32_t a, int32_t b)
 {
     int32_t result;
@@ -314,78 +713,246 @@ static int32_t s168_s1516(int32_t s1516)
     return s1516_div(s1516, s1516_int(256));
 }
 
-typedef struct tile_cmdbuf_t
+typedef struct tile_cmdchunk_t
+{
+    struct tile_cmdchunk_t* next;
+    int32_t num_dwords;
+    uint32_t dwords[TILE_COMMAND_CHUNK_SIZE_IN_DWORDS];
+} tile_cmdchunk_t;
+
+typedef struct tile_cmdlist_t
 {
-    // start and past-the-end of the allocation for the buffer
-    uint32_t* cmdbuf_start;
-    uint32_t* cmdbuf_end;
-    // the next location where to read and write commands
-    uint32_t* cmdbuf_read;
-    uint32_t* cmdbuf_write;
-} tile_cmdbuf_t;
+    // chunks are read from head to tail, and written at the tail
+    tile_cmdchunk_t* head;
+    tile_cmdchunk_t* tail;
+    // total number of dwords written in all chunks of the list
+    int32_t num_dwords;
+} tile_cmdlist_t;
+
+// The command memory of a framebuffer: slabs of chunks, shared by all of its binners and only allocated when they run out.
+// Slabs that are given back are kept for the next frames, so the pool ends up as big as the most a frame ever needed at once.
+typedef struct tile_cmdpool_t
+{
+    std::mutex lock;
+    std::vector<tile_cmdchunk_t*> free_slabs;
+    // slabs allocated in total, and how many of them are taken by arenas
+    int32_t num_slabs;
+    int32_t num_slabs_in_use;
+    int32_t peak_num_slabs_in_use;
+} tile_cmdpool_t;
+
+// Chunks live until the end of the frame: allocating one is a pointer bump, and framebuffer_resolve
+// frees all of them at once by giving the arena's slabs back to the pool.
+// Every binner has its own arena, so binning threads only wait on each other to take a whole slab from the pool.
+typedef struct tile_cmdarena_t
+{
+    tile_cmdpool_t* pool;
+    // the slabs taken from the pool since the last reset. chunks come from the last one.
+    std::vector<tile_cmdchunk_t*> slabs;
+    int32_t num_chunks_used;
+} tile_cmdarena_t;
+
+// Command lists that got flushed while binning, waiting to be resolved by a worker thread.
+// At most one task resolves a given tile at a time, so its commands still run in order.
+typedef struct tile_flush_queue_t
+{
+    std::mutex lock;
+    tile_cmdchunk_t* head;
+    tile_cmdchunk_t* tail;
+    // whether a task is already submitted to resolve this tile
+    bool scheduled;
+} tile_flush_queue_t;
 
 typedef enum tilecmd_id_t
 {
-    tilecmd_id_resetbuf, // when there's not enough space in the command ring buffer and the ring loops
     tilecmd_id_drawsmalltri,
     tilecmd_id_drawlargetri_0edgemask,
     tilecmd_id_drawlargetri_7edgemask = tilecmd_id_drawlargetri_0edgemask + 7,
     tilecmd_id_cleartile
 } tilecmd_id_t;
 
+// Perfcounters measure time in ticks of rdtsc, and are only measured while enabled (see framebuffer_enable_perfcounters).
+// Stats count things, and are always kept since they're only a few adds.
+// Each binner and each tile has counters of its own, which are only written by the thread using that binner or running that tile's commands.
+// Queries add them up, so nothing needs to be atomic.
+
+// time spent in triangle setup, by one binner
 typedef struct framebuffer_perfcounters_t
 {
-#ifdef ENABLE_PERFCOUNTERS
     uint64_t clipping;
     uint64_t common_setup;
     uint64_t smalltri_setup;
     uint64_t largetri_setup;
-#else
-    uint64_t unused;
-#endif
 } framebuffer_perfcounters_t;
 
 const char* kFramebufferPerfcounterNames[] = {
-#ifdef ENABLE_PERFCOUNTERS
     "clipping",
     "common_setup",
     "smalltri_setup",
     "largetri_setup"
-#else
-    ""
-#endif
 };
 
 static_assert(sizeof(kFramebufferPerfcounterNames) / sizeof(*kFramebufferPerfcounterNames) == sizeof(framebuffer_perfcounters_t) / sizeof(uint64_t), "Names for perfcounters");
 
+// what happened to the triangles of one binner.
+// triangles made by clipping are counted from triangle setup on, so every triangle that got to setup was either binned or culled for one reason.
+typedef struct framebuffer_stats_t
+{
+    uint64_t triangles;
+    uint64_t triangles_culled_clipping;
+    uint64_t triangles_culled_offscreen;
+    uint64_t triangles_culled_backface;
+    uint64_t triangles_culled_zero_area;
+    uint64_t triangles_culled_occluded;
+    uint64_t triangles_binned;
+    uint64_t tile_commands;
+} framebuffer_stats_t;
+
+// time spent running the commands of one tile
 typedef struct framebuffer_tile_perfcounters_t
 {
-#ifdef ENABLE_PERFCOUNTERS
     uint64_t smalltri_raster;
     uint64_t largetri_raster;
     uint64_t clear;
-#else
-    uint64_t unused;
-#endif
 } framebuffer_tile_perfcounters_t;
 
 const char* kFramebufferTilePerfcounterNames[] = {
-#ifdef ENABLE_PERFCOUNTERS
     "smalltri_raster",
     "largetri_raster",
     "clear",
-#else
-    ""
-#endif
 };
 
 static_assert(sizeof(kFramebufferTilePerfcounterNames) / sizeof(*kFramebufferTilePerfcounterNames) == sizeof(framebuffer_tile_perfcounters_t) / sizeof(uint64_t), "Names for perfcounters");
 
+// what the commands of one tile drew
+typedef struct framebuffer_tile_stats_t
+{
+    uint64_t fine_blocks;
+    uint64_t pixels_passed;
+} framebuffer_tile_stats_t;
+
+// the stats of the binners, followed by the stats of the tiles
+const char* kFramebufferStatNames[] = {
+    "triangles",
+    "triangles_culled_clipping",
+    "triangles_culled_offscreen",
+    "triangles_culled_backface",
+    "triangles_culled_zero_area",
+    "triangles_culled_occluded",
+    "triangles_binned",
+    "tile_commands",
+    "fine_blocks",
+    "pixels_passed"
+};
+
+static_assert(sizeof(kFramebufferStatNames) / sizeof(*kFramebufferStatNames) == (sizeof(framebuffer_stats_t) + sizeof(framebuffer_tile_stats_t)) / sizeof(uint64_t), "Names for stats");
+
+// the counters of a tile get a cache line of their own, since neighboring tiles are usually run by different threads
+typedef struct tile_counters_t
+{
+    framebuffer_tile_perfcounters_t perfcounters;
+    framebuffer_tile_stats_t stats;
+    uint64_t padding[3];
+} tile_counters_t;
+
+static_assert(sizeof(tile_counters_t) == 64, "Tile counters fill a cache line");
+
+// Trace capture
+// ------------------
+// While a trace is being captured, every thread appends the events it ran to a list of its own, so recording them doesn't take a lock.
+typedef struct framebuffer_trace_event_t
+{
+    // string literals, or strings that outlive the capture
+    const char* name;
+    const char* arg_name;
+    int32_t arg;
+    uint64_t begin_ticks;
+    uint64_t end_ticks;
+} framebuffer_trace_event_t;
+
+typedef struct framebuffer_trace_thread_t
+{
+    std::vector<framebuffer_trace_event_t> events;
+
+    // keeps the threads from writing to the same cache line
+    uint8_t padding[64 - sizeof(std::vector<framebuffer_trace_event_t>)];
+} framebuffer_trace_thread_t;
+
 typedef struct xyzw_i32_t
 {
     int32_t x, y, z, w;
 } xyzw_i32_t;
 
+// A triangle that's visible in the visibility buffer, with what framebuffer_shade needs to interpolate its varyings.
+// The perspective correct barycentrics of its vertices at the window coordinates (x, y) are proportional to
+// planes[v][0] * (x - origin_x) + planes[v][1] * (y - origin_y) + planes[v][2], which holds for every part of the triangle left after clipping.
+// The origin is a pixel of the part of the triangle that's on screen, since the planes lose too much precision far away from it.
+typedef struct shade_triangle_t
+{
+    float planes[3][3];
+    int32_t origin_x, origin_y;
+    uint32_t draw_id;
+    uint32_t triangle_index;
+    int32_t num_varyings;
+    // where the varyings of its vertices start in the binner's varyings, the 3 vertices one after the other
+    int32_t first_varying;
+} shade_triangle_t;
+
+// The ids in the visibility buffer are the binner in the top bits and the index of its shade_triangle_t in the rest.
+#define SHADE_TRIANGLE_INDEX_BITS 24
+#define MAX_SHADE_TRIANGLES_PER_BINNER ((1 << SHADE_TRIANGLE_INDEX_BITS) - 1)
+#define MAX_VISIBILITY_BUFFER_BINNERS 256
+
+// what cleared pixels of the visibility buffer hold
+#define NO_TRIANGLE 0xFFFFFFFF
+
+// The state that triangle setup writes to.
+// Serial binning uses the framebuffer's own command lists through binner 0.
+// When framebuffer_draw_indexed bins in parallel, every other thread gets
+// its own command lists that are appended to the framebuffer's ones afterwards, in order.
+typedef struct tile_binner_t
+{
+    // one command list per tile
+    tile_cmdlist_t* tile_cmdlists;
+
+    // where the chunks of the command lists come from, out of the framebuffer's command pool
+    tile_cmdarena_t* cmdarena;
+
+    // the chunk of the arena that the setups of large triangles are currently being written to
+    tile_cmdchunk_t* largetri_setup_chunk;
+
+    // whether a tile can be flushed when its command list fills up.
+    // only true for binner 0, since the other binners' commands have to wait for the earlier binners' commands.
+    bool can_flush;
+
+    // the thread pool worker that's currently binning with this binner, for the trace capture
+    int32_t worker_id;
+
+    // the visibility buffer's triangles binned since the last clear, and their varyings.
+    // they're only read by framebuffer_shade, so they grow without waiting on the tiles.
+    shade_triangle_t* shade_triangles;
+    int32_t num_shade_triangles;
+    int32_t shade_triangles_capacity;
+    float* shade_varyings;
+    int32_t num_shade_varyings;
+    int32_t shade_varyings_capacity;
+
+    // the varyings of the draw being binned
+    const float* varyings;
+    int32_t num_varyings;
+    uint32_t draw_id;
+
+    // the triangle being set up, before clipping. its shade_triangle_t is only written once it gets binned to a tile,
+    // and all the triangles that clipping splits it into share it.
+    xyzw_i32_t shade_clip_verts[3];
+    uint32_t shade_vertex_ids[3];
+    uint32_t shade_triangle_index;
+    uint32_t shade_triangle_id;
+
+    framebuffer_perfcounters_t perfcounters;
+    framebuffer_stats_t stats;
+} tile_binner_t;
+
 typedef struct tilecmd_drawsmalltri_t
 {
     uint32_t tilecmd_id;
@@ -397,8 +964,29 @@ typedef struct tilecmd_drawsmalltri_t
     uint32_t shifted_triarea2;
     uint32_t rcp_triarea2_mantissa;
     int32_t rcp_triarea2_rshift;
+    // what goes in the visibility buffer where the triangle is visible
+    uint32_t triangle_id;
 } tilecmd_drawsmalltri_t;
 
+// where the samples of a multisampled pixel are, in 1/256ths of a pixel from its top left (the usual 4x rotated grid)
+static const int32_t kMsaaSampleXs[MSAA_SAMPLES_PER_PIXEL] = { 0x60, 0xE0, 0x20, 0xA0 };
+static const int32_t kMsaaSampleYs[MSAA_SAMPLES_PER_PIXEL] = { 0x20, 0x60, 0xA0, 0xE0 };
+
+// the edge equations of multisampled framebuffers are evaluated at the top left corner of the pixels,
+// and this is how much each of them goes up from there to each sample. it's the same for every pixel of a triangle.
+typedef struct sample_edge_offsets_t
+{
+    int32_t edges[MSAA_SAMPLES_PER_PIXEL][3];
+} sample_edge_offsets_t;
+
+// what small triangles are binned as in multisampled framebuffers
+typedef struct tilecmd_drawsmalltri_msaa_t
+{
+    tilecmd_drawsmalltri_t drawcmd;
+    sample_edge_offsets_t sample_offsets;
+} tilecmd_drawsmalltri_msaa_t;
+
+// what the large triangle kernels draw a tile with, unpacked from a tilecmd_drawlargetri_t and the setup it points to
 typedef struct tilecmd_drawtile_t
 {
     uint32_t tilecmd_id;
@@ -411,28 +999,135 @@ typedef struct tilecmd_drawtile_t
     uint32_t shifted_triarea2;
     uint32_t rcp_triarea2_mantissa;
     int32_t rcp_triarea2_rshift;
+    uint32_t triangle_id;
+    // null unless the framebuffer is multisampled
+    const sample_edge_offsets_t* sample_offsets;
 } tilecmd_drawtile_t;
 
+// the part of a large triangle's setup that is the same in every tile it covers.
+// it's written once per triangle, one cache line each, in the frame's command memory of the binner.
+// multisampled framebuffers put its sample_edge_offsets_t in the cache line after it.
+typedef struct largetri_setup_t
+{
+    int32_t edge_dxs[3];
+    int32_t edge_dys[3];
+    int32_t vert_Zs[3];
+    uint32_t max_Z, min_Z;
+    uint32_t shifted_triarea2;
+    uint32_t rcp_triarea2_mantissa;
+    int32_t rcp_triarea2_rshift;
+    uint32_t triangle_id;
+    uint32_t padding;
+} largetri_setup_t;
+
+static_assert(sizeof(largetri_setup_t) == 64, "largetri_setup_t is one cache line");
+
+// draws a large triangle in one tile. the command's id says which edges need testing in the tile:
+// those edges are relative to the tile's top left, and for the others it's the offset of their barycentric in the tile.
+typedef struct tilecmd_drawlargetri_t
+{
+    uint32_t tilecmd_id;
+    int32_t tile_edges[3];
+    const largetri_setup_t* setup;
+} tilecmd_drawlargetri_t;
+
 typedef struct tilecmd_cleartile_t
 {
     uint32_t tilecmd_id;
     uint32_t color;
 } tilecmd_cleartile_t;
 
+typedef void(*draw_tile_smalltri_fn_t)(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd);
+typedef void(*draw_tile_largetri_fn_t)(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd);
+
+// fills the coarse block with the clear depth, and with the clear color too unless it's about to be overwritten
+typedef void(*clear_coarse_block_fn_t)(framebuffer_t* fb, int32_t coarse_dst_i, uint32_t color, bool clear_color);
+
+// recomputes the depth bound of each coarse block of a tile from its depth buffer
+typedef void(*update_coarse_max_depths_fn_t)(framebuffer_t* fb, int32_t tile_id);
+
+// converts the pixels [x0, x1) x [y0, y1) of a tile, relative to the tile's top left.
+// dst is where pixel (x0, y0) goes, and the rows of dst are dst_pitch bytes apart.
+typedef void(*pack_tile_fn_t)(const uint32_t* tile_src, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch);
+
+// the same for a multisampled tile, resolving the samples of each pixel down to one. colors are averaged,
+// except in the fine blocks that are compressed (where tile_compressed is non zero), whose colors are the ones of tile_src.
+// depths are the farthest of the samples, and tile_src and tile_compressed are null for them.
+typedef void(*pack_tile_msaa_fn_t)(const uint32_t* tile_src, const uint32_t* tile_samples, const uint8_t* tile_compressed, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch);
+
+// shades the pixels of a tile that a triangle is visible in, and fills the rest with the clear color
+typedef void(*shade_tile_fn_t)(framebuffer_t* fb, int32_t tile_id, framebuffer_shader_fn_t shader, void* ctx);
+
+// clips, sets up and bins the triangles made of every 3 vertices
+typedef void(*bin_fn_t)(framebuffer_t* fb, tile_binner_t* binner, const int32_t* vertices, uint32_t num_vertices);
+
+// clips, sets up and bins the triangles of indices [first_index, end_index)
+typedef void(*bin_indexed_fn_t)(framebuffer_t* fb, tile_binner_t* binner, const int32_t* vertices, const uint32_t* indices, uint32_t first_index, uint32_t end_index);
+
+// the kernels for one instruction set and one tile size (and whether the framebuffer is multisampled)
+typedef struct framebuffer_kernels_t
+{
+    draw_tile_smalltri_fn_t draw_tile_smalltri;
+    draw_tile_largetri_fn_t draw_tile_largetri[8]; // indexed by edge test mask
+    clear_coarse_block_fn_t clear_coarse_block;
+    update_coarse_max_depths_fn_t update_coarse_max_depths;
+    pack_tile_fn_t pack_tile[3]; // indexed by pixelformat_t
+    pack_tile_msaa_fn_t pack_tile_msaa[3]; // likewise, only for multisampled framebuffers
+    shade_tile_fn_t shade_tile;
+    bin_fn_t bin;
+    bin_indexed_fn_t bin_indexed;
+} framebuffer_kernels_t;
+
+// defined after all the kernels
+static const framebuffer_kernels_t* framebuffer_kernels_for(instructionset_t instruction_set, int32_t tile_width_in_pixels, bool msaa);
+
 typedef struct framebuffer_t
 {
+    // null for depth only framebuffers
     uint32_t* backbuffer;
     uint32_t* depthbuffer;
+
+    // skips everything related to color
+    bool depth_only;
+
+    // the color buffer holds which triangle is visible in each pixel until framebuffer_shade turns them into colors
+    bool visibility_buffer;
+
+    // 4x multisampling. the depth buffer has MSAA_SAMPLES_PER_PIXEL depths per pixel,
+    // and the color of each pixel is either in the backbuffer or in the samplebuffer depending on its fine block.
+    // compressed fine blocks (non zero in compressed_fine_blocks, one per fine block) only keep one color per pixel in the backbuffer,
+    // the others keep MSAA_SAMPLES_PER_PIXEL colors per pixel in the samplebuffer. fine blocks get uncompressed when a triangle covers
+    // part of a pixel, and compressed again when one covers all of them. null without multisampling, or when depth only.
+    bool msaa;
+    uint32_t* samplebuffer;
+    uint8_t* compressed_fine_blocks;
     
-    uint32_t* tile_cmdpool;
-    tile_cmdbuf_t* tile_cmdbufs;
+    tile_cmdlist_t* tile_cmdlists;
+
+    // binner 0 writes directly to tile_cmdlists
+    int32_t num_binners;
+    tile_binner_t* binners;
     
     int32_t width_in_pixels;
     int32_t height_in_pixels;
 
+    // the guard band is where -guard_band_x * w <= x <= guard_band_x * w (and likewise for y) in clip space
+    int32_t guard_band_x;
+    int32_t guard_band_y;
+
     int32_t width_in_tiles;
     int32_t height_in_tiles;
     int32_t total_num_tiles;
+
+    // the layout of a tile, for the code that isn't templated on the tile size
+    int32_t tile_width_in_pixels;
+    int32_t tile_width_in_coarse_blocks;
+    int32_t pixels_per_tile;
+    int32_t coarse_blocks_per_tile;
+    uint32_t tile_x_swizzle_mask;
+    uint32_t tile_y_swizzle_mask;
+    // one bit per coarse block of a tile
+    uint64_t all_coarse_blocks_mask;
     
     // num_tiles_per_row * num_pixels_per_tile
     int32_t pixels_per_row_of_tiles;
@@ -440,17 +1135,235 @@ typedef struct framebuffer_t
     // pixels_per_row_of_tiles * num_tile_rows
     int32_t pixels_per_slice;
 
-#ifdef ENABLE_PERFCOUNTERS
-    // performance counters
-    uint64_t pc_frequency;
-    framebuffer_perfcounters_t perfcounters;
-    framebuffer_tile_perfcounters_t* tile_perfcounters;
-#endif
-
+    // resolves tiles in parallel. null when resolving on the calling thread only.
+    threadpool_t* threadpool;
+
+    // scratch space for framebuffer_resolve to order the tiles by how much work they have queued up,
+    // kept until the framebuffers resolved along with this one are done
+    int32_t* tile_resolve_order;
+    int32_t* tile_resolve_weights;
+    int32_t num_busy_tiles;
+    uint64_t resolve_trace_start;
+
+    // when true, tiles that fill up while binning are resolved by the thread pool instead of the binning thread.
+    bool async_flush;
+    tile_flush_queue_t* tile_flush_queues;
+    std::atomic<int32_t>* num_flushes_left;
+
+    // a tile's command list is flushed when binner 0 gets it to hold this many dwords of commands
+    int32_t tile_flush_threshold_in_dwords;
+
+    // where every binner's command memory comes from. when it has more than the budget in use when a draw starts,
+    // everything binned so far gets resolved to give it all back. 0 means no budget.
+    tile_cmdpool_t* cmdpool;
+    int32_t cmdpool_budget_in_slabs;
+
+    // hierarchical depth: a conservative upper bound on the depth of every coarse block and every tile.
+    // only written by whoever is resolving the tile. the tile bounds are also read while binning, hence atomic.
+    uint32_t* coarse_max_depths;
+    std::atomic<uint32_t>* tile_max_depths;
+
+    // the tile bounds are stale (too close) until the tile resolves the latest clear, so binning only uses them
+    // when the tile has resolved as many clears as were binned.
+    int32_t num_clears_binned;
+    std::atomic<int32_t>* tile_num_clears_resolved;
+
+    // clears are lazy: resolving a clear only sets every bit of the tile's mask, one bit per coarse block (up to 64 of them).
+    // the pixels of a coarse block are only cleared when a triangle first draws into it, or when packing finds it still cleared.
+    // only used by whoever is resolving the tile.
+    uint64_t* tile_pending_clears;
+    uint32_t* tile_clear_colors;
+
+    // picked at creation based on what the CPU supports
+    instructionset_t instruction_set;
+    const framebuffer_kernels_t* kernels;
+
+    // performance counters and stats
+    bool perfcounters_enabled;
+    tile_counters_t* tile_counters;
+
+    // when the time stamp counter started being measured against the OS's clock, to know its frequency
+    uint64_t pc_calibration_ticks;
+    std::chrono::steady_clock::time_point pc_calibration_time;
+
+    // trace capture, with one list of events for each thread of the thread pool (or only the calling thread without one)
+    bool trace_capturing;
+    uint64_t trace_begin_ticks;
+    int32_t num_trace_threads;
+    framebuffer_trace_thread_t* trace_threads;
 } framebuffer_t;
 
-framebuffer_t* new_framebuffer(int32_t width, int32_t height)
+// starts timing something, if perfcounters are enabled
+static __forceinline uint64_t perfcounter_begin(const framebuffer_t* fb)
+{
+    return fb->perfcounters_enabled ? rdtsc() : 0;
+}
+
+// adds the time since perfcounter_begin to a perfcounter.
+// perfcounter_begin returns 0 when perfcounters are disabled, and the time stamp counter is never 0 after boot.
+static __forceinline void perfcounter_end(uint64_t* pc, uint64_t begin_pc)
+{
+    if (begin_pc)
+    {
+        *pc += rdtsc() - begin_pc;
+    }
+}
+
+// starts timing an event for the trace capture, if a trace is being captured
+static __forceinline uint64_t trace_begin(const framebuffer_t* fb)
+{
+    return fb->trace_capturing ? rdtsc() : 0;
+}
+
+// records an event that started at trace_begin, in the events of the worker that ran it
+static __forceinline void trace_end(framebuffer_t* fb, int32_t worker_id, const char* name, const char* arg_name, int32_t arg, uint64_t begin_ticks)
+{
+    if (begin_ticks)
+    {
+        framebuffer_trace_event_t event;
+        event.name = name;
+        event.arg_name = arg_name;
+        event.arg = arg;
+        event.begin_ticks = begin_ticks;
+        event.end_ticks = rdtsc();
+        fb->trace_threads[worker_id].events.push_back(event);
+    }
+}
+
+static tile_cmdpool_t* new_tile_cmdpool()
+{
+    tile_cmdpool_t* pool = new tile_cmdpool_t();
+    pool->num_slabs = 0;
+    pool->num_slabs_in_use = 0;
+    pool->peak_num_slabs_in_use = 0;
+    return pool;
+}
+
+static void delete_tile_cmdpool(tile_cmdpool_t* pool)
+{
+    if (!pool)
+        return;
+
+    // every arena must have given its slabs back
+    assert(pool->num_slabs_in_use == 0);
+    assert((int32_t)pool->free_slabs.size() == pool->num_slabs);
+
+    for (tile_cmdchunk_t* slab : pool->free_slabs)
+    {
+        free(slab);
+    }
+
+    delete pool;
+}
+
+static tile_cmdchunk_t* tile_cmdpool_take_slab(tile_cmdpool_t* pool)
+{
+    std::lock_guard<std::mutex> lock(pool->lock);
+
+    tile_cmdchunk_t* slab;
+    if (!pool->free_slabs.empty())
+    {
+        slab = pool->free_slabs.back();
+        pool->free_slabs.pop_back();
+    }
+    else
+    {
+        slab = (tile_cmdchunk_t*)malloc(TILE_COMMAND_SLAB_SIZE_IN_CHUNKS * sizeof(tile_cmdchunk_t));
+        assert(slab);
+        pool->num_slabs++;
+    }
+
+    pool->num_slabs_in_use++;
+    if (pool->num_slabs_in_use > pool->peak_num_slabs_in_use)
+    {
+        pool->peak_num_slabs_in_use = pool->num_slabs_in_use;
+    }
+
+    return slab;
+}
+
+static int32_t tile_cmdpool_num_slabs_in_use(tile_cmdpool_t* pool)
+{
+    std::lock_guard<std::mutex> lock(pool->lock);
+    return pool->num_slabs_in_use;
+}
+
+static tile_cmdarena_t* new_tile_cmdarena(tile_cmdpool_t* pool)
 {
+    assert(pool);
+
+    tile_cmdarena_t* arena = new tile_cmdarena_t();
+    arena->pool = pool;
+    arena->num_chunks_used = 0;
+    return arena;
+}
+
+static void delete_tile_cmdarena(tile_cmdarena_t* arena)
+{
+    if (!arena)
+        return;
+
+    // the chunks can't be in use anymore, but the slabs still belong to the pool
+    assert(arena->slabs.empty());
+
+    delete arena;
+}
+
+static tile_cmdchunk_t* tile_cmdarena_alloc_chunk(tile_cmdarena_t* arena)
+{
+    if (arena->slabs.empty() || arena->num_chunks_used == TILE_COMMAND_SLAB_SIZE_IN_CHUNKS)
+    {
+        arena->slabs.push_back(tile_cmdpool_take_slab(arena->pool));
+        arena->num_chunks_used = 0;
+    }
+
+    tile_cmdchunk_t* chunk = &arena->slabs.back()[arena->num_chunks_used];
+    arena->num_chunks_used++;
+
+    chunk->next = NULL;
+    chunk->num_dwords = 0;
+    return chunk;
+}
+
+// frees every chunk allocated since the last reset, by giving their slabs back to the pool. nothing may still be using them.
+static void tile_cmdarena_reset(tile_cmdarena_t* arena)
+{
+    if (!arena->slabs.empty())
+    {
+        tile_cmdpool_t* pool = arena->pool;
+        std::lock_guard<std::mutex> lock(pool->lock);
+        pool->free_slabs.insert(pool->free_slabs.end(), arena->slabs.begin(), arena->slabs.end());
+        pool->num_slabs_in_use -= (int32_t)arena->slabs.size();
+    }
+
+    arena->slabs.clear();
+    arena->num_chunks_used = 0;
+}
+
+static tile_cmdlist_t* new_tile_cmdlists(int32_t num_tiles)
+{
+    tile_cmdlist_t* cmdlists = (tile_cmdlist_t*)malloc(num_tiles * sizeof(tile_cmdlist_t));
+    assert(cmdlists);
+
+    // command lists are initially empty
+    for (int32_t i = 0; i < num_tiles; i++)
+    {
+        cmdlists[i].head = NULL;
+        cmdlists[i].tail = NULL;
+        cmdlists[i].num_dwords = 0;
+    }
+
+    return cmdlists;
+}
+
+framebuffer_t* new_framebuffer_ex(int32_t width, int32_t height, const framebuffer_config_t* config)
+{
+    assert(config);
+    assert(config->num_threads >= 0);
+    assert(config->num_binners >= 0);
+    assert(config->instruction_set >= instructionset_auto && config->instruction_set <= instructionset_avx512);
+    assert(config->tile_width_in_pixels == 0 || config->tile_width_in_pixels == 32 || config->tile_width_in_pixels == 64 || config->tile_width_in_pixels == 128);
+
     // limits of the rasterizer's precision
     // this is based on an analysis of the range of results of the 2D cross product between two fixed16.8 numbers.
     assert(width < 16384);
@@ -462,76 +1375,308 @@ framebuffer_t* new_framebuffer(int32_t width, int32_t height)
     fb->width_in_pixels = width;
     fb->height_in_pixels = height;
 
+    // (guard_band + 1) / 2 * width <= GUARD_BAND_IN_PIXELS
+    fb->guard_band_x = (2 * GUARD_BAND_IN_PIXELS) / width - 1;
+    fb->guard_band_y = (2 * GUARD_BAND_IN_PIXELS) / height - 1;
+    assert(fb->guard_band_x >= 1 && fb->guard_band_y >= 1);
+
+    int32_t tile_width = config->tile_width_in_pixels == 0 ? DEFAULT_TILE_WIDTH_IN_PIXELS : config->tile_width_in_pixels;
+    fb->tile_width_in_pixels = tile_width;
+    fb->tile_width_in_coarse_blocks = tile_width / COARSE_BLOCK_WIDTH_IN_PIXELS;
+    fb->pixels_per_tile = tile_width * tile_width;
+    fb->coarse_blocks_per_tile = fb->pixels_per_tile / PIXELS_PER_COARSE_BLOCK;
+    fb->tile_x_swizzle_mask = 0x55555555 & (fb->pixels_per_tile - 1);
+    fb->tile_y_swizzle_mask = 0xAAAAAAAA & (fb->pixels_per_tile - 1);
+    fb->all_coarse_blocks_mask = ~0ULL >> (64 - fb->coarse_blocks_per_tile);
+
     // pad framebuffer up to size of next tile
     // that way the rasterization code doesn't have to handlep otential out of bounds access after tile binning
-    int32_t padded_width_in_pixels = (width + (TILE_WIDTH_IN_PIXELS - 1)) & -TILE_WIDTH_IN_PIXELS;
-    int32_t padded_height_in_pixels = (height + (TILE_WIDTH_IN_PIXELS - 1)) & -TILE_WIDTH_IN_PIXELS;
+    int32_t padded_width_in_pixels = (width + (tile_width - 1)) & -tile_width;
+    int32_t padded_height_in_pixels = (height + (tile_width - 1)) & -tile_width;
     
-    fb->width_in_tiles = padded_width_in_pixels / TILE_WIDTH_IN_PIXELS;
-    fb->height_in_tiles = padded_height_in_pixels / TILE_WIDTH_IN_PIXELS;
+    fb->width_in_tiles = padded_width_in_pixels / tile_width;
+    fb->height_in_tiles = padded_height_in_pixels / tile_width;
     fb->total_num_tiles = fb->width_in_tiles * fb->height_in_tiles;
 
-    fb->pixels_per_row_of_tiles = padded_width_in_pixels * TILE_WIDTH_IN_PIXELS;
-    fb->pixels_per_slice = padded_height_in_pixels / TILE_WIDTH_IN_PIXELS * fb->pixels_per_row_of_tiles;
+    fb->pixels_per_row_of_tiles = padded_width_in_pixels * tile_width;
+    fb->pixels_per_slice = padded_height_in_pixels / tile_width * fb->pixels_per_row_of_tiles;
+
+    fb->depth_only = config->depth_only != 0;
+    fb->visibility_buffer = config->visibility_buffer != 0;
+    assert(!(fb->depth_only && fb->visibility_buffer));
+    fb->msaa = config->msaa != 0;
+    assert(!(fb->msaa && fb->visibility_buffer));
+
+    int32_t samples_per_pixel = fb->msaa ? MSAA_SAMPLES_PER_PIXEL : 1;
+
+    // aligned for the widest vector stores of the kernels
+    if (fb->depth_only)
+    {
+        fb->backbuffer = NULL;
+    }
+    else
+    {
+        fb->backbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * sizeof(uint32_t), 64);
+        assert(fb->backbuffer);
+
+        // clear to black/transparent initially
+        memset(fb->backbuffer, 0, fb->pixels_per_slice * sizeof(uint32_t));
+    }
 
-    fb->backbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * sizeof(uint32_t), 32);
-    assert(fb->backbuffer);
+    if (fb->msaa && !fb->depth_only)
+    {
+        // every fine block starts out compressed, so the samples are only ever read after being written
+        fb->samplebuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * MSAA_SAMPLES_PER_PIXEL * sizeof(uint32_t), 64);
+        assert(fb->samplebuffer);
 
-    // clear to black/transparent initially
-    memset(fb->backbuffer, 0, fb->pixels_per_slice * sizeof(uint32_t));
+        fb->compressed_fine_blocks = (uint8_t*)malloc(fb->pixels_per_slice / PIXELS_PER_FINE_BLOCK);
+        assert(fb->compressed_fine_blocks);
+        memset(fb->compressed_fine_blocks, 1, fb->pixels_per_slice / PIXELS_PER_FINE_BLOCK);
+    }
+    else
+    {
+        fb->samplebuffer = NULL;
+        fb->compressed_fine_blocks = NULL;
+    }
 
-    fb->depthbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * sizeof(uint32_t), 32);
+    fb->depthbuffer = (uint32_t*)_aligned_malloc(fb->pixels_per_slice * samples_per_pixel * sizeof(uint32_t), 64);
     assert(fb->depthbuffer);
     
     // clear to infinity initially
-    memset(fb->depthbuffer, 0xFF, fb->pixels_per_slice * sizeof(uint32_t));
+    memset(fb->depthbuffer, 0xFF, fb->pixels_per_slice * samples_per_pixel * sizeof(uint32_t));
+
+    fb->coarse_max_depths = (uint32_t*)malloc(fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(uint32_t));
+    assert(fb->coarse_max_depths);
+    memset(fb->coarse_max_depths, 0xFF, fb->total_num_tiles * fb->coarse_blocks_per_tile * sizeof(uint32_t));
+
+    fb->tile_max_depths = new std::atomic<uint32_t>[fb->total_num_tiles];
+    fb->tile_num_clears_resolved = new std::atomic<int32_t>[fb->total_num_tiles];
+    for (int32_t i = 0; i < fb->total_num_tiles; i++)
+    {
+        fb->tile_max_depths[i].store(0xFFFFFFFF, std::memory_order_relaxed);
+        fb->tile_num_clears_resolved[i].store(0, std::memory_order_relaxed);
+    }
+    fb->num_clears_binned = 0;
+
+    fb->tile_pending_clears = (uint64_t*)malloc(fb->total_num_tiles * sizeof(uint64_t));
+    assert(fb->tile_pending_clears);
+    memset(fb->tile_pending_clears, 0, fb->total_num_tiles * sizeof(uint64_t));
+
+    fb->tile_clear_colors = (uint32_t*)malloc(fb->total_num_tiles * sizeof(uint32_t));
+    assert(fb->tile_clear_colors);
+    memset(fb->tile_clear_colors, 0, fb->total_num_tiles * sizeof(uint32_t));
 
     // allocate command lists for each tile
-    fb->tile_cmdpool = (uint32_t*)malloc(fb->total_num_tiles * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS * sizeof(uint32_t));
-    assert(fb->tile_cmdpool);
+    fb->tile_cmdlists = new_tile_cmdlists(fb->total_num_tiles);
+
+    int32_t num_threads = config->num_threads;
+    if (num_threads == 0)
+    {
+        num_threads = (int32_t)std::thread::hardware_concurrency();
+        if (num_threads == 0)
+        {
+            num_threads = 1;
+        }
+    }
 
-    fb->tile_cmdbufs = (tile_cmdbuf_t*)malloc(fb->total_num_tiles * sizeof(tile_cmdbuf_t));
-    assert(fb->tile_cmdbufs);
+    if (config->share_threads_with)
+    {
+        fb->threadpool = config->share_threads_with->threadpool;
+        num_threads = fb->threadpool ? fb->threadpool->num_threads : 1;
+        if (fb->threadpool)
+        {
+            fb->threadpool->num_framebuffers++;
+        }
+    }
+    else
+    {
+        fb->threadpool = num_threads > 1 ? new_threadpool(num_threads) : NULL;
+    }
 
-    // command lists are circular queues that are initially empty
+    fb->async_flush = config->async_flush && fb->threadpool;
+    fb->tile_flush_queues = new tile_flush_queue_t[fb->total_num_tiles];
     for (int32_t i = 0; i < fb->total_num_tiles; i++)
     {
-        fb->tile_cmdbufs[i].cmdbuf_start = &fb->tile_cmdpool[i * TILE_COMMAND_BUFFER_SIZE_IN_DWORDS];
-        fb->tile_cmdbufs[i].cmdbuf_end = fb->tile_cmdbufs[i].cmdbuf_start + TILE_COMMAND_BUFFER_SIZE_IN_DWORDS;
-        fb->tile_cmdbufs[i].cmdbuf_read = fb->tile_cmdbufs[i].cmdbuf_start;
-        fb->tile_cmdbufs[i].cmdbuf_write = fb->tile_cmdbufs[i].cmdbuf_start;
+        fb->tile_flush_queues[i].head = NULL;
+        fb->tile_flush_queues[i].tail = NULL;
+        fb->tile_flush_queues[i].scheduled = false;
     }
+    fb->num_flushes_left = new std::atomic<int32_t>(0);
 
-#ifdef ENABLE_PERFCOUNTERS
-    fb->pc_frequency = qpf();
+    fb->tile_flush_threshold_in_dwords = config->tile_flush_threshold_in_dwords == 0 ? TILE_COMMAND_BUFFER_SIZE_IN_DWORDS : config->tile_flush_threshold_in_dwords;
+    assert(fb->tile_flush_threshold_in_dwords > 0);
 
-    memset(&fb->perfcounters, 0, sizeof(framebuffer_perfcounters_t));
+    fb->cmdpool = new_tile_cmdpool();
 
-    fb->tile_perfcounters = (framebuffer_tile_perfcounters_t*)malloc(fb->total_num_tiles * sizeof(framebuffer_tile_perfcounters_t));
-    memset(fb->tile_perfcounters, 0, fb->total_num_tiles * sizeof(framebuffer_tile_perfcounters_t));
-#endif
+    // round the budget up to whole slabs, so any budget leaves room for at least one
+    assert(config->command_memory_budget_in_kb >= 0);
+    int64_t slab_size_in_bytes = TILE_COMMAND_SLAB_SIZE_IN_CHUNKS * (int64_t)sizeof(tile_cmdchunk_t);
+    fb->cmdpool_budget_in_slabs = (int32_t)((config->command_memory_budget_in_kb * (int64_t)1024 + slab_size_in_bytes - 1) / slab_size_in_bytes);
+
+    // binning in parallel only makes sense with other threads to bin on
+    fb->num_binners = config->num_binners == 0 ? num_threads : config->num_binners;
+    if (!fb->threadpool)
+    {
+        fb->num_binners = 1;
+    }
+
+    // the ids in the visibility buffer only have room for so many binners
+    if (fb->visibility_buffer && fb->num_binners > MAX_VISIBILITY_BUFFER_BINNERS)
+    {
+        fb->num_binners = MAX_VISIBILITY_BUFFER_BINNERS;
+    }
+
+    fb->binners = (tile_binner_t*)malloc(fb->num_binners * sizeof(tile_binner_t));
+    assert(fb->binners);
+
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        tile_binner_t* binner = &fb->binners[i];
+        binner->tile_cmdlists = i == 0 ? fb->tile_cmdlists : new_tile_cmdlists(fb->total_num_tiles);
+        binner->can_flush = i == 0;
+        binner->worker_id = 0;
+        binner->largetri_setup_chunk = NULL;
+        binner->cmdarena = new_tile_cmdarena(fb->cmdpool);
+        binner->shade_triangles = NULL;
+        binner->num_shade_triangles = 0;
+        binner->shade_triangles_capacity = 0;
+        binner->shade_varyings = NULL;
+        binner->num_shade_varyings = 0;
+        binner->shade_varyings_capacity = 0;
+        binner->varyings = NULL;
+        binner->num_varyings = 0;
+        binner->draw_id = 0;
+        binner->shade_triangle_id = NO_TRIANGLE;
+        memset(&binner->perfcounters, 0, sizeof(framebuffer_perfcounters_t));
+        memset(&binner->stats, 0, sizeof(framebuffer_stats_t));
+    }
+
+    instructionset_t supported_instruction_set = detect_instruction_set();
+    if (config->instruction_set == instructionset_auto || config->instruction_set > supported_instruction_set)
+    {
+        fb->instruction_set = supported_instruction_set;
+    }
+    else
+    {
+        fb->instruction_set = config->instruction_set;
+    }
+
+    fb->kernels = framebuffer_kernels_for(fb->instruction_set, fb->tile_width_in_pixels, fb->msaa);
+
+    fb->tile_resolve_order = (int32_t*)malloc(fb->total_num_tiles * sizeof(int32_t));
+    assert(fb->tile_resolve_order);
+
+    fb->tile_resolve_weights = (int32_t*)malloc(fb->total_num_tiles * sizeof(int32_t));
+    assert(fb->tile_resolve_weights);
+
+    fb->perfcounters_enabled = false;
+    fb->pc_calibration_ticks = rdtsc();
+    fb->pc_calibration_time = std::chrono::steady_clock::now();
+
+    fb->tile_counters = (tile_counters_t*)_aligned_malloc(fb->total_num_tiles * sizeof(tile_counters_t), 64);
+    assert(fb->tile_counters);
+    memset(fb->tile_counters, 0, fb->total_num_tiles * sizeof(tile_counters_t));
+
+    fb->trace_capturing = false;
+    fb->trace_begin_ticks = 0;
+    fb->num_trace_threads = num_threads > 1 ? num_threads : 1;
+    fb->trace_threads = new framebuffer_trace_thread_t[fb->num_trace_threads];
     
     return fb;
 }
 
+framebuffer_t* new_framebuffer(int32_t width, int32_t height)
+{
+    framebuffer_config_t config;
+    config.num_threads = 0;
+    config.num_binners = 0;
+    config.async_flush = 1;
+    config.instruction_set = instructionset_auto;
+    config.depth_only = 0;
+    config.tile_flush_threshold_in_dwords = 0;
+    config.command_memory_budget_in_kb = 0;
+    config.tile_width_in_pixels = 0;
+    config.visibility_buffer = 0;
+    config.msaa = 0;
+    config.share_threads_with = NULL;
+    return new_framebuffer_ex(width, height, &config);
+}
+
 void delete_framebuffer(framebuffer_t* fb)
 {
     if (!fb)
         return;
 
-#ifdef ENABLE_PERFCOUNTERS
-    free(fb->tile_perfcounters);
-#endif
+    // tiles flushed while binning might still be getting resolved
+    if (fb->async_flush)
+    {
+        threadpool_wait(fb->threadpool, fb->num_flushes_left);
+    }
 
-    free(fb->tile_cmdbufs);
-    free(fb->tile_cmdpool);
+    delete_threadpool(fb->threadpool);
+    delete fb->num_flushes_left;
+    delete[] fb->tile_flush_queues;
+    free(fb->tile_resolve_weights);
+    free(fb->tile_resolve_order);
+
+    _aligned_free(fb->tile_counters);
+    delete[] fb->trace_threads;
+
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        if (i > 0)
+        {
+            free(fb->binners[i].tile_cmdlists);
+        }
+        // commands binned since the last resolve are dropped
+        tile_cmdarena_reset(fb->binners[i].cmdarena);
+        delete_tile_cmdarena(fb->binners[i].cmdarena);
+        free(fb->binners[i].shade_triangles);
+        free(fb->binners[i].shade_varyings);
+    }
+    free(fb->binners);
+    delete_tile_cmdpool(fb->cmdpool);
+
+    free(fb->tile_cmdlists);
+    free(fb->tile_clear_colors);
+    free(fb->tile_pending_clears);
+    delete[] fb->tile_num_clears_resolved;
+    delete[] fb->tile_max_depths;
+    free(fb->coarse_max_depths);
     _aligned_free(fb->depthbuffer);
+    free(fb->compressed_fine_blocks);
+    _aligned_free(fb->samplebuffer);
     _aligned_free(fb->backbuffer);
     free(fb);
 }
 
-static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
+// clears the pixels of the coarse blocks in draw_mask that are still waiting for a clear, before a triangle draws into them.
+// a triangle passes the depth test everywhere against the clear depth, so the coarse blocks in cover_mask that it covers
+// entirely only need their depth cleared.
+static __forceinline void framebuffer_materialize_clears(framebuffer_t* fb, int32_t tile_id, uint64_t draw_mask, uint64_t cover_mask)
+{
+    uint64_t pending_clears = fb->tile_pending_clears[tile_id] & draw_mask;
+    if (!pending_clears)
+    {
+        return;
+    }
+
+    fb->tile_pending_clears[tile_id] &= ~pending_clears;
+
+    uint32_t color = fb->visibility_buffer ? NO_TRIANGLE : fb->tile_clear_colors[tile_id];
+    int32_t tile_dst_i = tile_id * fb->pixels_per_tile;
+    while (pending_clears)
+    {
+        uint32_t cb_i = (uint32_t)tzcnt64(pending_clears);
+        fb->kernels->clear_coarse_block(fb, tile_dst_i + cb_i * PIXELS_PER_COARSE_BLOCK, color, !(cover_mask & (1ULL << cb_i)));
+        pending_clears &= pending_clears - 1;
+    }
+}
+
+static uint32_t draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
 {
+    uint32_t num_pixels_passed = 0;
+
     int32_t edge_dxs[3];
     int32_t edge_dys[3];
     for (int32_t v = 0; v < 3; v++)
@@ -630,8 +1775,16 @@ static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_
 
                 if (pixel_Z < fb->depthbuffer[dst_i])
                 {
+                    num_pixels_passed++;
                     fb->depthbuffer[dst_i] = pixel_Z;
-                    fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    if (fb->visibility_buffer)
+                    {
+                        fb->backbuffer[dst_i] = drawcmd->triangle_id;
+                    }
+                    else if (!fb->depth_only)
+                    {
+                        fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    }
                 }
             }
 
@@ -646,9 +1799,11 @@ static void draw_fine_block_smalltri_scalar(framebuffer_t* fb, int32_t fine_dst_
             edges[v] += edge_dys[v];
         }
     }
+
+    return num_pixels_passed;
 }
 
-static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* drawcmd)
+static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* drawcmd, framebuffer_tile_stats_t* tile_stats)
 {
     int32_t fine_edge_dxs[3];
     int32_t fine_edge_dys[3];
@@ -718,7 +1873,8 @@ static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_
                 }
 
                 int32_t dst_i = coarse_dst_i + (fine_y_bits | fine_x_bits);
-                draw_fine_block_smalltri_scalar(fb, dst_i, &fbargs);
+                tile_stats->pixels_passed += draw_fine_block_smalltri_scalar(fb, dst_i, &fbargs);
+                tile_stats->fine_blocks++;
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -744,8 +1900,11 @@ static void draw_coarse_block_smalltri_scalar(framebuffer_t* fb, int32_t coarse_
     }
 }
 
+template<int32_t TileWidth>
 static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
 {
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
+
     int32_t coarse_edge_dxs[3];
     int32_t coarse_edge_dys[3];
     for (int32_t v = 0; v < 3; v++)
@@ -773,6 +1932,10 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
     uint32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
+    // every pixel of the triangle is at least this far
+    uint32_t tri_min_depth = drawcmd->min_Z << 16;
+    const uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+
     for (
         uint32_t cb_y = 0, cb_y_bits = 0;
         cb_y < TILE_WIDTH_IN_COARSE_BLOCKS;
@@ -806,6 +1969,13 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
                 }
             }
 
+            // reject coarse blocks where everything is already in front of the triangle
+            uint32_t cb_i = (cb_y_bits | cb_x_bits) / PIXELS_PER_COARSE_BLOCK;
+            if (tri_min_depth >= coarse_max_depths[cb_i])
+            {
+                trivially_rejected = 1;
+            }
+
             if (!trivially_rejected)
             {
                 tilecmd_drawsmalltri_t cbargs = *drawcmd;
@@ -817,7 +1987,8 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
                 uint32_t dst_i = tile_dst_i + (cb_y_bits | cb_x_bits);
 
-                draw_coarse_block_smalltri_scalar(fb, dst_i, &cbargs);
+                framebuffer_materialize_clears(fb, tile_id, 1ULL << cb_i, 0);
+                draw_coarse_block_smalltri_scalar(fb, dst_i, &cbargs, tile_stats);
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -843,9 +2014,17 @@ static void draw_tile_smalltri_scalar(framebuffer_t* fb, int32_t tile_id, const
     }
 }
 
-#ifdef USE_HSWni
-static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
+// converts unorm16 to unorm8 the same way as x * 0xFF / 0xFFFF.
+// (x * 0xFF01) >> 24 gives the same result for all x in [0, 0xFFFF], without an integer division.
+TARGET_AVX2 static __forceinline __m256i unorm16_to_unorm8_avx2(__m256i x)
+{
+    return _mm256_srli_epi32(_mm256_mullo_epi32(x, _mm256_set1_epi32(0xFF01)), 24);
+}
+
+TARGET_AVX2 static uint32_t draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
 {
+    uint32_t num_pixels_passed = 0;
+
     // pixels are stored in fine blocks according to a morton code ordering:
     //  0  1  4  5
     //  2  3  6  7
@@ -977,17 +2156,27 @@ static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i,
         if (!depth_pass_mask)
             goto end_fineblock_half;
         
+        num_pixels_passed += popcnt((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(depth_pass)));
+
         // blend depth into depthbuffer
         _mm256_maskstore_epi32((int32_t*)&fb->depthbuffer[fine_dst_i], depth_pass, src_depth);
 
-        // set color based on barycentrics.
-        __m256i src_color = _mm256_set1_epi32(0xFF << 24);
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(w, _mm256_set1_epi32(0xFF)), 16), 16));
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(u, _mm256_set1_epi32(0xFF)), 16), 8));
-        src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(v, _mm256_set1_epi32(0xFF)), 16), 0));
-
-        // write color into backbuffer
-        _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, src_color);
+        if (fb->visibility_buffer)
+        {
+            // write which triangle is visible, for framebuffer_shade
+            _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, _mm256_set1_epi32(drawcmd.triangle_id));
+        }
+        else if (!fb->depth_only)
+        {
+            // set color based on barycentrics.
+            __m256i src_color = _mm256_set1_epi32(0xFF << 24);
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(w), 16));
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(u), 8));
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(v), 0));
+
+            // write color into backbuffer
+            _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, src_color);
+        }
 
     end_fineblock_half:
         // offset edge equations down for the second half
@@ -1005,11 +2194,11 @@ static void draw_fine_block_smalltri_avx2(framebuffer_t* fb, int32_t fine_dst_i,
         // offset destination to the next half of the fine block
         fine_dst_i += PIXELS_PER_FINE_BLOCK / 2;
     }
+
+    return num_pixels_passed;
 }
-#endif
 
-#ifdef USE_HSWni
-static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
+TARGET_AVX2 static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd, framebuffer_tile_stats_t* tile_stats)
 {
     // coarse blocks are made out of 4x4 fine blocks, organized as:
     //  0  1  4  5
@@ -1122,7 +2311,9 @@ static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_ds
                 finecmd.edges[1] = fineblock_edges[1][i];
                 finecmd.edges[2] = fineblock_edges[2][i];
 
-                draw_fine_block_smalltri_avx2(fb, dst_i, &finecmd);
+                tile_stats->pixels_passed += draw_fine_block_smalltri_avx2(fb, dst_i, &finecmd);
+
+                tile_stats->fine_blocks++;
                 // draw_fine_block_smalltri_scalar(fb, dst_i, &finecmd);
             }
 
@@ -1147,17 +2338,21 @@ static void draw_coarse_block_smalltri_avx2(framebuffer_t* fb, int32_t coarse_ds
 
     }
 }
-#endif
 
-#ifdef USE_HSWni
-static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
+template<int32_t TileWidth>
+TARGET_AVX2 static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
 {
-    // tiles are made out of 4x4 coarse blocks, organized as:
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
+
+    // tiles are made out of coarse blocks in morton order. eg: the 4x4 coarse blocks of a 64x64 tile are organized as:
     //  0  1  4  5
     //  2  3  6  7
     //  8  9 12 13
     // 10 11 14 15
-    // therefore, tiles are rasterized by shifting around the fine block's edge equations.
+    // therefore, tiles are rasterized 4x2 coarse blocks at a time, by shifting around the coarse block's edge equations.
+    // the 2x2 coarse blocks of a 32x32 tile only use the first 4 lanes.
+    const int32_t coarse_blocks_per_group = COARSE_BLOCKS_PER_TILE < 8 ? COARSE_BLOCKS_PER_TILE : 8;
+    const int lanes_mask = (int)((1ULL << (coarse_blocks_per_group * 4)) - 1);
 
     __m256i edges[3];
     __m256i edge_trivRejs[3];
@@ -1176,29 +2371,53 @@ static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const ti
         if (dy < 0) edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], _mm256_set1_epi32(dy));
     }
 
-    int32_t dst_i = tile_id * PIXELS_PER_TILE;
+    int32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
-    for (int32_t tile_half = 0; tile_half < 2; tile_half++)
+    // every pixel of the triangle is at least this far
+    // note: unsigned compare implemented using signed compare, done by subtracting 2^31
+    __m256i tri_min_depth = _mm256_set1_epi32((drawcmd->min_Z << 16) - 0x80000000);
+    const uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+
+    for (int32_t group_cb_i = 0; group_cb_i < COARSE_BLOCKS_PER_TILE; group_cb_i += coarse_blocks_per_group)
     {
-        // draw each coarse block in the tile half
-        __declspec(align(32)) int32_t coarseblock_edges[3][8];
-        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], edges[0]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], edges[1]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], edges[2]);
+        // move the edge equations to the first coarse block of the group
+        int32_t group_cb_x = (int32_t)morton_decode_x(group_cb_i);
+        int32_t group_cb_y = (int32_t)morton_decode_x(group_cb_i >> 1);
 
-        __m256i trivRej_pass = _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[0]);
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[1]));
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[2]));
+        __m256i group_edges[3];
+        __m256i group_edge_trivRejs[3];
+        for (int32_t i = 0; i < 3; i++)
+        {
+            __m256i offset = _mm256_set1_epi32((drawcmd->edge_dxs[i] * group_cb_x + drawcmd->edge_dys[i] * group_cb_y) * COARSE_BLOCK_WIDTH_IN_PIXELS);
+            group_edges[i] = _mm256_add_epi32(edges[i], offset);
+            group_edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], offset);
+        }
 
-        int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass);
+        // draw each coarse block in the group
+        __declspec(align(32)) int32_t coarseblock_edges[3][8];
+        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], group_edges[0]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], group_edges[1]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], group_edges[2]);
+
+        __m256i trivRej_pass = _mm256_cmpgt_epi32(_mm256_setzero_si256(), group_edge_trivRejs[0]);
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), group_edge_trivRejs[1]));
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), group_edge_trivRejs[2]));
+
+        // reject coarse blocks where everything is already in front of the triangle.
+        // lanes past the end of a small group are garbage, but they're masked off.
+        __m256i coarse_max_depth = coarse_blocks_per_group == 8 ?
+            _mm256_loadu_si256((const __m256i*)&coarse_max_depths[group_cb_i]) :
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&coarse_max_depths[group_cb_i]));
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_sub_epi32(coarse_max_depth, _mm256_set1_epi32(0x80000000)), tri_min_depth));
+
+        int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass) & lanes_mask;
         if (!trivRej_pass_mask)
         {
-            dst_i += PIXELS_PER_COARSE_BLOCK * 8;
-            goto tile_half_end;
+            continue;
         }
 
         tilecmd_drawsmalltri_t coarsecmd = *drawcmd;
-        for (int32_t i = 0; i < 8; i++)
+        for (int32_t i = 0; i < coarse_blocks_per_group; i++)
         {
             if (trivRej_pass_mask & (1 << (i*4)))
             {
@@ -1206,26 +2425,19 @@ static void draw_tile_smalltri_avx2(framebuffer_t* fb, int32_t tile_id, const ti
                 coarsecmd.edges[1] = coarseblock_edges[1][i];
                 coarsecmd.edges[2] = coarseblock_edges[2][i];
 
-                draw_coarse_block_smalltri_avx2(fb, dst_i, &coarsecmd);
+                int32_t cb_i = group_cb_i + i;
+                framebuffer_materialize_clears(fb, tile_id, 1ULL << cb_i, 0);
+                draw_coarse_block_smalltri_avx2(fb, tile_dst_i + cb_i * PIXELS_PER_COARSE_BLOCK, &coarsecmd, tile_stats);
             }
-
-            dst_i += PIXELS_PER_COARSE_BLOCK;
-        }
-
-    tile_half_end:
-        for (int32_t i = 0; i < 3; i++)
-        {
-            __m256i dy2 = _mm256_set1_epi32(drawcmd->edge_dys[i] * COARSE_BLOCK_WIDTH_IN_PIXELS * 2);
-            edges[i] = _mm256_add_epi32(edges[i], dy2);
-            edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], dy2);
         }
     }
 }
-#endif
 
 template<uint32_t TestEdgeMask>
-static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* drawcmd)
+static uint32_t draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* drawcmd)
 {
+    uint32_t num_pixels_passed = 0;
+
     int32_t edge_dxs[3];
     int32_t edge_dys[3];
     for (int32_t v = 0; v < 3; v++)
@@ -1330,8 +2542,16 @@ static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_
 
                 if (pixel_Z < fb->depthbuffer[dst_i])
                 {
+                    num_pixels_passed++;
                     fb->depthbuffer[dst_i] = pixel_Z;
-                    fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    if (fb->visibility_buffer)
+                    {
+                        fb->backbuffer[dst_i] = drawcmd->triangle_id;
+                    }
+                    else if (!fb->depth_only)
+                    {
+                        fb->backbuffer[dst_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                    }
                 }
             }
 
@@ -1346,17 +2566,29 @@ static void draw_fine_block_largetri_scalar(framebuffer_t* fb, int32_t fine_dst_
             edges[v] += edge_dys[v];
         }
     }
+
+    return num_pixels_passed;
 }
 
+// draws a fine block of a multisampled framebuffer. coverage and depth are tested at every sample of every pixel like
+// draw_fine_block_largetri_scalar does at their centers, but the color is only computed once per pixel, at the first sample that passed.
+// returns the number of pixels that passed at any of their samples.
 template<uint32_t TestEdgeMask>
-static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id, int32_t coarse_dst_i, const tilecmd_drawtile_t* drawcmd)
+static uint32_t draw_fine_block_msaa_scalar(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* drawcmd)
 {
-    int32_t fine_edge_dxs[3];
-    int32_t fine_edge_dys[3];
+    const sample_edge_offsets_t* sample_offsets = drawcmd->sample_offsets;
+    uint32_t* sample_depths = &fb->depthbuffer[fine_dst_i * MSAA_SAMPLES_PER_PIXEL];
+
+    // one bit per pixel of the fine block, for each sample
+    uint32_t sample_pass_masks[MSAA_SAMPLES_PER_PIXEL] = { 0 };
+    uint32_t colors[PIXELS_PER_FINE_BLOCK];
+
+    int32_t edge_dxs[3];
+    int32_t edge_dys[3];
     for (int32_t v = 0; v < 3; v++)
     {
-        fine_edge_dxs[v] = drawcmd->edge_dxs[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
-        fine_edge_dys[v] = drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+        edge_dxs[v] = drawcmd->edge_dxs[v];
+        edge_dys[v] = drawcmd->edge_dys[v];
     }
 
     int32_t edges[3];
@@ -1365,23 +2597,214 @@ static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id
         edges[v] = drawcmd->edges[v];
     }
 
-    int32_t edge_trivRejs[3];
-    for (int32_t v = 0; v < 3; v++)
-    {
-        if (TestEdgeMask & (1 << v))
-        {
-            edge_trivRejs[v] = drawcmd->edges[v];
-            if (fine_edge_dxs[v] < 0) edge_trivRejs[v] += fine_edge_dxs[v];
-            if (fine_edge_dys[v] < 0) edge_trivRejs[v] += fine_edge_dys[v];
-        }
-    }
-
-    const uint32_t mask_x = pdep_u32(-FINE_BLOCK_WIDTH_IN_PIXELS, COARSE_BLOCK_X_SWIZZLE_MASK);
-    const uint32_t mask_y = pdep_u32(-FINE_BLOCK_WIDTH_IN_PIXELS, COARSE_BLOCK_Y_SWIZZLE_MASK);
-
-    for (uint32_t fine_y = 0, fine_y_bits = 0;
-        fine_y < COARSE_BLOCK_WIDTH_IN_FINE_BLOCKS;
-        fine_y++, fine_y_bits = (fine_y_bits - mask_y) & mask_y)
+    for (
+        uint32_t px_y = 0, px_y_bits = 0;
+        px_y < FINE_BLOCK_WIDTH_IN_PIXELS;
+        px_y++, px_y_bits = (px_y_bits - FINE_BLOCK_Y_SWIZZLE_MASK) & FINE_BLOCK_Y_SWIZZLE_MASK)
+    {
+        int32_t edges_row[3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            edges_row[v] = edges[v];
+        }
+
+        for (
+            uint32_t px_x = 0, px_x_bits = 0;
+            px_x < FINE_BLOCK_WIDTH_IN_PIXELS;
+            px_x++, px_x_bits = (px_x_bits - FINE_BLOCK_X_SWIZZLE_MASK) & FINE_BLOCK_X_SWIZZLE_MASK)
+        {
+            uint32_t px_i = px_y_bits | px_x_bits;
+
+            // backwards, so the color ends up being the first passing sample's
+            for (int32_t sample_i = MSAA_SAMPLES_PER_PIXEL - 1; sample_i >= 0; sample_i--)
+            {
+                int32_t sample_edges[3];
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    sample_edges[v] = edges_row[v] + sample_offsets->edges[sample_i][v];
+                }
+
+                int32_t sample_discarded = 0;
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    if (TestEdgeMask & (1 << v))
+                    {
+                        if (sample_edges[v] >= 0)
+                        {
+                            sample_discarded = 1;
+                            break;
+                        }
+                    }
+                }
+
+                if (sample_discarded)
+                {
+                    continue;
+                }
+
+                int32_t rcp_triarea2_rshift = drawcmd->rcp_triarea2_rshift;
+
+                // note: off by one because -1 maps to 0
+                int32_t shifted_e2 = -sample_edges[2] - 1;
+                int32_t shifted_e0 = -sample_edges[0] - 1;
+                if (rcp_triarea2_rshift < 0)
+                {
+                    shifted_e2 = shifted_e2 << -rcp_triarea2_rshift;
+                    shifted_e0 = shifted_e0 << -rcp_triarea2_rshift;
+                }
+                else
+                {
+                    shifted_e2 = shifted_e2 >> rcp_triarea2_rshift;
+                    shifted_e0 = shifted_e0 >> rcp_triarea2_rshift;
+                }
+
+                shifted_e2 += drawcmd->shifted_es[2];
+                shifted_e0 += drawcmd->shifted_es[0];
+
+                // clamp to triangle area
+                if ((uint32_t)shifted_e2 > drawcmd->shifted_triarea2)
+                    shifted_e2 = drawcmd->shifted_triarea2;
+
+                if ((uint32_t)shifted_e0 > drawcmd->shifted_triarea2)
+                    shifted_e0 = drawcmd->shifted_triarea2;
+
+                // compute non-perspective-correct barycentrics for vertices 1 and 2
+                uint32_t u = ((uint32_t)shifted_e2 * drawcmd->rcp_triarea2_mantissa) >> 15;
+                uint32_t v = ((uint32_t)shifted_e0 * drawcmd->rcp_triarea2_mantissa) >> 15;
+
+                if (u + v > 0xFFFF)
+                    v = 0xFFFF - u;
+
+                uint32_t w = 0xFFFF - u - v;
+
+                // compute interpolated depth
+                uint32_t pixel_Z = (drawcmd->vert_Zs[0] << 16)
+                    + u * (drawcmd->vert_Zs[1] - drawcmd->vert_Zs[0])
+                    + v * (drawcmd->vert_Zs[2] - drawcmd->vert_Zs[0]);
+
+                assert(pixel_Z >= drawcmd->min_Z << 16);
+                assert(pixel_Z <= drawcmd->max_Z << 16);
+
+                uint32_t* sample_depth = &sample_depths[sample_i * PIXELS_PER_FINE_BLOCK + px_i];
+                if (pixel_Z < *sample_depth)
+                {
+                    *sample_depth = pixel_Z;
+                    sample_pass_masks[sample_i] |= 1 << px_i;
+                    colors[px_i] = (0xFF << 24) | ((w * 0xFF / 0xFFFF) << 16) | ((u * 0xFF / 0xFFFF) << 8) | (v * 0xFF / 0xFFFF);
+                }
+            }
+
+            for (int32_t v = 0; v < 3; v++)
+            {
+                edges_row[v] += edge_dxs[v];
+            }
+        }
+
+        for (int32_t v = 0; v < 3; v++)
+        {
+            edges[v] += edge_dys[v];
+        }
+    }
+
+    // the pixels that passed at any of their samples, and the ones that passed at all of them
+    uint32_t any_pass_mask = 0;
+    uint32_t all_pass_mask = (1 << PIXELS_PER_FINE_BLOCK) - 1;
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        any_pass_mask |= sample_pass_masks[sample_i];
+        all_pass_mask &= sample_pass_masks[sample_i];
+    }
+
+    if (fb->depth_only || !any_pass_mask)
+    {
+        return popcnt(any_pass_mask);
+    }
+
+    uint32_t* pixel_colors = &fb->backbuffer[fine_dst_i];
+    uint32_t* sample_colors = &fb->samplebuffer[fine_dst_i * MSAA_SAMPLES_PER_PIXEL];
+    uint8_t* compressed = &fb->compressed_fine_blocks[fine_dst_i / PIXELS_PER_FINE_BLOCK];
+
+    if (*compressed)
+    {
+        // as long as every pixel passed at all or none of its samples, each pixel still has one color
+        if (any_pass_mask == all_pass_mask)
+        {
+            for (int32_t px_i = 0; px_i < PIXELS_PER_FINE_BLOCK; px_i++)
+            {
+                if (all_pass_mask & (1 << px_i))
+                    pixel_colors[px_i] = colors[px_i];
+            }
+            return popcnt(any_pass_mask);
+        }
+
+        // otherwise every sample needs a color of its own from now on
+        for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+        {
+            for (int32_t px_i = 0; px_i < PIXELS_PER_FINE_BLOCK; px_i++)
+            {
+                sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + px_i] = pixel_colors[px_i];
+            }
+        }
+        *compressed = 0;
+    }
+
+    // every sample of the fine block got overwritten, so it's back to one color per pixel
+    if (all_pass_mask == (1 << PIXELS_PER_FINE_BLOCK) - 1)
+    {
+        for (int32_t px_i = 0; px_i < PIXELS_PER_FINE_BLOCK; px_i++)
+        {
+            pixel_colors[px_i] = colors[px_i];
+        }
+        *compressed = 1;
+        return PIXELS_PER_FINE_BLOCK;
+    }
+
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        for (int32_t px_i = 0; px_i < PIXELS_PER_FINE_BLOCK; px_i++)
+        {
+            if (sample_pass_masks[sample_i] & (1 << px_i))
+                sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + px_i] = colors[px_i];
+        }
+    }
+
+    return popcnt(any_pass_mask);
+}
+
+template<uint32_t TestEdgeMask, bool Msaa>
+static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawtile_t* drawcmd, framebuffer_tile_stats_t* tile_stats)
+{
+    int32_t fine_edge_dxs[3];
+    int32_t fine_edge_dys[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        fine_edge_dxs[v] = drawcmd->edge_dxs[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+        fine_edge_dys[v] = drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+    }
+
+    int32_t edges[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        edges[v] = drawcmd->edges[v];
+    }
+
+    int32_t edge_trivRejs[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        if (TestEdgeMask & (1 << v))
+        {
+            edge_trivRejs[v] = drawcmd->edges[v];
+            if (fine_edge_dxs[v] < 0) edge_trivRejs[v] += fine_edge_dxs[v];
+            if (fine_edge_dys[v] < 0) edge_trivRejs[v] += fine_edge_dys[v];
+        }
+    }
+
+    const uint32_t mask_x = pdep_u32(-FINE_BLOCK_WIDTH_IN_PIXELS, COARSE_BLOCK_X_SWIZZLE_MASK);
+    const uint32_t mask_y = pdep_u32(-FINE_BLOCK_WIDTH_IN_PIXELS, COARSE_BLOCK_Y_SWIZZLE_MASK);
+
+    for (uint32_t fine_y = 0, fine_y_bits = 0;
+        fine_y < COARSE_BLOCK_WIDTH_IN_FINE_BLOCKS;
+        fine_y++, fine_y_bits = (fine_y_bits - mask_y) & mask_y)
     {
         int32_t edges_row[3];
         for (int32_t v = 0; v < 3; v++)
@@ -1427,7 +2850,11 @@ static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id
                 }
 
                 int32_t dst_i = coarse_dst_i + (fine_y_bits | fine_x_bits);
-                draw_fine_block_largetri_scalar<TestEdgeMask>(fb, dst_i, &fbargs);
+                if (Msaa)
+                    tile_stats->pixels_passed += draw_fine_block_msaa_scalar<TestEdgeMask>(fb, dst_i, &fbargs);
+                else
+                    tile_stats->pixels_passed += draw_fine_block_largetri_scalar<TestEdgeMask>(fb, dst_i, &fbargs);
+                tile_stats->fine_blocks++;
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -1459,9 +2886,11 @@ static void draw_coarse_block_largetri_scalar(framebuffer_t* fb, int32_t tile_id
     }
 }
 
-template<uint32_t TestEdgeMask>
+template<int32_t TileWidth, uint32_t TestEdgeMask, bool Msaa>
 static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd)
 {
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
+
    
     int32_t coarse_edge_dxs[3];
     int32_t coarse_edge_dys[3];
@@ -1497,6 +2926,11 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
 
     uint32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
+    // every pixel of the triangle is at least this far, and at most max_Z far
+    uint32_t tri_min_depth = drawcmd->min_Z << 16;
+    uint32_t tri_max_depth = drawcmd->max_Z << 16;
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+
     // figure out which coarse blocks pass the reject and accept tests
     for (
         uint32_t cb_y = 0, cb_y_bits = 0;
@@ -1539,6 +2973,13 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
                 }
             }
 
+            // reject coarse blocks where everything is already in front of the triangle
+            uint32_t cb_i = (cb_y_bits | cb_x_bits) / PIXELS_PER_COARSE_BLOCK;
+            if (tri_min_depth >= coarse_max_depths[cb_i])
+            {
+                trivially_rejected = 1;
+            }
+
             if (!trivially_rejected)
             {
                 tilecmd_drawtile_t cbargs = *drawcmd;
@@ -1562,33 +3003,41 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
                     cbargs.edges[v] = edges_row[v];
                 }
 
+                framebuffer_materialize_clears(fb, tile_id, 1ULL << cb_i, newTestEdgeMask == 0 ? 1ULL << cb_i : 0);
+
                 switch (newTestEdgeMask)
                 {
                 case 0:
-                    draw_coarse_block_largetri_scalar<0>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<0, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 1:
-                    draw_coarse_block_largetri_scalar<1>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<1, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 2:
-                    draw_coarse_block_largetri_scalar<2>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<2, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 3:
-                    draw_coarse_block_largetri_scalar<3>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<3, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 4:
-                    draw_coarse_block_largetri_scalar<4>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<4, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 5:
-                    draw_coarse_block_largetri_scalar<5>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<5, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 6:
-                    draw_coarse_block_largetri_scalar<6>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<6, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 case 7:
-                    draw_coarse_block_largetri_scalar<7>(fb, tile_id, dst_i, &cbargs);
+                    draw_coarse_block_largetri_scalar<7, Msaa>(fb, dst_i, &cbargs, tile_stats);
                     break;
                 }
+
+                // the triangle covers the whole coarse block, so nothing in it can be further than the triangle anymore
+                if (newTestEdgeMask == 0 && tri_max_depth < coarse_max_depths[cb_i])
+                {
+                    coarse_max_depths[cb_i] = tri_max_depth;
+                }
             }
 
             for (int32_t v = 0; v < 3; v++)
@@ -1622,1470 +3071,4700 @@ static void draw_tile_largetri_scalar(framebuffer_t* fb, int32_t tile_id, const
     }
 }
 
-#if 0
-#ifdef USE_HSWni
 template<uint32_t TestEdgeMask>
-static void draw_tile_largetri_avx2(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd)
+TARGET_AVX2 static uint32_t draw_fine_block_largetri_avx2(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* pDrawcmd)
 {
-    // tiles are made out of 4x4 coarse blocks, organized as:
+    uint32_t num_pixels_passed = 0;
+
+    // pixels are stored in fine blocks according to a morton code ordering:
     //  0  1  4  5
     //  2  3  6  7
     //  8  9 12 13
     // 10 11 14 15
-    // therefore, tiles are rasterized by shifting around the fine block's edge equations.
+    // Thus, the 4x4 fine block is rasterized in two iterations.
+    // one iteration for the top 4x2, and one for the bottom 4x2.
 
-    __m256i edges[3];
-    __m256i edge_trivRejs[kNumTestEdges > 0 ? kNumTestEdges : 1];
-    __m256i edge_trivAccs[kNumTestEdges > 0 ? kNumTestEdges : 1];
+    tilecmd_drawtile_t drawcmd = *pDrawcmd;
 
-    for (int32_t i = 0; i < 3; i++)
+    __m256i edges[3];
+    for (int32_t v = 0; v < 3; v++)
     {
-        int32_t dx = drawcmd->edge_dxs[i] * COARSE_BLOCK_WIDTH_IN_PIXELS;
-        int32_t dy = drawcmd->edge_dys[i] * COARSE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t dx = drawcmd.edge_dxs[v];
+        int32_t dy = drawcmd.edge_dys[v];
 
-        edges[i] = _mm256_add_epi32(
-            _mm256_set1_epi32(drawcmd->edges[i]),
+        edges[v] = _mm256_add_epi32(
+            _mm256_set1_epi32(drawcmd.edges[v]),
             _mm256_setr_epi32(0, dx, dy, dx + dy, dx * 2, dx * 3, dx * 2 + dy, dx * 3 + dy));
-
-        edge_trivRejs[i] = edges[i];
-        if (dx < 0) edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], _mm256_set1_epi32(dx));
-        if (dx > 0) edge_trivAccs[v] = _mm256_add_epi32(edge_trivAccs[i], _mm256_set1_epi32(dx));
-        if (dy < 0) edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], _mm256_set1_epi32(dy));
-        if (dy > 0) edge_trivAccs[v] = _mm256_add_epi32(edge_trivAccs[i], _mm256_set1_epi32(dy));
     }
 
-    uint32_t dst_i = tile_id * PIXELS_PER_TILE;
+    // pre-compute triarea2 related stuff
+    int32_t rcp_triarea2_mantissa = drawcmd.rcp_triarea2_mantissa;
+    int32_t rcp_triarea2_rshift = drawcmd.rcp_triarea2_rshift;
+    __m256i rcp_triarea2_mantissa256 = _mm256_set1_epi32(rcp_triarea2_mantissa);
+    __m256i shifted_triarea2 = _mm256_set1_epi32(drawcmd.shifted_triarea2);
 
-    for (int32_t tile_half = 0; tile_half < 2; tile_half++)
-    {
-        // draw each coarse block in the tile half
-        __declspec(align(32)) int32_t coarseblock_edges[3][8];
-        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], edges[0]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], edges[1]);
-        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], edges[2]);
+    // the part of the edge equations that was shifted out of the tile relative ones during setup
+    __m256i shifted_e2_offset = _mm256_set1_epi32(drawcmd.shifted_es[2]);
+    __m256i shifted_e0_offset = _mm256_set1_epi32(drawcmd.shifted_es[0]);
 
-        __m256i trivRej_pass = _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[0]);
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[1]));
-        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[2]));
+    // pre-compute depth related stuff
+    __m256i d0 = _mm256_set1_epi32(drawcmd.vert_Zs[0] << 16);
+    __m256i dd1 = _mm256_set1_epi32(drawcmd.vert_Zs[1] - drawcmd.vert_Zs[0]);
+    __m256i dd2 = _mm256_set1_epi32(drawcmd.vert_Zs[2] - drawcmd.vert_Zs[0]);
 
-        int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass);
-        if (!trivRej_pass_mask)
+    // rasterize both fine block halves
+    for (int32_t fineblock_half = 0; fineblock_half < 2; fineblock_half++)
+    {
+        // compute all pixels passing the edge equation.
+        // edges that are trivially accepted for the whole coarse block don't need to be tested.
+        __m256i coverage_pass = _mm256_set1_epi32(-1);
+        for (int32_t v = 0; v < 3; v++)
         {
-            dst_i += PIXELS_PER_COARSE_BLOCK * 8;
-            goto tile_half_end;
+            if (TestEdgeMask & (1 << v))
+            {
+                coverage_pass = _mm256_and_si256(coverage_pass, edges[v]);
+            }
         }
+        coverage_pass = _mm256_srai_epi32(coverage_pass, 31);
 
-        __m256i edge_needs_test[3];
-        int32_t num_tests_necessary = 0;
-        for (int32_t v = 0; v < kNumTestEdges; v++)
+        // early-out if no pixels pass the test
+        if (_mm256_testz_si256(coverage_pass, coverage_pass))
+            goto end_fineblock_half;
+
+        // shift edge equations to be on the same scale as the triangle area
+        // note: off by one because -1 maps to 0
+        __m256i shifted_e2 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), edges[2]), _mm256_set1_epi32(1));
+        __m256i shifted_e0 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), edges[0]), _mm256_set1_epi32(1));
+        if (rcp_triarea2_rshift < 0)
         {
-            if ((edge_needs_test[v] = edge_row_trivAccs[v] >= 0))
-            {
-                num_tests_necessary++;
-            }
+            shifted_e2 = _mm256_slli_epi32(shifted_e2, -rcp_triarea2_rshift);
+            shifted_e0 = _mm256_slli_epi32(shifted_e0, -rcp_triarea2_rshift);
         }
-        
-        tilecmd_drawsmalltri_t coarsecmd = *drawcmd;
-        for (int32_t i = 0; i < 8; i++)
+        else
         {
-            if (trivRej_pass_mask & (1 << (i * 4)))
-            {
-                coarsecmd.edges[0] = coarseblock_edges[0][i];
-                coarsecmd.edges[1] = coarseblock_edges[1][i];
-                coarsecmd.edges[2] = coarseblock_edges[2][i];
+            // note: arithmetic shift, since the tile relative edge equations can be negative before adding the offset back
+            shifted_e2 = _mm256_srai_epi32(shifted_e2, rcp_triarea2_rshift);
+            shifted_e0 = _mm256_srai_epi32(shifted_e0, rcp_triarea2_rshift);
+        }
 
-                drawtilecmd.tilecmd_id = tilecmd_id_drawtile_0edge + num_tests_necessary;
+        shifted_e2 = _mm256_add_epi32(shifted_e2, shifted_e2_offset);
+        shifted_e0 = _mm256_add_epi32(shifted_e0, shifted_e0_offset);
 
-                int32_t vertex_rotation = 0;
+        // clamp to triangle area (unsigned, so negative values also clamp to the area)
+        shifted_e0 = _mm256_min_epu32(shifted_triarea2, shifted_e0);
+        shifted_e2 = _mm256_min_epu32(shifted_triarea2, shifted_e2);
 
-                if (num_tests_necessary == 1) {
-                    if (edge_needs_test[1]) vertex_rotation = 1;
-                    else if (edge_needs_test[2]) vertex_rotation = 2;
-                }
-                else if (num_tests_necessary == 2) {
-                    if (!edge_needs_test[0]) vertex_rotation = 1;
-                    else if (!edge_needs_test[1]) vertex_rotation = 2;
-                }
+        // compute non-perspective-correct barycentrics for vertices 1 and 2
+        __m256i u = _mm256_srli_epi32(_mm256_mullo_epi32(shifted_e2, rcp_triarea2_mantissa256), 15);
+        __m256i v = _mm256_srli_epi32(_mm256_mullo_epi32(shifted_e0, rcp_triarea2_mantissa256), 15);
 
-                for (int32_t v = 0; v < 3; v++)
-                {
-                    int32_t rotated_v = (v + vertex_rotation) % 3;
+        // ensure barycentrics sum to 1
+        __m256i one_minus_u = _mm256_sub_epi32(_mm256_set1_epi32(0xFFFF), u);
+        v = _mm256_min_epi32(v, one_minus_u);
 
-                    drawtilecmd.edges[v] = edges_row[rotated_v];
-                    drawtilecmd.edge_dxs[v] = drawcmd->edge_dxs[rotated_v];
-                    drawtilecmd.edge_dys[v] = drawcmd->edge_dys[rotated_v];
-                    drawtilecmd.shifted_es[v] = drawcmd->shifted_es[rotated_v];
-                    drawtilecmd.vert_Zs[v] = drawcmd->vert_Zs[rotated_v];
-                }
+        // not related to vertex w. Just third barycentric. Bad naming.
+        __m256i w = _mm256_sub_epi32(_mm256_set1_epi32(0xFFFF), _mm256_add_epi32(u, v));
 
-                uint32_t dst_i = tile_dst_i + (cb_y_bits | cb_x_bits);
+        // compute interpolated depth
+        __m256i src_depth = d0;
+        src_depth = _mm256_add_epi32(src_depth, _mm256_mullo_epi32(u, dd1));
+        src_depth = _mm256_add_epi32(src_depth, _mm256_mullo_epi32(v, dd2));
 
-                switch (drawtilecmd.tilecmd_id)
-                {
-                case tilecmd_id_drawtile_0edge:
-                    draw_coarse_block_largetri_scalar<0>(fb, tile_id, dst_i, &drawtilecmd);
-                    break;
-                case tilecmd_id_drawtile_1edge:
-                    draw_coarse_block_largetri_scalar<1>(fb, tile_id, dst_i, &drawtilecmd);
-                    break;
-                case tilecmd_id_drawtile_2edge:
-                    draw_coarse_block_largetri_scalar<2>(fb, tile_id, dst_i, &drawtilecmd);
-                    break;
-                case tilecmd_id_drawtile_3edge:
-                    draw_coarse_block_largetri_scalar<3>(fb, tile_id, dst_i, &drawtilecmd);
-                    break;
-                }
-            }
+        __m256i dst_depth = _mm256_load_si256((__m256i*)&fb->depthbuffer[fine_dst_i]);
 
-            dst_i += PIXELS_PER_COARSE_BLOCK;
-        }
+        // note: unsigned compare implemented using signed compare, done by subtracting 2^31
+        __m256i depth_pass = _mm256_cmpgt_epi32(_mm256_sub_epi32(dst_depth, _mm256_set1_epi32(0x80000000)), _mm256_sub_epi32(src_depth, _mm256_set1_epi32(0x80000000)));
 
-    tile_half_end:
-        for (int32_t i = 0; i < 3; i++)
-        {
-            __m256i dy2 = _mm256_set1_epi32(drawcmd->edge_dys[i] * COARSE_BLOCK_WIDTH_IN_PIXELS * 2);
-            edges[i] = _mm256_add_epi32(edges[i], dy2);
-            edge_trivRejs[i] = _mm256_add_epi32(edge_trivRejs[i], dy2);
-            edge_trivAccs[i] = _mm256_add_epi32(edge_trivAccs[i], dy2);
-        }
-    }
-}
-#endif
-#endif
+        // combine coverage and depth masks
+        depth_pass = _mm256_and_si256(coverage_pass, depth_pass);
 
-static void clear_tile(framebuffer_t* fb, int32_t tile_id, tilecmd_cleartile_t* cmd)
-{
-    int32_t tile_start_i = PIXELS_PER_TILE * tile_id;
-    int32_t tile_end_i = tile_start_i + PIXELS_PER_TILE;
-    uint32_t color = cmd->color;
-    for (int32_t px = tile_start_i; px < tile_end_i; px++)
-    {
-        fb->backbuffer[px] = color;
-        fb->depthbuffer[px] = 0xFFFFFFFF;
-    }
-}
+        // early out if all depth tests fail
+        if (_mm256_testz_si256(depth_pass, depth_pass))
+            goto end_fineblock_half;
 
-static void debugprint_cmdbuf(tile_cmdbuf_t* cmdbuf)
-{
-    int32_t read_i = (int32_t)(cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_start);
-    int32_t write_i = (int32_t)(cmdbuf->cmdbuf_write - cmdbuf->cmdbuf_start);
-    int32_t sz = (int32_t)(cmdbuf->cmdbuf_end - cmdbuf->cmdbuf_start);
-    for (int32_t i = 0; i < sz; i++)
-    {
-        if (i == write_i)
-            printf(" W");
-        else
-            printf("--");
-    }
-    printf("\n");
-    for (int32_t i = 0; i < sz; i++)
-    {
-        printf("| ");
-    }
-    printf("|\n");
-    for (int32_t i = 0; i < sz; i++)
-    {
-        if (i == read_i)
-            printf(" R");
-        else
-            printf("--");
-    }
-    printf("\n");
-}
+        num_pixels_passed += popcnt((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(depth_pass)));
 
-static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id)
-{
-    tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
-    
-    uint32_t* cmd;
-    for (cmd = cmdbuf->cmdbuf_read; cmd != cmdbuf->cmdbuf_write; )
-    {
-        uint32_t tilecmd_id = *cmd;
-        
-        // debugging code for logging commands
-        // printf("Reading command [id: %d]\n", tilecmd_id);
-        // debugprint_cmdbuf(cmdbuf);
+        // blend depth into depthbuffer
+        _mm256_maskstore_epi32((int32_t*)&fb->depthbuffer[fine_dst_i], depth_pass, src_depth);
 
-        if (tilecmd_id == tilecmd_id_resetbuf)
+        if (fb->visibility_buffer)
         {
-            cmd = cmdbuf->cmdbuf_start;
+            // write which triangle is visible, for framebuffer_shade
+            _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, _mm256_set1_epi32(drawcmd.triangle_id));
         }
-        else if (tilecmd_id == tilecmd_id_drawsmalltri)
+        else if (!fb->depth_only)
         {
-#ifdef ENABLE_PERFCOUNTERS
-            uint64_t smalltri_start_pc = qpc();
-#endif
+            // set color based on barycentrics.
+            __m256i src_color = _mm256_set1_epi32(0xFF << 24);
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(w), 16));
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(u), 8));
+            src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(v), 0));
+
+            // write color into backbuffer
+            _mm256_maskstore_epi32((int32_t*)&fb->backbuffer[fine_dst_i], depth_pass, src_color);
+        }
 
-#ifdef USE_HSWni
-            draw_tile_smalltri_avx2(fb, tile_id, (tilecmd_drawsmalltri_t*)cmd);
-#else
-            draw_tile_smalltri_scalar(fb, tile_id, (tilecmd_drawsmalltri_t*)cmd);
-#endif
+    end_fineblock_half:
+        // offset edge equations down for the second half
+        for (int32_t v = 0; v < 3; v++)
+        {
+            edges[v] = _mm256_add_epi32(edges[v], _mm256_set1_epi32(drawcmd.edge_dys[v] * 2));
+        }
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->tile_perfcounters[tile_id].smalltri_raster += qpc() - smalltri_start_pc;
-#endif
+        // offset destination to the next half of the fine block
+        fine_dst_i += PIXELS_PER_FINE_BLOCK / 2;
+    }
 
-            cmd += sizeof(tilecmd_drawsmalltri_t) / sizeof(uint32_t);
-        }
-        else if (tilecmd_id >= tilecmd_id_drawlargetri_0edgemask && tilecmd_id <= tilecmd_id_drawlargetri_7edgemask)
-        {   
-#ifdef ENABLE_PERFCOUNTERS
-            uint64_t largetri_start_pc = qpc();
-#endif
+    return num_pixels_passed;
+}
 
-#if defined(USE_HSWni) && 0
-            switch (tilecmd_id - tilecmd_id_drawlargetri_0edgemask)
-            {
-            case 0:
-                draw_tile_largetri_avx2<0>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 1:
-                draw_tile_largetri_avx2<1>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 2:
-                draw_tile_largetri_avx2<2>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 3:
-                draw_tile_largetri_avx2<3>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 4:
-                draw_tile_largetri_avx2<4>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 5:
-                draw_tile_largetri_avx2<5>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 6:
-                draw_tile_largetri_avx2<6>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 7:
-                draw_tile_largetri_avx2<7>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            }
-#else
-            switch (tilecmd_id - tilecmd_id_drawlargetri_0edgemask)
-            {
-            case 0:
-                draw_tile_largetri_scalar<0>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 1:
-                draw_tile_largetri_scalar<1>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 2:
-                draw_tile_largetri_scalar<2>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 3:
-                draw_tile_largetri_scalar<3>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 4:
-                draw_tile_largetri_scalar<4>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 5:
-                draw_tile_largetri_scalar<5>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 6:
-                draw_tile_largetri_scalar<6>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            case 7:
-                draw_tile_largetri_scalar<7>(fb, tile_id, (tilecmd_drawtile_t*)cmd);
-                break;
-            }
-#endif
+// the AVX2 version of draw_fine_block_msaa_scalar
+template<uint32_t TestEdgeMask>
+TARGET_AVX2 static uint32_t draw_fine_block_msaa_avx2(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* pDrawcmd)
+{
+    // each half of the fine block is drawn one sample at a time, in the same order as the pixels (see draw_fine_block_largetri_avx2)
+    tilecmd_drawtile_t drawcmd = *pDrawcmd;
+    const sample_edge_offsets_t* sample_offsets = drawcmd.sample_offsets;
+    uint32_t* sample_depths = &fb->depthbuffer[fine_dst_i * MSAA_SAMPLES_PER_PIXEL];
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->tile_perfcounters[tile_id].largetri_raster += qpc() - largetri_start_pc;
-#endif
+    __m256i edges[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        int32_t dx = drawcmd.edge_dxs[v];
+        int32_t dy = drawcmd.edge_dys[v];
 
-            cmd += sizeof(tilecmd_drawtile_t) / sizeof(uint32_t);
-        }
-        else if (tilecmd_id == tilecmd_id_cleartile)
-        {
-#ifdef ENABLE_PERFCOUNTERS
-            uint64_t clear_start_pc = qpc();
-#endif
+        edges[v] = _mm256_add_epi32(
+            _mm256_set1_epi32(drawcmd.edges[v]),
+            _mm256_setr_epi32(0, dx, dy, dx + dy, dx * 2, dx * 3, dx * 2 + dy, dx * 3 + dy));
+    }
 
-            clear_tile(fb, tile_id, (tilecmd_cleartile_t*)cmd);
+    // pre-compute triarea2 related stuff
+    int32_t rcp_triarea2_rshift = drawcmd.rcp_triarea2_rshift;
+    __m256i rcp_triarea2_mantissa256 = _mm256_set1_epi32(drawcmd.rcp_triarea2_mantissa);
+    __m256i shifted_triarea2 = _mm256_set1_epi32(drawcmd.shifted_triarea2);
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->tile_perfcounters[tile_id].clear += qpc() - clear_start_pc;
-#endif
+    // the part of the edge equations that was shifted out of the tile relative ones during setup
+    __m256i shifted_e2_offset = _mm256_set1_epi32(drawcmd.shifted_es[2]);
+    __m256i shifted_e0_offset = _mm256_set1_epi32(drawcmd.shifted_es[0]);
 
-            cmd += sizeof(tilecmd_cleartile_t) / sizeof(uint32_t);
-        }
-        else
-        {
-            assert(!"Unknown tile command");
-        }
+    // pre-compute depth related stuff
+    __m256i d0 = _mm256_set1_epi32(drawcmd.vert_Zs[0] << 16);
+    __m256i dd1 = _mm256_set1_epi32(drawcmd.vert_Zs[1] - drawcmd.vert_Zs[0]);
+    __m256i dd2 = _mm256_set1_epi32(drawcmd.vert_Zs[2] - drawcmd.vert_Zs[0]);
+
+    // which samples passed in each half, and the color of its pixels
+    __m256i sample_passes[2][MSAA_SAMPLES_PER_PIXEL];
+    __m256i colors[2];
+
+    for (int32_t fineblock_half = 0; fineblock_half < 2; fineblock_half++)
+    {
+        colors[fineblock_half] = _mm256_setzero_si256();
 
-        if (cmd == cmdbuf->cmdbuf_end)
+        // backwards, so the color ends up being the first passing sample's
+        for (int32_t sample_i = MSAA_SAMPLES_PER_PIXEL - 1; sample_i >= 0; sample_i--)
         {
-            cmd = cmdbuf->cmdbuf_start;
-            
-            if (cmdbuf->cmdbuf_write == cmdbuf->cmdbuf_end)
+            sample_passes[fineblock_half][sample_i] = _mm256_setzero_si256();
+
+            __m256i sample_edges[3];
+            for (int32_t v = 0; v < 3; v++)
             {
-                break;
+                sample_edges[v] = _mm256_add_epi32(edges[v], _mm256_set1_epi32(sample_offsets->edges[sample_i][v]));
             }
-        }
-    }
 
-    // read ptr should never be at the end ptr after interpreting
-    assert(cmd != cmdbuf->cmdbuf_end);
+            __m256i coverage_pass = _mm256_set1_epi32(-1);
+            for (int32_t v = 0; v < 3; v++)
+            {
+                if (TestEdgeMask & (1 << v))
+                {
+                    coverage_pass = _mm256_and_si256(coverage_pass, sample_edges[v]);
+                }
+            }
+            coverage_pass = _mm256_srai_epi32(coverage_pass, 31);
 
-    cmdbuf->cmdbuf_read = cmd;
-}
+            if (_mm256_testz_si256(coverage_pass, coverage_pass))
+                continue;
 
-static void framebuffer_push_tilecmd(framebuffer_t* fb, int32_t tile_id, const uint32_t* cmd_dwords, int32_t num_dwords)
-{
-    assert(tile_id < fb->total_num_tiles);
+            // note: off by one because -1 maps to 0
+            __m256i shifted_e2 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), sample_edges[2]), _mm256_set1_epi32(1));
+            __m256i shifted_e0 = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), sample_edges[0]), _mm256_set1_epi32(1));
+            if (rcp_triarea2_rshift < 0)
+            {
+                shifted_e2 = _mm256_slli_epi32(shifted_e2, -rcp_triarea2_rshift);
+                shifted_e0 = _mm256_slli_epi32(shifted_e0, -rcp_triarea2_rshift);
+            }
+            else
+            {
+                shifted_e2 = _mm256_srai_epi32(shifted_e2, rcp_triarea2_rshift);
+                shifted_e0 = _mm256_srai_epi32(shifted_e0, rcp_triarea2_rshift);
+            }
 
-    tile_cmdbuf_t* cmdbuf = &fb->tile_cmdbufs[tile_id];
+            shifted_e2 = _mm256_add_epi32(shifted_e2, shifted_e2_offset);
+            shifted_e0 = _mm256_add_epi32(shifted_e0, shifted_e0_offset);
 
-    // read should never be at the end.
-    assert(cmdbuf->cmdbuf_read != cmdbuf->cmdbuf_end);
+            // clamp to triangle area (unsigned, so negative values also clamp to the area)
+            shifted_e0 = _mm256_min_epu32(shifted_triarea2, shifted_e0);
+            shifted_e2 = _mm256_min_epu32(shifted_triarea2, shifted_e2);
 
-    // debugging code for logging commands
-    // printf("Writing command [id: %d, sz: %d]\n", cmd_dwords[0], num_dwords);
-    // debugprint_cmdbuf(cmdbuf);
+            // compute non-perspective-correct barycentrics for vertices 1 and 2
+            __m256i u = _mm256_srli_epi32(_mm256_mullo_epi32(shifted_e2, rcp_triarea2_mantissa256), 15);
+            __m256i v = _mm256_srli_epi32(_mm256_mullo_epi32(shifted_e0, rcp_triarea2_mantissa256), 15);
 
-    if (cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_write > 0 && cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_write < num_dwords + 1)
-    {
-        // read ptr is after write ptr and there's not enough room in between
-        // therefore, need to flush
-        // note: write is not allowed to "catch up" to read from behind, hence why a +1 is added to keep them separate.
-        framebuffer_resolve_tile(fb, tile_id);
+            // ensure barycentrics sum to 1
+            __m256i one_minus_u = _mm256_sub_epi32(_mm256_set1_epi32(0xFFFF), u);
+            v = _mm256_min_epi32(v, one_minus_u);
 
-        // after resolve, read should now have "caught up" to write from behind
-        assert(cmdbuf->cmdbuf_read == cmdbuf->cmdbuf_write);
-    }
+            __m256i w = _mm256_sub_epi32(_mm256_set1_epi32(0xFFFF), _mm256_add_epi32(u, v));
 
-    // At this point, the read head can't be a problem. However, it's possible there isn't enough memory at the end.
-    if (cmdbuf->cmdbuf_end - cmdbuf->cmdbuf_write < num_dwords)
-    {
-        // not enough room in the buffer to write the commands, need to loop around
+            // compute interpolated depth
+            __m256i src_depth = d0;
+            src_depth = _mm256_add_epi32(src_depth, _mm256_mullo_epi32(u, dd1));
+            src_depth = _mm256_add_epi32(src_depth, _mm256_mullo_epi32(v, dd2));
 
-        // should never be at the end of the buffer since it always loops at the end of this function
-        assert(cmdbuf->cmdbuf_write != cmdbuf->cmdbuf_end);
+            uint32_t* sample_depth = &sample_depths[sample_i * PIXELS_PER_FINE_BLOCK + fineblock_half * (PIXELS_PER_FINE_BLOCK / 2)];
+            __m256i dst_depth = _mm256_load_si256((__m256i*)sample_depth);
 
-        // abandon the rest of the slop at the end of the buffer
-        *cmdbuf->cmdbuf_write = tilecmd_id_resetbuf;
+            // note: unsigned compare implemented using signed compare, done by subtracting 2^31
+            __m256i depth_pass = _mm256_cmpgt_epi32(_mm256_sub_epi32(dst_depth, _mm256_set1_epi32(0x80000000)), _mm256_sub_epi32(src_depth, _mm256_set1_epi32(0x80000000)));
+            depth_pass = _mm256_and_si256(coverage_pass, depth_pass);
 
-        if (cmdbuf->cmdbuf_start == cmdbuf->cmdbuf_read)
-        {
-            // write is not allowed to catch up to read,
-            // so make sure read catches up to write instead.
-            framebuffer_resolve_tile(fb, tile_id);
+            if (_mm256_testz_si256(depth_pass, depth_pass))
+                continue;
 
-            // reset read back to start since we'll set write back to start also
-            cmdbuf->cmdbuf_read = cmdbuf->cmdbuf_start;
-        }
+            sample_passes[fineblock_half][sample_i] = depth_pass;
+            _mm256_maskstore_epi32((int32_t*)sample_depth, depth_pass, src_depth);
 
-        cmdbuf->cmdbuf_write = cmdbuf->cmdbuf_start;
+            if (!fb->depth_only)
+            {
+                __m256i src_color = _mm256_set1_epi32(0xFF << 24);
+                src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(w), 16));
+                src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(u), 8));
+                src_color = _mm256_or_si256(src_color, _mm256_slli_epi32(unorm16_to_unorm8_avx2(v), 0));
+                colors[fineblock_half] = _mm256_blendv_epi8(colors[fineblock_half], src_color, depth_pass);
+            }
+        }
 
-        // After loping around the buffer, it's possible that the read head is in the way again.
-        if (cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_write > 0 && cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_write < num_dwords + 1)
+        // offset edge equations down for the second half
+        for (int32_t v = 0; v < 3; v++)
         {
-            // read ptr is after write ptr and there's not enough room in between
-            // therefore, need to flush
-            // note: write is not allowed to "catch up" to read from behind, hence why a +1 is added to keep them separate.
-            framebuffer_resolve_tile(fb, tile_id);
-
-            // after resolve, read should now have "caught up" to write from behind
-            assert(cmdbuf->cmdbuf_read == cmdbuf->cmdbuf_write);
+            edges[v] = _mm256_add_epi32(edges[v], _mm256_set1_epi32(drawcmd.edge_dys[v] * 2));
         }
     }
 
-    // assert enough room in the buffer after the write
-    assert(cmdbuf->cmdbuf_end - cmdbuf->cmdbuf_write >= num_dwords);
-    // assert that the read head isn't in the way
-    assert((cmdbuf->cmdbuf_read <= cmdbuf->cmdbuf_write) || (cmdbuf->cmdbuf_read > cmdbuf->cmdbuf_write && cmdbuf->cmdbuf_read - cmdbuf->cmdbuf_write >= num_dwords + 1));
+    // the pixels that passed at any of their samples, and the ones that passed at all of them
+    __m256i any_passes[2];
+    __m256i all_passes[2];
+    uint32_t any_pass_mask = 0;
+    uint32_t all_pass_mask = 0;
+    for (int32_t fineblock_half = 0; fineblock_half < 2; fineblock_half++)
+    {
+        any_passes[fineblock_half] = sample_passes[fineblock_half][0];
+        all_passes[fineblock_half] = sample_passes[fineblock_half][0];
+        for (int32_t sample_i = 1; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+        {
+            any_passes[fineblock_half] = _mm256_or_si256(any_passes[fineblock_half], sample_passes[fineblock_half][sample_i]);
+            all_passes[fineblock_half] = _mm256_and_si256(all_passes[fineblock_half], sample_passes[fineblock_half][sample_i]);
+        }
+        any_pass_mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(any_passes[fineblock_half])) << (fineblock_half * 8);
+        all_pass_mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(all_passes[fineblock_half])) << (fineblock_half * 8);
+    }
 
-    // finally actually write the command
-    for (int32_t i = 0; i < num_dwords; i++)
+    uint32_t num_pixels_passed = popcnt(any_pass_mask);
+    if (fb->depth_only || !any_pass_mask)
     {
-        cmdbuf->cmdbuf_write[i] = cmd_dwords[i];
+        return num_pixels_passed;
     }
-    cmdbuf->cmdbuf_write += num_dwords;
 
-    // write is not allowed to catch up to read
-    assert(cmdbuf->cmdbuf_write != cmdbuf->cmdbuf_read);
+    uint32_t* pixel_colors = &fb->backbuffer[fine_dst_i];
+    uint32_t* sample_colors = &fb->samplebuffer[fine_dst_i * MSAA_SAMPLES_PER_PIXEL];
+    uint8_t* compressed = &fb->compressed_fine_blocks[fine_dst_i / PIXELS_PER_FINE_BLOCK];
 
-    // loop around the buffer if necessary
-    if (cmdbuf->cmdbuf_write == cmdbuf->cmdbuf_end)
+    if (*compressed)
     {
-        if (cmdbuf->cmdbuf_start == cmdbuf->cmdbuf_read)
+        // as long as every pixel passed at all or none of its samples, each pixel still has one color
+        if (any_pass_mask == all_pass_mask)
         {
-            // write is not allowed to catch up to read,
-            // so make sure read catches up to write instead.
-            framebuffer_resolve_tile(fb, tile_id);
+            _mm256_maskstore_epi32((int32_t*)&pixel_colors[0], all_passes[0], colors[0]);
+            _mm256_maskstore_epi32((int32_t*)&pixel_colors[8], all_passes[1], colors[1]);
+            return num_pixels_passed;
+        }
 
-            // since the resolve made read ptr catch up to write ptr, that means read reached the end
-            // that also means it currently looped back to the start, so the write ptr can be put there too
-            // this is the case where the whole buffer gets consumed in one go
+        // otherwise every sample needs a color of its own from now on
+        __m256i pixel_colors0 = _mm256_load_si256((const __m256i*)&pixel_colors[0]);
+        __m256i pixel_colors1 = _mm256_load_si256((const __m256i*)&pixel_colors[8]);
+        for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+        {
+            _mm256_store_si256((__m256i*)&sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + 0], pixel_colors0);
+            _mm256_store_si256((__m256i*)&sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + 8], pixel_colors1);
         }
+        *compressed = 0;
+    }
 
-        cmdbuf->cmdbuf_write = cmdbuf->cmdbuf_start;
+    // every sample of the fine block got overwritten, so it's back to one color per pixel
+    if (all_pass_mask == (1 << PIXELS_PER_FINE_BLOCK) - 1)
+    {
+        _mm256_store_si256((__m256i*)&pixel_colors[0], colors[0]);
+        _mm256_store_si256((__m256i*)&pixel_colors[8], colors[1]);
+        *compressed = 1;
+        return num_pixels_passed;
     }
 
-    // DEBUGGING: Always flush. Helpful since it gives you a straight call stack through the command list.
-    // framebuffer_resolve_tile(fb, tile_id);
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        _mm256_maskstore_epi32((int32_t*)&sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + 0], sample_passes[0][sample_i], colors[0]);
+        _mm256_maskstore_epi32((int32_t*)&sample_colors[sample_i * PIXELS_PER_FINE_BLOCK + 8], sample_passes[1][sample_i], colors[1]);
+    }
+
+    return num_pixels_passed;
 }
 
-void framebuffer_resolve(framebuffer_t* fb)
+template<uint32_t TestEdgeMask, bool Msaa>
+TARGET_AVX2 static void draw_coarse_block_largetri_avx2(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawtile_t* drawcmd, framebuffer_tile_stats_t* tile_stats)
 {
-    assert(fb);
+    // coarse blocks are made out of 4x4 fine blocks, organized as:
+    //  0  1  4  5
+    //  2  3  6  7
+    //  8  9 12 13
+    // 10 11 14 15
+    // therefore, coarse blocks are rasterized by shifting around the fine block's edge equations.
 
-    int32_t tile_i = 0;
-    for (int32_t tile_y = 0; tile_y < fb->height_in_tiles; tile_y++)
+    __m256i edges[3];
+    __m256i edge_trivRejs[3];
+
+    for (int32_t v = 0; v < 3; v++)
     {
-        for (int32_t tile_x = 0; tile_x < fb->width_in_tiles; tile_x++)
+        int32_t dx = drawcmd->edge_dxs[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t dy = drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+
+        edges[v] = _mm256_add_epi32(
+            _mm256_set1_epi32(drawcmd->edges[v]),
+            _mm256_setr_epi32(0, dx, dy, dx + dy, dx * 2, dx * 3, dx * 2 + dy, dx * 3 + dy));
+
+        if (TestEdgeMask & (1 << v))
         {
-            framebuffer_resolve_tile(fb, tile_i);
-            tile_i++;
+            edge_trivRejs[v] = edges[v];
+            if (dx < 0) edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], _mm256_set1_epi32(dx));
+            if (dy < 0) edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], _mm256_set1_epi32(dy));
         }
     }
-}
-
-void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data)
-{
-    assert(fb);
-    assert(x >= 0 && x < fb->width_in_pixels);
-    assert(y >= 0 && y < fb->height_in_pixels);
-    assert(width >= 0 && width <= fb->width_in_pixels);
-    assert(height >= 0 && height <= fb->height_in_pixels);
-    assert(x + width <= fb->width_in_pixels);
-    assert(y + height <= fb->height_in_pixels);
-    assert(data);
 
-    int32_t topleft_tile_y = y / TILE_WIDTH_IN_PIXELS;
-    int32_t topleft_tile_x = x / TILE_WIDTH_IN_PIXELS;
-    int32_t bottomright_tile_y = (y + (height - 1)) / TILE_WIDTH_IN_PIXELS;
-    int32_t bottomright_tile_x = (x + (width - 1)) / TILE_WIDTH_IN_PIXELS;
+    int32_t dst_i = coarse_dst_i;
 
-    int32_t curr_tile_row_start = topleft_tile_y * fb->pixels_per_row_of_tiles + topleft_tile_x * PIXELS_PER_TILE;
-    for (int32_t tile_y = topleft_tile_y; tile_y <= bottomright_tile_y; tile_y++)
+    for (int32_t coarseblock_half = 0; coarseblock_half < 2; coarseblock_half++)
     {
-        int32_t curr_tile_start = curr_tile_row_start;
+        // draw each fine block in the coarse block half
+        __declspec(align(32)) int32_t fineblock_edges[3][8];
+        _mm256_store_si256((__m256i*)&fineblock_edges[0][0], edges[0]);
+        _mm256_store_si256((__m256i*)&fineblock_edges[1][0], edges[1]);
+        _mm256_store_si256((__m256i*)&fineblock_edges[2][0], edges[2]);
+
+        // trivial reject if at least one edge doesn't cover the fine block at all
+        __m256i trivRej_pass = _mm256_set1_epi32(-1);
+        for (int32_t v = 0; v < 3; v++)
+        {
+            if (TestEdgeMask & (1 << v))
+            {
+                trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), edge_trivRejs[v]));
+            }
+        }
 
-        for (int32_t tile_x = topleft_tile_x; tile_x <= bottomright_tile_x; tile_x++)
+        int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass);
+        if (!trivRej_pass_mask)
         {
-            int32_t topleft_y = tile_y * TILE_WIDTH_IN_PIXELS;
-            int32_t topleft_x = tile_x * TILE_WIDTH_IN_PIXELS;
-            int32_t bottomright_y = topleft_y + TILE_WIDTH_IN_PIXELS;
-            int32_t bottomright_x = topleft_x + TILE_WIDTH_IN_PIXELS;
-            int32_t pixel_y_min = topleft_y < y ? y : topleft_y;
-            int32_t pixel_x_min = topleft_x < x ? x : topleft_x;
-            int32_t pixel_y_max = bottomright_y > y + height ? y + height : bottomright_y;
-            int32_t pixel_x_max = bottomright_x > x + width ? x + width : bottomright_x;
+            dst_i += PIXELS_PER_FINE_BLOCK * 8;
+            goto coarseblock_half_end;
+        }
 
-            for (int32_t pixel_y = pixel_y_min, pixel_y_bits = pdep_u32(topleft_y, TILE_Y_SWIZZLE_MASK);
-                pixel_y < pixel_y_max;
-                pixel_y++, pixel_y_bits = (pixel_y_bits - TILE_Y_SWIZZLE_MASK) & TILE_Y_SWIZZLE_MASK)
+        tilecmd_drawtile_t finecmd = *drawcmd;
+        for (int32_t i = 0; i < 8; i++)
+        {
+            if (trivRej_pass_mask & (1 << (i * 4)))
             {
-                for (int32_t pixel_x = pixel_x_min, pixel_x_bits = pdep_u32(topleft_x, TILE_X_SWIZZLE_MASK);
-                    pixel_x < pixel_x_max;
-                    pixel_x++, pixel_x_bits = (pixel_x_bits - TILE_X_SWIZZLE_MASK) & TILE_X_SWIZZLE_MASK)
-                {
-                    int32_t rel_pixel_y = pixel_y - y;
-                    int32_t rel_pixel_x = pixel_x - x;
-                    int32_t dst_i = rel_pixel_y * width + rel_pixel_x;
+                finecmd.edges[0] = fineblock_edges[0][i];
+                finecmd.edges[1] = fineblock_edges[1][i];
+                finecmd.edges[2] = fineblock_edges[2][i];
 
-                    int32_t src_i = curr_tile_start + (pixel_y_bits | pixel_x_bits);
-                    if (attachment == attachment_color0)
-                    {
-                        uint32_t src = fb->backbuffer[src_i];
-                        if (format == pixelformat_r8g8b8a8_unorm)
-                        {
-                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
-                            dst[0] = (uint8_t)((src & 0x00FF0000) >> 16);
-                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
-                            dst[2] = (uint8_t)((src & 0x000000FF) >> 0);
-                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
-                        }
-                        else if (format == pixelformat_b8g8r8a8_unorm)
-                        {
-                            uint8_t* dst = (uint8_t*)data + dst_i * 4;
-                            dst[0] = (uint8_t)((src & 0x000000FF) >> 0);
-                            dst[1] = (uint8_t)((src & 0x0000FF00) >> 8);
-                            dst[2] = (uint8_t)((src & 0x00FF0000) >> 16);
-                            dst[3] = (uint8_t)((src & 0xFF000000) >> 24);
-                        }
-                        else
-                        {
-                            assert(!"Unknown color pixel format");
-                        }
-                    }
-                    else if (attachment == attachment_depth)
-                    {
-                        uint32_t src = fb->depthbuffer[src_i];
-                        if (format == pixelformat_r32_unorm)
-                        {
-                            uint32_t* dst = (uint32_t*)data + dst_i;
-                            *dst = src;
-                        }
-                        else
-                        {
-                            assert(!"Unknown depth pixel format");
-                        }
-                    }
-                }
+                if (Msaa)
+                    tile_stats->pixels_passed += draw_fine_block_msaa_avx2<TestEdgeMask>(fb, dst_i, &finecmd);
+                else
+                    tile_stats->pixels_passed += draw_fine_block_largetri_avx2<TestEdgeMask>(fb, dst_i, &finecmd);
+
+                tile_stats->fine_blocks++;
             }
 
-            curr_tile_start += PIXELS_PER_TILE;
+            dst_i += PIXELS_PER_FINE_BLOCK;
         }
 
-        curr_tile_row_start += fb->pixels_per_row_of_tiles;
+    coarseblock_half_end:
+        for (int32_t v = 0; v < 3; v++)
+        {
+            __m256i dy2 = _mm256_set1_epi32(drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS * 2);
+            edges[v] = _mm256_add_epi32(edges[v], dy2);
+            if (TestEdgeMask & (1 << v))
+            {
+                edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], dy2);
+            }
+        }
     }
 }
 
-void framebuffer_clear(framebuffer_t* fb, uint32_t color)
+template<int32_t TileWidth, uint32_t TestEdgeMask, bool Msaa>
+TARGET_AVX2 static void draw_tile_largetri_avx2(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd)
 {
-    tilecmd_cleartile_t tilecmd;
-    tilecmd.tilecmd_id = tilecmd_id_cleartile;
-    tilecmd.color = color;
-
-    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
-    {
-        framebuffer_push_tilecmd(fb, tile_id, &tilecmd.tilecmd_id, sizeof(tilecmd) / sizeof(uint32_t));
-    }
-}
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
 
-static void rasterize_triangle(
-    framebuffer_t* fb,
-    xyzw_i32_t clipVerts[3])
-{
-#ifdef ENABLE_PERFCOUNTERS
-    uint64_t clipping_start_pc = qpc();
-#endif
+    // tiles are made out of coarse blocks in morton order. eg: the 4x4 coarse blocks of a 64x64 tile are organized as:
+    //  0  1  4  5
+    //  2  3  6  7
+    //  8  9 12 13
+    // 10 11 14 15
+    // therefore, tiles are rasterized 4x2 coarse blocks at a time, by shifting around the coarse block's edge equations.
+    // the 2x2 coarse blocks of a 32x32 tile only use the first 4 lanes.
+    const int32_t coarse_blocks_per_group = COARSE_BLOCKS_PER_TILE < 8 ? COARSE_BLOCKS_PER_TILE : 8;
+    const int lanes_mask = (int)((1ULL << (coarse_blocks_per_group * 4)) - 1);
 
-    int32_t fully_clipped = 0;
+    __m256i edges[3];
+    __m256i edge_trivRejs[3];
+    __m256i edge_trivAccs[3];
 
-    // perform near plane clipping
-    {
-        // check which vertices are behind the near plane
-        int32_t vert_near_clipped[3];
-        vert_near_clipped[0] = clipVerts[0].z < 0;
-        vert_near_clipped[1] = clipVerts[1].z < 0;
-        vert_near_clipped[2] = clipVerts[2].z < 0;
-
-        int32_t num_near_clipped = vert_near_clipped[0] + vert_near_clipped[1] + vert_near_clipped[2];
-
-        if (num_near_clipped == 3)
-        {
-            // clip whole triangles with 3 vertices behind the near plane
-            fully_clipped = 1;
-            goto clipping_end;
-        }
-
-        if (num_near_clipped == 2)
-        {
-            // Two vertices behind the near plane. In this case, cut the associated edges short.
-            int32_t unclipped_vert = 0;
-            if (!vert_near_clipped[1]) unclipped_vert = 1;
-            else if (!vert_near_clipped[2]) unclipped_vert = 2;
-
-            int32_t v1 = (unclipped_vert + 1) % 3;
-            int32_t v2 = (unclipped_vert + 2) % 3;
-
-            // clip the first edge
-            int32_t a1 = s1516_div(clipVerts[unclipped_vert].z, clipVerts[unclipped_vert].z - clipVerts[v1].z);
-            int32_t one_minus_a1 = s1516_int(1) - a1;
-            clipVerts[v1].x = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].x) + s1516_mul(a1, clipVerts[v1].x);
-            clipVerts[v1].y = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].y) + s1516_mul(a1, clipVerts[v1].y);
-            clipVerts[v1].z = 0;
-            clipVerts[v1].w = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
-            assert(clipVerts[v1].w != 0);
-
-            // clip the second edge
-            int32_t a2 = s1516_div(clipVerts[unclipped_vert].z, clipVerts[unclipped_vert].z - clipVerts[v2].z);
-            int32_t one_minus_a2 = s1516_int(1) - a2;
-            clipVerts[v2].x = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].x) + s1516_mul(a2, clipVerts[v2].x);
-            clipVerts[v2].y = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].y) + s1516_mul(a2, clipVerts[v2].y);
-            clipVerts[v2].z = 0;
-            clipVerts[v2].w = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
-            assert(clipVerts[v2].w != 0);
-        }
-
-        if (num_near_clipped == 1)
-        {
-            // One vertex behind the near plane. In this case, triangulate the triangle into two triangles.
-            int32_t clipped_vert = 0;
-            if (vert_near_clipped[1]) clipped_vert = 1;
-            else if (vert_near_clipped[2]) clipped_vert = 2;
-
-            int32_t v1 = (clipped_vert + 1) % 3;
-            int32_t v2 = (clipped_vert + 2) % 3;
-
-            // clip the first edge
-            xyzw_i32_t clipped1;
-            int32_t a1 = s1516_div(clipVerts[clipped_vert].z, clipVerts[clipped_vert].z - clipVerts[v1].z);
-            int32_t one_minus_a1 = s1516_int(1) - a1;
-            clipped1.x = s1516_mul(one_minus_a1, clipVerts[clipped_vert].x) + s1516_mul(a1, clipVerts[v1].x);
-            clipped1.y = s1516_mul(one_minus_a1, clipVerts[clipped_vert].y) + s1516_mul(a1, clipVerts[v1].y);
-            clipped1.z = 0;
-            clipped1.w = s1516_mul(one_minus_a1, clipVerts[clipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
-            assert(clipped1.w != 0);
-
-            // clip the second edge
-            xyzw_i32_t clipped2;
-            int32_t a2 = s1516_div(clipVerts[clipped_vert].z, clipVerts[clipped_vert].z - clipVerts[v2].z);
-            int32_t one_minus_a2 = s1516_int(1) - a2;
-            clipped2.x = s1516_mul(one_minus_a2, clipVerts[clipped_vert].x) + s1516_mul(a2, clipVerts[v2].x);
-            clipped2.y = s1516_mul(one_minus_a2, clipVerts[clipped_vert].y) + s1516_mul(a2, clipVerts[v2].y);
-            clipped2.z = 0;
-            clipped2.w = s1516_mul(one_minus_a2, clipVerts[clipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
-            assert(clipped2.w != 0);
-
-            // output the first clipped triangle (note: recursive call)
-            xyzw_i32_t clipVerts1[3] = { clipVerts[0], clipVerts[1], clipVerts[2] };
-            clipVerts1[clipped_vert] = clipped1;
-
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.clipping += qpc() - clipping_start_pc;
-#endif
+    for (int32_t v = 0; v < 3; v++)
+    {
+        int32_t dx = drawcmd->edge_dxs[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t dy = drawcmd->edge_dys[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
 
-            rasterize_triangle(fb, clipVerts1);
-            
-#ifdef ENABLE_PERFCOUNTERS
-            clipping_start_pc = qpc();
-#endif
+        edges[v] = _mm256_add_epi32(
+            _mm256_set1_epi32(drawcmd->edges[v]),
+            _mm256_setr_epi32(0, dx, dy, dx + dy, dx * 2, dx * 3, dx * 2 + dy, dx * 3 + dy));
 
-            // set self up to output the second clipped triangle
-            clipVerts[clipped_vert] = clipped2;
-            clipVerts[v1] = clipped1;
+        if (TestEdgeMask & (1 << v))
+        {
+            edge_trivRejs[v] = edges[v];
+            edge_trivAccs[v] = edges[v];
+            if (dx < 0) edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], _mm256_set1_epi32(dx));
+            if (dx > 0) edge_trivAccs[v] = _mm256_add_epi32(edge_trivAccs[v], _mm256_set1_epi32(dx));
+            if (dy < 0) edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], _mm256_set1_epi32(dy));
+            if (dy > 0) edge_trivAccs[v] = _mm256_add_epi32(edge_trivAccs[v], _mm256_set1_epi32(dy));
         }
     }
 
-    // perform far plane clipping
-    {
-        // check which vertices are behind (or on) the far plane
-        int32_t vert_far_clipped[3];
-        vert_far_clipped[0] = clipVerts[0].z >= clipVerts[0].w;
-        vert_far_clipped[1] = clipVerts[1].z >= clipVerts[1].w;
-        vert_far_clipped[2] = clipVerts[2].z >= clipVerts[2].w;
+    int32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
-        int32_t num_far_clipped = vert_far_clipped[0] + vert_far_clipped[1] + vert_far_clipped[2];
+    // every pixel of the triangle is at least this far, and at most max_Z far
+    // note: unsigned compare implemented using signed compare, done by subtracting 2^31
+    __m256i tri_min_depth = _mm256_set1_epi32((drawcmd->min_Z << 16) - 0x80000000);
+    uint32_t tri_max_depth = drawcmd->max_Z << 16;
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+
+    for (int32_t group_cb_i = 0; group_cb_i < COARSE_BLOCKS_PER_TILE; group_cb_i += coarse_blocks_per_group)
+    {
+        // move the edge equations to the first coarse block of the group
+        int32_t group_cb_x = (int32_t)morton_decode_x(group_cb_i);
+        int32_t group_cb_y = (int32_t)morton_decode_x(group_cb_i >> 1);
 
-        if (num_far_clipped == 3)
+        __m256i group_edges[3];
+        __m256i group_edge_trivRejs[3];
+        __m256i group_edge_trivAccs[3];
+        for (int32_t v = 0; v < 3; v++)
         {
-            // clip whole triangles with 3 vertices behind the far plane
-            fully_clipped = 1;
-            goto clipping_end;
+            __m256i offset = _mm256_set1_epi32((drawcmd->edge_dxs[v] * group_cb_x + drawcmd->edge_dys[v] * group_cb_y) * COARSE_BLOCK_WIDTH_IN_PIXELS);
+            group_edges[v] = _mm256_add_epi32(edges[v], offset);
+            if (TestEdgeMask & (1 << v))
+            {
+                group_edge_trivRejs[v] = _mm256_add_epi32(edge_trivRejs[v], offset);
+                group_edge_trivAccs[v] = _mm256_add_epi32(edge_trivAccs[v], offset);
+            }
         }
 
-        if (num_far_clipped == 2)
-        {
-            // Two vertices behind the far plane. In this case, cut the associated edges short.
-            int32_t unclipped_vert = 0;
-            if (!vert_far_clipped[1]) unclipped_vert = 1;
-            else if (!vert_far_clipped[2]) unclipped_vert = 2;
+        // draw each coarse block in the group
+        __declspec(align(32)) int32_t coarseblock_edges[3][8];
+        _mm256_store_si256((__m256i*)&coarseblock_edges[0][0], group_edges[0]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[1][0], group_edges[1]);
+        _mm256_store_si256((__m256i*)&coarseblock_edges[2][0], group_edges[2]);
 
-            int32_t v1 = (unclipped_vert + 1) % 3;
-            int32_t v2 = (unclipped_vert + 2) % 3;
+        // trivial reject if at least one edge doesn't cover the coarse block at all
+        __m256i trivRej_pass = _mm256_set1_epi32(-1);
+        for (int32_t v = 0; v < 3; v++)
+        {
+            if (TestEdgeMask & (1 << v))
+            {
+                trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_setzero_si256(), group_edge_trivRejs[v]));
+            }
+        }
 
-            // clip the first edge
-            int32_t a1 = s1516_div(clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w, (clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w) - (clipVerts[v1].z - clipVerts[v1].w));
-            int32_t one_minus_a1 = s1516_int(1) - a1;
-            clipVerts[v1].x = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].x) + s1516_mul(a1, clipVerts[v1].x);
-            clipVerts[v1].y = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].y) + s1516_mul(a1, clipVerts[v1].y);
-            clipVerts[v1].w = s1516_mul(one_minus_a1, clipVerts[unclipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
-            clipVerts[v1].z = clipVerts[v1].w - 1;
-            assert(clipVerts[v1].w != 0);
+        // reject coarse blocks where everything is already in front of the triangle.
+        // lanes past the end of a small group are garbage, but they're masked off.
+        __m256i coarse_max_depth = coarse_blocks_per_group == 8 ?
+            _mm256_loadu_si256((const __m256i*)&coarse_max_depths[group_cb_i]) :
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&coarse_max_depths[group_cb_i]));
+        trivRej_pass = _mm256_and_si256(trivRej_pass, _mm256_cmpgt_epi32(_mm256_sub_epi32(coarse_max_depth, _mm256_set1_epi32(0x80000000)), tri_min_depth));
 
-            // clip the second edge
-            int32_t a2 = s1516_div(clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w, (clipVerts[unclipped_vert].z - clipVerts[unclipped_vert].w) - (clipVerts[v2].z - clipVerts[v2].w));
-            int32_t one_minus_a2 = s1516_int(1) - a2;
-            clipVerts[v2].x = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].x) + s1516_mul(a2, clipVerts[v2].x);
-            clipVerts[v2].y = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].y) + s1516_mul(a2, clipVerts[v2].y);
-            clipVerts[v2].w = s1516_mul(one_minus_a2, clipVerts[unclipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
-            clipVerts[v2].z = clipVerts[v2].w - 1;
-            assert(clipVerts[v2].w != 0);
+        int trivRej_pass_mask = _mm256_movemask_epi8(trivRej_pass) & lanes_mask;
+        if (!trivRej_pass_mask)
+        {
+            continue;
         }
 
-        if (num_far_clipped == 1)
+        // edges that cover a whole coarse block don't need to be tested inside of it
+        int trivAcc_pass_masks[3];
+        for (int32_t v = 0; v < 3; v++)
         {
-            // One vertex behind the near plane. In this case, triangulate the triangle into two triangles.
-            int32_t clipped_vert = 0;
-            if (vert_far_clipped[1]) clipped_vert = 1;
-            else if (vert_far_clipped[2]) clipped_vert = 2;
-
-            int32_t v1 = (clipped_vert + 1) % 3;
-            int32_t v2 = (clipped_vert + 2) % 3;
+            if (TestEdgeMask & (1 << v))
+            {
+                trivAcc_pass_masks[v] = _mm256_movemask_epi8(_mm256_cmpgt_epi32(_mm256_setzero_si256(), group_edge_trivAccs[v]));
+            }
+        }
 
-            // clip the first edge
-            xyzw_i32_t clipped1;
-            int32_t a1 = s1516_div(clipVerts[clipped_vert].z - clipVerts[clipped_vert].w, (clipVerts[clipped_vert].z - clipVerts[clipped_vert].w) - (clipVerts[v1].z - clipVerts[v1].w));
-            int32_t one_minus_a1 = s1516_int(1) - a1;
-            clipped1.x = s1516_mul(one_minus_a1, clipVerts[clipped_vert].x) + s1516_mul(a1, clipVerts[v1].x);
-            clipped1.y = s1516_mul(one_minus_a1, clipVerts[clipped_vert].y) + s1516_mul(a1, clipVerts[v1].y);
-            clipped1.w = s1516_mul(one_minus_a1, clipVerts[clipped_vert].w) + s1516_mul(a1, clipVerts[v1].w);
-            clipped1.z = clipped1.w - 1;
-            assert(clipped1.w != 0);
+        tilecmd_drawtile_t coarsecmd = *drawcmd;
+        for (int32_t i = 0; i < coarse_blocks_per_group; i++)
+        {
+            if (trivRej_pass_mask & (1 << (i * 4)))
+            {
+                uint32_t newTestEdgeMask = TestEdgeMask;
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    if (TestEdgeMask & (1 << v))
+                    {
+                        if (trivAcc_pass_masks[v] & (1 << (i * 4)))
+                        {
+                            newTestEdgeMask &= ~(1 << v);
+                        }
+                    }
+                }
 
-            // clip the second edge
-            xyzw_i32_t clipped2;
-            int32_t a2 = s1516_div(clipVerts[clipped_vert].z - clipVerts[clipped_vert].w, (clipVerts[clipped_vert].z - clipVerts[clipped_vert].w) - (clipVerts[v2].z - clipVerts[v2].w));
-            int32_t one_minus_a2 = s1516_int(1) - a2;
-            clipped2.x = s1516_mul(one_minus_a2, clipVerts[clipped_vert].x) + s1516_mul(a2, clipVerts[v2].x);
-            clipped2.y = s1516_mul(one_minus_a2, clipVerts[clipped_vert].y) + s1516_mul(a2, clipVerts[v2].y);
-            clipped2.w = s1516_mul(one_minus_a2, clipVerts[clipped_vert].w) + s1516_mul(a2, clipVerts[v2].w);
-            clipped2.z = clipped2.w - 1;
-            assert(clipped2.w != 0);
+                coarsecmd.edges[0] = coarseblock_edges[0][i];
+                coarsecmd.edges[1] = coarseblock_edges[1][i];
+                coarsecmd.edges[2] = coarseblock_edges[2][i];
 
-            // output the first clipped triangle (note: recursive call)
-            xyzw_i32_t clipVerts1[3] = { clipVerts[0], clipVerts[1], clipVerts[2] };
-            clipVerts1[clipped_vert] = clipped1;
+                // the triangle covers the whole coarse block when no edge needs testing inside of it
+                int32_t cb_i = group_cb_i + i;
+                framebuffer_materialize_clears(fb, tile_id, 1ULL << cb_i, newTestEdgeMask == 0 ? 1ULL << cb_i : 0);
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.clipping += qpc() - clipping_start_pc;
-#endif
+                int32_t dst_i = tile_dst_i + cb_i * PIXELS_PER_COARSE_BLOCK;
 
-            rasterize_triangle(fb, clipVerts1);
-            
-#ifdef ENABLE_PERFCOUNTERS
-            clipping_start_pc = qpc();
-#endif
+                switch (newTestEdgeMask)
+                {
+                case 0:
+                    draw_coarse_block_largetri_avx2<0, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 1:
+                    draw_coarse_block_largetri_avx2<1, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 2:
+                    draw_coarse_block_largetri_avx2<2, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 3:
+                    draw_coarse_block_largetri_avx2<3, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 4:
+                    draw_coarse_block_largetri_avx2<4, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 5:
+                    draw_coarse_block_largetri_avx2<5, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 6:
+                    draw_coarse_block_largetri_avx2<6, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 7:
+                    draw_coarse_block_largetri_avx2<7, Msaa>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                }
 
-            // set self up to output the second clipped triangle
-            clipVerts[clipped_vert] = clipped2;
-            clipVerts[v1] = clipped1;
+                // the triangle covers the whole coarse block, so nothing in it can be further than the triangle anymore
+                if (newTestEdgeMask == 0 && tri_max_depth < coarse_max_depths[cb_i])
+                {
+                    coarse_max_depths[cb_i] = tri_max_depth;
+                }
+            }
         }
     }
+}
 
-clipping_end:
+#ifdef ENABLE_AVX512
+// Every level of the rasterizer (fine block, coarse block, 64x64 tile) is a 4x4 grid stored in morton order:
+//  0  1  4  5
+//  2  3  6  7
+//  8  9 12 13
+// 10 11 14 15
+// so with 16 lanes, a whole level is processed at once. 128x128 tiles are 2x2 of those grids, and 32x32 tiles are the first 4 lanes.
+// These are the x and y of each lane in the grid.
+#define AVX512_GRID_XS _mm512_setr_epi32(0, 1, 0, 1, 2, 3, 2, 3, 0, 1, 0, 1, 2, 3, 2, 3)
+#define AVX512_GRID_YS _mm512_setr_epi32(0, 0, 1, 1, 0, 0, 1, 1, 2, 2, 3, 3, 2, 2, 3, 3)
+
+// evaluates an edge equation at every point of the 4x4 grid, with the given step between points
+TARGET_AVX512 static __forceinline __m512i edge_grid_avx512(int32_t edge, int32_t dx, int32_t dy)
+{
+    __m512i xoffsets = _mm512_mullo_epi32(AVX512_GRID_XS, _mm512_set1_epi32(dx));
+    __m512i yoffsets = _mm512_mullo_epi32(AVX512_GRID_YS, _mm512_set1_epi32(dy));
+    return _mm512_add_epi32(_mm512_set1_epi32(edge), _mm512_add_epi32(xoffsets, yoffsets));
+}
 
-#ifdef ENABLE_PERFCOUNTERS
-    fb->perfcounters.clipping += qpc() - clipping_start_pc;
-#endif
+// same as unorm16_to_unorm8_avx2
+TARGET_AVX512 static __forceinline __m512i unorm16_to_unorm8_avx512(__m512i x)
+{
+    return _mm512_srli_epi32(_mm512_mullo_epi32(x, _mm512_set1_epi32(0xFF01)), 24);
+}
 
-    if (fully_clipped)
-    {
-        return;
-    }
+TARGET_AVX512 static uint32_t draw_fine_block_smalltri_avx512(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawsmalltri_t* pDrawcmd)
+{
+    // the whole 4x4 fine block is rasterized at once, one pixel per lane.
 
-#ifdef ENABLE_PERFCOUNTERS
-    uint64_t commonsetup_start_pc = qpc();
-#endif
+    tilecmd_drawsmalltri_t drawcmd = *pDrawcmd;
 
-    // transform vertices from clip space to window coordinates
-    xyzw_i32_t verts[3];
+    __m512i edges[3];
     for (int32_t v = 0; v < 3; v++)
     {
-        int32_t one_over_w = s1516_div(s1516_int(1), clipVerts[v].w);
-
-        // convert s15.16 (in clip space) to s16.8 window coordinates
-        // note to self: should probably avoid round-to-zero here? otherwise geometry warps inwards to the center of the screen
-        verts[v].x = s168_s1516(s1516_mul(s1516_div(s1516_add(s1516_mul(+clipVerts[v].x, one_over_w), s1516_int(1)), s1516_int(2)), s1516_int(fb->width_in_pixels)));
-        verts[v].y = s168_s1516(s1516_mul(s1516_div(s1516_add(s1516_mul(-clipVerts[v].y, one_over_w), s1516_int(1)), s1516_int(2)), s1516_int(fb->height_in_pixels)));
-
-        // TODO: clip things that are outside the guard band
-
-        // perform z/w, rounding down to maintain the z < w upper bound
-        verts[v].z = ((int64_t)clipVerts[v].z * one_over_w - (clipVerts[v].w / 2)) >> 16;
-        if (verts[v].z < 0)
-            verts[v].z = 0;
+        edges[v] = edge_grid_avx512(drawcmd.edges[v], drawcmd.edge_dxs[v], drawcmd.edge_dys[v]);
+    }
 
-        // Should be 0 <= z < w, thanks to near and far plane clipping
-        assert(verts[v].z >= 0 && verts[v].z <= 0xFFFF);
+    // compute all pixels passing the edge equation
+    __mmask16 coverage_mask = _mm512_cmplt_epi32_mask(edges[0], _mm512_setzero_si512());
+    coverage_mask &= _mm512_cmplt_epi32_mask(edges[1], _mm512_setzero_si512());
+    coverage_mask &= _mm512_cmplt_epi32_mask(edges[2], _mm512_setzero_si512());
 
-        verts[v].w = clipVerts[v].w;
-    }
+    // early-out if no pixels pass the test
+    if (!coverage_mask)
+        return 0;
 
-    uint32_t min_Z = verts[0].z;
-    uint32_t max_Z = verts[0].z;
-    for (int32_t v = 1; v < 3; v++)
+    // shift edge equations to be on the same scale as the triangle area
+    // note: off by one because -1 maps to 0
+    int32_t rcp_triarea2_rshift = drawcmd.rcp_triarea2_rshift;
+    __m512i shifted_e2 = _mm512_sub_epi32(_mm512_sub_epi32(_mm512_setzero_si512(), edges[2]), _mm512_set1_epi32(1));
+    __m512i shifted_e0 = _mm512_sub_epi32(_mm512_sub_epi32(_mm512_setzero_si512(), edges[0]), _mm512_set1_epi32(1));
+    if (rcp_triarea2_rshift < 0)
     {
-        if ((uint32_t)verts[v].z < min_Z)
-            min_Z = (uint32_t)verts[v].z;
-        
-        if ((uint32_t)verts[v].z > max_Z)
-            max_Z = (uint32_t)verts[v].z;
+        __m128i lshift = _mm_cvtsi32_si128(-rcp_triarea2_rshift);
+        shifted_e2 = _mm512_sll_epi32(shifted_e2, lshift);
+        shifted_e0 = _mm512_sll_epi32(shifted_e0, lshift);
     }
-    
-    // get window coordinates bounding box
-    int32_t bbox_min_x = verts[0].x;
-    if (verts[1].x < bbox_min_x) bbox_min_x = verts[1].x;
-    if (verts[2].x < bbox_min_x) bbox_min_x = verts[2].x;
-    int32_t bbox_max_x = verts[0].x;
-    if (verts[1].x > bbox_max_x) bbox_max_x = verts[1].x;
-    if (verts[2].x > bbox_max_x) bbox_max_x = verts[2].x;
-    int32_t bbox_min_y = verts[0].y;
-    if (verts[1].y < bbox_min_y) bbox_min_y = verts[1].y;
-    if (verts[2].y < bbox_min_y) bbox_min_y = verts[2].y;
-    int32_t bbox_max_y = verts[0].y;
-    if (verts[1].y > bbox_max_y) bbox_max_y = verts[1].y;
-    if (verts[2].y > bbox_max_y) bbox_max_y = verts[2].y;
-
-    // clip triangles that are fully outside the scissor rect (scissor rect = whole window)
-    if (bbox_max_x < 0 ||
-        bbox_max_y < 0 ||
-        bbox_min_x >= (int32_t)(fb->width_in_pixels << 8) ||
-        bbox_min_y >= (int32_t)(fb->height_in_pixels << 8))
+    else
     {
-        fully_clipped = 1;
-        goto commonsetup_end;
+        __m128i rshift = _mm_cvtsi32_si128(rcp_triarea2_rshift);
+        shifted_e2 = _mm512_srl_epi32(shifted_e2, rshift);
+        shifted_e0 = _mm512_srl_epi32(shifted_e0, rshift);
     }
 
-    int32_t clamped_bbox_min_x = bbox_min_x, clamped_bbox_max_x = bbox_max_x;
-    int32_t clamped_bbox_min_y = bbox_min_y, clamped_bbox_max_y = bbox_max_y;
+    // clamp to triangle area
+    __m512i shifted_triarea2 = _mm512_set1_epi32(drawcmd.shifted_triarea2);
+    shifted_e0 = _mm512_min_epi32(shifted_triarea2, shifted_e0);
+    shifted_e2 = _mm512_min_epi32(shifted_triarea2, shifted_e2);
 
-    // clamp bbox to scissor rect
-    if (clamped_bbox_min_x < 0) clamped_bbox_min_x = 0;
-    if (clamped_bbox_min_y < 0) clamped_bbox_min_y = 0;
-    if (clamped_bbox_max_x >= (int32_t)(fb->width_in_pixels << 8)) clamped_bbox_max_x = ((int32_t)fb->width_in_pixels << 8) - 1;
-    if (clamped_bbox_max_y >= (int32_t)(fb->height_in_pixels << 8)) clamped_bbox_max_y = ((int32_t)fb->height_in_pixels << 8) - 1;
+    // compute non-perspective-correct barycentrics for vertices 1 and 2
+    __m512i rcp_triarea2_mantissa = _mm512_set1_epi32(drawcmd.rcp_triarea2_mantissa);
+    __m512i u = _mm512_srli_epi32(_mm512_mullo_epi32(shifted_e2, rcp_triarea2_mantissa), 15);
+    __m512i v = _mm512_srli_epi32(_mm512_mullo_epi32(shifted_e0, rcp_triarea2_mantissa), 15);
 
-    // "small" triangles are no wider than a tile.
-    int32_t is_large =
-        (bbox_max_x - bbox_min_x) >= (TILE_WIDTH_IN_PIXELS << 8) ||
-        (bbox_max_y - bbox_min_y) >= (TILE_WIDTH_IN_PIXELS << 8);
+    // ensure barycentrics sum to 1
+    __m512i one_minus_u = _mm512_sub_epi32(_mm512_set1_epi32(0xFFFF), u);
+    v = _mm512_min_epi32(v, one_minus_u);
 
-commonsetup_end:
+    // not related to vertex w. Just third barycentric. Bad naming.
+    __m512i w = _mm512_sub_epi32(_mm512_set1_epi32(0xFFFF), _mm512_add_epi32(u, v));
 
-#ifdef ENABLE_PERFCOUNTERS
-    fb->perfcounters.common_setup += qpc() - commonsetup_start_pc;
-#endif
+    // compute interpolated depth
+    __m512i src_depth = _mm512_set1_epi32(drawcmd.vert_Zs[0] << 16);
+    src_depth = _mm512_add_epi32(src_depth, _mm512_mullo_epi32(u, _mm512_set1_epi32(drawcmd.vert_Zs[1] - drawcmd.vert_Zs[0])));
+    src_depth = _mm512_add_epi32(src_depth, _mm512_mullo_epi32(v, _mm512_set1_epi32(drawcmd.vert_Zs[2] - drawcmd.vert_Zs[0])));
 
-    if (fully_clipped)
+    __m512i dst_depth = _mm512_load_si512(&fb->depthbuffer[fine_dst_i]);
+
+    // combine coverage and depth masks
+    __mmask16 depth_pass_mask = _mm512_mask_cmplt_epu32_mask(coverage_mask, src_depth, dst_depth);
+
+    // early out if all depth tests fail
+    if (!depth_pass_mask)
+        return 0;
+
+    // blend depth into depthbuffer
+    _mm512_mask_store_epi32(&fb->depthbuffer[fine_dst_i], depth_pass_mask, src_depth);
+    uint32_t num_pixels_passed = popcnt(depth_pass_mask);
+
+    if (fb->depth_only)
+        return num_pixels_passed;
+
+    if (fb->visibility_buffer)
     {
-        return;
+        // write which triangle is visible, for framebuffer_shade
+        _mm512_mask_store_epi32(&fb->backbuffer[fine_dst_i], depth_pass_mask, _mm512_set1_epi32(drawcmd.triangle_id));
+        return num_pixels_passed;
     }
 
-#ifdef ENABLE_PERFCOUNTERS
-    uint64_t setup_start_pc = qpc();
-#endif
+    // set color based on barycentrics.
+    __m512i src_color = _mm512_set1_epi32(0xFF << 24);
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(w), 16));
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(u), 8));
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(v), 0));
 
-    if (!is_large)
+    // write color into backbuffer
+    _mm512_mask_store_epi32(&fb->backbuffer[fine_dst_i], depth_pass_mask, src_color);
+
+    return num_pixels_passed;
+}
+
+TARGET_AVX512 static void draw_coarse_block_smalltri_avx512(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawsmalltri_t* drawcmd, framebuffer_tile_stats_t* tile_stats)
+{
+    // the 4x4 fine blocks of the coarse block are trivially rejected all at once, one fine block per lane.
+
+    __m512i trivRej_pass[3];
+    __declspec(align(64)) int32_t fineblock_edges[3][16];
+    for (int32_t v = 0; v < 3; v++)
     {
-        // since this is a small triangle, that means the triangle is smaller than a tile.
-        // that means it can overlap at most 2x2 adjacent tiles if it's in the middle of all of them.
-        // just need to figure out which boxes are overlapping the triangle's bbox
-        int32_t first_tile_x = (bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_y = (bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_x = (bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_y = (bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
-        
-        // pixel coordinates of the first and last tile of the (up to) 2x2 block of tiles
-        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_px_x = (last_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_px_y = (last_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t dx = drawcmd->edge_dxs[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t dy = drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
 
-        // range of coarse blocks affected (relative to top left of 2x2 tile block)
-        int32_t first_rel_cb_x = ((bbox_min_x - first_tile_px_x) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
-        int32_t first_rel_cb_y = ((bbox_min_y - first_tile_px_y) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
-        int32_t last_rel_cb_x = ((bbox_max_x - first_tile_px_x) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
-        int32_t last_rel_cb_y = ((bbox_max_y - first_tile_px_y) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
+        __m512i edges = edge_grid_avx512(drawcmd->edges[v], dx, dy);
+        _mm512_store_si512(&fineblock_edges[v][0], edges);
 
-        tilecmd_drawsmalltri_t drawsmalltricmd;
-        drawsmalltricmd.tilecmd_id = tilecmd_id_drawsmalltri;
+        trivRej_pass[v] = _mm512_add_epi32(edges, _mm512_set1_epi32((dx < 0 ? dx : 0) + (dy < 0 ? dy : 0)));
+    }
 
-        // make vertices relative to the last tile they're in
-        for (int32_t v = 0; v < 3; v++)
+    // trivial reject if at least one edge doesn't cover the fine block at all
+    __mmask16 trivRej_pass_mask = _mm512_cmplt_epi32_mask(trivRej_pass[0], _mm512_setzero_si512());
+    trivRej_pass_mask &= _mm512_cmplt_epi32_mask(trivRej_pass[1], _mm512_setzero_si512());
+    trivRej_pass_mask &= _mm512_cmplt_epi32_mask(trivRej_pass[2], _mm512_setzero_si512());
+
+    tilecmd_drawsmalltri_t finecmd = *drawcmd;
+    for (int32_t i = 0; i < 16; i++)
+    {
+        if (trivRej_pass_mask & (1 << i))
         {
-            // the point of making them relative is to lower the required precision to 4 hex digits
-            assert((verts[v].x - last_tile_px_x) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].x - last_tile_px_x) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
-            assert((verts[v].y - last_tile_px_y) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].y - last_tile_px_y) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
+            finecmd.edges[0] = fineblock_edges[0][i];
+            finecmd.edges[1] = fineblock_edges[1][i];
+            finecmd.edges[2] = fineblock_edges[2][i];
 
-            verts[v].x -= last_tile_px_x;
-            verts[v].y -= last_tile_px_y;
+            tile_stats->pixels_passed += draw_fine_block_smalltri_avx512(fb, coarse_dst_i + i * PIXELS_PER_FINE_BLOCK, &finecmd);
+
+            tile_stats->fine_blocks++;
         }
+    }
+}
 
-        int32_t triarea2 = (verts[1].x - verts[0].x) * (verts[2].y - verts[0].y) - (verts[1].y - verts[0].y) * (verts[2].x - verts[0].x);
+template<int32_t TileWidth>
+TARGET_AVX512 static void draw_tile_smalltri_avx512(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
+{
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
 
-        // round away from zero to guarantee edge equations don't become greater than area
-        if (triarea2 < 0)
-            triarea2 -= 0x7F;
-        else if (triarea2 > 0)
-            triarea2 += 0x7F;
+    // 4x4 coarse blocks of the tile are trivially rejected all at once, one coarse block per lane.
+    // 32x32 tiles only have 2x2 coarse blocks, in the first 4 lanes.
+    const int32_t coarse_blocks_per_group = COARSE_BLOCKS_PER_TILE < 16 ? COARSE_BLOCKS_PER_TILE : 16;
+    const __mmask16 lanes_mask = (__mmask16)((1 << coarse_blocks_per_group) - 1);
 
-        if (triarea2 < 0 && triarea2 > -256)
-        {
-            // force to zero, since right shift of negative numbers never reach zero
-            triarea2 = 0;
-        }
+    const uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+    int32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
-        triarea2 = triarea2 >> 8;
-        
-        if (triarea2 == 0)
-        {
-            goto setup_end;
-        }
+    for (int32_t group_cb_i = 0; group_cb_i < COARSE_BLOCKS_PER_TILE; group_cb_i += coarse_blocks_per_group)
+    {
+        int32_t group_cb_x = (int32_t)morton_decode_x(group_cb_i);
+        int32_t group_cb_y = (int32_t)morton_decode_x(group_cb_i >> 1);
 
-        if (triarea2 < 0)
+        __m512i trivRej_pass[3];
+        __declspec(align(64)) int32_t coarseblock_edges[3][16];
+        for (int32_t v = 0; v < 3; v++)
         {
-            xyzw_i32_t tmp = verts[1];
-            verts[1] = verts[2];
-            verts[2] = tmp;
-            triarea2 = -triarea2;
+            int32_t dx = drawcmd->edge_dxs[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
+            int32_t dy = drawcmd->edge_dys[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
 
-            // backface culling
-            goto setup_end;
-        }
+            __m512i edges = edge_grid_avx512(drawcmd->edges[v] + dx * group_cb_x + dy * group_cb_y, dx, dy);
+            _mm512_store_si512(&coarseblock_edges[v][0], edges);
 
-        // compute 1/(2triarea) and convert to a pseudo 8.16 floating point value
-        int32_t triarea2_lzcnt = lzcnt(triarea2);
-        int32_t triarea2_mantissa_rshift = (31 - 16) - triarea2_lzcnt;
-        int32_t triarea2_mantissa;
-        if (triarea2_mantissa_rshift < 0)
-            triarea2_mantissa = triarea2 << -triarea2_mantissa_rshift;
-        else
-            triarea2_mantissa = triarea2 >> triarea2_mantissa_rshift;
-        assert(triarea2_mantissa & 0x10000);
-        
-        // perform the reciprocal
-        // note: triarea2_mantissa is currently normalized as 1.16, and so is the numerator of the division (before being adjusted for rounding)
-        int32_t rcp_triarea2_mantissa = 0xFFFFFFFF / triarea2_mantissa;
-        assert(rcp_triarea2_mantissa != 0);
-        
-        // ensure the mantissa is denormalized so it fits in 16 bits
-        int32_t rcp_triarea2_mantissa_rshift = (31 - 15) - lzcnt(rcp_triarea2_mantissa);
-        if (rcp_triarea2_mantissa_rshift < 0)
-            rcp_triarea2_mantissa = rcp_triarea2_mantissa << -rcp_triarea2_mantissa_rshift;
-        else
-            rcp_triarea2_mantissa = rcp_triarea2_mantissa >> rcp_triarea2_mantissa_rshift;
-        assert(!(rcp_triarea2_mantissa & 0xFFFF0000));
-        assert(rcp_triarea2_mantissa & 0x8000);
+            trivRej_pass[v] = _mm512_add_epi32(edges, _mm512_set1_epi32((dx < 0 ? dx : 0) + (dy < 0 ? dy : 0)));
+        }
 
-        assert(rcp_triarea2_mantissa < 0x10000);
-        rcp_triarea2_mantissa = rcp_triarea2_mantissa & 0xFFFF;
-        rcp_triarea2_mantissa_rshift = (triarea2_mantissa_rshift + 1) - rcp_triarea2_mantissa_rshift;
+        // trivial reject if at least one edge doesn't cover the coarse block at all
+        __mmask16 trivRej_pass_mask = _mm512_mask_cmplt_epi32_mask(lanes_mask, trivRej_pass[0], _mm512_setzero_si512());
+        trivRej_pass_mask &= _mm512_cmplt_epi32_mask(trivRej_pass[1], _mm512_setzero_si512());
+        trivRej_pass_mask &= _mm512_cmplt_epi32_mask(trivRej_pass[2], _mm512_setzero_si512());
 
-        drawsmalltricmd.shifted_triarea2 = triarea2_mantissa >> 1;
-        drawsmalltricmd.rcp_triarea2_mantissa = rcp_triarea2_mantissa;
-        drawsmalltricmd.rcp_triarea2_rshift = rcp_triarea2_mantissa_rshift;
+        // reject coarse blocks where everything is already in front of the triangle
+        trivRej_pass_mask &= _mm512_cmpgt_epu32_mask(_mm512_maskz_loadu_epi32(lanes_mask, &coarse_max_depths[group_cb_i]), _mm512_set1_epi32(drawcmd->min_Z << 16));
 
-        // compute edge equations with reduced precision thanks to being localized to the tiles
+        framebuffer_materialize_clears(fb, tile_id, (uint64_t)trivRej_pass_mask << group_cb_i, 0);
 
-        int32_t edges[3];
-        int32_t edge_dxs[3], edge_dys[3];
-        for (int32_t v = 0; v < 3; v++)
+        tilecmd_drawsmalltri_t coarsecmd = *drawcmd;
+        for (int32_t i = 0; i < coarse_blocks_per_group; i++)
         {
-            int32_t v1 = (v + 1) % 3;
-            int32_t v2 = (v + 2) % 3;
+            if (trivRej_pass_mask & (1 << i))
+            {
+                coarsecmd.edges[0] = coarseblock_edges[0][i];
+                coarsecmd.edges[1] = coarseblock_edges[1][i];
+                coarsecmd.edges[2] = coarseblock_edges[2][i];
 
-            // find how the edge equation varies along x and y
-            edge_dxs[v] = verts[v1].y - verts[v].y;
-            edge_dys[v] = verts[v].x - verts[v1].x;
+                draw_coarse_block_smalltri_avx512(fb, tile_dst_i + (group_cb_i + i) * PIXELS_PER_COARSE_BLOCK, &coarsecmd, tile_stats);
+            }
+        }
+    }
+}
 
-            // compute edge equation
-            // |  x  y  z |
-            // | ax ay  0 |
-            // | bx by  0 |
-            // = ax*by - ay*bx
-            // eg: a = (px-v0), b = (v1-v0)
-            // note: evaluated at px = (0.5,0.5) because the vertices are relative to the last tile
-            const int32_t s168_zero_pt_five = 0x80;
-            edges[v] = ((s168_zero_pt_five - verts[v].x) * edge_dxs[v]) - ((s168_zero_pt_five - verts[v].y) * -edge_dys[v]);
+template<uint32_t TestEdgeMask>
+TARGET_AVX512 static uint32_t draw_fine_block_largetri_avx512(framebuffer_t* fb, int32_t fine_dst_i, const tilecmd_drawtile_t* pDrawcmd)
+{
+    // the whole 4x4 fine block is rasterized at once, one pixel per lane.
 
-            // round to negative infinity
-            if (edges[v] < 0)
-                edges[v] = edges[v] - 0xFF;
+    tilecmd_drawtile_t drawcmd = *pDrawcmd;
 
-            edges[v] = edges[v] >> 8;
+    __m512i edges[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        edges[v] = edge_grid_avx512(drawcmd.edges[v], drawcmd.edge_dxs[v], drawcmd.edge_dys[v]);
+    }
 
-            // Top-left rule: shift top-left edges ever so slightly outward to make the top-left edges be the tie-breakers when rasterizing adjacent triangles
-            if ((verts[v].y == verts[v1].y && verts[v].x < verts[v1].x) || verts[v].y > verts[v1].y) edges[v]--;
+    // compute all pixels passing the edge equation.
+    // edges that are trivially accepted for the whole coarse block don't need to be tested.
+    __mmask16 coverage_mask = 0xFFFF;
+    for (int32_t v = 0; v < 3; v++)
+    {
+        if (TestEdgeMask & (1 << v))
+        {
+            coverage_mask &= _mm512_cmplt_epi32_mask(edges[v], _mm512_setzero_si512());
         }
+    }
 
-        drawsmalltricmd.min_Z = min_Z;
-        drawsmalltricmd.max_Z = max_Z;
+    // early-out if no pixels pass the test
+    if (!coverage_mask)
+        return 0;
 
-        for (int32_t v = 0; v < 3; v++)
+    // shift edge equations to be on the same scale as the triangle area
+    // note: off by one because -1 maps to 0
+    int32_t rcp_triarea2_rshift = drawcmd.rcp_triarea2_rshift;
+    __m512i shifted_e2 = _mm512_sub_epi32(_mm512_sub_epi32(_mm512_setzero_si512(), edges[2]), _mm512_set1_epi32(1));
+    __m512i shifted_e0 = _mm512_sub_epi32(_mm512_sub_epi32(_mm512_setzero_si512(), edges[0]), _mm512_set1_epi32(1));
+    if (rcp_triarea2_rshift < 0)
+    {
+        __m128i lshift = _mm_cvtsi32_si128(-rcp_triarea2_rshift);
+        shifted_e2 = _mm512_sll_epi32(shifted_e2, lshift);
+        shifted_e0 = _mm512_sll_epi32(shifted_e0, lshift);
+    }
+    else
+    {
+        // note: arithmetic shift, since the tile relative edge equations can be negative before adding the offset back
+        __m128i rshift = _mm_cvtsi32_si128(rcp_triarea2_rshift);
+        shifted_e2 = _mm512_sra_epi32(shifted_e2, rshift);
+        shifted_e0 = _mm512_sra_epi32(shifted_e0, rshift);
+    }
+
+    shifted_e2 = _mm512_add_epi32(shifted_e2, _mm512_set1_epi32(drawcmd.shifted_es[2]));
+    shifted_e0 = _mm512_add_epi32(shifted_e0, _mm512_set1_epi32(drawcmd.shifted_es[0]));
+
+    // clamp to triangle area (unsigned, so negative values also clamp to the area)
+    __m512i shifted_triarea2 = _mm512_set1_epi32(drawcmd.shifted_triarea2);
+    shifted_e0 = _mm512_min_epu32(shifted_triarea2, shifted_e0);
+    shifted_e2 = _mm512_min_epu32(shifted_triarea2, shifted_e2);
+
+    // compute non-perspective-correct barycentrics for vertices 1 and 2
+    __m512i rcp_triarea2_mantissa = _mm512_set1_epi32(drawcmd.rcp_triarea2_mantissa);
+    __m512i u = _mm512_srli_epi32(_mm512_mullo_epi32(shifted_e2, rcp_triarea2_mantissa), 15);
+    __m512i v = _mm512_srli_epi32(_mm512_mullo_epi32(shifted_e0, rcp_triarea2_mantissa), 15);
+
+    // ensure barycentrics sum to 1
+    __m512i one_minus_u = _mm512_sub_epi32(_mm512_set1_epi32(0xFFFF), u);
+    v = _mm512_min_epi32(v, one_minus_u);
+
+    // not related to vertex w. Just third barycentric. Bad naming.
+    __m512i w = _mm512_sub_epi32(_mm512_set1_epi32(0xFFFF), _mm512_add_epi32(u, v));
+
+    // compute interpolated depth
+    __m512i src_depth = _mm512_set1_epi32(drawcmd.vert_Zs[0] << 16);
+    src_depth = _mm512_add_epi32(src_depth, _mm512_mullo_epi32(u, _mm512_set1_epi32(drawcmd.vert_Zs[1] - drawcmd.vert_Zs[0])));
+    src_depth = _mm512_add_epi32(src_depth, _mm512_mullo_epi32(v, _mm512_set1_epi32(drawcmd.vert_Zs[2] - drawcmd.vert_Zs[0])));
+
+    __m512i dst_depth = _mm512_load_si512(&fb->depthbuffer[fine_dst_i]);
+
+    // combine coverage and depth masks
+    __mmask16 depth_pass_mask = _mm512_mask_cmplt_epu32_mask(coverage_mask, src_depth, dst_depth);
+
+    // early out if all depth tests fail
+    if (!depth_pass_mask)
+        return 0;
+
+    // blend depth into depthbuffer
+    _mm512_mask_store_epi32(&fb->depthbuffer[fine_dst_i], depth_pass_mask, src_depth);
+    uint32_t num_pixels_passed = popcnt(depth_pass_mask);
+
+    if (fb->depth_only)
+        return num_pixels_passed;
+
+    if (fb->visibility_buffer)
+    {
+        // write which triangle is visible, for framebuffer_shade
+        _mm512_mask_store_epi32(&fb->backbuffer[fine_dst_i], depth_pass_mask, _mm512_set1_epi32(drawcmd.triangle_id));
+        return num_pixels_passed;
+    }
+
+    // set color based on barycentrics.
+    __m512i src_color = _mm512_set1_epi32(0xFF << 24);
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(w), 16));
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(u), 8));
+    src_color = _mm512_or_si512(src_color, _mm512_slli_epi32(unorm16_to_unorm8_avx512(v), 0));
+
+    // write color into backbuffer
+    _mm512_mask_store_epi32(&fb->backbuffer[fine_dst_i], depth_pass_mask, src_color);
+
+    return num_pixels_passed;
+}
+
+template<uint32_t TestEdgeMask>
+TARGET_AVX512 static void draw_coarse_block_largetri_avx512(framebuffer_t* fb, int32_t coarse_dst_i, const tilecmd_drawtile_t* drawcmd, framebuffer_tile_stats_t* tile_stats)
+{
+    // the 4x4 fine blocks of the coarse block are trivially rejected all at once, one fine block per lane.
+
+    __declspec(align(64)) int32_t fineblock_edges[3][16];
+    __mmask16 trivRej_pass_mask = 0xFFFF;
+    for (int32_t v = 0; v < 3; v++)
+    {
+        int32_t dx = drawcmd->edge_dxs[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t dy = drawcmd->edge_dys[v] * FINE_BLOCK_WIDTH_IN_PIXELS;
+
+        __m512i edges = edge_grid_avx512(drawcmd->edges[v], dx, dy);
+        _mm512_store_si512(&fineblock_edges[v][0], edges);
+
+        // trivial reject if at least one edge doesn't cover the fine block at all
+        if (TestEdgeMask & (1 << v))
         {
-            drawsmalltricmd.edge_dxs[v] = edge_dxs[v];
-            drawsmalltricmd.edge_dys[v] = edge_dys[v];
-            drawsmalltricmd.vert_Zs[v] = verts[v].z;
+            __m512i edge_trivRejs = _mm512_add_epi32(edges, _mm512_set1_epi32((dx < 0 ? dx : 0) + (dy < 0 ? dy : 0)));
+            trivRej_pass_mask &= _mm512_cmplt_epi32_mask(edge_trivRejs, _mm512_setzero_si512());
         }
+    }
 
-        // draw top left tile
-        int32_t first_tile_id = first_tile_y * fb->width_in_tiles + first_tile_x;
-        if (first_tile_x >= 0 && first_tile_y >= 0)
+    tilecmd_drawtile_t finecmd = *drawcmd;
+    for (int32_t i = 0; i < 16; i++)
+    {
+        if (trivRej_pass_mask & (1 << i))
         {
-            for (int32_t v = 0; v < 3; v++)
-            {
-                drawsmalltricmd.edges[v] = edges[v] + (
-                    edge_dxs[v] * (first_tile_x - last_tile_x) +
-                    edge_dys[v] * (first_tile_y - last_tile_y)) * TILE_WIDTH_IN_PIXELS;
-            }
-
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.smalltri_setup += qpc() - setup_start_pc;
-#endif
+            finecmd.edges[0] = fineblock_edges[0][i];
+            finecmd.edges[1] = fineblock_edges[1][i];
+            finecmd.edges[2] = fineblock_edges[2][i];
 
-            framebuffer_push_tilecmd(fb, first_tile_id, &drawsmalltricmd.tilecmd_id, sizeof(drawsmalltricmd) / sizeof(uint32_t));
+            tile_stats->pixels_passed += draw_fine_block_largetri_avx512<TestEdgeMask>(fb, coarse_dst_i + i * PIXELS_PER_FINE_BLOCK, &finecmd);
 
-#ifdef ENABLE_PERFCOUNTERS
-            setup_start_pc = qpc();
-#endif
+            tile_stats->fine_blocks++;
         }
+    }
+}
 
-        // draw top right tile
-        if (last_tile_x > first_tile_x &&
-            last_tile_x < fb->width_in_tiles && first_tile_y >= 0)
-        {
-            for (int32_t v = 0; v < 3; v++)
-            {
-                drawsmalltricmd.edges[v] = edges[v] + edge_dys[v] * (first_tile_y - last_tile_y) * TILE_WIDTH_IN_PIXELS;
-            }
+template<int32_t TileWidth, uint32_t TestEdgeMask>
+TARGET_AVX512 static void draw_tile_largetri_avx512(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawtile_t* drawcmd)
+{
+    framebuffer_tile_stats_t* tile_stats = &fb->tile_counters[tile_id].stats;
 
-            int32_t tile_id_right = first_tile_id + 1;
+    // 4x4 coarse blocks of the tile are trivially rejected and accepted all at once, one coarse block per lane.
+    // 32x32 tiles only have 2x2 coarse blocks, in the first 4 lanes.
+    const int32_t coarse_blocks_per_group = COARSE_BLOCKS_PER_TILE < 16 ? COARSE_BLOCKS_PER_TILE : 16;
+    const __mmask16 lanes_mask = (__mmask16)((1 << coarse_blocks_per_group) - 1);
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.smalltri_setup += qpc() - setup_start_pc;
-#endif
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+    int32_t tile_dst_i = tile_id * PIXELS_PER_TILE;
 
-            framebuffer_push_tilecmd(fb, tile_id_right, &drawsmalltricmd.tilecmd_id, sizeof(drawsmalltricmd) / sizeof(uint32_t));
+    // every pixel of the triangle is at most this far
+    uint32_t tri_max_depth = drawcmd->max_Z << 16;
 
-#ifdef ENABLE_PERFCOUNTERS
-            setup_start_pc = qpc();
-#endif
-        }
+    for (int32_t group_cb_i = 0; group_cb_i < COARSE_BLOCKS_PER_TILE; group_cb_i += coarse_blocks_per_group)
+    {
+        int32_t group_cb_x = (int32_t)morton_decode_x(group_cb_i);
+        int32_t group_cb_y = (int32_t)morton_decode_x(group_cb_i >> 1);
 
-        // draw bottom left tile
-        if (last_tile_y > first_tile_y &&
-            first_tile_x >= 0 && last_tile_y < fb->height_in_tiles)
+        __declspec(align(64)) int32_t coarseblock_edges[3][16];
+        __mmask16 trivRej_pass_mask = lanes_mask;
+        __mmask16 trivAcc_pass_masks[3];
+        for (int32_t v = 0; v < 3; v++)
         {
-            for (int32_t v = 0; v < 3; v++)
-            {
-                drawsmalltricmd.edges[v] = edges[v] + edge_dxs[v] * (first_tile_x - last_tile_x) * TILE_WIDTH_IN_PIXELS;
-            }
-
-            int32_t tile_id_down = first_tile_id + fb->width_in_tiles;
+            int32_t dx = drawcmd->edge_dxs[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
+            int32_t dy = drawcmd->edge_dys[v] * COARSE_BLOCK_WIDTH_IN_PIXELS;
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.smalltri_setup += qpc() - setup_start_pc;
-#endif
+            __m512i edges = edge_grid_avx512(drawcmd->edges[v] + dx * group_cb_x + dy * group_cb_y, dx, dy);
+            _mm512_store_si512(&coarseblock_edges[v][0], edges);
 
-            framebuffer_push_tilecmd(fb, tile_id_down, &drawsmalltricmd.tilecmd_id, sizeof(drawsmalltricmd) / sizeof(uint32_t));
+            if (TestEdgeMask & (1 << v))
+            {
+                // trivial reject if at least one edge doesn't cover the coarse block at all
+                __m512i edge_trivRejs = _mm512_add_epi32(edges, _mm512_set1_epi32((dx < 0 ? dx : 0) + (dy < 0 ? dy : 0)));
+                trivRej_pass_mask &= _mm512_cmplt_epi32_mask(edge_trivRejs, _mm512_setzero_si512());
 
-#ifdef ENABLE_PERFCOUNTERS
-            setup_start_pc = qpc();
-#endif
+                // edges that cover a whole coarse block don't need to be tested inside of it
+                __m512i edge_trivAccs = _mm512_add_epi32(edges, _mm512_set1_epi32((dx > 0 ? dx : 0) + (dy > 0 ? dy : 0)));
+                trivAcc_pass_masks[v] = _mm512_cmplt_epi32_mask(edge_trivAccs, _mm512_setzero_si512());
+            }
         }
 
-        // draw bottom right tile
-        if (last_tile_x > first_tile_x && last_tile_y > first_tile_y &&
-            last_tile_x < fb->width_in_tiles && last_tile_y < fb->height_in_tiles)
+        // reject coarse blocks where everything is already in front of the triangle
+        trivRej_pass_mask &= _mm512_cmpgt_epu32_mask(_mm512_maskz_loadu_epi32(lanes_mask, &coarse_max_depths[group_cb_i]), _mm512_set1_epi32(drawcmd->min_Z << 16));
+
+        // coarse blocks that pass the accept test of every edge are entirely covered
+        __mmask16 cover_mask = trivRej_pass_mask;
+        for (int32_t v = 0; v < 3; v++)
         {
-            for (int32_t v = 0; v < 3; v++)
+            if (TestEdgeMask & (1 << v))
             {
-                drawsmalltricmd.edges[v] = edges[v];
+                cover_mask &= trivAcc_pass_masks[v];
             }
+        }
 
-            int32_t tile_id_downright = first_tile_id + 1 + fb->width_in_tiles;
+        framebuffer_materialize_clears(fb, tile_id, (uint64_t)trivRej_pass_mask << group_cb_i, (uint64_t)cover_mask << group_cb_i);
 
-#ifdef ENABLE_PERFCOUNTERS
-            fb->perfcounters.smalltri_setup += qpc() - setup_start_pc;
-#endif
+        tilecmd_drawtile_t coarsecmd = *drawcmd;
+        for (int32_t i = 0; i < coarse_blocks_per_group; i++)
+        {
+            if (trivRej_pass_mask & (1 << i))
+            {
+                uint32_t newTestEdgeMask = TestEdgeMask;
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    if (TestEdgeMask & (1 << v))
+                    {
+                        if (trivAcc_pass_masks[v] & (1 << i))
+                        {
+                            newTestEdgeMask &= ~(1 << v);
+                        }
+                    }
+                }
 
-            framebuffer_push_tilecmd(fb, tile_id_downright, &drawsmalltricmd.tilecmd_id, sizeof(drawsmalltricmd) / sizeof(uint32_t));
+                coarsecmd.edges[0] = coarseblock_edges[0][i];
+                coarsecmd.edges[1] = coarseblock_edges[1][i];
+                coarsecmd.edges[2] = coarseblock_edges[2][i];
 
-#ifdef ENABLE_PERFCOUNTERS
-            setup_start_pc = qpc();
-#endif
+                int32_t cb_i = group_cb_i + i;
+                int32_t dst_i = tile_dst_i + cb_i * PIXELS_PER_COARSE_BLOCK;
+
+                switch (newTestEdgeMask)
+                {
+                case 0:
+                    draw_coarse_block_largetri_avx512<0>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 1:
+                    draw_coarse_block_largetri_avx512<1>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 2:
+                    draw_coarse_block_largetri_avx512<2>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 3:
+                    draw_coarse_block_largetri_avx512<3>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 4:
+                    draw_coarse_block_largetri_avx512<4>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 5:
+                    draw_coarse_block_largetri_avx512<5>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 6:
+                    draw_coarse_block_largetri_avx512<6>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                case 7:
+                    draw_coarse_block_largetri_avx512<7>(fb, dst_i, &coarsecmd, tile_stats);
+                    break;
+                }
+
+                // the triangle covers the whole coarse block, so nothing in it can be further than the triangle anymore
+                if (newTestEdgeMask == 0 && tri_max_depth < coarse_max_depths[cb_i])
+                {
+                    coarse_max_depths[cb_i] = tri_max_depth;
+                }
+            }
         }
     }
-    else // large triangle
+}
+#endif
+
+// multisampled framebuffers clear every sample's depth, and the color of the pixels of compressed fine blocks
+template<int32_t SamplesPerPixel>
+static void clear_coarse_block_scalar(framebuffer_t* fb, int32_t coarse_dst_i, uint32_t color, bool clear_color)
+{
+    int32_t coarse_end_i = coarse_dst_i + PIXELS_PER_COARSE_BLOCK;
+    for (int32_t sample = coarse_dst_i * SamplesPerPixel; sample < coarse_end_i * SamplesPerPixel; sample++)
     {
-        // for large triangles, test each tile in their bbox for overlap
-        // done using scalar code for simplicity, since rasterization dominates large triangle performance anyways.
-        int32_t first_tile_x = (clamped_bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_y = (clamped_bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_x = (clamped_bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
-        int32_t last_tile_y = (clamped_bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        fb->depthbuffer[sample] = 0xFFFFFFFF;
+    }
 
-        // evaluate edge equation at the top left tile
-        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
-        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+    if (fb->depth_only)
+        return;
 
-        // 64 bit integers are used for the edge equations here because multiplying two 16.8 numbers requires up to 48 bits
-        // this results in some extra overhead, but it's not a big deal when you consider that this happens only for large triangles.
-        // The tens of thousands of pixels that large triangles generate outweigh the cost of slightly more expensive setup.
+    if (SamplesPerPixel > 1)
+    {
+        memset(&fb->compressed_fine_blocks[coarse_dst_i / PIXELS_PER_FINE_BLOCK], 1, PIXELS_PER_COARSE_BLOCK / PIXELS_PER_FINE_BLOCK);
+    }
 
-        int64_t triarea2 = ((int64_t)verts[1].x - verts[0].x) * ((int64_t)verts[2].y - verts[0].y) - ((int64_t)verts[1].y - verts[0].y) * ((int64_t)verts[2].x - verts[0].x);
+    if (!clear_color)
+        return;
 
-        // round away from zero to guarantee edge equations don't become greater than area
-        if (triarea2 < 0)
-            triarea2 -= 0x7F;
-        else if (triarea2 > 0)
-            triarea2 += 0x7F;
+    for (int32_t px = coarse_dst_i; px < coarse_end_i; px++)
+    {
+        fb->backbuffer[px] = color;
+    }
+}
 
-        if (triarea2 < 0 && triarea2 > -256)
+template<int32_t SamplesPerPixel>
+TARGET_AVX2 static void clear_coarse_block_avx2(framebuffer_t* fb, int32_t coarse_dst_i, uint32_t color, bool clear_color)
+{
+    int32_t coarse_end_i = coarse_dst_i + PIXELS_PER_COARSE_BLOCK;
+    __m256i depth = _mm256_set1_epi32(-1);
+    for (int32_t sample = coarse_dst_i * SamplesPerPixel; sample < coarse_end_i * SamplesPerPixel; sample += 8)
+    {
+        _mm256_store_si256((__m256i*)&fb->depthbuffer[sample], depth);
+    }
+
+    if (fb->depth_only)
+        return;
+
+    if (SamplesPerPixel > 1)
+    {
+        memset(&fb->compressed_fine_blocks[coarse_dst_i / PIXELS_PER_FINE_BLOCK], 1, PIXELS_PER_COARSE_BLOCK / PIXELS_PER_FINE_BLOCK);
+    }
+
+    if (!clear_color)
+        return;
+
+    __m256i colors = _mm256_set1_epi32(color);
+    for (int32_t px = coarse_dst_i; px < coarse_end_i; px += 8)
+    {
+        _mm256_store_si256((__m256i*)&fb->backbuffer[px], colors);
+    }
+}
+
+#ifdef ENABLE_AVX512
+TARGET_AVX512 static void clear_coarse_block_avx512(framebuffer_t* fb, int32_t coarse_dst_i, uint32_t color, bool clear_color)
+{
+    int32_t coarse_end_i = coarse_dst_i + PIXELS_PER_COARSE_BLOCK;
+    __m512i depth = _mm512_set1_epi32(-1);
+    for (int32_t px = coarse_dst_i; px < coarse_end_i; px += 16)
+    {
+        _mm512_store_si512(&fb->depthbuffer[px], depth);
+    }
+
+    if (fb->depth_only || !clear_color)
+        return;
+
+    __m512i colors = _mm512_set1_epi32(color);
+    for (int32_t px = coarse_dst_i; px < coarse_end_i; px += 16)
+    {
+        _mm512_store_si512(&fb->backbuffer[px], colors);
+    }
+}
+#endif
+
+// multisampled framebuffers bound the depth of every sample
+template<int32_t TileWidth, int32_t SamplesPerPixel>
+static void update_coarse_max_depths_scalar(framebuffer_t* fb, int32_t tile_id)
+{
+    const uint32_t* depths = &fb->depthbuffer[tile_id * PIXELS_PER_TILE * SamplesPerPixel];
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+    uint64_t pending_clears = fb->tile_pending_clears[tile_id];
+    for (int32_t cb_i = 0; cb_i < COARSE_BLOCKS_PER_TILE; cb_i++)
+    {
+        // the depth buffer of a coarse block still waiting for its clear is stale
+        if (pending_clears & (1ULL << cb_i))
         {
-            // force to zero, since right shift of negative numbers never reach zero
-            triarea2 = 0;
+            coarse_max_depths[cb_i] = 0xFFFFFFFF;
+            depths += PIXELS_PER_COARSE_BLOCK * SamplesPerPixel;
+            continue;
         }
 
-        triarea2 = triarea2 >> 8;
-        
-        if (triarea2 == 0)
+        uint32_t max_depth = 0;
+        for (int32_t sample = 0; sample < PIXELS_PER_COARSE_BLOCK * SamplesPerPixel; sample++)
         {
-            goto setup_end;
+            if (depths[sample] > max_depth)
+                max_depth = depths[sample];
         }
+        coarse_max_depths[cb_i] = max_depth;
+        depths += PIXELS_PER_COARSE_BLOCK * SamplesPerPixel;
+    }
+}
 
-        if (triarea2 < 0)
+template<int32_t TileWidth, int32_t SamplesPerPixel>
+TARGET_AVX2 static void update_coarse_max_depths_avx2(framebuffer_t* fb, int32_t tile_id)
+{
+    const uint32_t* depths = &fb->depthbuffer[tile_id * PIXELS_PER_TILE * SamplesPerPixel];
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+    uint64_t pending_clears = fb->tile_pending_clears[tile_id];
+    for (int32_t cb_i = 0; cb_i < COARSE_BLOCKS_PER_TILE; cb_i++)
+    {
+        // the depth buffer of a coarse block still waiting for its clear is stale
+        if (pending_clears & (1ULL << cb_i))
         {
-            xyzw_i32_t tmp = verts[1];
-            verts[1] = verts[2];
-            verts[2] = tmp;
-            triarea2 = -triarea2;
-            
-            // backface culling
-            goto setup_end;
+            coarse_max_depths[cb_i] = 0xFFFFFFFF;
+            depths += PIXELS_PER_COARSE_BLOCK * SamplesPerPixel;
+            continue;
         }
 
-        // compute 1/(2triarea) and convert to a pseudo 8.16 floating point value
-        int32_t triarea2_lzcnt = (int32_t)lzcnt64(triarea2);
-        int32_t triarea2_mantissa_rshift = (63 - 16) - triarea2_lzcnt;
-        int32_t triarea2_mantissa;
-        if (triarea2_mantissa_rshift < 0)
-            triarea2_mantissa = (int32_t)(triarea2 << -triarea2_mantissa_rshift);
-        else
-            triarea2_mantissa = (int32_t)(triarea2 >> triarea2_mantissa_rshift);
-        assert(triarea2_mantissa & 0x10000);
+        __m256i max_depth = _mm256_setzero_si256();
+        for (int32_t sample = 0; sample < PIXELS_PER_COARSE_BLOCK * SamplesPerPixel; sample += 8)
+        {
+            max_depth = _mm256_max_epu32(max_depth, _mm256_load_si256((const __m256i*)&depths[sample]));
+        }
 
-        // perform the reciprocal
-        // note: triarea2_mantissa is currently normalized as 1.16, and so is the numerator of the division (before being adjusted for rounding)
-        int32_t rcp_triarea2_mantissa = 0xFFFFFFFF / triarea2_mantissa;
-        assert(rcp_triarea2_mantissa != 0);
+        // reduce the 8 lanes down to one
+        max_depth = _mm256_max_epu32(max_depth, _mm256_permute2x128_si256(max_depth, max_depth, 1));
+        max_depth = _mm256_max_epu32(max_depth, _mm256_shuffle_epi32(max_depth, _MM_SHUFFLE(1, 0, 3, 2)));
+        max_depth = _mm256_max_epu32(max_depth, _mm256_shuffle_epi32(max_depth, _MM_SHUFFLE(2, 3, 0, 1)));
+        coarse_max_depths[cb_i] = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(max_depth));
 
-        // ensure the mantissa is denormalized so it fits in 16 bits
-        int32_t rcp_triarea2_mantissa_rshift = (31 - 15) - lzcnt(rcp_triarea2_mantissa);
-        if (rcp_triarea2_mantissa_rshift < 0)
-            rcp_triarea2_mantissa = rcp_triarea2_mantissa << -rcp_triarea2_mantissa_rshift;
-        else
-            rcp_triarea2_mantissa = rcp_triarea2_mantissa >> rcp_triarea2_mantissa_rshift;
-        assert(!(rcp_triarea2_mantissa & 0x10000));
-        assert(rcp_triarea2_mantissa & 0x8000);
+        depths += PIXELS_PER_COARSE_BLOCK * SamplesPerPixel;
+    }
+}
 
-        assert(rcp_triarea2_mantissa < 0x10000);
-        rcp_triarea2_mantissa = rcp_triarea2_mantissa & 0xFFFF;
-        rcp_triarea2_mantissa_rshift = (triarea2_mantissa_rshift + 1) - rcp_triarea2_mantissa_rshift;
+#ifdef ENABLE_AVX512
+template<int32_t TileWidth>
+TARGET_AVX512 static void update_coarse_max_depths_avx512(framebuffer_t* fb, int32_t tile_id)
+{
+    const uint32_t* depths = &fb->depthbuffer[tile_id * PIXELS_PER_TILE];
+    uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * COARSE_BLOCKS_PER_TILE];
+    uint64_t pending_clears = fb->tile_pending_clears[tile_id];
+    for (int32_t cb_i = 0; cb_i < COARSE_BLOCKS_PER_TILE; cb_i++)
+    {
+        // the depth buffer of a coarse block still waiting for its clear is stale
+        if (pending_clears & (1ULL << cb_i))
+        {
+            coarse_max_depths[cb_i] = 0xFFFFFFFF;
+            depths += PIXELS_PER_COARSE_BLOCK;
+            continue;
+        }
 
-        int64_t edges[3];
-        int64_t edge_dxs[3], edge_dys[3];
-        for (int32_t v = 0; v < 3; v++)
+        __m512i max_depth = _mm512_setzero_si512();
+        for (int32_t px = 0; px < PIXELS_PER_COARSE_BLOCK; px += 16)
         {
-            int32_t v1 = (v + 1) % 3;
-            int32_t v2 = (v + 2) % 3;
+            max_depth = _mm512_max_epu32(max_depth, _mm512_load_si512(&depths[px]));
+        }
 
-            // find how the edge equation varies along x and y
-            edge_dxs[v] = verts[v1].y - verts[v].y;
-            edge_dys[v] = verts[v].x - verts[v1].x;
+        // reduce the 16 lanes down to one
+        __m256i max_depth256 = _mm256_max_epu32(_mm512_castsi512_si256(max_depth), _mm512_extracti64x4_epi64(max_depth, 1));
+        max_depth256 = _mm256_max_epu32(max_depth256, _mm256_permute2x128_si256(max_depth256, max_depth256, 1));
+        max_depth256 = _mm256_max_epu32(max_depth256, _mm256_shuffle_epi32(max_depth256, _MM_SHUFFLE(1, 0, 3, 2)));
+        max_depth256 = _mm256_max_epu32(max_depth256, _mm256_shuffle_epi32(max_depth256, _MM_SHUFFLE(2, 3, 0, 1)));
+        coarse_max_depths[cb_i] = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(max_depth256));
 
-            // compute edge equation
-            // |  x  y  z |
-            // | ax ay  0 |
-            // | bx by  0 |
+        depths += PIXELS_PER_COARSE_BLOCK;
+    }
+}
+#endif
+
+// the framebuffer stores colors as b8g8r8a8, so r8g8b8a8 swaps red and blue.
+// the other formats match the layout of the framebuffer and are straight copies.
+template<int32_t TileWidth, bool SwapRB>
+static void pack_tile_row_scalar(const uint32_t* tile_src, uint32_t y_bits, int32_t x, int32_t num_pixels, uint32_t* dst)
+{
+    for (int32_t i = 0, x_bits = pdep_u32(x, TILE_X_SWIZZLE_MASK);
+        i < num_pixels;
+        i++, x_bits = (x_bits - TILE_X_SWIZZLE_MASK) & TILE_X_SWIZZLE_MASK)
+    {
+        uint32_t src = tile_src[y_bits | x_bits];
+        if (SwapRB)
+        {
+            src = (src & 0xFF00FF00) | ((src & 0x00FF0000) >> 16) | ((src & 0x000000FF) << 16);
+        }
+        dst[i] = src;
+    }
+}
+
+template<int32_t TileWidth, bool SwapRB>
+static void pack_tile_scalar(const uint32_t* tile_src, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch)
+{
+    for (int32_t y = y0, y_bits = pdep_u32(y0, TILE_Y_SWIZZLE_MASK);
+        y < y1;
+        y++, y_bits = (y_bits - TILE_Y_SWIZZLE_MASK) & TILE_Y_SWIZZLE_MASK)
+    {
+        pack_tile_row_scalar<TileWidth, SwapRB>(tile_src, y_bits, x0, x1 - x0, (uint32_t*)dst);
+        dst += dst_pitch;
+    }
+}
+
+// stores two side by side fine blocks as 4 rows of 8 pixels. they're 32 consecutive pixels, each fine block laid out as:
+//  0  1  4  5
+//  2  3  6  7
+//  8  9 12 13
+// 10 11 14 15
+// so every 8 pixels hold two rows of one fine block, with each pair of pixels going to alternating rows
+template<bool SwapRB>
+TARGET_AVX2 static __forceinline void pack_fine_block_pair_avx2(const __m256i src[4], uint8_t* dst, int32_t dst_pitch)
+{
+    const __m256i swap_rb = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    __m256i left_rows01 = _mm256_permute4x64_epi64(src[0], _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i left_rows23 = _mm256_permute4x64_epi64(src[1], _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i right_rows01 = _mm256_permute4x64_epi64(src[2], _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i right_rows23 = _mm256_permute4x64_epi64(src[3], _MM_SHUFFLE(3, 1, 2, 0));
+
+    __m256i rows[4];
+    rows[0] = _mm256_permute2x128_si256(left_rows01, right_rows01, 0x20);
+    rows[1] = _mm256_permute2x128_si256(left_rows01, right_rows01, 0x31);
+    rows[2] = _mm256_permute2x128_si256(left_rows23, right_rows23, 0x20);
+    rows[3] = _mm256_permute2x128_si256(left_rows23, right_rows23, 0x31);
+
+    for (int32_t i = 0; i < 4; i++)
+    {
+        if (SwapRB)
+        {
+            rows[i] = _mm256_shuffle_epi8(rows[i], swap_rb);
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i * dst_pitch), rows[i]);
+    }
+}
+
+template<int32_t TileWidth, bool SwapRB>
+TARGET_AVX2 static void pack_tile_avx2(const uint32_t* tile_src, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch)
+{
+    // the part of the rectangle made of whole pairs of side by side fine blocks is unswizzled with shuffles,
+    // and the rows and columns around it are done a pixel at a time
+    int32_t fast_x0 = (x0 + 7) & -8;
+    int32_t fast_x1 = x1 & -8;
+    int32_t fast_y0 = (y0 + 3) & -4;
+    int32_t fast_y1 = y1 & -4;
+    if (fast_x0 >= fast_x1 || fast_y0 >= fast_y1)
+    {
+        pack_tile_scalar<TileWidth, SwapRB>(tile_src, x0, y0, x1, y1, dst, dst_pitch);
+        return;
+    }
+
+    uint8_t* fast_dst = dst + (fast_y0 - y0) * dst_pitch;
+    pack_tile_scalar<TileWidth, SwapRB>(tile_src, x0, y0, x1, fast_y0, dst, dst_pitch);
+    pack_tile_scalar<TileWidth, SwapRB>(tile_src, x0, fast_y1, x1, y1, dst + (fast_y1 - y0) * dst_pitch, dst_pitch);
+    pack_tile_scalar<TileWidth, SwapRB>(tile_src, x0, fast_y0, fast_x0, fast_y1, fast_dst, dst_pitch);
+    pack_tile_scalar<TileWidth, SwapRB>(tile_src, fast_x1, fast_y0, x1, fast_y1, fast_dst + (fast_x1 - x0) * 4, dst_pitch);
+
+    fast_dst += (fast_x0 - x0) * 4;
+    for (int32_t y = fast_y0; y < fast_y1; y += FINE_BLOCK_WIDTH_IN_PIXELS)
+    {
+        uint32_t y_bits = pdep_u32(y, TILE_Y_SWIZZLE_MASK);
+        uint8_t* row_dst = fast_dst;
+
+        for (int32_t x = fast_x0; x < fast_x1; x += FINE_BLOCK_WIDTH_IN_PIXELS * 2)
+        {
+            const __m256i* src = (const __m256i*)&tile_src[y_bits | pdep_u32(x, TILE_X_SWIZZLE_MASK)];
+            __m256i fine_blocks[4];
+            for (int32_t i = 0; i < 4; i++)
+            {
+                fine_blocks[i] = _mm256_load_si256(&src[i]);
+            }
+            pack_fine_block_pair_avx2<SwapRB>(fine_blocks, row_dst, dst_pitch);
+
+            row_dst += FINE_BLOCK_WIDTH_IN_PIXELS * 2 * 4;
+        }
+
+        fast_dst += FINE_BLOCK_WIDTH_IN_PIXELS * dst_pitch;
+    }
+}
+
+// the resolved value of pixel px_i of a multisampled tile (see pack_tile_msaa_fn_t).
+// colors are averaged one channel at a time, rounding to nearest, two channels per 32 bits.
+template<bool Depth>
+static __forceinline uint32_t resolve_pixel_scalar(const uint32_t* tile_src, const uint32_t* tile_samples, const uint8_t* tile_compressed, uint32_t px_i)
+{
+    uint32_t fine_i = px_i / PIXELS_PER_FINE_BLOCK;
+    if (!Depth && tile_compressed[fine_i])
+    {
+        return tile_src[px_i];
+    }
+
+    const uint32_t* samples = &tile_samples[fine_i * PIXELS_PER_FINE_BLOCK * MSAA_SAMPLES_PER_PIXEL + px_i % PIXELS_PER_FINE_BLOCK];
+    if (Depth)
+    {
+        uint32_t max_depth = 0;
+        for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+        {
+            if (samples[sample_i * PIXELS_PER_FINE_BLOCK] > max_depth)
+                max_depth = samples[sample_i * PIXELS_PER_FINE_BLOCK];
+        }
+        return max_depth;
+    }
+
+    uint32_t rb = (MSAA_SAMPLES_PER_PIXEL / 2) * 0x00010001;
+    uint32_t ag = (MSAA_SAMPLES_PER_PIXEL / 2) * 0x00010001;
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        rb += samples[sample_i * PIXELS_PER_FINE_BLOCK] & 0x00FF00FF;
+        ag += (samples[sample_i * PIXELS_PER_FINE_BLOCK] >> 8) & 0x00FF00FF;
+    }
+    return ((rb >> 2) & 0x00FF00FF) | (((ag >> 2) & 0x00FF00FF) << 8);
+}
+
+template<int32_t TileWidth, bool SwapRB, bool Depth>
+static void pack_tile_msaa_scalar(const uint32_t* tile_src, const uint32_t* tile_samples, const uint8_t* tile_compressed, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch)
+{
+    for (int32_t y = y0, y_bits = pdep_u32(y0, TILE_Y_SWIZZLE_MASK);
+        y < y1;
+        y++, y_bits = (y_bits - TILE_Y_SWIZZLE_MASK) & TILE_Y_SWIZZLE_MASK)
+    {
+        uint32_t* row_dst = (uint32_t*)dst;
+        for (int32_t x = x0, x_bits = pdep_u32(x0, TILE_X_SWIZZLE_MASK);
+            x < x1;
+            x++, x_bits = (x_bits - TILE_X_SWIZZLE_MASK) & TILE_X_SWIZZLE_MASK)
+        {
+            uint32_t src = resolve_pixel_scalar<Depth>(tile_src, tile_samples, tile_compressed, y_bits | x_bits);
+            if (SwapRB)
+            {
+                src = (src & 0xFF00FF00) | ((src & 0x00FF0000) >> 16) | ((src & 0x000000FF) << 16);
+            }
+            row_dst[x - x0] = src;
+        }
+        dst += dst_pitch;
+    }
+}
+
+// resolves 8 consecutive pixels of a fine block, the same way as resolve_pixel_scalar
+template<bool Depth>
+TARGET_AVX2 static __forceinline __m256i resolve_samples_avx2(const uint32_t* samples)
+{
+    if (Depth)
+    {
+        __m256i max_depth = _mm256_load_si256((const __m256i*)&samples[0]);
+        for (int32_t sample_i = 1; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+        {
+            max_depth = _mm256_max_epu32(max_depth, _mm256_load_si256((const __m256i*)&samples[sample_i * PIXELS_PER_FINE_BLOCK]));
+        }
+        return max_depth;
+    }
+
+    const __m256i channels_mask = _mm256_set1_epi32(0x00FF00FF);
+    __m256i rb = _mm256_set1_epi32((MSAA_SAMPLES_PER_PIXEL / 2) * 0x00010001);
+    __m256i ag = rb;
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        __m256i sample = _mm256_load_si256((const __m256i*)&samples[sample_i * PIXELS_PER_FINE_BLOCK]);
+        rb = _mm256_add_epi32(rb, _mm256_and_si256(sample, channels_mask));
+        ag = _mm256_add_epi32(ag, _mm256_and_si256(_mm256_srli_epi32(sample, 8), channels_mask));
+    }
+    rb = _mm256_and_si256(_mm256_srli_epi32(rb, 2), channels_mask);
+    ag = _mm256_and_si256(_mm256_srli_epi32(ag, 2), channels_mask);
+    return _mm256_or_si256(rb, _mm256_slli_epi32(ag, 8));
+}
+
+// like pack_tile_avx2, resolving the samples of the fine blocks as they're loaded
+template<int32_t TileWidth, bool SwapRB, bool Depth>
+TARGET_AVX2 static void pack_tile_msaa_avx2(const uint32_t* tile_src, const uint32_t* tile_samples, const uint8_t* tile_compressed, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t* dst, int32_t dst_pitch)
+{
+    int32_t fast_x0 = (x0 + 7) & -8;
+    int32_t fast_x1 = x1 & -8;
+    int32_t fast_y0 = (y0 + 3) & -4;
+    int32_t fast_y1 = y1 & -4;
+    if (fast_x0 >= fast_x1 || fast_y0 >= fast_y1)
+    {
+        pack_tile_msaa_scalar<TileWidth, SwapRB, Depth>(tile_src, tile_samples, tile_compressed, x0, y0, x1, y1, dst, dst_pitch);
+        return;
+    }
+
+    uint8_t* fast_dst = dst + (fast_y0 - y0) * dst_pitch;
+    pack_tile_msaa_scalar<TileWidth, SwapRB, Depth>(tile_src, tile_samples, tile_compressed, x0, y0, x1, fast_y0, dst, dst_pitch);
+    pack_tile_msaa_scalar<TileWidth, SwapRB, Depth>(tile_src, tile_samples, tile_compressed, x0, fast_y1, x1, y1, dst + (fast_y1 - y0) * dst_pitch, dst_pitch);
+    pack_tile_msaa_scalar<TileWidth, SwapRB, Depth>(tile_src, tile_samples, tile_compressed, x0, fast_y0, fast_x0, fast_y1, fast_dst, dst_pitch);
+    pack_tile_msaa_scalar<TileWidth, SwapRB, Depth>(tile_src, tile_samples, tile_compressed, fast_x1, fast_y0, x1, fast_y1, fast_dst + (fast_x1 - x0) * 4, dst_pitch);
+
+    fast_dst += (fast_x0 - x0) * 4;
+    for (int32_t y = fast_y0; y < fast_y1; y += FINE_BLOCK_WIDTH_IN_PIXELS)
+    {
+        uint32_t y_bits = pdep_u32(y, TILE_Y_SWIZZLE_MASK);
+        uint8_t* row_dst = fast_dst;
+
+        for (int32_t x = fast_x0; x < fast_x1; x += FINE_BLOCK_WIDTH_IN_PIXELS * 2)
+        {
+            uint32_t px_i = y_bits | pdep_u32(x, TILE_X_SWIZZLE_MASK);
+            __m256i fine_blocks[4];
+            for (int32_t i = 0; i < 2; i++)
+            {
+                uint32_t fine_px_i = px_i + i * PIXELS_PER_FINE_BLOCK;
+                if (!Depth && tile_compressed[fine_px_i / PIXELS_PER_FINE_BLOCK])
+                {
+                    fine_blocks[i * 2 + 0] = _mm256_load_si256((const __m256i*)&tile_src[fine_px_i]);
+                    fine_blocks[i * 2 + 1] = _mm256_load_si256((const __m256i*)&tile_src[fine_px_i + 8]);
+                }
+                else
+                {
+                    const uint32_t* fine_samples = &tile_samples[fine_px_i * MSAA_SAMPLES_PER_PIXEL];
+                    fine_blocks[i * 2 + 0] = resolve_samples_avx2<Depth>(&fine_samples[0]);
+                    fine_blocks[i * 2 + 1] = resolve_samples_avx2<Depth>(&fine_samples[8]);
+                }
+            }
+            pack_fine_block_pair_avx2<SwapRB>(fine_blocks, row_dst, dst_pitch);
+
+            row_dst += FINE_BLOCK_WIDTH_IN_PIXELS * 2 * 4;
+        }
+
+        fast_dst += FINE_BLOCK_WIDTH_IN_PIXELS * dst_pitch;
+    }
+}
+
+// the lanes of framebuffer_pixels_t, relative to the top left of their 4x2 block of pixels
+static const int32_t kShadeLaneXs[8] = { 0, 1, 0, 1, 2, 3, 2, 3 };
+static const int32_t kShadeLaneYs[8] = { 0, 0, 1, 1, 0, 0, 1, 1 };
+
+// interpolates the varyings of the lanes in pixels->mask, out of the ids of the triangles visible in them
+typedef void(*interpolate_varyings_fn_t)(const framebuffer_t* fb, const uint32_t* ids, framebuffer_pixels_t* pixels);
+
+static void interpolate_varyings_scalar(const framebuffer_t* fb, const uint32_t* ids, framebuffer_pixels_t* pixels)
+{
+    for (uint32_t lanes = pixels->mask; lanes; lanes &= lanes - 1)
+    {
+        uint32_t lane = tzcnt(lanes);
+        const tile_binner_t* binner = &fb->binners[ids[lane] >> SHADE_TRIANGLE_INDEX_BITS];
+        const shade_triangle_t* tri = &binner->shade_triangles[ids[lane] & MAX_SHADE_TRIANGLES_PER_BINNER];
+
+        // at the center of the pixel
+        float x = (float)(pixels->x + kShadeLaneXs[lane] - tri->origin_x) + 0.5f;
+        float y = (float)(pixels->y + kShadeLaneYs[lane] - tri->origin_y) + 0.5f;
+
+        float b0 = tri->planes[0][0] * x + tri->planes[0][1] * y + tri->planes[0][2];
+        float b1 = tri->planes[1][0] * x + tri->planes[1][1] * y + tri->planes[1][2];
+        float b2 = tri->planes[2][0] * x + tri->planes[2][1] * y + tri->planes[2][2];
+        float rcp_sum = 1.0f / (b0 + b1 + b2);
+        b1 = b1 * rcp_sum;
+        b2 = b2 * rcp_sum;
+
+        int32_t num_varyings = tri->num_varyings;
+        const float* v0 = &binner->shade_varyings[tri->first_varying];
+        const float* v1 = v0 + num_varyings;
+        const float* v2 = v1 + num_varyings;
+        for (int32_t i = 0; i < num_varyings; i++)
+        {
+            pixels->varyings[i][lane] = v0[i] + b1 * (v1[i] - v0[i]) + b2 * (v2[i] - v0[i]);
+        }
+
+        pixels->draw_ids[lane] = tri->draw_id;
+        pixels->triangle_indices[lane] = tri->triangle_index;
+    }
+}
+
+// gives the same results as interpolate_varyings_scalar
+TARGET_AVX2 static void interpolate_varyings_avx2(const framebuffer_t* fb, const uint32_t* ids, framebuffer_pixels_t* pixels)
+{
+    // most blocks of 8 pixels only show one triangle, and those are interpolated 8 lanes at a time
+    uint32_t id = ids[tzcnt(pixels->mask)];
+    __m256i same_triangle = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)ids), _mm256_set1_epi32(id));
+    uint32_t same_triangle_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(same_triangle));
+    if ((same_triangle_mask & pixels->mask) != pixels->mask)
+    {
+        interpolate_varyings_scalar(fb, ids, pixels);
+        return;
+    }
+
+    const tile_binner_t* binner = &fb->binners[id >> SHADE_TRIANGLE_INDEX_BITS];
+    const shade_triangle_t* tri = &binner->shade_triangles[id & MAX_SHADE_TRIANGLES_PER_BINNER];
+
+    __m256 x = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(pixels->x - tri->origin_x), _mm256_loadu_si256((const __m256i*)kShadeLaneXs)));
+    __m256 y = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(pixels->y - tri->origin_y), _mm256_loadu_si256((const __m256i*)kShadeLaneYs)));
+    x = _mm256_add_ps(x, _mm256_set1_ps(0.5f));
+    y = _mm256_add_ps(y, _mm256_set1_ps(0.5f));
+
+    __m256 bs[3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        bs[v] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(tri->planes[v][0]), x), _mm256_mul_ps(_mm256_set1_ps(tri->planes[v][1]), y)), _mm256_set1_ps(tri->planes[v][2]));
+    }
+    __m256 rcp_sum = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(_mm256_add_ps(bs[0], bs[1]), bs[2]));
+    __m256 b1 = _mm256_mul_ps(bs[1], rcp_sum);
+    __m256 b2 = _mm256_mul_ps(bs[2], rcp_sum);
+
+    int32_t num_varyings = tri->num_varyings;
+    const float* v0 = &binner->shade_varyings[tri->first_varying];
+    const float* v1 = v0 + num_varyings;
+    const float* v2 = v1 + num_varyings;
+    for (int32_t i = 0; i < num_varyings; i++)
+    {
+        __m256 varying = _mm256_add_ps(_mm256_set1_ps(v0[i]), _mm256_mul_ps(b1, _mm256_set1_ps(v1[i] - v0[i])));
+        varying = _mm256_add_ps(varying, _mm256_mul_ps(b2, _mm256_set1_ps(v2[i] - v0[i])));
+        _mm256_storeu_ps(pixels->varyings[i], varying);
+    }
+
+    _mm256_storeu_si256((__m256i*)pixels->draw_ids, _mm256_set1_epi32(tri->draw_id));
+    _mm256_storeu_si256((__m256i*)pixels->triangle_indices, _mm256_set1_epi32(tri->triangle_index));
+}
+
+template<int32_t TileWidth, interpolate_varyings_fn_t InterpolateVaryings>
+static void shade_tile(framebuffer_t* fb, int32_t tile_id, framebuffer_shader_fn_t shader, void* ctx)
+{
+    int32_t tile_x = (tile_id % fb->width_in_tiles) * TILE_WIDTH_IN_PIXELS;
+    int32_t tile_y = (tile_id / fb->width_in_tiles) * TILE_WIDTH_IN_PIXELS;
+    uint32_t* tile_pixels = &fb->backbuffer[tile_id * PIXELS_PER_TILE];
+    uint32_t clear_color = fb->tile_clear_colors[tile_id];
+
+    // packing fills a tile that nothing was drawn to with its clear color
+    uint64_t pending_clears = fb->tile_pending_clears[tile_id];
+    if (pending_clears == fb->all_coarse_blocks_mask)
+    {
+        return;
+    }
+
+    // but the coarse blocks of other tiles that are still waiting for their clear would get the id of no triangle, so they get their color now
+    fb->tile_pending_clears[tile_id] = 0;
+
+    framebuffer_pixels_t pixels;
+    uint32_t colors[8];
+    for (int32_t cb_i = 0; cb_i < COARSE_BLOCKS_PER_TILE; cb_i++)
+    {
+        if (pending_clears & (1ULL << cb_i))
+        {
+            fb->kernels->clear_coarse_block(fb, tile_id * PIXELS_PER_TILE + cb_i * PIXELS_PER_COARSE_BLOCK, clear_color, true);
+            continue;
+        }
+
+        // 4x2 blocks are every 8 pixels in morton order
+        int32_t cb_end_i = (cb_i + 1) * PIXELS_PER_COARSE_BLOCK;
+        for (int32_t px = cb_i * PIXELS_PER_COARSE_BLOCK; px < cb_end_i; px += 8)
+        {
+            uint32_t* ids = &tile_pixels[px];
+            pixels.x = tile_x + (int32_t)morton_decode_x((uint32_t)px);
+            pixels.y = tile_y + (int32_t)morton_decode_x((uint32_t)px >> 1);
+
+            // the padding past the right and bottom of the framebuffer isn't shaded
+            pixels.mask = 0;
+            for (int32_t lane = 0; lane < 8; lane++)
+            {
+                if (ids[lane] != NO_TRIANGLE &&
+                    pixels.x + kShadeLaneXs[lane] < fb->width_in_pixels &&
+                    pixels.y + kShadeLaneYs[lane] < fb->height_in_pixels)
+                {
+                    pixels.mask |= 1 << lane;
+                }
+            }
+
+            if (pixels.mask)
+            {
+                InterpolateVaryings(fb, ids, &pixels);
+                shader(ctx, &pixels, colors);
+            }
+
+            for (int32_t lane = 0; lane < 8; lane++)
+            {
+                ids[lane] = (pixels.mask & (1 << lane)) ? colors[lane] : clear_color;
+            }
+        }
+    }
+}
+
+// defined with the rest of triangle setup
+template<int32_t TileWidth>
+static void framebuffer_bin(framebuffer_t* fb, tile_binner_t* binner, const int32_t* vertices, uint32_t num_vertices);
+template<int32_t TileWidth>
+static void framebuffer_bin_indexed_scalar(framebuffer_t* fb, tile_binner_t* binner, const int32_t* vertices, const uint32_t* indices, uint32_t first_index, uint32_t end_index);
+template<int32_t TileWidth>
+TARGET_AVX2 static void framebuffer_bin_indexed_avx2(framebuffer_t* fb, tile_binner_t* binner, const int32_t* vertices, const uint32_t* indices, uint32_t first_index, uint32_t end_index);
+
+// multisampled small triangles are drawn by the large triangle kernels, testing every edge
+template<draw_tile_largetri_fn_t DrawTileLargetri>
+static void draw_tile_smalltri_msaa(framebuffer_t* fb, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd)
+{
+    tilecmd_drawtile_t drawtile;
+    drawtile.tilecmd_id = drawcmd->tilecmd_id;
+    for (int32_t v = 0; v < 3; v++)
+    {
+        drawtile.edges[v] = drawcmd->edges[v];
+        drawtile.edge_dxs[v] = drawcmd->edge_dxs[v];
+        drawtile.edge_dys[v] = drawcmd->edge_dys[v];
+        drawtile.shifted_es[v] = 0;
+        drawtile.vert_Zs[v] = drawcmd->vert_Zs[v];
+    }
+    drawtile.max_Z = drawcmd->max_Z;
+    drawtile.min_Z = drawcmd->min_Z;
+    drawtile.shifted_triarea2 = drawcmd->shifted_triarea2;
+    drawtile.rcp_triarea2_mantissa = drawcmd->rcp_triarea2_mantissa;
+    drawtile.rcp_triarea2_rshift = drawcmd->rcp_triarea2_rshift;
+    drawtile.triangle_id = drawcmd->triangle_id;
+    drawtile.sample_offsets = &((const tilecmd_drawsmalltri_msaa_t*)drawcmd)->sample_offsets;
+
+    DrawTileLargetri(fb, tile_id, &drawtile);
+}
+
+// the kernels of every instruction set, for one tile size
+template<int32_t TileWidth>
+struct framebuffer_tile_kernels_t
+{
+    static const framebuffer_kernels_t scalar;
+    static const framebuffer_kernels_t avx2;
+#ifdef ENABLE_AVX512
+    static const framebuffer_kernels_t avx512;
+#endif
+    static const framebuffer_kernels_t scalar_msaa;
+    static const framebuffer_kernels_t avx2_msaa;
+};
+
+template<int32_t TileWidth>
+const framebuffer_kernels_t framebuffer_tile_kernels_t<TileWidth>::scalar = {
+    draw_tile_smalltri_scalar<TileWidth>,
+    {
+        draw_tile_largetri_scalar<TileWidth, 0, false>, draw_tile_largetri_scalar<TileWidth, 1, false>, draw_tile_largetri_scalar<TileWidth, 2, false>, draw_tile_largetri_scalar<TileWidth, 3, false>,
+        draw_tile_largetri_scalar<TileWidth, 4, false>, draw_tile_largetri_scalar<TileWidth, 5, false>, draw_tile_largetri_scalar<TileWidth, 6, false>, draw_tile_largetri_scalar<TileWidth, 7, false>
+    },
+    clear_coarse_block_scalar<1>,
+    update_coarse_max_depths_scalar<TileWidth, 1>,
+    { pack_tile_scalar<TileWidth, true>, pack_tile_scalar<TileWidth, false>, pack_tile_scalar<TileWidth, false> },
+    { NULL, NULL, NULL },
+    shade_tile<TileWidth, interpolate_varyings_scalar>,
+    framebuffer_bin<TileWidth>,
+    framebuffer_bin_indexed_scalar<TileWidth>
+};
+
+template<int32_t TileWidth>
+const framebuffer_kernels_t framebuffer_tile_kernels_t<TileWidth>::avx2 = {
+    draw_tile_smalltri_avx2<TileWidth>,
+    {
+        draw_tile_largetri_avx2<TileWidth, 0, false>, draw_tile_largetri_avx2<TileWidth, 1, false>, draw_tile_largetri_avx2<TileWidth, 2, false>, draw_tile_largetri_avx2<TileWidth, 3, false>,
+        draw_tile_largetri_avx2<TileWidth, 4, false>, draw_tile_largetri_avx2<TileWidth, 5, false>, draw_tile_largetri_avx2<TileWidth, 6, false>, draw_tile_largetri_avx2<TileWidth, 7, false>
+    },
+    clear_coarse_block_avx2<1>,
+    update_coarse_max_depths_avx2<TileWidth, 1>,
+    { pack_tile_avx2<TileWidth, true>, pack_tile_avx2<TileWidth, false>, pack_tile_avx2<TileWidth, false> },
+    { NULL, NULL, NULL },
+    shade_tile<TileWidth, interpolate_varyings_avx2>,
+    framebuffer_bin<TileWidth>,
+    framebuffer_bin_indexed_avx2<TileWidth>
+};
+
+#ifdef ENABLE_AVX512
+// packing is bound by memory bandwidth, binning by the scalar command emission and shading by the shader, so they share the AVX2 kernels
+template<int32_t TileWidth>
+const framebuffer_kernels_t framebuffer_tile_kernels_t<TileWidth>::avx512 = {
+    draw_tile_smalltri_avx512<TileWidth>,
+    {
+        draw_tile_largetri_avx512<TileWidth, 0>, draw_tile_largetri_avx512<TileWidth, 1>, draw_tile_largetri_avx512<TileWidth, 2>, draw_tile_largetri_avx512<TileWidth, 3>,
+        draw_tile_largetri_avx512<TileWidth, 4>, draw_tile_largetri_avx512<TileWidth, 5>, draw_tile_largetri_avx512<TileWidth, 6>, draw_tile_largetri_avx512<TileWidth, 7>
+    },
+    clear_coarse_block_avx512,
+    update_coarse_max_depths_avx512<TileWidth>,
+    { pack_tile_avx2<TileWidth, true>, pack_tile_avx2<TileWidth, false>, pack_tile_avx2<TileWidth, false> },
+    { NULL, NULL, NULL },
+    shade_tile<TileWidth, interpolate_varyings_avx2>,
+    framebuffer_bin<TileWidth>,
+    framebuffer_bin_indexed_avx2<TileWidth>
+};
+#endif
+
+// multisampled framebuffers can't have a visibility buffer, so they never shade. the pack kernels are for the clear values.
+template<int32_t TileWidth>
+const framebuffer_kernels_t framebuffer_tile_kernels_t<TileWidth>::scalar_msaa = {
+    draw_tile_smalltri_msaa<draw_tile_largetri_scalar<TileWidth, 7, true>>,
+    {
+        draw_tile_largetri_scalar<TileWidth, 0, true>, draw_tile_largetri_scalar<TileWidth, 1, true>, draw_tile_largetri_scalar<TileWidth, 2, true>, draw_tile_largetri_scalar<TileWidth, 3, true>,
+        draw_tile_largetri_scalar<TileWidth, 4, true>, draw_tile_largetri_scalar<TileWidth, 5, true>, draw_tile_largetri_scalar<TileWidth, 6, true>, draw_tile_largetri_scalar<TileWidth, 7, true>
+    },
+    clear_coarse_block_scalar<MSAA_SAMPLES_PER_PIXEL>,
+    update_coarse_max_depths_scalar<TileWidth, MSAA_SAMPLES_PER_PIXEL>,
+    { pack_tile_scalar<TileWidth, true>, pack_tile_scalar<TileWidth, false>, pack_tile_scalar<TileWidth, false> },
+    { pack_tile_msaa_scalar<TileWidth, true, false>, pack_tile_msaa_scalar<TileWidth, false, false>, pack_tile_msaa_scalar<TileWidth, false, true> },
+    NULL,
+    framebuffer_bin<TileWidth>,
+    framebuffer_bin_indexed_scalar<TileWidth>
+};
+
+// AVX-512 framebuffers use these too
+template<int32_t TileWidth>
+const framebuffer_kernels_t framebuffer_tile_kernels_t<TileWidth>::avx2_msaa = {
+    draw_tile_smalltri_msaa<draw_tile_largetri_avx2<TileWidth, 7, true>>,
+    {
+        draw_tile_largetri_avx2<TileWidth, 0, true>, draw_tile_largetri_avx2<TileWidth, 1, true>, draw_tile_largetri_avx2<TileWidth, 2, true>, draw_tile_largetri_avx2<TileWidth, 3, true>,
+        draw_tile_largetri_avx2<TileWidth, 4, true>, draw_tile_largetri_avx2<TileWidth, 5, true>, draw_tile_largetri_avx2<TileWidth, 6, true>, draw_tile_largetri_avx2<TileWidth, 7, true>
+    },
+    clear_coarse_block_avx2<MSAA_SAMPLES_PER_PIXEL>,
+    update_coarse_max_depths_avx2<TileWidth, MSAA_SAMPLES_PER_PIXEL>,
+    { pack_tile_avx2<TileWidth, true>, pack_tile_avx2<TileWidth, false>, pack_tile_avx2<TileWidth, false> },
+    { pack_tile_msaa_avx2<TileWidth, true, false>, pack_tile_msaa_avx2<TileWidth, false, false>, pack_tile_msaa_avx2<TileWidth, false, true> },
+    NULL,
+    framebuffer_bin<TileWidth>,
+    framebuffer_bin_indexed_avx2<TileWidth>
+};
+
+template<int32_t TileWidth>
+static const framebuffer_kernels_t* framebuffer_tile_kernels_for(instructionset_t instruction_set, bool msaa)
+{
+    if (msaa)
+    {
+        return instruction_set == instructionset_scalar ? &framebuffer_tile_kernels_t<TileWidth>::scalar_msaa : &framebuffer_tile_kernels_t<TileWidth>::avx2_msaa;
+    }
+
+    switch (instruction_set)
+    {
+#ifdef ENABLE_AVX512
+    case instructionset_avx512:
+        return &framebuffer_tile_kernels_t<TileWidth>::avx512;
+#endif
+    case instructionset_avx2:
+        return &framebuffer_tile_kernels_t<TileWidth>::avx2;
+    case instructionset_scalar:
+        return &framebuffer_tile_kernels_t<TileWidth>::scalar;
+    default:
+        assert(!"Unknown instruction set");
+        return &framebuffer_tile_kernels_t<TileWidth>::scalar;
+    }
+}
+
+static const framebuffer_kernels_t* framebuffer_kernels_for(instructionset_t instruction_set, int32_t tile_width_in_pixels, bool msaa)
+{
+    switch (tile_width_in_pixels)
+    {
+    case 32:
+        return framebuffer_tile_kernels_for<32>(instruction_set, msaa);
+    case 64:
+        return framebuffer_tile_kernels_for<64>(instruction_set, msaa);
+    case 128:
+        return framebuffer_tile_kernels_for<128>(instruction_set, msaa);
+    default:
+        assert(!"Unsupported tile size");
+        return framebuffer_tile_kernels_for<DEFAULT_TILE_WIDTH_IN_PIXELS>(instruction_set, msaa);
+    }
+}
+
+static void debugprint_cmdlist(tile_cmdlist_t* cmdlist)
+{
+    for (tile_cmdchunk_t* chunk = cmdlist->head; chunk; chunk = chunk->next)
+    {
+        printf("[%4d/%4d]", chunk->num_dwords, TILE_COMMAND_CHUNK_SIZE_IN_DWORDS);
+        if (chunk == cmdlist->tail)
+            printf(" W");
+        printf("\n");
+    }
+    printf("total: %d dwords\n", cmdlist->num_dwords);
+}
+
+// recomputes the bound of a tile from the bounds of its coarse blocks
+static void framebuffer_update_tile_max_depth(framebuffer_t* fb, int32_t tile_id)
+{
+    const uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * fb->coarse_blocks_per_tile];
+    uint32_t tile_max_depth = coarse_max_depths[0];
+    for (int32_t i = 1; i < fb->coarse_blocks_per_tile; i++)
+    {
+        if (coarse_max_depths[i] > tile_max_depth)
+            tile_max_depth = coarse_max_depths[i];
+    }
+    fb->tile_max_depths[tile_id].store(tile_max_depth, std::memory_order_relaxed);
+}
+
+// interprets the commands in a linked list of chunks
+static void framebuffer_run_tilecmds(framebuffer_t* fb, int32_t tile_id, const tile_cmdchunk_t* first_chunk)
+{
+    // only this thread writes the bound while it resolves the tile
+    uint32_t tile_max_depth = fb->tile_max_depths[tile_id].load(std::memory_order_relaxed);
+    bool drew_any = false;
+
+    for (const tile_cmdchunk_t* chunk = first_chunk; chunk; chunk = chunk->next)
+    {
+        const uint32_t* cmd_end = chunk->dwords + chunk->num_dwords;
+        for (const uint32_t* cmd = chunk->dwords; cmd != cmd_end; )
+        {
+            uint32_t tilecmd_id = *cmd;
+            
+            // debugging code for logging commands
+            // printf("Reading command [id: %d]\n", tilecmd_id);
+            // debugprint_cmdlist(&fb->tile_cmdlists[tile_id]);
+
+            if (tilecmd_id == tilecmd_id_drawsmalltri)
+            {
+                uint64_t smalltri_start_pc = perfcounter_begin(fb);
+
+                const tilecmd_drawsmalltri_t* drawcmd = (const tilecmd_drawsmalltri_t*)cmd;
+
+                // skip triangles that are entirely behind everything in the tile
+                if ((drawcmd->min_Z << 16) < tile_max_depth)
+                {
+                    fb->kernels->draw_tile_smalltri(fb, tile_id, drawcmd);
+                    drew_any = true;
+                }
+
+                perfcounter_end(&fb->tile_counters[tile_id].perfcounters.smalltri_raster, smalltri_start_pc);
+
+                cmd += (fb->msaa ? sizeof(tilecmd_drawsmalltri_msaa_t) : sizeof(tilecmd_drawsmalltri_t)) / sizeof(uint32_t);
+            }
+            else if (tilecmd_id >= tilecmd_id_drawlargetri_0edgemask && tilecmd_id <= tilecmd_id_drawlargetri_7edgemask)
+            {   
+                uint64_t largetri_start_pc = perfcounter_begin(fb);
+
+                const tilecmd_drawlargetri_t* drawcmd = (const tilecmd_drawlargetri_t*)cmd;
+                const largetri_setup_t* setup = drawcmd->setup;
+
+                // skip triangles that are entirely behind everything in the tile
+                if ((setup->min_Z << 16) < tile_max_depth)
+                {
+                    uint32_t edge_mask = tilecmd_id - tilecmd_id_drawlargetri_0edgemask;
+
+                    tilecmd_drawtile_t drawtile;
+                    drawtile.tilecmd_id = tilecmd_id;
+                    for (int32_t v = 0; v < 3; v++)
+                    {
+                        if (edge_mask & (1 << v))
+                        {
+                            drawtile.edges[v] = drawcmd->tile_edges[v];
+                            drawtile.shifted_es[v] = 0;
+                        }
+                        else
+                        {
+                            drawtile.edges[v] = 0;
+                            drawtile.shifted_es[v] = drawcmd->tile_edges[v];
+                        }
+
+                        drawtile.edge_dxs[v] = setup->edge_dxs[v];
+                        drawtile.edge_dys[v] = setup->edge_dys[v];
+                        drawtile.vert_Zs[v] = setup->vert_Zs[v];
+                    }
+                    drawtile.max_Z = setup->max_Z;
+                    drawtile.min_Z = setup->min_Z;
+                    drawtile.shifted_triarea2 = setup->shifted_triarea2;
+                    drawtile.rcp_triarea2_mantissa = setup->rcp_triarea2_mantissa;
+                    drawtile.rcp_triarea2_rshift = setup->rcp_triarea2_rshift;
+                    drawtile.triangle_id = setup->triangle_id;
+                    drawtile.sample_offsets = fb->msaa ? (const sample_edge_offsets_t*)(setup + 1) : NULL;
+
+                    fb->kernels->draw_tile_largetri[edge_mask](fb, tile_id, &drawtile);
+                    drew_any = true;
+
+                    // coarse blocks can only have gotten closer than the tile's farthest point if the triangle is closer than it too
+                    if ((setup->max_Z << 16) < tile_max_depth)
+                    {
+                        framebuffer_update_tile_max_depth(fb, tile_id);
+                        tile_max_depth = fb->tile_max_depths[tile_id].load(std::memory_order_relaxed);
+                    }
+                }
+
+                perfcounter_end(&fb->tile_counters[tile_id].perfcounters.largetri_raster, largetri_start_pc);
+
+                cmd += sizeof(tilecmd_drawlargetri_t) / sizeof(uint32_t);
+            }
+            else if (tilecmd_id == tilecmd_id_cleartile)
+            {
+                uint64_t clear_start_pc = perfcounter_begin(fb);
+
+                // the pixels are cleared when something draws over them
+                const tilecmd_cleartile_t* clearcmd = (const tilecmd_cleartile_t*)cmd;
+                fb->tile_pending_clears[tile_id] = fb->all_coarse_blocks_mask;
+                fb->tile_clear_colors[tile_id] = clearcmd->color;
+
+                uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * fb->coarse_blocks_per_tile];
+                for (int32_t i = 0; i < fb->coarse_blocks_per_tile; i++)
+                {
+                    coarse_max_depths[i] = 0xFFFFFFFF;
+                }
+                tile_max_depth = 0xFFFFFFFF;
+                fb->tile_max_depths[tile_id].store(tile_max_depth, std::memory_order_relaxed);
+
+                // publishes the reset bound to binning
+                fb->tile_num_clears_resolved[tile_id].fetch_add(1, std::memory_order_release);
+
+                perfcounter_end(&fb->tile_counters[tile_id].perfcounters.clear, clear_start_pc);
+
+                cmd += sizeof(tilecmd_cleartile_t) / sizeof(uint32_t);
+            }
+            else
+            {
+                assert(!"Unknown tile command");
+            }
+        }
+    }
+
+    // the bounds kept up to date while drawing only tighten for fully covered coarse blocks,
+    // so tighten them all the way now that this batch of commands is done.
+    if (drew_any)
+    {
+        fb->kernels->update_coarse_max_depths(fb, tile_id);
+        framebuffer_update_tile_max_depth(fb, tile_id);
+    }
+}
+
+static void framebuffer_resolve_tile(framebuffer_t* fb, int32_t tile_id, int32_t worker_id)
+{
+    tile_cmdlist_t* cmdlist = &fb->tile_cmdlists[tile_id];
+
+    uint64_t trace_start = trace_begin(fb);
+    framebuffer_run_tilecmds(fb, tile_id, cmdlist->head);
+    trace_end(fb, worker_id, "resolve tile", "tile", tile_id, trace_start);
+
+    // the chunks are freed with the rest of the frame's at the end of framebuffer_resolve
+    cmdlist->head = NULL;
+    cmdlist->tail = NULL;
+    cmdlist->num_dwords = 0;
+}
+
+static void framebuffer_flush_tile_task(void* ctx, int32_t tile_id, int32_t worker_id)
+{
+    framebuffer_t* fb = (framebuffer_t*)ctx;
+    tile_flush_queue_t* queue = &fb->tile_flush_queues[tile_id];
+
+    // keep going until the binner stops flushing this tile
+    for (;;)
+    {
+        tile_cmdchunk_t* first_chunk;
+        {
+            std::lock_guard<std::mutex> lock(queue->lock);
+            first_chunk = queue->head;
+            queue->head = NULL;
+            queue->tail = NULL;
+
+            if (!first_chunk)
+            {
+                queue->scheduled = false;
+                return;
+            }
+        }
+
+        uint64_t trace_start = trace_begin(fb);
+        framebuffer_run_tilecmds(fb, tile_id, first_chunk);
+        trace_end(fb, worker_id, "resolve flushed tile", "tile", tile_id, trace_start);
+    }
+}
+
+// hands the tile's commands over to the thread pool, and starts the tile over with an empty command list
+static void framebuffer_flush_tile_async(framebuffer_t* fb, int32_t tile_id)
+{
+    tile_cmdlist_t* cmdlist = &fb->tile_cmdlists[tile_id];
+    tile_flush_queue_t* queue = &fb->tile_flush_queues[tile_id];
+
+    bool needs_task;
+    {
+        std::lock_guard<std::mutex> lock(queue->lock);
+        if (queue->tail)
+            queue->tail->next = cmdlist->head;
+        else
+            queue->head = cmdlist->head;
+        queue->tail = cmdlist->tail;
+
+        needs_task = !queue->scheduled;
+        queue->scheduled = true;
+    }
+
+    cmdlist->head = NULL;
+    cmdlist->tail = NULL;
+    cmdlist->num_dwords = 0;
+
+    if (needs_task)
+    {
+        threadpool_submit(fb->threadpool, framebuffer_flush_tile_task, fb, tile_id, fb->num_flushes_left);
+    }
+}
+
+// waits for the commands flushed while binning to be done, since they come before the current command lists
+static void framebuffer_finish_flushes(framebuffer_t* fb)
+{
+    if (fb->async_flush)
+    {
+        uint64_t trace_start = trace_begin(fb);
+        threadpool_wait(fb->threadpool, fb->num_flushes_left);
+        trace_end(fb, 0, "wait for flushes", "flushes", 0, trace_start);
+    }
+}
+
+static void framebuffer_push_tilecmd(framebuffer_t* fb, tile_binner_t* binner, int32_t tile_id, const uint32_t* cmd_dwords, int32_t num_dwords)
+{
+    assert(tile_id < fb->total_num_tiles);
+    assert(num_dwords <= TILE_COMMAND_CHUNK_SIZE_IN_DWORDS);
+
+    tile_cmdlist_t* cmdlist = &binner->tile_cmdlists[tile_id];
+
+    // debugging code for logging commands
+    // printf("Writing command [id: %d, sz: %d]\n", cmd_dwords[0], num_dwords);
+    // debugprint_cmdlist(cmdlist);
+
+    // start a new chunk if the command doesn't fit at the end of the current one
+    if (!cmdlist->tail || TILE_COMMAND_CHUNK_SIZE_IN_DWORDS - cmdlist->tail->num_dwords < num_dwords)
+    {
+        tile_cmdchunk_t* chunk = tile_cmdarena_alloc_chunk(binner->cmdarena);
+        if (cmdlist->tail)
+            cmdlist->tail->next = chunk;
+        else
+            cmdlist->head = chunk;
+        cmdlist->tail = chunk;
+    }
+
+    // finally actually write the command
+    uint32_t* dst = cmdlist->tail->dwords + cmdlist->tail->num_dwords;
+    for (int32_t i = 0; i < num_dwords; i++)
+    {
+        dst[i] = cmd_dwords[i];
+    }
+    cmdlist->tail->num_dwords += num_dwords;
+    cmdlist->num_dwords += num_dwords;
+    binner->stats.tile_commands++;
+
+    // flush the tile if too many commands are queued up
+    if (binner->can_flush && cmdlist->num_dwords >= fb->tile_flush_threshold_in_dwords)
+    {
+        uint64_t trace_start = trace_begin(fb);
+        if (fb->async_flush)
+            framebuffer_flush_tile_async(fb, tile_id);
+        else
+            framebuffer_resolve_tile(fb, tile_id, binner->worker_id);
+        trace_end(fb, binner->worker_id, "flush tile", "tile", tile_id, trace_start);
+    }
+
+    // DEBUGGING: Always flush. Helpful since it gives you a straight call stack through the command list.
+    // framebuffer_resolve_tile(fb, tile_id, binner->worker_id);
+}
+
+// multisampled framebuffers bin small triangles along with their sample offsets
+static void framebuffer_push_smalltri_tilecmd(framebuffer_t* fb, tile_binner_t* binner, int32_t tile_id, const tilecmd_drawsmalltri_t* drawcmd, const sample_edge_offsets_t* sample_offsets)
+{
+    if (!sample_offsets)
+    {
+        framebuffer_push_tilecmd(fb, binner, tile_id, &drawcmd->tilecmd_id, sizeof(tilecmd_drawsmalltri_t) / sizeof(uint32_t));
+        return;
+    }
+
+    tilecmd_drawsmalltri_msaa_t msaa_drawcmd;
+    msaa_drawcmd.drawcmd = *drawcmd;
+    msaa_drawcmd.sample_offsets = *sample_offsets;
+    framebuffer_push_tilecmd(fb, binner, tile_id, &msaa_drawcmd.drawcmd.tilecmd_id, sizeof(tilecmd_drawsmalltri_msaa_t) / sizeof(uint32_t));
+}
+
+// copies the setup of a large triangle to the binner's command memory, for the commands of every tile it covers to point to.
+// it lives as long as the commands do. sample_offsets are only for multisampled framebuffers, and go in the next cache line.
+static const largetri_setup_t* framebuffer_push_largetri_setup(tile_binner_t* binner, const largetri_setup_t* setup, const sample_edge_offsets_t* sample_offsets)
+{
+    static_assert(sizeof(sample_edge_offsets_t) <= sizeof(largetri_setup_t), "the sample offsets fit in a cache line");
+    const int32_t setup_num_dwords = (sample_offsets ? 2 : 1) * (int32_t)(sizeof(largetri_setup_t) / sizeof(uint32_t));
+
+    tile_cmdchunk_t* chunk = binner->largetri_setup_chunk;
+    if (!chunk || TILE_COMMAND_CHUNK_SIZE_IN_DWORDS - chunk->num_dwords < setup_num_dwords)
+    {
+        chunk = tile_cmdarena_alloc_chunk(binner->cmdarena);
+
+        // start at the first cache line of the chunk, so every setup is on a cache line of its own
+        chunk->num_dwords = (int32_t)(((64 - ((uintptr_t)chunk->dwords & 63)) & 63) / sizeof(uint32_t));
+        binner->largetri_setup_chunk = chunk;
+    }
+
+    largetri_setup_t* dst = (largetri_setup_t*)(chunk->dwords + chunk->num_dwords);
+    *dst = *setup;
+    if (sample_offsets)
+    {
+        *(sample_edge_offsets_t*)(dst + 1) = *sample_offsets;
+    }
+    chunk->num_dwords += setup_num_dwords;
+    return dst;
+}
+
+// ends the frame's command memory, once every command list is empty and every flush is done
+static void framebuffer_free_tilecmds(framebuffer_t* fb)
+{
+    for (int32_t binner_id = 0; binner_id < fb->num_binners; binner_id++)
+    {
+        tile_cmdarena_reset(fb->binners[binner_id].cmdarena);
+        fb->binners[binner_id].largetri_setup_chunk = NULL;
+    }
+}
+
+// resolves everything binned so far if the command memory went over budget since the last resolve.
+// only called before a draw starts binning, since there is no other point where the command lists can all be run.
+static void framebuffer_enforce_command_budget(framebuffer_t* fb)
+{
+    if (fb->cmdpool_budget_in_slabs != 0 && tile_cmdpool_num_slabs_in_use(fb->cmdpool) > fb->cmdpool_budget_in_slabs)
+    {
+        framebuffer_resolve(fb);
+    }
+}
+
+static void framebuffer_resolve_tile_task(void* ctx, int32_t tile_id, int32_t worker_id)
+{
+    framebuffer_resolve_tile((framebuffer_t*)ctx, tile_id, worker_id);
+}
+
+// resolves the tiles of a framebuffer without threads one after the other
+static void framebuffer_resolve_serial(framebuffer_t* fb)
+{
+    uint64_t trace_start = trace_begin(fb);
+
+    framebuffer_finish_flushes(fb);
+
+    int32_t tile_i = 0;
+    for (int32_t tile_y = 0; tile_y < fb->height_in_tiles; tile_y++)
+    {
+        for (int32_t tile_x = 0; tile_x < fb->width_in_tiles; tile_x++)
+        {
+            framebuffer_resolve_tile(fb, tile_i, 0);
+            tile_i++;
+        }
+    }
+    framebuffer_free_tilecmds(fb);
+    trace_end(fb, 0, "resolve", "tiles", fb->total_num_tiles, trace_start);
+}
+
+// every tile has its own command buffer and its own pixels, so tiles can be resolved independently.
+// only tiles with pending commands are submitted, with the busiest tiles first,
+// so the long running tiles don't start last and leave the other threads waiting on them.
+static void framebuffer_submit_busy_tiles(framebuffer_t* fb, std::atomic<int32_t>* tiles_left)
+{
+    fb->num_busy_tiles = 0;
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        int32_t num_pending_dwords = fb->tile_cmdlists[tile_id].num_dwords;
+        if (num_pending_dwords > 0)
+        {
+            fb->tile_resolve_weights[tile_id] = num_pending_dwords;
+            fb->tile_resolve_order[fb->num_busy_tiles] = tile_id;
+            fb->num_busy_tiles++;
+        }
+    }
+
+    const int32_t* weights = fb->tile_resolve_weights;
+    std::stable_sort(fb->tile_resolve_order, fb->tile_resolve_order + fb->num_busy_tiles, [weights](int32_t a, int32_t b) {
+        return weights[a] > weights[b];
+    });
+
+    for (int32_t i = 0; i < fb->num_busy_tiles; i++)
+    {
+        threadpool_submit(fb->threadpool, framebuffer_resolve_tile_task, fb, fb->tile_resolve_order[i], tiles_left);
+    }
+}
+
+void framebuffer_resolve(framebuffer_t* fb)
+{
+    assert(fb);
+
+    framebuffer_resolve_many(&fb, 1);
+}
+
+void framebuffer_resolve_many(framebuffer_t* const* fbs, int32_t num_fbs)
+{
+    assert(fbs);
+    assert(num_fbs >= 0);
+
+    for (int32_t fb_i = 0; fb_i < num_fbs; fb_i++)
+    {
+        framebuffer_t* fb = fbs[fb_i];
+        assert(fb);
+
+        bool resolved = false;
+        for (int32_t other_fb_i = 0; other_fb_i < fb_i; other_fb_i++)
+        {
+            assert(fbs[other_fb_i] != fb);
+            resolved = resolved || (fb->threadpool && fbs[other_fb_i]->threadpool == fb->threadpool);
+        }
+
+        // the framebuffers sharing the threads of an earlier one were resolved along with it
+        if (resolved)
+        {
+            continue;
+        }
+
+        if (!fb->threadpool)
+        {
+            framebuffer_resolve_serial(fb);
+            continue;
+        }
+
+        // the tiles of all the framebuffers on these threads are submitted before waiting on any of them,
+        // so the threads don't sit idle at the end of each framebuffer while its last tiles finish
+        std::atomic<int32_t> tiles_left(0);
+        for (int32_t shared_fb_i = fb_i; shared_fb_i < num_fbs; shared_fb_i++)
+        {
+            framebuffer_t* shared_fb = fbs[shared_fb_i];
+            if (shared_fb->threadpool == fb->threadpool)
+            {
+                shared_fb->resolve_trace_start = trace_begin(shared_fb);
+                framebuffer_finish_flushes(shared_fb);
+                framebuffer_submit_busy_tiles(shared_fb, &tiles_left);
+            }
+        }
+
+        threadpool_wait(fb->threadpool, &tiles_left);
+
+        for (int32_t shared_fb_i = fb_i; shared_fb_i < num_fbs; shared_fb_i++)
+        {
+            framebuffer_t* shared_fb = fbs[shared_fb_i];
+            if (shared_fb->threadpool == fb->threadpool)
+            {
+                framebuffer_free_tilecmds(shared_fb);
+                trace_end(shared_fb, 0, "resolve", "tiles", shared_fb->num_busy_tiles, shared_fb->resolve_trace_start);
+            }
+        }
+    }
+}
+
+typedef struct framebuffer_pack_job_t
+{
+    framebuffer_t* fb;
+    attachment_t attachment;
+    pack_tile_fn_t pack_tile;
+    pack_tile_msaa_fn_t pack_tile_msaa; // only if the framebuffer is multisampled
+    const uint32_t* src_buffer;
+    const uint32_t* src_samples; // likewise
+    const uint8_t* src_compressed_fine_blocks; // only for the color of a multisampled framebuffer
+    int32_t x, y, width, height;
+    uint8_t* data;
+    int32_t pitch;
+} framebuffer_pack_job_t;
+
+// packs the part of the rectangle that is in one row of tiles
+static void framebuffer_pack_tile_row_task(void* ctx, int32_t tile_y, int32_t /*worker_id*/)
+{
+    const framebuffer_pack_job_t* job = (const framebuffer_pack_job_t*)ctx;
+    framebuffer_t* fb = job->fb;
+
+    int32_t topleft_y = tile_y * fb->tile_width_in_pixels;
+    int32_t bottomright_y = topleft_y + fb->tile_width_in_pixels;
+    int32_t pixel_y_min = topleft_y < job->y ? job->y : topleft_y;
+    int32_t pixel_y_max = bottomright_y > job->y + job->height ? job->y + job->height : bottomright_y;
+
+    int32_t topleft_tile_x = job->x / fb->tile_width_in_pixels;
+    int32_t bottomright_tile_x = (job->x + (job->width - 1)) / fb->tile_width_in_pixels;
+
+    for (int32_t tile_x = topleft_tile_x; tile_x <= bottomright_tile_x; tile_x++)
+    {
+        int32_t topleft_x = tile_x * fb->tile_width_in_pixels;
+        int32_t bottomright_x = topleft_x + fb->tile_width_in_pixels;
+        int32_t pixel_x_min = topleft_x < job->x ? job->x : topleft_x;
+        int32_t pixel_x_max = bottomright_x > job->x + job->width ? job->x + job->width : bottomright_x;
+
+        int32_t tile_id = tile_y * fb->width_in_tiles + tile_x;
+        uint8_t* dst = job->data + (pixel_y_min - job->y) * job->pitch + (pixel_x_min - job->x) * 4;
+
+        uint64_t pending_clears = fb->tile_pending_clears[tile_id];
+        if (pending_clears == fb->all_coarse_blocks_mask)
+        {
+            // nothing was drawn since the tile was cleared, so every pixel is the clear value
+            uint32_t clear_value = job->attachment == attachment_depth ? 0xFFFFFFFF : fb->tile_clear_colors[tile_id];
+            uint32_t packed_clear_value;
+            job->pack_tile(&clear_value, 0, 0, 1, 1, (uint8_t*)&packed_clear_value, sizeof(uint32_t));
+
+            for (int32_t pixel_y = pixel_y_min; pixel_y < pixel_y_max; pixel_y++)
+            {
+                uint32_t* row_dst = (uint32_t*)dst;
+                for (int32_t i = 0; i < pixel_x_max - pixel_x_min; i++)
+                {
+                    row_dst[i] = packed_clear_value;
+                }
+                dst += job->pitch;
+            }
+
+            continue;
+        }
+
+        if (pending_clears)
+        {
+            framebuffer_materialize_clears(fb, tile_id, pending_clears, 0);
+        }
+
+        if (job->pack_tile_msaa)
+        {
+            const uint32_t* tile_src = job->src_buffer ? job->src_buffer + tile_id * fb->pixels_per_tile : NULL;
+            const uint32_t* tile_samples = job->src_samples + tile_id * fb->pixels_per_tile * MSAA_SAMPLES_PER_PIXEL;
+            const uint8_t* tile_compressed = job->src_compressed_fine_blocks ? job->src_compressed_fine_blocks + tile_id * fb->pixels_per_tile / PIXELS_PER_FINE_BLOCK : NULL;
+            job->pack_tile_msaa(tile_src, tile_samples, tile_compressed, pixel_x_min - topleft_x, pixel_y_min - topleft_y, pixel_x_max - topleft_x, pixel_y_max - topleft_y, dst, job->pitch);
+        }
+        else
+        {
+            const uint32_t* tile_src = job->src_buffer + tile_id * fb->pixels_per_tile;
+            job->pack_tile(tile_src, pixel_x_min - topleft_x, pixel_y_min - topleft_y, pixel_x_max - topleft_x, pixel_y_max - topleft_y, dst, job->pitch);
+        }
+    }
+}
+
+void framebuffer_pack_row_major(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data)
+{
+    framebuffer_pack_row_major_pitched(fb, attachment, x, y, width, height, format, data, width * 4);
+}
+
+void framebuffer_pack_row_major_pitched(framebuffer_t* fb, attachment_t attachment, int32_t x, int32_t y, int32_t width, int32_t height, pixelformat_t format, void* data, int32_t pitch)
+{
+    assert(fb);
+    assert(x >= 0 && x < fb->width_in_pixels);
+    assert(y >= 0 && y < fb->height_in_pixels);
+    assert(width >= 0 && width <= fb->width_in_pixels);
+    assert(height >= 0 && height <= fb->height_in_pixels);
+    assert(x + width <= fb->width_in_pixels);
+    assert(y + height <= fb->height_in_pixels);
+    assert(data);
+    assert(pitch >= width * 4 || -pitch >= width * 4);
+
+    framebuffer_pack_job_t job;
+    job.fb = fb;
+    job.attachment = attachment;
+    job.x = x;
+    job.y = y;
+    job.width = width;
+    job.height = height;
+    job.data = (uint8_t*)data;
+    job.pitch = pitch;
+
+    if (attachment == attachment_color0)
+    {
+        assert(format == pixelformat_r8g8b8a8_unorm || format == pixelformat_b8g8r8a8_unorm);
+        assert(!fb->depth_only);
+        job.src_buffer = fb->backbuffer;
+        job.src_samples = fb->samplebuffer;
+        job.src_compressed_fine_blocks = fb->compressed_fine_blocks;
+    }
+    else if (attachment == attachment_depth)
+    {
+        assert(format == pixelformat_r32_unorm);
+        // multisampled depth is only in the samples
+        job.src_buffer = fb->msaa ? NULL : fb->depthbuffer;
+        job.src_samples = fb->depthbuffer;
+        job.src_compressed_fine_blocks = NULL;
+    }
+    else
+    {
+        assert(!"Unknown attachment");
+        return;
+    }
+
+    job.pack_tile = fb->kernels->pack_tile[format];
+    job.pack_tile_msaa = fb->kernels->pack_tile_msaa[format];
+
+    if (width == 0 || height == 0)
+    {
+        return;
+    }
+
+    // flushed tiles might still be getting written to
+    framebuffer_finish_flushes(fb);
+
+    int32_t topleft_tile_y = y / fb->tile_width_in_pixels;
+    int32_t bottomright_tile_y = (y + (height - 1)) / fb->tile_width_in_pixels;
+
+    if (!fb->threadpool || topleft_tile_y == bottomright_tile_y)
+    {
+        for (int32_t tile_y = topleft_tile_y; tile_y <= bottomright_tile_y; tile_y++)
+        {
+            framebuffer_pack_tile_row_task(&job, tile_y, 0);
+        }
+        return;
+    }
+
+    // rows of tiles write to disjoint rows of the destination
+    std::atomic<int32_t> tile_rows_left(0);
+    for (int32_t tile_y = topleft_tile_y; tile_y <= bottomright_tile_y; tile_y++)
+    {
+        threadpool_submit(fb->threadpool, framebuffer_pack_tile_row_task, &job, tile_y, &tile_rows_left);
+    }
+
+    threadpool_wait(fb->threadpool, &tile_rows_left);
+}
+
+typedef struct framebuffer_shade_job_t
+{
+    framebuffer_t* fb;
+    framebuffer_shader_fn_t shader;
+    void* ctx;
+} framebuffer_shade_job_t;
+
+static void framebuffer_shade_tile_task(void* ctx, int32_t tile_id, int32_t worker_id)
+{
+    const framebuffer_shade_job_t* job = (const framebuffer_shade_job_t*)ctx;
+
+    uint64_t trace_start = trace_begin(job->fb);
+    job->fb->kernels->shade_tile(job->fb, tile_id, job->shader, job->ctx);
+    trace_end(job->fb, worker_id, "shade tile", "tile", tile_id, trace_start);
+}
+
+void framebuffer_shade(framebuffer_t* fb, framebuffer_shader_fn_t shader, void* ctx)
+{
+    assert(fb);
+    assert(fb->visibility_buffer);
+    assert(shader);
+
+    // flushed tiles might still be getting written to
+    framebuffer_finish_flushes(fb);
+
+    framebuffer_shade_job_t job;
+    job.fb = fb;
+    job.shader = shader;
+    job.ctx = ctx;
+
+    if (!fb->threadpool)
+    {
+        for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+        {
+            framebuffer_shade_tile_task(&job, tile_id, 0);
+        }
+        return;
+    }
+
+    // every tile writes to its own pixels
+    std::atomic<int32_t> tiles_left(0);
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        threadpool_submit(fb->threadpool, framebuffer_shade_tile_task, &job, tile_id, &tiles_left);
+    }
+
+    threadpool_wait(fb->threadpool, &tiles_left);
+}
+
+int32_t framebuffer_test_bbox(framebuffer_t* fb, int32_t x, int32_t y, int32_t width, int32_t height, uint32_t min_depth)
+{
+    assert(fb);
+    assert(width >= 0 && height >= 0);
+
+    // only the part of the rectangle inside the framebuffer can be visible
+    int32_t x_min = x < 0 ? 0 : x;
+    int32_t y_min = y < 0 ? 0 : y;
+    int32_t x_max = x + width > fb->width_in_pixels ? fb->width_in_pixels : x + width;
+    int32_t y_max = y + height > fb->height_in_pixels ? fb->height_in_pixels : y + height;
+    if (x_min >= x_max || y_min >= y_max)
+    {
+        return 0;
+    }
+
+    // flushed tiles might still be getting written to
+    framebuffer_finish_flushes(fb);
+
+    int32_t first_tile_x = x_min / fb->tile_width_in_pixels;
+    int32_t first_tile_y = y_min / fb->tile_width_in_pixels;
+    int32_t last_tile_x = (x_max - 1) / fb->tile_width_in_pixels;
+    int32_t last_tile_y = (y_max - 1) / fb->tile_width_in_pixels;
+
+    for (int32_t tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++)
+    {
+        for (int32_t tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++)
+        {
+            int32_t tile_id = tile_y * fb->width_in_tiles + tile_x;
+
+            // the bounds are exact for resolved tiles, so these tests are only inconclusive for partially overlapped coarse blocks
+            if (fb->tile_max_depths[tile_id].load(std::memory_order_relaxed) <= min_depth)
+            {
+                continue;
+            }
+
+            int32_t samples_per_pixel = fb->msaa ? MSAA_SAMPLES_PER_PIXEL : 1;
+            const uint32_t* tile_depths = &fb->depthbuffer[tile_id * fb->pixels_per_tile * samples_per_pixel];
+            const uint32_t* coarse_max_depths = &fb->coarse_max_depths[tile_id * fb->coarse_blocks_per_tile];
+
+            for (int32_t cb_y = 0; cb_y < fb->tile_width_in_coarse_blocks; cb_y++)
+            {
+                for (int32_t cb_x = 0; cb_x < fb->tile_width_in_coarse_blocks; cb_x++)
+                {
+                    int32_t cb_px_x = tile_x * fb->tile_width_in_pixels + cb_x * COARSE_BLOCK_WIDTH_IN_PIXELS;
+                    int32_t cb_px_y = tile_y * fb->tile_width_in_pixels + cb_y * COARSE_BLOCK_WIDTH_IN_PIXELS;
+
+                    int32_t px_x_min = cb_px_x < x_min ? x_min : cb_px_x;
+                    int32_t px_y_min = cb_px_y < y_min ? y_min : cb_px_y;
+                    int32_t px_x_max = cb_px_x + COARSE_BLOCK_WIDTH_IN_PIXELS > x_max ? x_max : cb_px_x + COARSE_BLOCK_WIDTH_IN_PIXELS;
+                    int32_t px_y_max = cb_px_y + COARSE_BLOCK_WIDTH_IN_PIXELS > y_max ? y_max : cb_px_y + COARSE_BLOCK_WIDTH_IN_PIXELS;
+                    if (px_x_min >= px_x_max || px_y_min >= px_y_max)
+                    {
+                        continue;
+                    }
+
+                    uint32_t cb_bits =
+                        pdep_u32(cb_x * COARSE_BLOCK_WIDTH_IN_PIXELS, fb->tile_x_swizzle_mask) |
+                        pdep_u32(cb_y * COARSE_BLOCK_WIDTH_IN_PIXELS, fb->tile_y_swizzle_mask);
+
+                    uint32_t cb_i = cb_bits / PIXELS_PER_COARSE_BLOCK;
+                    uint32_t coarse_max_depth = coarse_max_depths[cb_i];
+                    if (coarse_max_depth <= min_depth)
+                    {
+                        continue;
+                    }
+
+                    // the farthest pixel of the coarse block is in the rectangle, or every pixel of it is still cleared to the farthest depth
+                    if ((px_x_max - px_x_min == COARSE_BLOCK_WIDTH_IN_PIXELS && px_y_max - px_y_min == COARSE_BLOCK_WIDTH_IN_PIXELS) ||
+                        (fb->tile_pending_clears[tile_id] & (1ULL << cb_i)))
+                    {
+                        return 1;
+                    }
+
+                    int32_t tile_px_x = tile_x * fb->tile_width_in_pixels;
+                    int32_t tile_px_y = tile_y * fb->tile_width_in_pixels;
+
+                    for (int32_t pixel_y = px_y_min, pixel_y_bits = pdep_u32(px_y_min - tile_px_y, fb->tile_y_swizzle_mask);
+                        pixel_y < px_y_max;
+                        pixel_y++, pixel_y_bits = (pixel_y_bits - fb->tile_y_swizzle_mask) & fb->tile_y_swizzle_mask)
+                    {
+                        for (int32_t pixel_x = px_x_min, pixel_x_bits = pdep_u32(px_x_min - tile_px_x, fb->tile_x_swizzle_mask);
+                            pixel_x < px_x_max;
+                            pixel_x++, pixel_x_bits = (pixel_x_bits - fb->tile_x_swizzle_mask) & fb->tile_x_swizzle_mask)
+                        {
+                            // a pixel's samples are PIXELS_PER_FINE_BLOCK apart in its fine block (see MSAA_SAMPLES_PER_PIXEL)
+                            uint32_t px_i = pixel_y_bits | pixel_x_bits;
+                            uint32_t first_sample_i = (px_i & ~(PIXELS_PER_FINE_BLOCK - 1)) * samples_per_pixel + (px_i & (PIXELS_PER_FINE_BLOCK - 1));
+                            for (int32_t sample_i = 0; sample_i < samples_per_pixel; sample_i++)
+                            {
+                                if (min_depth < tile_depths[first_sample_i + sample_i * PIXELS_PER_FINE_BLOCK])
+                                {
+                                    return 1;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+void framebuffer_clear(framebuffer_t* fb, uint32_t color)
+{
+    tilecmd_cleartile_t tilecmd;
+    tilecmd.tilecmd_id = tilecmd_id_cleartile;
+    tilecmd.color = color;
+
+    // the depth bounds of the tiles won't apply to new triangles until each tile resolves this clear
+    fb->num_clears_binned++;
+
+    // the triangles of the visibility buffer are cleared along with it
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        fb->binners[i].num_shade_triangles = 0;
+        fb->binners[i].num_shade_varyings = 0;
+    }
+
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        framebuffer_push_tilecmd(fb, &fb->binners[0], tile_id, &tilecmd.tilecmd_id, sizeof(tilecmd) / sizeof(uint32_t));
+    }
+}
+
+// whether the resolved contents of a tile are already in front of a triangle with the given min_Z.
+// the tile might still have commands queued up, but those can only bring it closer.
+static bool framebuffer_tile_occludes(framebuffer_t* fb, int32_t tile_id, uint32_t min_Z)
+{
+    if (fb->tile_num_clears_resolved[tile_id].load(std::memory_order_acquire) != fb->num_clears_binned)
+    {
+        return false;
+    }
+
+    return (min_Z << 16) >= fb->tile_max_depths[tile_id].load(std::memory_order_relaxed);
+}
+
+// remembers which triangle of the draw is about to be set up, for the visibility buffer
+static __forceinline void framebuffer_begin_shade_triangle(tile_binner_t* binner, const xyzw_i32_t clip_verts[3], uint32_t i0, uint32_t i1, uint32_t i2, uint32_t triangle_index)
+{
+    binner->shade_clip_verts[0] = clip_verts[0];
+    binner->shade_clip_verts[1] = clip_verts[1];
+    binner->shade_clip_verts[2] = clip_verts[2];
+    binner->shade_vertex_ids[0] = i0;
+    binner->shade_vertex_ids[1] = i1;
+    binner->shade_vertex_ids[2] = i2;
+    binner->shade_triangle_index = triangle_index;
+    binner->shade_triangle_id = NO_TRIANGLE;
+}
+
+// what the triangle being set up writes to the visibility buffer.
+// the first time it's binned to a tile, this keeps what framebuffer_shade needs to interpolate its varyings, relative to the pixel (origin_x, origin_y).
+static uint32_t framebuffer_get_shade_triangle_id(framebuffer_t* fb, tile_binner_t* binner, int32_t origin_x, int32_t origin_y)
+{
+    if (!fb->visibility_buffer)
+    {
+        return 0;
+    }
+
+    if (binner->shade_triangle_id != NO_TRIANGLE)
+    {
+        return binner->shade_triangle_id;
+    }
+
+    if (binner->num_shade_triangles == binner->shade_triangles_capacity)
+    {
+        binner->shade_triangles_capacity = binner->shade_triangles_capacity ? binner->shade_triangles_capacity * 2 : 1024;
+        binner->shade_triangles = (shade_triangle_t*)realloc(binner->shade_triangles, binner->shade_triangles_capacity * sizeof(shade_triangle_t));
+        assert(binner->shade_triangles);
+    }
+
+    int32_t num_varyings = binner->num_varyings;
+    int32_t num_triangle_varyings = num_varyings * 3;
+    if (binner->num_shade_varyings + num_triangle_varyings > binner->shade_varyings_capacity)
+    {
+        while (binner->num_shade_varyings + num_triangle_varyings > binner->shade_varyings_capacity)
+        {
+            binner->shade_varyings_capacity = binner->shade_varyings_capacity ? binner->shade_varyings_capacity * 2 : 4096;
+        }
+        binner->shade_varyings = (float*)realloc(binner->shade_varyings, binner->shade_varyings_capacity * sizeof(float));
+        assert(binner->shade_varyings);
+    }
+
+    assert(binner->num_shade_triangles < MAX_SHADE_TRIANGLES_PER_BINNER);
+    int32_t shade_triangle_index = binner->num_shade_triangles++;
+    shade_triangle_t* tri = &binner->shade_triangles[shade_triangle_index];
+
+    // a point of the triangle is sum(b[v] * (x, y, w)[v]) in clip space, with the barycentrics b summing to 1.
+    // it's at (X, Y) in normalized device coordinates when that's proportional to (X, Y, 1), so b is proportional to M^-1 * (X, Y, 1),
+    // where the columns of M are the (x, y, w) of the vertices. the rows of M^-1 are the cross products of the other two columns, up to a scale.
+    const xyzw_i32_t* verts = binner->shade_clip_verts;
+    double max_abs = 0.0;
+    double planes[3][3];
+    for (int32_t v = 0; v < 3; v++)
+    {
+        const xyzw_i32_t* a = &verts[(v + 1) % 3];
+        const xyzw_i32_t* b = &verts[(v + 2) % 3];
+        double row_x = (double)a->y * b->w - (double)a->w * b->y;
+        double row_y = (double)a->w * b->x - (double)a->x * b->w;
+        double row_w = (double)a->x * b->y - (double)a->y * b->x;
+
+        // in window coordinates, X = 2x / width - 1 and Y = 1 - 2y / height
+        planes[v][0] = row_x * 2.0 / fb->width_in_pixels;
+        planes[v][1] = -row_y * 2.0 / fb->height_in_pixels;
+        planes[v][2] = row_w - row_x + row_y + planes[v][0] * origin_x + planes[v][1] * origin_y;
+
+        for (int32_t i = 0; i < 3; i++)
+        {
+            if (fabs(planes[v][i]) > max_abs)
+                max_abs = fabs(planes[v][i]);
+        }
+    }
+
+    // only the ratios matter, so keep them well within the range of floats
+    double scale = max_abs > 0.0 ? 1.0 / max_abs : 0.0;
+    for (int32_t v = 0; v < 3; v++)
+    {
+        for (int32_t i = 0; i < 3; i++)
+        {
+            tri->planes[v][i] = (float)(planes[v][i] * scale);
+        }
+    }
+
+    tri->origin_x = origin_x;
+    tri->origin_y = origin_y;
+    tri->draw_id = binner->draw_id;
+    tri->triangle_index = binner->shade_triangle_index;
+    tri->num_varyings = num_varyings;
+    tri->first_varying = binner->num_shade_varyings;
+    for (int32_t v = 0; v < 3; v++)
+    {
+        memcpy(&binner->shade_varyings[tri->first_varying + v * num_varyings], &binner->varyings[binner->shade_vertex_ids[v] * num_varyings], num_varyings * sizeof(float));
+    }
+    binner->num_shade_varyings += num_triangle_varyings;
+
+    uint32_t binner_id = (uint32_t)(binner - fb->binners);
+    binner->shade_triangle_id = (binner_id << SHADE_TRIANGLE_INDEX_BITS) | (uint32_t)shade_triangle_index;
+    return binner->shade_triangle_id;
+}
+
+// the part of rasterize_triangle after clipping, which batched setup calls directly
+template<int32_t TileWidth>
+static void setup_triangle(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    xyzw_i32_t verts[3]);
+
+// the planes triangles are clipped against
+typedef enum clip_plane_t
+{
+    clip_plane_near,
+    clip_plane_far,
+    clip_plane_left,
+    clip_plane_right,
+    clip_plane_bottom,
+    clip_plane_top,
+    num_clip_planes
+} clip_plane_t;
+
+// a triangle clipped by every plane has at most one extra vertex per plane
+#define MAX_CLIPPED_POLYGON_VERTICES (3 + num_clip_planes)
+
+// signed distance to a clip plane (scaled by something positive), where inside is >= 0.
+// 64 bits since the guard band planes can be far outside the range of 32 bits.
+static int64_t clip_plane_distance(const framebuffer_t* fb, int32_t plane, const xyzw_i32_t* vert)
+{
+    switch (plane)
+    {
+    case clip_plane_near:
+        return vert->z;
+    case clip_plane_far:
+        // z has to be strictly less than w
+        return (int64_t)vert->w - vert->z - 1;
+    case clip_plane_left:
+        return (int64_t)fb->guard_band_x * vert->w + vert->x;
+    case clip_plane_right:
+        return (int64_t)fb->guard_band_x * vert->w - vert->x;
+    case clip_plane_bottom:
+        return (int64_t)fb->guard_band_y * vert->w + vert->y;
+    case clip_plane_top:
+        return (int64_t)fb->guard_band_y * vert->w - vert->y;
+    default:
+        assert(!"Unknown clip plane");
+        return 0;
+    }
+}
+
+// which planes a vertex is outside of, one bit per clip_plane_t
+static uint32_t clip_outcode(const framebuffer_t* fb, const xyzw_i32_t* vert)
+{
+    uint32_t outcode = 0;
+    for (int32_t plane = 0; plane < num_clip_planes; plane++)
+    {
+        if (clip_plane_distance(fb, plane, vert) < 0)
+        {
+            outcode |= 1 << plane;
+        }
+    }
+    return outcode;
+}
+
+// Clips a convex polygon against the planes in plane_mask (Sutherland-Hodgman), in place, and returns the new number of vertices.
+static int32_t clip_polygon(const framebuffer_t* fb, uint32_t plane_mask, xyzw_i32_t* polygon, int32_t num_verts)
+{
+    for (int32_t plane = 0; plane < num_clip_planes && num_verts >= 3; plane++)
+    {
+        if (!(plane_mask & (1 << plane)))
+        {
+            continue;
+        }
+
+        xyzw_i32_t input[MAX_CLIPPED_POLYGON_VERTICES];
+        int64_t dists[MAX_CLIPPED_POLYGON_VERTICES];
+        for (int32_t v = 0; v < num_verts; v++)
+        {
+            input[v] = polygon[v];
+            dists[v] = clip_plane_distance(fb, plane, &input[v]);
+        }
+
+        int32_t num_output_verts = 0;
+        for (int32_t v0 = 0; v0 < num_verts; v0++)
+        {
+            int32_t v1 = v0 + 1 < num_verts ? v0 + 1 : 0;
+
+            if (dists[v0] >= 0)
+            {
+                polygon[num_output_verts++] = input[v0];
+            }
+
+            if ((dists[v0] >= 0) == (dists[v1] >= 0))
+            {
+                continue;
+            }
+
+            // always interpolate from the inside vertex, so a shared edge is clipped the same way for both of its triangles
+            int32_t in_v = dists[v0] >= 0 ? v0 : v1;
+            int32_t out_v = dists[v0] >= 0 ? v1 : v0;
+
+            // s15.16 fraction of the way from the inside vertex to the plane
+            int64_t a = (dists[in_v] << 16) / (dists[in_v] - dists[out_v]);
+
+            xyzw_i32_t clipped;
+            clipped.x = (int32_t)(input[in_v].x + ((((int64_t)input[out_v].x - input[in_v].x) * a + (1 << 15)) >> 16));
+            clipped.y = (int32_t)(input[in_v].y + ((((int64_t)input[out_v].y - input[in_v].y) * a + (1 << 15)) >> 16));
+            clipped.z = (int32_t)(input[in_v].z + ((((int64_t)input[out_v].z - input[in_v].z) * a + (1 << 15)) >> 16));
+            clipped.w = (int32_t)(input[in_v].w + ((((int64_t)input[out_v].w - input[in_v].w) * a + (1 << 15)) >> 16));
+
+            // land exactly on the near and far planes, and keep 0 <= z < w despite the rounding
+            if (plane == clip_plane_near || clipped.z < 0)
+                clipped.z = 0;
+            if (plane == clip_plane_far || clipped.z >= clipped.w)
+                clipped.z = clipped.w - 1;
+
+            assert(clipped.w != 0);
+            polygon[num_output_verts++] = clipped;
+        }
+
+        num_verts = num_output_verts;
+    }
+
+    return num_verts;
+}
+
+template<int32_t TileWidth>
+static void rasterize_triangle(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    xyzw_i32_t clipVerts[3])
+{
+    uint64_t clipping_start_pc = perfcounter_begin(fb);
+
+    uint32_t outcodes[3];
+    outcodes[0] = clip_outcode(fb, &clipVerts[0]);
+    outcodes[1] = clip_outcode(fb, &clipVerts[1]);
+    outcodes[2] = clip_outcode(fb, &clipVerts[2]);
+
+    xyzw_i32_t polygon[MAX_CLIPPED_POLYGON_VERTICES] = { clipVerts[0], clipVerts[1], clipVerts[2] };
+    int32_t num_polygon_verts = 3;
+
+    if (outcodes[0] & outcodes[1] & outcodes[2])
+    {
+        // fully outside one of the planes
+        num_polygon_verts = 0;
+    }
+    else if (outcodes[0] | outcodes[1] | outcodes[2])
+    {
+        // only triangles that are behind the near plane, past the far plane, or out of the guard band get clipped,
+        // and all of the planes are clipped against in one pass. the result is drawn as a triangle fan.
+        num_polygon_verts = clip_polygon(fb, outcodes[0] | outcodes[1] | outcodes[2], polygon, num_polygon_verts);
+    }
+
+    perfcounter_end(&binner->perfcounters.clipping, clipping_start_pc);
+
+    if (num_polygon_verts < 3)
+    {
+        binner->stats.triangles_culled_clipping++;
+        return;
+    }
+
+    uint64_t commonsetup_start_pc = perfcounter_begin(fb);
+
+    // transform vertices from clip space to window coordinates
+    xyzw_i32_t window_verts[MAX_CLIPPED_POLYGON_VERTICES];
+    for (int32_t v = 0; v < num_polygon_verts; v++)
+    {
+        const xyzw_i32_t* clipVert = &polygon[v];
+        xyzw_i32_t* vert = &window_verts[v];
+
+        int32_t one_over_w = s1516_div(s1516_int(1), clipVert->w);
+
+        // convert s15.16 (in clip space) to s16.8 window coordinates
+        // note to self: should probably avoid round-to-zero here? otherwise geometry warps inwards to the center of the screen
+        vert->x = s168_s1516(s1516_mul(s1516_div(s1516_add(s1516_mul(+clipVert->x, one_over_w), s1516_int(1)), s1516_int(2)), s1516_int(fb->width_in_pixels)));
+        vert->y = s168_s1516(s1516_mul(s1516_div(s1516_add(s1516_mul(-clipVert->y, one_over_w), s1516_int(1)), s1516_int(2)), s1516_int(fb->height_in_pixels)));
+
+        // perform z/w, rounding down to maintain the z < w upper bound
+        vert->z = ((int64_t)clipVert->z * one_over_w - (clipVert->w / 2)) >> 16;
+        if (vert->z < 0)
+            vert->z = 0;
+
+        // Should be 0 <= z < w, thanks to near and far plane clipping
+        assert(vert->z >= 0 && vert->z <= 0xFFFF);
+
+        vert->w = clipVert->w;
+    }
+
+    perfcounter_end(&binner->perfcounters.common_setup, commonsetup_start_pc);
+
+    for (int32_t v = 2; v < num_polygon_verts; v++)
+    {
+        xyzw_i32_t verts[3] = { window_verts[0], window_verts[v - 1], window_verts[v] };
+        setup_triangle<TileWidth>(fb, binner, verts);
+    }
+}
+
+// computes how much edge v of a multisampled triangle goes up from the corner of a pixel to each of its samples.
+// edge is the edge equation at the corner of any pixel, before it's shifted down to the precision of the vertices,
+// so the offsets round exactly like each sample's own edge equation would.
+static void setup_sample_edge_offsets(int64_t edge, int64_t edge_dx, int64_t edge_dy, int32_t v, sample_edge_offsets_t* sample_offsets)
+{
+    for (int32_t sample_i = 0; sample_i < MSAA_SAMPLES_PER_PIXEL; sample_i++)
+    {
+        int64_t sample_edge = edge + kMsaaSampleXs[sample_i] * edge_dx + kMsaaSampleYs[sample_i] * edge_dy;
+        int64_t offset = (sample_edge >> 8) - (edge >> 8);
+        assert(offset >= INT32_MIN && offset <= INT32_MAX);
+        sample_offsets->edges[sample_i][v] = (int32_t)offset;
+    }
+}
+
+// bins a triangle that's already clipped and in window coordinates (s16.8 x and y, unorm16 z)
+template<int32_t TileWidth>
+static void setup_triangle(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    xyzw_i32_t verts[3])
+{
+    uint64_t commonsetup_start_pc = perfcounter_begin(fb);
+
+    int32_t fully_clipped = 0;
+
+    // how many of the tiles the triangle touches got a command, and how many were skipped for being in front of it
+    int32_t num_tiles_binned = 0;
+    int32_t num_tiles_occluded = 0;
+
+    uint32_t min_Z = verts[0].z;
+    uint32_t max_Z = verts[0].z;
+    for (int32_t v = 1; v < 3; v++)
+    {
+        if ((uint32_t)verts[v].z < min_Z)
+            min_Z = (uint32_t)verts[v].z;
+        
+        if ((uint32_t)verts[v].z > max_Z)
+            max_Z = (uint32_t)verts[v].z;
+    }
+    
+    // get window coordinates bounding box
+    int32_t bbox_min_x = verts[0].x;
+    if (verts[1].x < bbox_min_x) bbox_min_x = verts[1].x;
+    if (verts[2].x < bbox_min_x) bbox_min_x = verts[2].x;
+    int32_t bbox_max_x = verts[0].x;
+    if (verts[1].x > bbox_max_x) bbox_max_x = verts[1].x;
+    if (verts[2].x > bbox_max_x) bbox_max_x = verts[2].x;
+    int32_t bbox_min_y = verts[0].y;
+    if (verts[1].y < bbox_min_y) bbox_min_y = verts[1].y;
+    if (verts[2].y < bbox_min_y) bbox_min_y = verts[2].y;
+    int32_t bbox_max_y = verts[0].y;
+    if (verts[1].y > bbox_max_y) bbox_max_y = verts[1].y;
+    if (verts[2].y > bbox_max_y) bbox_max_y = verts[2].y;
+
+    // clip triangles that are fully outside the scissor rect (scissor rect = whole window)
+    if (bbox_max_x < 0 ||
+        bbox_max_y < 0 ||
+        bbox_min_x >= (int32_t)(fb->width_in_pixels << 8) ||
+        bbox_min_y >= (int32_t)(fb->height_in_pixels << 8))
+    {
+        fully_clipped = 1;
+        binner->stats.triangles_culled_offscreen++;
+        goto commonsetup_end;
+    }
+
+    int32_t clamped_bbox_min_x = bbox_min_x, clamped_bbox_max_x = bbox_max_x;
+    int32_t clamped_bbox_min_y = bbox_min_y, clamped_bbox_max_y = bbox_max_y;
+
+    // clamp bbox to scissor rect
+    if (clamped_bbox_min_x < 0) clamped_bbox_min_x = 0;
+    if (clamped_bbox_min_y < 0) clamped_bbox_min_y = 0;
+    if (clamped_bbox_max_x >= (int32_t)(fb->width_in_pixels << 8)) clamped_bbox_max_x = ((int32_t)fb->width_in_pixels << 8) - 1;
+    if (clamped_bbox_max_y >= (int32_t)(fb->height_in_pixels << 8)) clamped_bbox_max_y = ((int32_t)fb->height_in_pixels << 8) - 1;
+
+    // "small" triangles are no wider than a tile.
+    int32_t is_large =
+        (bbox_max_x - bbox_min_x) >= (TILE_WIDTH_IN_PIXELS << 8) ||
+        (bbox_max_y - bbox_min_y) >= (TILE_WIDTH_IN_PIXELS << 8);
+
+commonsetup_end:
+
+    perfcounter_end(&binner->perfcounters.common_setup, commonsetup_start_pc);
+
+    if (fully_clipped)
+    {
+        return;
+    }
+
+    // the visibility buffer interpolates the triangle's varyings relative to a pixel of its bbox that's on screen
+    int32_t shade_origin_x = (clamped_bbox_min_x + clamped_bbox_max_x) >> 9;
+    int32_t shade_origin_y = (clamped_bbox_min_y + clamped_bbox_max_y) >> 9;
+
+    uint64_t setup_start_pc = perfcounter_begin(fb);
+
+    if (!is_large)
+    {
+        // since this is a small triangle, that means the triangle is smaller than a tile.
+        // that means it can overlap at most 2x2 adjacent tiles if it's in the middle of all of them.
+        // just need to figure out which boxes are overlapping the triangle's bbox
+        int32_t first_tile_x = (bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_y = (bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_x = (bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_y = (bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        
+        // pixel coordinates of the first and last tile of the (up to) 2x2 block of tiles
+        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_px_x = (last_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_px_y = (last_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+
+        // range of coarse blocks affected (relative to top left of 2x2 tile block)
+        int32_t first_rel_cb_x = ((bbox_min_x - first_tile_px_x) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t first_rel_cb_y = ((bbox_min_y - first_tile_px_y) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t last_rel_cb_x = ((bbox_max_x - first_tile_px_x) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
+        int32_t last_rel_cb_y = ((bbox_max_y - first_tile_px_y) >> 8) / COARSE_BLOCK_WIDTH_IN_PIXELS;
+
+        tilecmd_drawsmalltri_t drawsmalltricmd;
+        drawsmalltricmd.tilecmd_id = tilecmd_id_drawsmalltri;
+
+        // make vertices relative to the last tile they're in
+        for (int32_t v = 0; v < 3; v++)
+        {
+            // the point of making them relative is to lower the required precision to 4 hex digits
+            assert((verts[v].x - last_tile_px_x) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].x - last_tile_px_x) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
+            assert((verts[v].y - last_tile_px_y) >= (-TILE_WIDTH_IN_PIXELS << 8) && (verts[v].y - last_tile_px_y) <= ((TILE_WIDTH_IN_PIXELS << 8) - 1));
+
+            verts[v].x -= last_tile_px_x;
+            verts[v].y -= last_tile_px_y;
+        }
+
+        int32_t triarea2 = (verts[1].x - verts[0].x) * (verts[2].y - verts[0].y) - (verts[1].y - verts[0].y) * (verts[2].x - verts[0].x);
+
+        // round away from zero to guarantee edge equations don't become greater than area
+        if (triarea2 < 0)
+            triarea2 -= 0x7F;
+        else if (triarea2 > 0)
+            triarea2 += 0x7F;
+
+        if (triarea2 < 0 && triarea2 > -256)
+        {
+            // force to zero, since right shift of negative numbers never reach zero
+            triarea2 = 0;
+        }
+
+        triarea2 = triarea2 >> 8;
+        
+        if (triarea2 == 0)
+        {
+            binner->stats.triangles_culled_zero_area++;
+            goto setup_end;
+        }
+
+        if (triarea2 < 0)
+        {
+            xyzw_i32_t tmp = verts[1];
+            verts[1] = verts[2];
+            verts[2] = tmp;
+            triarea2 = -triarea2;
+
+            // backface culling
+            binner->stats.triangles_culled_backface++;
+            goto setup_end;
+        }
+
+        // compute 1/(2triarea) and convert to a pseudo 8.16 floating point value
+        int32_t triarea2_lzcnt = lzcnt(triarea2);
+        int32_t triarea2_mantissa_rshift = (31 - 16) - triarea2_lzcnt;
+        int32_t triarea2_mantissa;
+        if (triarea2_mantissa_rshift < 0)
+            triarea2_mantissa = triarea2 << -triarea2_mantissa_rshift;
+        else
+            triarea2_mantissa = triarea2 >> triarea2_mantissa_rshift;
+        assert(triarea2_mantissa & 0x10000);
+        
+        // perform the reciprocal
+        // note: triarea2_mantissa is currently normalized as 1.16, and so is the numerator of the division (before being adjusted for rounding)
+        int32_t rcp_triarea2_mantissa = 0xFFFFFFFF / triarea2_mantissa;
+        assert(rcp_triarea2_mantissa != 0);
+        
+        // ensure the mantissa is denormalized so it fits in 16 bits
+        int32_t rcp_triarea2_mantissa_rshift = (31 - 15) - lzcnt(rcp_triarea2_mantissa);
+        if (rcp_triarea2_mantissa_rshift < 0)
+            rcp_triarea2_mantissa = rcp_triarea2_mantissa << -rcp_triarea2_mantissa_rshift;
+        else
+            rcp_triarea2_mantissa = rcp_triarea2_mantissa >> rcp_triarea2_mantissa_rshift;
+        assert(!(rcp_triarea2_mantissa & 0xFFFF0000));
+        assert(rcp_triarea2_mantissa & 0x8000);
+
+        assert(rcp_triarea2_mantissa < 0x10000);
+        rcp_triarea2_mantissa = rcp_triarea2_mantissa & 0xFFFF;
+        rcp_triarea2_mantissa_rshift = (triarea2_mantissa_rshift + 1) - rcp_triarea2_mantissa_rshift;
+
+        drawsmalltricmd.shifted_triarea2 = triarea2_mantissa >> 1;
+        drawsmalltricmd.rcp_triarea2_mantissa = rcp_triarea2_mantissa;
+        drawsmalltricmd.rcp_triarea2_rshift = rcp_triarea2_mantissa_rshift;
+
+        // compute edge equations with reduced precision thanks to being localized to the tiles
+
+        int32_t edges[3];
+        int32_t edge_dxs[3], edge_dys[3];
+        sample_edge_offsets_t sample_offsets;
+        for (int32_t v = 0; v < 3; v++)
+        {
+            int32_t v1 = (v + 1) % 3;
+            int32_t v2 = (v + 2) % 3;
+
+            // find how the edge equation varies along x and y
+            edge_dxs[v] = verts[v1].y - verts[v].y;
+            edge_dys[v] = verts[v].x - verts[v1].x;
+
+            // compute edge equation
+            // |  x  y  z |
+            // | ax ay  0 |
+            // | bx by  0 |
+            // = ax*by - ay*bx
+            // eg: a = (px-v0), b = (v1-v0)
+            // note: evaluated at px = (0.5,0.5) because the vertices are relative to the last tile,
+            // or at px = (0,0) when multisampling, where the samples are offsets from the corner of the pixel
+            const int32_t s168_zero_pt_five = 0x80;
+            const int32_t edge_origin = fb->msaa ? 0 : s168_zero_pt_five;
+            edges[v] = ((edge_origin - verts[v].x) * edge_dxs[v]) - ((edge_origin - verts[v].y) * -edge_dys[v]);
+
+            if (fb->msaa)
+            {
+                setup_sample_edge_offsets(edges[v], edge_dxs[v], edge_dys[v], v, &sample_offsets);
+            }
+
+            // the arithmetic shift rounds to negative infinity, whatever the sign of the edge at the origin of the tiles,
+            // so the same pixels are covered with every tile size (and the sample offsets round the same way)
+            edges[v] = edges[v] >> 8;
+
+            // Top-left rule: shift top-left edges ever so slightly outward to make the top-left edges be the tie-breakers when rasterizing adjacent triangles
+            if ((verts[v].y == verts[v1].y && verts[v].x < verts[v1].x) || verts[v].y > verts[v1].y) edges[v]--;
+        }
+
+        drawsmalltricmd.min_Z = min_Z;
+        drawsmalltricmd.max_Z = max_Z;
+
+        for (int32_t v = 0; v < 3; v++)
+        {
+            drawsmalltricmd.edge_dxs[v] = edge_dxs[v];
+            drawsmalltricmd.edge_dys[v] = edge_dys[v];
+            drawsmalltricmd.vert_Zs[v] = verts[v].z;
+        }
+
+        // draw top left tile
+        int32_t first_tile_id = first_tile_y * fb->width_in_tiles + first_tile_x;
+        if (first_tile_x >= 0 && first_tile_y >= 0)
+        {
+            for (int32_t v = 0; v < 3; v++)
+            {
+                drawsmalltricmd.edges[v] = edges[v] + (
+                    edge_dxs[v] * (first_tile_x - last_tile_x) +
+                    edge_dys[v] * (first_tile_y - last_tile_y)) * TILE_WIDTH_IN_PIXELS;
+            }
+
+            perfcounter_end(&binner->perfcounters.smalltri_setup, setup_start_pc);
+
+            if (!framebuffer_tile_occludes(fb, first_tile_id, min_Z))
+            {
+                drawsmalltricmd.triangle_id = framebuffer_get_shade_triangle_id(fb, binner, shade_origin_x, shade_origin_y);
+                framebuffer_push_smalltri_tilecmd(fb, binner, first_tile_id, &drawsmalltricmd, fb->msaa ? &sample_offsets : NULL);
+                num_tiles_binned++;
+            }
+            else
+            {
+                num_tiles_occluded++;
+            }
+
+            setup_start_pc = perfcounter_begin(fb);
+        }
+
+        // draw top right tile
+        if (last_tile_x > first_tile_x &&
+            last_tile_x < fb->width_in_tiles && first_tile_y >= 0)
+        {
+            for (int32_t v = 0; v < 3; v++)
+            {
+                drawsmalltricmd.edges[v] = edges[v] + edge_dys[v] * (first_tile_y - last_tile_y) * TILE_WIDTH_IN_PIXELS;
+            }
+
+            int32_t tile_id_right = first_tile_id + 1;
+
+            perfcounter_end(&binner->perfcounters.smalltri_setup, setup_start_pc);
+
+            if (!framebuffer_tile_occludes(fb, tile_id_right, min_Z))
+            {
+                drawsmalltricmd.triangle_id = framebuffer_get_shade_triangle_id(fb, binner, shade_origin_x, shade_origin_y);
+                framebuffer_push_smalltri_tilecmd(fb, binner, tile_id_right, &drawsmalltricmd, fb->msaa ? &sample_offsets : NULL);
+                num_tiles_binned++;
+            }
+            else
+            {
+                num_tiles_occluded++;
+            }
+
+            setup_start_pc = perfcounter_begin(fb);
+        }
+
+        // draw bottom left tile
+        if (last_tile_y > first_tile_y &&
+            first_tile_x >= 0 && last_tile_y < fb->height_in_tiles)
+        {
+            for (int32_t v = 0; v < 3; v++)
+            {
+                drawsmalltricmd.edges[v] = edges[v] + edge_dxs[v] * (first_tile_x - last_tile_x) * TILE_WIDTH_IN_PIXELS;
+            }
+
+            int32_t tile_id_down = first_tile_id + fb->width_in_tiles;
+
+            perfcounter_end(&binner->perfcounters.smalltri_setup, setup_start_pc);
+
+            if (!framebuffer_tile_occludes(fb, tile_id_down, min_Z))
+            {
+                drawsmalltricmd.triangle_id = framebuffer_get_shade_triangle_id(fb, binner, shade_origin_x, shade_origin_y);
+                framebuffer_push_smalltri_tilecmd(fb, binner, tile_id_down, &drawsmalltricmd, fb->msaa ? &sample_offsets : NULL);
+                num_tiles_binned++;
+            }
+            else
+            {
+                num_tiles_occluded++;
+            }
+
+            setup_start_pc = perfcounter_begin(fb);
+        }
+
+        // draw bottom right tile
+        if (last_tile_x > first_tile_x && last_tile_y > first_tile_y &&
+            last_tile_x < fb->width_in_tiles && last_tile_y < fb->height_in_tiles)
+        {
+            for (int32_t v = 0; v < 3; v++)
+            {
+                drawsmalltricmd.edges[v] = edges[v];
+            }
+
+            int32_t tile_id_downright = first_tile_id + 1 + fb->width_in_tiles;
+
+            perfcounter_end(&binner->perfcounters.smalltri_setup, setup_start_pc);
+
+            if (!framebuffer_tile_occludes(fb, tile_id_downright, min_Z))
+            {
+                drawsmalltricmd.triangle_id = framebuffer_get_shade_triangle_id(fb, binner, shade_origin_x, shade_origin_y);
+                framebuffer_push_smalltri_tilecmd(fb, binner, tile_id_downright, &drawsmalltricmd, fb->msaa ? &sample_offsets : NULL);
+                num_tiles_binned++;
+            }
+            else
+            {
+                num_tiles_occluded++;
+            }
+
+            setup_start_pc = perfcounter_begin(fb);
+        }
+    }
+    else // large triangle
+    {
+        // for large triangles, test each tile in their bbox for overlap
+        // done using scalar code for simplicity, since rasterization dominates large triangle performance anyways.
+        int32_t first_tile_x = (clamped_bbox_min_x >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_y = (clamped_bbox_min_y >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_x = (clamped_bbox_max_x >> 8) / TILE_WIDTH_IN_PIXELS;
+        int32_t last_tile_y = (clamped_bbox_max_y >> 8) / TILE_WIDTH_IN_PIXELS;
+
+        // evaluate edge equation at the top left tile
+        int32_t first_tile_px_x = (first_tile_x << 8) * TILE_WIDTH_IN_PIXELS;
+        int32_t first_tile_px_y = (first_tile_y << 8) * TILE_WIDTH_IN_PIXELS;
+
+        // 64 bit integers are used for the edge equations here because multiplying two 16.8 numbers requires up to 48 bits
+        // this results in some extra overhead, but it's not a big deal when you consider that this happens only for large triangles.
+        // The tens of thousands of pixels that large triangles generate outweigh the cost of slightly more expensive setup.
+
+        int64_t triarea2 = ((int64_t)verts[1].x - verts[0].x) * ((int64_t)verts[2].y - verts[0].y) - ((int64_t)verts[1].y - verts[0].y) * ((int64_t)verts[2].x - verts[0].x);
+
+        // round away from zero to guarantee edge equations don't become greater than area
+        if (triarea2 < 0)
+            triarea2 -= 0x7F;
+        else if (triarea2 > 0)
+            triarea2 += 0x7F;
+
+        if (triarea2 < 0 && triarea2 > -256)
+        {
+            // force to zero, since right shift of negative numbers never reach zero
+            triarea2 = 0;
+        }
+
+        triarea2 = triarea2 >> 8;
+        
+        if (triarea2 == 0)
+        {
+            binner->stats.triangles_culled_zero_area++;
+            goto setup_end;
+        }
+
+        if (triarea2 < 0)
+        {
+            xyzw_i32_t tmp = verts[1];
+            verts[1] = verts[2];
+            verts[2] = tmp;
+            triarea2 = -triarea2;
+            
+            // backface culling
+            binner->stats.triangles_culled_backface++;
+            goto setup_end;
+        }
+
+        // compute 1/(2triarea) and convert to a pseudo 8.16 floating point value
+        int32_t triarea2_lzcnt = (int32_t)lzcnt64(triarea2);
+        int32_t triarea2_mantissa_rshift = (63 - 16) - triarea2_lzcnt;
+        int32_t triarea2_mantissa;
+        if (triarea2_mantissa_rshift < 0)
+            triarea2_mantissa = (int32_t)(triarea2 << -triarea2_mantissa_rshift);
+        else
+            triarea2_mantissa = (int32_t)(triarea2 >> triarea2_mantissa_rshift);
+        assert(triarea2_mantissa & 0x10000);
+
+        // perform the reciprocal
+        // note: triarea2_mantissa is currently normalized as 1.16, and so is the numerator of the division (before being adjusted for rounding)
+        int32_t rcp_triarea2_mantissa = 0xFFFFFFFF / triarea2_mantissa;
+        assert(rcp_triarea2_mantissa != 0);
+
+        // ensure the mantissa is denormalized so it fits in 16 bits
+        int32_t rcp_triarea2_mantissa_rshift = (31 - 15) - lzcnt(rcp_triarea2_mantissa);
+        if (rcp_triarea2_mantissa_rshift < 0)
+            rcp_triarea2_mantissa = rcp_triarea2_mantissa << -rcp_triarea2_mantissa_rshift;
+        else
+            rcp_triarea2_mantissa = rcp_triarea2_mantissa >> rcp_triarea2_mantissa_rshift;
+        assert(!(rcp_triarea2_mantissa & 0x10000));
+        assert(rcp_triarea2_mantissa & 0x8000);
+
+        assert(rcp_triarea2_mantissa < 0x10000);
+        rcp_triarea2_mantissa = rcp_triarea2_mantissa & 0xFFFF;
+        rcp_triarea2_mantissa_rshift = (triarea2_mantissa_rshift + 1) - rcp_triarea2_mantissa_rshift;
+
+        int64_t edges[3];
+        int64_t edge_dxs[3], edge_dys[3];
+        sample_edge_offsets_t sample_offsets;
+        for (int32_t v = 0; v < 3; v++)
+        {
+            int32_t v1 = (v + 1) % 3;
+            int32_t v2 = (v + 2) % 3;
+
+            // find how the edge equation varies along x and y
+            edge_dxs[v] = verts[v1].y - verts[v].y;
+            edge_dys[v] = verts[v].x - verts[v1].x;
+
+            // compute edge equation
+            // |  x  y  z |
+            // | ax ay  0 |
+            // | bx by  0 |
             // = ax*by - ay*bx
             // eg: a = (px-v0), b = (v1-v0)
-            // note: evaluated at px + (0.5,0.5)
+            // note: evaluated at px + (0.5,0.5), or at px when multisampling
             const int32_t s168_zero_pt_five = 0x80;
-            edges[v] = ((int64_t)first_tile_px_x + s168_zero_pt_five - verts[v].x) * edge_dxs[v] - ((int64_t)first_tile_px_y + s168_zero_pt_five - verts[v].y) * -edge_dys[v];
+            const int32_t edge_origin = fb->msaa ? 0 : s168_zero_pt_five;
+            edges[v] = ((int64_t)first_tile_px_x + edge_origin - verts[v].x) * edge_dxs[v] - ((int64_t)first_tile_px_y + edge_origin - verts[v].y) * -edge_dys[v];
+
+            if (fb->msaa)
+            {
+                setup_sample_edge_offsets(edges[v], edge_dxs[v], edge_dys[v], v, &sample_offsets);
+            }
+
+            // the arithmetic shift rounds to negative infinity, whatever the sign of the edge at the origin of the tiles,
+            // so the same pixels are covered with every tile size (and the sample offsets round the same way)
+            edges[v] = edges[v] >> 8;
+
+            // Top-left rule: shift top-left edges ever so slightly outward to make the top-left edges be the tie-breakers when rasterizing adjacent triangles
+            if ((verts[v].y == verts[v1].y && verts[v].x < verts[v1].x) || verts[v].y > verts[v1].y) edges[v]--;
+        }
+
+        int64_t tile_edge_dxs[3];
+        int64_t tile_edge_dys[3];
+        for (int32_t v = 0; v < 3; v++)
+        {
+            tile_edge_dxs[v] = edge_dxs[v] * TILE_WIDTH_IN_PIXELS;
+            tile_edge_dys[v] = edge_dys[v] * TILE_WIDTH_IN_PIXELS;
+        }
+
+        int64_t edge_trivRejs[3];
+        int64_t edge_trivAccs[3];
+
+        for (int32_t v = 0; v < 3; v++)
+        {
+            edge_trivRejs[v] = edges[v];
+            edge_trivAccs[v] = edges[v];
+            if (tile_edge_dxs[v] < 0) edge_trivRejs[v] += tile_edge_dxs[v];
+            if (tile_edge_dxs[v] > 0) edge_trivAccs[v] += tile_edge_dxs[v];
+            if (tile_edge_dys[v] < 0) edge_trivRejs[v] += tile_edge_dys[v];
+            if (tile_edge_dys[v] > 0) edge_trivAccs[v] += tile_edge_dys[v];
+        }
+
+        largetri_setup_t setup;
+        for (int32_t v = 0; v < 3; v++)
+        {
+            assert(edge_dxs[v] >= INT32_MIN && edge_dxs[v] <= INT32_MAX);
+            assert(edge_dys[v] >= INT32_MIN && edge_dys[v] <= INT32_MAX);
+
+            setup.edge_dxs[v] = (int32_t)edge_dxs[v];
+            setup.edge_dys[v] = (int32_t)edge_dys[v];
+            setup.vert_Zs[v] = verts[v].z;
+        }
+        setup.min_Z = min_Z;
+        setup.max_Z = max_Z;
+        setup.shifted_triarea2 = triarea2_mantissa >> 1;
+        setup.rcp_triarea2_mantissa = rcp_triarea2_mantissa;
+        setup.rcp_triarea2_rshift = rcp_triarea2_mantissa_rshift;
+        setup.triangle_id = 0;
+        setup.padding = 0;
+
+        // only written out once the triangle turns out to cover a tile
+        const largetri_setup_t* pushed_setup = NULL;
+
+        int32_t tile_row_start = first_tile_y * fb->width_in_tiles + first_tile_x;
+        for (int32_t tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++)
+        {
+            int64_t tile_i_edges[3];
+            int64_t tile_i_edge_trivRejs[3];
+            int64_t tile_i_edge_trivAccs[3];
+            for (int32_t v = 0; v < 3; v++)
+            {
+                tile_i_edges[v] = edges[v];
+                tile_i_edge_trivRejs[v] = edge_trivRejs[v];
+                tile_i_edge_trivAccs[v] = edge_trivAccs[v];
+            }
+
+            int32_t tile_i = tile_row_start;
+
+            for (int32_t tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++)
+            {
+                // trivial reject if at least one edge doesn't cover the tile at all
+                int32_t trivially_rejected = tile_i_edge_trivRejs[0] >= 0 || tile_i_edge_trivRejs[1] >= 0 || tile_i_edge_trivRejs[2] >= 0;
+
+                // also reject if everything in the tile is already in front of the triangle
+                if (!trivially_rejected && framebuffer_tile_occludes(fb, tile_i, min_Z))
+                {
+                    trivially_rejected = 1;
+                    num_tiles_occluded++;
+                }
+
+                if (!trivially_rejected)
+                {
+                    tilecmd_drawlargetri_t drawtilecmd;
+
+                    int32_t edge_needs_test[3];
+                    edge_needs_test[0] = tile_i_edge_trivAccs[0] >= 0;
+                    edge_needs_test[1] = tile_i_edge_trivAccs[1] >= 0;
+                    edge_needs_test[2] = tile_i_edge_trivAccs[2] >= 0;
+
+                    drawtilecmd.tilecmd_id = tilecmd_id_drawlargetri_0edgemask;
+                    drawtilecmd.tilecmd_id += edge_needs_test[0];
+                    drawtilecmd.tilecmd_id += edge_needs_test[1] << 1;
+                    drawtilecmd.tilecmd_id += edge_needs_test[2] << 2;
+
+                    for (int32_t v = 0; v < 3; v++)
+                    {
+                        // the maximum change in area over one tile shouldn't exceed int32
+                        assert(tile_i_edge_trivAccs[v] - tile_i_edge_trivRejs[v] <= INT32_MAX);
+
+                        if (edge_needs_test[v])
+                        {
+                            // ensure edges to test are within range of 32 bits (they should be, since trivial accept/reject only keeps nearby edges)
+                            assert(tile_i_edges[v] >= INT32_MIN && tile_i_edges[v] <= INT32_MAX);
+                            drawtilecmd.tile_edges[v] = (int32_t)tile_i_edges[v];
+                        }
+                        else
+                        {
+                            // the edge is made relative to the corner of the tile to prevent overflows,
+                            // so compute an initial offset for the unnormalized barycentric coordinates instead
+                            int64_t shifted_e = -tile_i_edges[v];
+                            if (rcp_triarea2_mantissa_rshift < 0)
+                                shifted_e = shifted_e << -rcp_triarea2_mantissa_rshift;
+                            else
+                                shifted_e = shifted_e >> rcp_triarea2_mantissa_rshift;
+
+                            assert(shifted_e >= INT32_MIN && shifted_e <= INT32_MAX);
+                            drawtilecmd.tile_edges[v] = (int32_t)shifted_e;
+                        }
+                    }
+
+                    if (!pushed_setup)
+                    {
+                        setup.triangle_id = framebuffer_get_shade_triangle_id(fb, binner, shade_origin_x, shade_origin_y);
+                        pushed_setup = framebuffer_push_largetri_setup(binner, &setup, fb->msaa ? &sample_offsets : NULL);
+                    }
+                    drawtilecmd.setup = pushed_setup;
+
+                    perfcounter_end(&binner->perfcounters.largetri_setup, setup_start_pc);
+                    framebuffer_push_tilecmd(fb, binner, tile_i, &drawtilecmd.tilecmd_id, sizeof(drawtilecmd) / sizeof(uint32_t));
+                    num_tiles_binned++;
+
+                    setup_start_pc = perfcounter_begin(fb);
+                }
+
+                tile_i++;
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    tile_i_edges[v] += tile_edge_dxs[v];
+                    tile_i_edge_trivRejs[v] += tile_edge_dxs[v];
+                    tile_i_edge_trivAccs[v] += tile_edge_dxs[v];
+                }
+            }
+
+            tile_row_start += fb->width_in_tiles;
+            for (int32_t v = 0; v < 3; v++)
+            {
+                edges[v] += tile_edge_dys[v];
+                edge_trivRejs[v] += tile_edge_dys[v];
+                edge_trivAccs[v] += tile_edge_dys[v];
+            }
+        }
+    }
+
+    // a large triangle can still miss every tile of its bbox that's on screen
+    if (num_tiles_binned)
+        binner->stats.triangles_binned++;
+    else if (num_tiles_occluded)
+        binner->stats.triangles_culled_occluded++;
+    else
+        binner->stats.triangles_culled_offscreen++;
+
+setup_end:;
+    if (is_large)
+    {
+        perfcounter_end(&binner->perfcounters.largetri_setup, setup_start_pc);
+    }
+    else
+    {
+        perfcounter_end(&binner->perfcounters.smalltri_setup, setup_start_pc);
+    }
+} 
+
+template<int32_t TileWidth>
+static void framebuffer_bin(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    const int32_t* vertices,
+    uint32_t num_vertices)
+{
+    binner->stats.triangles += num_vertices / 3;
+
+    for (uint32_t vertex_id = 0, cmpt_id = 0; vertex_id < num_vertices; vertex_id += 3, cmpt_id += 12)
+    {
+        xyzw_i32_t verts[3];
+
+        verts[0].x = vertices[cmpt_id + 0];
+        verts[0].y = vertices[cmpt_id + 1];
+        verts[0].z = vertices[cmpt_id + 2];
+        verts[0].w = vertices[cmpt_id + 3];
+        verts[1].x = vertices[cmpt_id + 4];
+        verts[1].y = vertices[cmpt_id + 5];
+        verts[1].z = vertices[cmpt_id + 6];
+        verts[1].w = vertices[cmpt_id + 7];
+        verts[2].x = vertices[cmpt_id + 8];
+        verts[2].y = vertices[cmpt_id + 9];
+        verts[2].z = vertices[cmpt_id + 10];
+        verts[2].w = vertices[cmpt_id + 11];
+
+        if (fb->visibility_buffer)
+        {
+            framebuffer_begin_shade_triangle(binner, verts, vertex_id, vertex_id + 1, vertex_id + 2, vertex_id / 3);
+        }
+
+        rasterize_triangle<TileWidth>(fb, binner, verts);
+    }
+}
+
+void framebuffer_draw(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    uint32_t num_vertices)
+{
+    assert(fb);
+    assert(vertices);
+    assert(num_vertices % 3 == 0);
+
+    framebuffer_enforce_command_budget(fb);
+
+    uint64_t trace_start = trace_begin(fb);
+    fb->binners[0].worker_id = 0;
+    fb->binners[0].varyings = NULL;
+    fb->binners[0].num_varyings = 0;
+    fb->binners[0].draw_id = 0;
+    fb->kernels->bin(fb, &fb->binners[0], vertices, num_vertices);
+    trace_end(fb, 0, "draw", "triangles", (int32_t)(num_vertices / 3), trace_start);
+}
+
+template<int32_t TileWidth>
+static void framebuffer_bin_indexed_scalar(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t first_index,
+    uint32_t end_index)
+{
+    binner->stats.triangles += (end_index - first_index) / 3;
+
+    for (uint32_t index_id = first_index; index_id < end_index; index_id += 3)
+    {
+        xyzw_i32_t verts[3];
+
+        uint32_t cmpt_i0 = indices[index_id + 0] * 4;
+        uint32_t cmpt_i1 = indices[index_id + 1] * 4;
+        uint32_t cmpt_i2 = indices[index_id + 2] * 4;
+
+        verts[0].x = vertices[cmpt_i0 + 0];
+        verts[0].y = vertices[cmpt_i0 + 1];
+        verts[0].z = vertices[cmpt_i0 + 2];
+        verts[0].w = vertices[cmpt_i0 + 3];
+        verts[1].x = vertices[cmpt_i1 + 0];
+        verts[1].y = vertices[cmpt_i1 + 1];
+        verts[1].z = vertices[cmpt_i1 + 2];
+        verts[1].w = vertices[cmpt_i1 + 3];
+        verts[2].x = vertices[cmpt_i2 + 0];
+        verts[2].y = vertices[cmpt_i2 + 1];
+        verts[2].z = vertices[cmpt_i2 + 2];
+        verts[2].w = vertices[cmpt_i2 + 3];
+
+        if (fb->visibility_buffer)
+        {
+            framebuffer_begin_shade_triangle(binner, verts, indices[index_id + 0], indices[index_id + 1], indices[index_id + 2], index_id / 3);
+        }
+
+        rasterize_triangle<TileWidth>(fb, binner, verts);
+    }
+}
+
+// s1516_mul on 8 lanes at once, with the same rounding and saturation
+TARGET_AVX2 static __forceinline __m256i s1516_mul_avx2(__m256i a, __m256i b)
+{
+    // 64 bit products of the even and odd lanes, plus rounding
+    const __m256i rounding = _mm256_set1_epi64x(1 << 15);
+    __m256i temp_even = _mm256_add_epi64(_mm256_mul_epi32(a, b), rounding);
+    __m256i temp_odd = _mm256_add_epi64(_mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)), rounding);
+
+    // the low 32 bits of temp >> 16, back in the lanes they came from
+    __m256i result = _mm256_blend_epi32(
+        _mm256_srli_epi64(temp_even, 16),
+        _mm256_slli_epi64(_mm256_srli_epi64(temp_odd, 16), 32),
+        0xAA);
+
+    // saturate if bits 47 to 63 of temp aren't all the same as the sign bit
+    __m256i temp_hi = _mm256_blend_epi32(_mm256_shuffle_epi32(temp_even, _MM_SHUFFLE(3, 3, 1, 1)), temp_odd, 0xAA);
+    __m256i sign = _mm256_srai_epi32(temp_hi, 31);
+    __m256i fits = _mm256_cmpeq_epi32(_mm256_srai_epi32(temp_hi, 15), sign);
+    __m256i saturated = _mm256_xor_si256(sign, _mm256_set1_epi32(0x7FFFFFFF));
+
+    return _mm256_blendv_epi8(saturated, result, fits);
+}
+
+// s1516_div(s1516_int(1), w) on 8 lanes, for w > 2.
+// the numerator and denominator are exact in doubles, and the rounding error of the quotient
+// is too small to cross an integer, so truncating it gives the same result as the integer division.
+TARGET_AVX2 static __forceinline __m256i s1516_rcp_avx2(__m256i w)
+{
+    const __m256d one = _mm256_set1_pd(4294967296.0);
+    __m256i half_w = _mm256_srli_epi32(w, 1);
+
+    __m256d num_lo = _mm256_add_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(half_w)), one);
+    __m256d num_hi = _mm256_add_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(half_w, 1)), one);
+    __m256d den_lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(w));
+    __m256d den_hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1));
+
+    __m128i rcp_lo = _mm256_cvttpd_epi32(_mm256_div_pd(num_lo, den_lo));
+    __m128i rcp_hi = _mm256_cvttpd_epi32(_mm256_div_pd(num_hi, den_hi));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(rcp_lo), rcp_hi, 1);
+}
+
+// the conversion of a clip space x (or -y) to s16.8 window coordinates done by rasterize_triangle, on 8 lanes
+TARGET_AVX2 static __forceinline __m256i clip_to_window_xy_avx2(__m256i c, __m256i one_over_w, __m256i size_s1516)
+{
+    // s1516_div by s1516_int(2) rounds half away from zero: (t >> 1) + (t & 1) for t >= 0, and t >> 1 otherwise
+    __m256i t = _mm256_add_epi32(s1516_mul_avx2(c, one_over_w), _mm256_set1_epi32(s1516_int(1)));
+    __m256i t_nonneg = _mm256_cmpgt_epi32(t, _mm256_set1_epi32(-1));
+    t = _mm256_add_epi32(_mm256_srai_epi32(t, 1), _mm256_and_si256(_mm256_and_si256(t, _mm256_set1_epi32(1)), t_nonneg));
+
+    // s168_s1516 rounds half away from zero too: (d + 128) >> 8 for d >= 0 (without overflowing), and (d + 127) >> 8 otherwise
+    __m256i d = s1516_mul_avx2(t, size_s1516);
+    __m256i d_nonneg = _mm256_cmpgt_epi32(d, _mm256_set1_epi32(-1));
+    __m256i d_pos = _mm256_add_epi32(
+        _mm256_srai_epi32(d, 8),
+        _mm256_srli_epi32(_mm256_add_epi32(_mm256_and_si256(d, _mm256_set1_epi32(0xFF)), _mm256_set1_epi32(0x80)), 8));
+    __m256i d_neg = _mm256_srai_epi32(_mm256_add_epi32(d, _mm256_set1_epi32(0x7F)), 8);
+
+    return _mm256_blendv_epi8(d_neg, d_pos, d_nonneg);
+}
+
+// ((int64_t)z * one_over_w - w / 2) >> 16 clamped to 0, on 8 lanes, for 0 <= z < w
+TARGET_AVX2 static __forceinline __m256i clip_to_window_z_avx2(__m256i z, __m256i w, __m256i one_over_w)
+{
+    __m256i half_w = _mm256_srli_epi32(w, 1);
+    __m256i temp_even = _mm256_sub_epi64(_mm256_mul_epu32(z, one_over_w), _mm256_and_si256(half_w, _mm256_set1_epi64x(0xFFFFFFFF)));
+    __m256i temp_odd = _mm256_sub_epi64(_mm256_mul_epu32(_mm256_srli_epi64(z, 32), _mm256_srli_epi64(one_over_w, 32)), _mm256_srli_epi64(half_w, 32));
+
+    __m256i result = _mm256_blend_epi32(
+        _mm256_srli_epi64(temp_even, 16),
+        _mm256_slli_epi64(_mm256_srli_epi64(temp_odd, 16), 32),
+        0xAA);
+
+    // clamp negative results to 0
+    __m256i temp_hi = _mm256_blend_epi32(_mm256_shuffle_epi32(temp_even, _MM_SHUFFLE(3, 3, 1, 1)), temp_odd, 0xAA);
+    return _mm256_andnot_si256(_mm256_srai_epi32(temp_hi, 31), result);
+}
+
+// a bit for each of 8 lanes where |c| > guard_band * w, the test for being outside the guard band in clip_outcode.
+// exact, since the values fit in the 53 bits of a double.
+TARGET_AVX2 static __forceinline uint32_t outside_guard_band_mask_avx2(__m256i c, __m256i w, int32_t guard_band)
+{
+    const __m256d sign_bit = _mm256_set1_pd(-0.0);
+    const __m256d guard_band_pd = _mm256_set1_pd((double)guard_band);
+
+    __m256d abs_c_lo = _mm256_andnot_pd(sign_bit, _mm256_cvtepi32_pd(_mm256_castsi256_si128(c)));
+    __m256d abs_c_hi = _mm256_andnot_pd(sign_bit, _mm256_cvtepi32_pd(_mm256_extracti128_si256(c, 1)));
+    __m256d bound_lo = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(w)), guard_band_pd);
+    __m256d bound_hi = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(w, 1)), guard_band_pd);
+
+    return (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(abs_c_lo, bound_lo, _CMP_GT_OQ)) |
+        ((uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(abs_c_hi, bound_hi, _CMP_GT_OQ)) << 4);
+}
+
+// Runs the checks at the start of triangle setup for 8 triangles at once:
+// near/far plane rejection, the guard band test, the transform to window coordinates, scissor rejection, and zero area/backface culling of small triangles.
+// Only the triangles that survive get set up one at a time, and triangles that need clipping go through rasterize_triangle.
+// The results are exactly the same as framebuffer_bin_indexed_scalar.
+template<int32_t TileWidth>
+TARGET_AVX2 static void framebuffer_bin_indexed_avx2(
+    framebuffer_t* fb,
+    tile_binner_t* binner,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t first_index,
+    uint32_t end_index)
+{
+    // the indices of a vertex of 8 consecutive triangles are every 3rd index
+    const __m256i index_offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    const __m256i width_s1516 = _mm256_set1_epi32(s1516_int(fb->width_in_pixels));
+    const __m256i height_s1516 = _mm256_set1_epi32(s1516_int(fb->height_in_pixels));
+    const __m256i last_x = _mm256_set1_epi32(((int32_t)fb->width_in_pixels << 8) - 1);
+    const __m256i last_y = _mm256_set1_epi32(((int32_t)fb->height_in_pixels << 8) - 1);
+
+    uint32_t index_id = first_index;
+    for (; index_id + 24 <= end_index; index_id += 24)
+    {
+        uint64_t commonsetup_start_pc = perfcounter_begin(fb);
+
+        __m256i xs[3], ys[3], zs[3], ws[3];
+        __m256i needs_clipping = _mm256_setzero_si256();
+        uint32_t outside_guard_band_mask = 0;
+        __m256i all_near = _mm256_set1_epi32(-1);
+        __m256i all_far = _mm256_set1_epi32(-1);
+
+        for (int32_t v = 0; v < 3; v++)
+        {
+            __m256i cmpt_offsets = _mm256_slli_epi32(_mm256_i32gather_epi32((const int*)&indices[index_id + v], index_offsets, 4), 2);
+            __m256i clip_x = _mm256_i32gather_epi32((const int*)vertices + 0, cmpt_offsets, 4);
+            __m256i clip_y = _mm256_i32gather_epi32((const int*)vertices + 1, cmpt_offsets, 4);
+            __m256i clip_z = _mm256_i32gather_epi32((const int*)vertices + 2, cmpt_offsets, 4);
+            __m256i clip_w = _mm256_i32gather_epi32((const int*)vertices + 3, cmpt_offsets, 4);
+
+            __m256i near = _mm256_cmpgt_epi32(_mm256_setzero_si256(), clip_z);
+            __m256i not_far = _mm256_cmpgt_epi32(clip_w, clip_z);
+
+            // 1/w doesn't fit in s15.16 for tiny w, so those take the slow path too
+            __m256i tiny_w = _mm256_cmpgt_epi32(_mm256_set1_epi32(3), clip_w);
+
+            all_near = _mm256_and_si256(all_near, near);
+            all_far = _mm256_andnot_si256(not_far, all_far);
+            needs_clipping = _mm256_or_si256(needs_clipping, _mm256_or_si256(_mm256_or_si256(near, tiny_w), _mm256_cmpeq_epi32(not_far, _mm256_setzero_si256())));
+            outside_guard_band_mask |= outside_guard_band_mask_avx2(clip_x, clip_w, fb->guard_band_x);
+            outside_guard_band_mask |= outside_guard_band_mask_avx2(clip_y, clip_w, fb->guard_band_y);
+
+            // garbage in the lanes that need clipping, but those are set up from scratch anyways
+            __m256i one_over_w = s1516_rcp_avx2(clip_w);
+            xs[v] = clip_to_window_xy_avx2(clip_x, one_over_w, width_s1516);
+            ys[v] = clip_to_window_xy_avx2(_mm256_sub_epi32(_mm256_setzero_si256(), clip_y), one_over_w, height_s1516);
+            zs[v] = clip_to_window_z_avx2(clip_z, clip_w, one_over_w);
+            ws[v] = clip_w;
+        }
+
+        // fully behind the near plane or fully past the far plane
+        __m256i plane_rejected = _mm256_or_si256(all_near, all_far);
+
+        __m256i bbox_min_x = _mm256_min_epi32(_mm256_min_epi32(xs[0], xs[1]), xs[2]);
+        __m256i bbox_max_x = _mm256_max_epi32(_mm256_max_epi32(xs[0], xs[1]), xs[2]);
+        __m256i bbox_min_y = _mm256_min_epi32(_mm256_min_epi32(ys[0], ys[1]), ys[2]);
+        __m256i bbox_max_y = _mm256_max_epi32(_mm256_max_epi32(ys[0], ys[1]), ys[2]);
+
+        // fully outside the scissor rect
+        __m256i scissor_rejected = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), bbox_max_x), _mm256_cmpgt_epi32(_mm256_setzero_si256(), bbox_max_y)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(bbox_min_x, last_x), _mm256_cmpgt_epi32(bbox_min_y, last_y)));
+
+        const __m256i max_small_extent = _mm256_set1_epi32((TILE_WIDTH_IN_PIXELS << 8) - 1);
+        __m256i is_large = _mm256_or_si256(
+            _mm256_cmpgt_epi32(_mm256_sub_epi32(bbox_max_x, bbox_min_x), max_small_extent),
+            _mm256_cmpgt_epi32(_mm256_sub_epi32(bbox_max_y, bbox_min_y), max_small_extent));
+
+        // the area of small triangles fits in 32 bits. setup_triangle rounds it up by 0x7F before dropping 8 bits,
+        // so it culls everything up to 0x80 as either zero area or backfacing.
+        __m256i triarea2 = _mm256_sub_epi32(
+            _mm256_mullo_epi32(_mm256_sub_epi32(xs[1], xs[0]), _mm256_sub_epi32(ys[2], ys[0])),
+            _mm256_mullo_epi32(_mm256_sub_epi32(ys[1], ys[0]), _mm256_sub_epi32(xs[2], xs[0])));
+        __m256i area_rejected = _mm256_andnot_si256(is_large, _mm256_cmpgt_epi32(_mm256_set1_epi32(0x81), triarea2));
+
+        __m256i slow = _mm256_andnot_si256(plane_rejected, needs_clipping);
+        __m256i fast = _mm256_andnot_si256(_mm256_or_si256(needs_clipping, _mm256_or_si256(scissor_rejected, area_rejected)), _mm256_set1_epi32(-1));
+
+        uint32_t plane_rejected_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(plane_rejected));
+        uint32_t slow_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(slow));
+        uint32_t fast_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(fast));
+
+        // triangles that stick out of the guard band need clipping too
+        slow_mask |= outside_guard_band_mask & ~plane_rejected_mask;
+        fast_mask &= ~outside_guard_band_mask;
+
+        // the rest are culled here, for the same reasons setup_triangle would cull them for.
+        // out of the ones with a small area, only those below -0x80 end up with a negative area there.
+        uint32_t culled_mask = ~(plane_rejected_mask | slow_mask | fast_mask) & 0xFF;
+        uint32_t scissor_rejected_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(scissor_rejected));
+        uint32_t backfacing_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(-0x80), triarea2)));
+        binner->stats.triangles += 8;
+        binner->stats.triangles_culled_clipping += popcnt(plane_rejected_mask);
+        binner->stats.triangles_culled_offscreen += popcnt(culled_mask & scissor_rejected_mask);
+        binner->stats.triangles_culled_backface += popcnt(culled_mask & ~scissor_rejected_mask & backfacing_mask);
+        binner->stats.triangles_culled_zero_area += popcnt(culled_mask & ~scissor_rejected_mask & ~backfacing_mask);
+
+        int32_t window_cmpts[4][3][8];
+        if (fast_mask)
+        {
+            for (int32_t v = 0; v < 3; v++)
+            {
+                _mm256_storeu_si256((__m256i*)window_cmpts[0][v], xs[v]);
+                _mm256_storeu_si256((__m256i*)window_cmpts[1][v], ys[v]);
+                _mm256_storeu_si256((__m256i*)window_cmpts[2][v], zs[v]);
+                _mm256_storeu_si256((__m256i*)window_cmpts[3][v], ws[v]);
+            }
+        }
+
+        perfcounter_end(&binner->perfcounters.common_setup, commonsetup_start_pc);
+
+        // set up the survivors in order, so the command lists are the same as with serial setup
+        for (uint32_t lanes = slow_mask | fast_mask; lanes; lanes &= lanes - 1)
+        {
+            uint32_t lane = tzcnt(lanes);
+            xyzw_i32_t verts[3];
+            const uint32_t* lane_indices = &indices[index_id + lane * 3];
+
+            if (slow_mask & (1 << lane))
+            {
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    uint32_t cmpt_i = lane_indices[v] * 4;
+                    verts[v].x = vertices[cmpt_i + 0];
+                    verts[v].y = vertices[cmpt_i + 1];
+                    verts[v].z = vertices[cmpt_i + 2];
+                    verts[v].w = vertices[cmpt_i + 3];
+                }
+
+                if (fb->visibility_buffer)
+                {
+                    framebuffer_begin_shade_triangle(binner, verts, lane_indices[0], lane_indices[1], lane_indices[2], index_id / 3 + lane);
+                }
+
+                rasterize_triangle<TileWidth>(fb, binner, verts);
+            }
+            else
+            {
+                if (fb->visibility_buffer)
+                {
+                    // the varyings are interpolated from the vertices before the transform to window coordinates
+                    xyzw_i32_t clip_verts[3];
+                    for (int32_t v = 0; v < 3; v++)
+                    {
+                        memcpy(&clip_verts[v], &vertices[lane_indices[v] * 4], sizeof(xyzw_i32_t));
+                    }
+                    framebuffer_begin_shade_triangle(binner, clip_verts, lane_indices[0], lane_indices[1], lane_indices[2], index_id / 3 + lane);
+                }
+
+                for (int32_t v = 0; v < 3; v++)
+                {
+                    verts[v].x = window_cmpts[0][v][lane];
+                    verts[v].y = window_cmpts[1][v][lane];
+                    verts[v].z = window_cmpts[2][v][lane];
+                    verts[v].w = window_cmpts[3][v][lane];
+                }
+
+                setup_triangle<TileWidth>(fb, binner, verts);
+            }
+        }
+    }
+
+    // leftover triangles
+    framebuffer_bin_indexed_scalar<TileWidth>(fb, binner, vertices, indices, index_id, end_index);
+}
+
+typedef struct framebuffer_bin_indexed_job_t
+{
+    framebuffer_t* fb;
+    const int32_t* vertices;
+    const uint32_t* indices;
+    uint32_t num_triangles;
+    int32_t num_binners;
+} framebuffer_bin_indexed_job_t;
+
+static void framebuffer_bin_indexed_task(void* ctx, int32_t binner_id, int32_t worker_id)
+{
+    const framebuffer_bin_indexed_job_t* job = (const framebuffer_bin_indexed_job_t*)ctx;
+
+    // every binner gets a contiguous range of triangles
+    uint32_t first_triangle = (uint32_t)((uint64_t)job->num_triangles * binner_id / job->num_binners);
+    uint32_t end_triangle = (uint32_t)((uint64_t)job->num_triangles * (binner_id + 1) / job->num_binners);
+
+    tile_binner_t* binner = &job->fb->binners[binner_id];
+    binner->worker_id = worker_id;
+
+    uint64_t trace_start = trace_begin(job->fb);
+    job->fb->kernels->bin_indexed(job->fb, binner, job->vertices, job->indices, first_triangle * 3, end_triangle * 3);
+    trace_end(job->fb, worker_id, "bin", "binner", binner_id, trace_start);
+}
+
+void framebuffer_draw_indexed(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t num_indices)
+{
+    framebuffer_draw_indexed_ex(fb, vertices, indices, num_indices, NULL);
+}
+
+void framebuffer_draw_indexed_ex(
+    framebuffer_t* fb,
+    const int32_t* vertices,
+    const uint32_t* indices,
+    uint32_t num_indices,
+    const framebuffer_varyings_t* varyings)
+{
+    assert(fb);
+    assert(vertices);
+    assert(indices);
+    assert(num_indices % 3 == 0);
+    assert(!varyings || (varyings->num_varyings >= 0 && varyings->num_varyings <= FRAMEBUFFER_MAX_VARYINGS));
+    assert(!varyings || varyings->varyings || varyings->num_varyings == 0);
+
+    framebuffer_enforce_command_budget(fb);
+
+    uint64_t trace_start = trace_begin(fb);
+
+    uint32_t num_triangles = num_indices / 3;
+
+    int32_t num_binners = fb->num_binners;
+    if (num_triangles / MIN_TRIANGLES_PER_BINNER < (uint32_t)num_binners)
+    {
+        num_binners = (int32_t)(num_triangles / MIN_TRIANGLES_PER_BINNER);
+    }
+
+    for (int32_t binner_id = 0; binner_id < (num_binners > 1 ? num_binners : 1); binner_id++)
+    {
+        tile_binner_t* binner = &fb->binners[binner_id];
+        binner->varyings = varyings ? varyings->varyings : NULL;
+        binner->num_varyings = varyings ? varyings->num_varyings : 0;
+        binner->draw_id = varyings ? varyings->draw_id : 0;
+    }
+
+    if (num_binners <= 1)
+    {
+        fb->binners[0].worker_id = 0;
+        fb->kernels->bin_indexed(fb, &fb->binners[0], vertices, indices, 0, num_indices);
+        trace_end(fb, 0, "draw", "triangles", (int32_t)num_triangles, trace_start);
+        return;
+    }
+
+    framebuffer_bin_indexed_job_t job;
+    job.fb = fb;
+    job.vertices = vertices;
+    job.indices = indices;
+    job.num_triangles = num_triangles;
+    job.num_binners = num_binners;
+
+    std::atomic<int32_t> binners_left(0);
+    for (int32_t binner_id = 0; binner_id < num_binners; binner_id++)
+    {
+        threadpool_submit(fb->threadpool, framebuffer_bin_indexed_task, &job, binner_id, &binners_left);
+    }
+
+    threadpool_wait(fb->threadpool, &binners_left);
+
+    // append the other binners' commands to the framebuffer's command lists in submission order,
+    // so the commands are replayed in the same order as if the triangles were binned serially.
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        tile_cmdlist_t* dst = &fb->tile_cmdlists[tile_id];
+
+        for (int32_t binner_id = 1; binner_id < num_binners; binner_id++)
+        {
+            tile_cmdlist_t* src = &fb->binners[binner_id].tile_cmdlists[tile_id];
+            if (!src->head)
+            {
+                continue;
+            }
+
+            if (dst->tail)
+                dst->tail->next = src->head;
+            else
+                dst->head = src->head;
+            dst->tail = src->tail;
+            dst->num_dwords += src->num_dwords;
+
+            src->head = NULL;
+            src->tail = NULL;
+            src->num_dwords = 0;
+        }
+    }
+
+    trace_end(fb, 0, "draw", "triangles", (int32_t)num_triangles, trace_start);
+}
+
+instructionset_t framebuffer_get_instruction_set(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->instruction_set;
+}
+
+int32_t framebuffer_get_total_num_tiles(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->total_num_tiles;
+}
+
+int32_t framebuffer_get_tile_width(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->tile_width_in_pixels;
+}
+
+int32_t framebuffer_get_num_threads(framebuffer_t* fb)
+{
+    assert(fb);
+    return fb->threadpool ? fb->threadpool->num_threads : 1;
+}
+
+void framebuffer_run_tasks(framebuffer_t* fb, framebuffer_task_fn_t fn, void* ctx, int32_t num_tasks)
+{
+    assert(fb);
+    assert(fn);
+    assert(num_tasks >= 0);
+
+    if (!fb->threadpool || num_tasks <= 1)
+    {
+        for (int32_t task_id = 0; task_id < num_tasks; task_id++)
+        {
+            fn(ctx, task_id, 0);
+        }
+        return;
+    }
+
+    std::atomic<int32_t> tasks_left(0);
+    for (int32_t task_id = 0; task_id < num_tasks; task_id++)
+    {
+        threadpool_submit(fb->threadpool, fn, ctx, task_id, &tasks_left);
+    }
+
+    threadpool_wait(fb->threadpool, &tasks_left);
+}
+
+int64_t framebuffer_get_peak_command_memory(framebuffer_t* fb)
+{
+    assert(fb);
+    std::lock_guard<std::mutex> lock(fb->cmdpool->lock);
+    return fb->cmdpool->peak_num_slabs_in_use * TILE_COMMAND_SLAB_SIZE_IN_CHUNKS * (int64_t)sizeof(tile_cmdchunk_t);
+}
+
+void framebuffer_enable_perfcounters(framebuffer_t* fb, int32_t enable)
+{
+    assert(fb);
+    fb->perfcounters_enabled = enable != 0;
+}
+
+uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb)
+{
+    assert(fb);
+
+    // the frequency of the time stamp counter isn't exposed, so it's measured against the OS's clock since the framebuffer was created.
+    // the longer that was, the more accurate this is, so the first couple of milliseconds are waited out.
+    uint64_t ticks;
+    std::chrono::steady_clock::duration elapsed;
+    do
+    {
+        ticks = rdtsc();
+        elapsed = std::chrono::steady_clock::now() - fb->pc_calibration_time;
+    } while (elapsed < std::chrono::milliseconds(2));
+
+    double elapsed_in_seconds = std::chrono::duration<double>(elapsed).count();
+    return (uint64_t)((double)(ticks - fb->pc_calibration_ticks) / elapsed_in_seconds);
+}
+
+void framebuffer_reset_perfcounters(framebuffer_t* fb)
+{
+    assert(fb);
+
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        memset(&fb->binners[i].perfcounters, 0, sizeof(framebuffer_perfcounters_t));
+        memset(&fb->binners[i].stats, 0, sizeof(framebuffer_stats_t));
+    }
+    memset(fb->tile_counters, 0, sizeof(tile_counters_t) * fb->total_num_tiles);
+}
+
+int32_t framebuffer_get_num_perfcounters(framebuffer_t* fb)
+{
+    assert(fb);
+    return sizeof(framebuffer_perfcounters_t) / sizeof(uint64_t);
+}
+
+void framebuffer_get_perfcounter_names(framebuffer_t* fb, const char** names)
+{
+    assert(fb);
+    assert(names);
+    memcpy(names, kFramebufferPerfcounterNames, sizeof(kFramebufferPerfcounterNames));
+}
+
+void framebuffer_get_perfcounters(framebuffer_t* fb, uint64_t* pcs)
+{
+    assert(fb);
+    assert(pcs);
+
+    // sum of the time spent by all binners
+    int32_t num_pcs = sizeof(framebuffer_perfcounters_t) / sizeof(uint64_t);
+    memset(pcs, 0, sizeof(framebuffer_perfcounters_t));
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        const uint64_t* binner_pcs = (const uint64_t*)&fb->binners[i].perfcounters;
+        for (int32_t pc_i = 0; pc_i < num_pcs; pc_i++)
+        {
+            pcs[pc_i] += binner_pcs[pc_i];
+        }
+    }
+}
+
+int32_t framebuffer_get_num_tile_perfcounters(framebuffer_t* fb)
+{
+    assert(fb);
+    return sizeof(framebuffer_tile_perfcounters_t) / sizeof(uint64_t);
+}
+
+void framebuffer_get_tile_perfcounter_names(framebuffer_t* fb, const char** names)
+{
+    assert(fb);
+    assert(names);
+    memcpy(names, kFramebufferTilePerfcounterNames, sizeof(kFramebufferTilePerfcounterNames));
+}
+
+void framebuffer_get_tile_perfcounters(framebuffer_t* fb, uint64_t* tile_pcs)
+{
+    assert(fb);
+    assert(tile_pcs);
+
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        memcpy(tile_pcs, &fb->tile_counters[tile_id].perfcounters, sizeof(framebuffer_tile_perfcounters_t));
+        tile_pcs += sizeof(framebuffer_tile_perfcounters_t) / sizeof(uint64_t);
+    }
+}
+
+int32_t framebuffer_get_num_stats(framebuffer_t* fb)
+{
+    assert(fb);
+    return (sizeof(framebuffer_stats_t) + sizeof(framebuffer_tile_stats_t)) / sizeof(uint64_t);
+}
+
+void framebuffer_get_stat_names(framebuffer_t* fb, const char** names)
+{
+    assert(fb);
+    assert(names);
+    memcpy(names, kFramebufferStatNames, sizeof(kFramebufferStatNames));
+}
+
+void framebuffer_get_stats(framebuffer_t* fb, uint64_t* stats)
+{
+    assert(fb);
+    assert(stats);
+
+    // sum of the binners' stats, then sum of the tiles' stats
+    int32_t num_binner_stats = sizeof(framebuffer_stats_t) / sizeof(uint64_t);
+    int32_t num_tile_stats = sizeof(framebuffer_tile_stats_t) / sizeof(uint64_t);
+    memset(stats, 0, sizeof(framebuffer_stats_t) + sizeof(framebuffer_tile_stats_t));
+
+    for (int32_t i = 0; i < fb->num_binners; i++)
+    {
+        const uint64_t* binner_stats = (const uint64_t*)&fb->binners[i].stats;
+        for (int32_t stat_i = 0; stat_i < num_binner_stats; stat_i++)
+        {
+            stats[stat_i] += binner_stats[stat_i];
+        }
+    }
+
+    for (int32_t tile_id = 0; tile_id < fb->total_num_tiles; tile_id++)
+    {
+        const uint64_t* tile_stats = (const uint64_t*)&fb->tile_counters[tile_id].stats;
+        for (int32_t stat_i = 0; stat_i < num_tile_stats; stat_i++)
+        {
+            stats[num_binner_stats + stat_i] += tile_stats[stat_i];
+        }
+    }
+}
+
+void framebuffer_begin_trace_capture(framebuffer_t* fb)
+{
+    assert(fb);
+
+    for (int32_t i = 0; i < fb->num_trace_threads; i++)
+    {
+        fb->trace_threads[i].events.clear();
+    }
+
+    fb->trace_begin_ticks = rdtsc();
+    fb->trace_capturing = true;
+}
+
+void framebuffer_end_trace_capture(framebuffer_t* fb)
+{
+    assert(fb);
+
+    // the flushes that started while capturing are still part of the capture
+    framebuffer_finish_flushes(fb);
+
+    fb->trace_capturing = false;
+}
+
+uint64_t framebuffer_get_trace_timestamp(framebuffer_t* fb)
+{
+    assert(fb);
+    return rdtsc();
+}
+
+void framebuffer_add_trace_event(framebuffer_t* fb, const char* name, const char* arg_name, int32_t arg, uint64_t begin_timestamp, uint64_t end_timestamp)
+{
+    assert(fb);
+    assert(name);
+    assert(arg_name);
+    assert(begin_timestamp <= end_timestamp);
+
+    if (!fb->trace_capturing)
+    {
+        return;
+    }
 
-            // round to negative infinity
-            if (edges[v] < 0)
-                edges[v] = edges[v] - 0xFF;
+    // the thread that draws is worker 0
+    framebuffer_trace_event_t event;
+    event.name = name;
+    event.arg_name = arg_name;
+    event.arg = arg;
+    event.begin_ticks = begin_timestamp;
+    event.end_ticks = end_timestamp;
+    fb->trace_threads[0].events.push_back(event);
+}
 
-            edges[v] = edges[v] >> 8;
+int32_t framebuffer_write_trace_capture(framebuffer_t* fb, const char* filename)
+{
+    assert(fb);
+    assert(filename);
+    assert(!fb->trace_capturing);
 
-            // Top-left rule: shift top-left edges ever so slightly outward to make the top-left edges be the tie-breakers when rasterizing adjacent triangles
-            if ((verts[v].y == verts[v1].y && verts[v].x < verts[v1].x) || verts[v].y > verts[v1].y) edges[v]--;
-        }
+    FILE* f = fopen(filename, "w");
+    if (!f)
+    {
+        return 0;
+    }
 
-        int64_t tile_edge_dxs[3];
-        int64_t tile_edge_dys[3];
-        for (int32_t v = 0; v < 3; v++)
-        {
-            tile_edge_dxs[v] = edge_dxs[v] * TILE_WIDTH_IN_PIXELS;
-            tile_edge_dys[v] = edge_dys[v] * TILE_WIDTH_IN_PIXELS;
-        }
+    // Chrome's trace event format, in microseconds since the capture began
+    double us_per_tick = 1000000.0 / (double)framebuffer_get_perfcounter_frequency(fb);
 
-        int64_t edge_trivRejs[3];
-        int64_t edge_trivAccs[3];
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int32_t thread_id = 0; thread_id < fb->num_trace_threads; thread_id++)
+    {
+        if (thread_id == 0)
+            fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"calling thread\"}}");
+        else
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", thread_id, thread_id);
+    }
 
-        for (int32_t v = 0; v < 3; v++)
+    for (int32_t thread_id = 0; thread_id < fb->num_trace_threads; thread_id++)
+    {
+        for (const framebuffer_trace_event_t& event : fb->trace_threads[thread_id].events)
         {
-            edge_trivRejs[v] = edges[v];
-            edge_trivAccs[v] = edges[v];
-            if (tile_edge_dxs[v] < 0) edge_trivRejs[v] += tile_edge_dxs[v];
-            if (tile_edge_dxs[v] > 0) edge_trivAccs[v] += tile_edge_dxs[v];
-            if (tile_edge_dys[v] < 0) edge_trivRejs[v] += tile_edge_dys[v];
-            if (tile_edge_dys[v] > 0) edge_trivAccs[v] += tile_edge_dys[v];
+            // events from before the capture began are clamped to its start
+            uint64_t begin_ticks = event.begin_ticks > fb->trace_begin_ticks ? event.begin_ticks - fb->trace_begin_ticks : 0;
+            uint64_t end_ticks = event.end_ticks > fb->trace_begin_ticks ? event.end_ticks - fb->trace_begin_ticks : 0;
+
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%d}}",
+                event.name, thread_id, begin_ticks * us_per_tick, (end_ticks - begin_ticks) * us_per_tick, event.arg_name, event.arg);
         }
+    }
+    fprintf(f, "\n]}\n");
 
-        int32_t tile_row_start = first_tile_y * fb->width_in_tiles + first_tile_x;
-        for (int32_t tile_y = first_tile_y; tile_y <= last_tile_y; tile_y++)
-        {
-            int64_t tile_i_edges[3];
-            int64_t tile_i_edge_trivRejs[3];
-            int64_t tile_i_edge_trivAccs[3];
-            for (int32_t v = 0; v < 3; v++)
-            {
-                tile_i_edges[v] = edges[v];
-                tile_i_edge_trivRejs[v] = edge_trivRejs[v];
-                tile_i_edge_trivAccs[v] = edge_trivAccs[v];
-            }
+    bool ok = ferror(f) == 0;
+    ok = fclose(f) == 0 && ok;
+    return ok ? 1 : 0;
+}
 
-            int32_t tile_i = tile_row_start;
+// Textures
+// ------------------
+// Every mip is split in square tiles of up to TEXTURE_TILE_WIDTH_IN_TEXELS texels, stored one row of tiles after the other,
+// and the texels of a tile are stored in morton order, like the pixels of the framebuffer's tiles.
+// Shaders run on 4x2 blocks of pixels, from tiles in morton order too, so the texels of neighboring pixels
+// come from a few cache lines instead of as many rows of the texture.
+#define TEXTURE_TILE_WIDTH_IN_TEXELS 32
 
-            for (int32_t tile_x = first_tile_x; tile_x <= last_tile_x; tile_x++)
-            {
-                // trivial reject if at least one edge doesn't cover the tile at all
-                int32_t trivially_rejected = tile_i_edge_trivRejs[0] >= 0 || tile_i_edge_trivRejs[1] >= 0 || tile_i_edge_trivRejs[2] >= 0;
+// up to 32768x32768
+#define TEXTURE_MAX_MIPS 16
 
-                if (!trivially_rejected)
-                {
-                    tilecmd_drawtile_t drawtilecmd;
+typedef struct texture_mip_t
+{
+    int32_t width;
+    int32_t height;
+    int32_t log2_tile_width;
+    int32_t width_in_tiles;
 
-                    int32_t edge_needs_test[3];
-                    edge_needs_test[0] = tile_i_edge_trivAccs[0] >= 0;
-                    edge_needs_test[1] = tile_i_edge_trivAccs[1] >= 0;
-                    edge_needs_test[2] = tile_i_edge_trivAccs[2] >= 0;
+    // where the mip starts in the texture's texels
+    uint32_t first_texel;
+} texture_mip_t;
 
-                    drawtilecmd.tilecmd_id = tilecmd_id_drawlargetri_0edgemask;
-                    drawtilecmd.tilecmd_id += edge_needs_test[0];
-                    drawtilecmd.tilecmd_id += edge_needs_test[1] << 1;
-                    drawtilecmd.tilecmd_id += edge_needs_test[2] << 2;
+typedef struct texture_t
+{
+    int32_t width;
+    int32_t height;
 
-                    for (int32_t v = 0; v < 3; v++)
-                    {
-                        assert(edge_dxs[v] >= INT32_MIN && edge_dxs[v] <= INT32_MAX);
-                        assert(edge_dys[v] >= INT32_MIN && edge_dys[v] <= INT32_MAX);
+    int32_t num_mips;
+    texture_mip_t mips[TEXTURE_MAX_MIPS];
 
-                        // the maximum change in area over one tile shouldn't exceed int32
-                        assert(tile_i_edge_trivAccs[v] - tile_i_edge_trivRejs[v] <= INT32_MAX);
+    // all the mips, one after the other
+    uint32_t* texels;
 
-                        if (edge_needs_test[v])
-                        {
-                            // ensure edges to test are within range of 32 bits (they should be, since trivial accept/reject only keeps nearby edges)
-                            assert(tile_i_edges[v] >= INT32_MIN && tile_i_edges[v] <= INT32_MAX);
-                            drawtilecmd.edges[v] = (int32_t)tile_i_edges[v];
+    instructionset_t instruction_set;
+} texture_t;
 
-                            // don't need any extra shift since we know there won't be any overflow
-                            drawtilecmd.shifted_es[v] = 0;
-                        }
-                        else
-                        {
-                            // make edge relative to the corner of the tile to prevent overflows
-                            drawtilecmd.edges[v] = 0;
+static __forceinline uint32_t texture_texel_index(const texture_mip_t* mip, uint32_t x, uint32_t y)
+{
+    uint32_t tile_mask = (1u << mip->log2_tile_width) - 1;
+    uint32_t tile_i = (y >> mip->log2_tile_width) * (uint32_t)mip->width_in_tiles + (x >> mip->log2_tile_width);
+    return mip->first_texel + (tile_i << (2 * mip->log2_tile_width)) + (morton_encode_x(x & tile_mask) | (morton_encode_x(y & tile_mask) << 1));
+}
 
-                            // compute an initial offset for the unnormalized barycentric coordinates
-                            int64_t shifted_e = -tile_i_edges[v];
-                            if (rcp_triarea2_mantissa_rshift < 0)
-                                shifted_e = shifted_e << -rcp_triarea2_mantissa_rshift;
-                            else
-                                shifted_e = shifted_e >> rcp_triarea2_mantissa_rshift;
+texture_t* new_texture(int32_t width, int32_t height, const uint32_t* colors)
+{
+    texture_config_t config;
+    config.instruction_set = instructionset_auto;
+    return new_texture_ex(width, height, colors, &config);
+}
 
-                            assert(shifted_e >= INT32_MIN && shifted_e <= INT32_MAX);
-                            drawtilecmd.shifted_es[v] = (int32_t)shifted_e;
-                        }
+texture_t* new_texture_ex(int32_t width, int32_t height, const uint32_t* colors, const texture_config_t* config)
+{
+    assert(width > 0 && width <= (1 << (TEXTURE_MAX_MIPS - 1)) && (width & (width - 1)) == 0);
+    assert(height > 0 && height <= (1 << (TEXTURE_MAX_MIPS - 1)) && (height & (height - 1)) == 0);
+    assert(colors);
+    assert(config);
 
-                        drawtilecmd.edge_dxs[v] = (int32_t)edge_dxs[v];
-                        drawtilecmd.edge_dys[v] = (int32_t)edge_dys[v];
+    texture_t* tex = (texture_t*)malloc(sizeof(texture_t));
+    assert(tex);
 
-                        drawtilecmd.vert_Zs[v] = verts[v].z;
-                    }
+    tex->width = width;
+    tex->height = height;
 
-                    drawtilecmd.min_Z = min_Z;
-                    drawtilecmd.max_Z = max_Z;
+    // every mip down to 1x1
+    uint64_t num_texels = 0;
+    tex->num_mips = 0;
+    for (int32_t mip_width = width, mip_height = height; ; mip_width = std::max(mip_width / 2, 1), mip_height = std::max(mip_height / 2, 1))
+    {
+        texture_mip_t* mip = &tex->mips[tex->num_mips];
+        mip->width = mip_width;
+        mip->height = mip_height;
 
-                    drawtilecmd.shifted_triarea2 = triarea2_mantissa >> 1;
-                    drawtilecmd.rcp_triarea2_mantissa = rcp_triarea2_mantissa;
-                    drawtilecmd.rcp_triarea2_rshift = rcp_triarea2_mantissa_rshift;
+        int32_t tile_width = std::min(std::min(mip_width, mip_height), TEXTURE_TILE_WIDTH_IN_TEXELS);
+        mip->log2_tile_width = (int32_t)tzcnt64((uint64_t)tile_width);
+        mip->width_in_tiles = mip_width / tile_width;
+        mip->first_texel = (uint32_t)num_texels;
 
-#ifdef ENABLE_PERFCOUNTERS
-                    fb->perfcounters.largetri_setup += qpc() - setup_start_pc;
-#endif
-                    framebuffer_push_tilecmd(fb, tile_i, &drawtilecmd.tilecmd_id, sizeof(drawtilecmd) / sizeof(uint32_t));
+        num_texels += (uint64_t)mip_width * mip_height;
+        tex->num_mips++;
 
-#ifdef ENABLE_PERFCOUNTERS
-                    setup_start_pc = qpc();
-#endif
-                }
+        if (mip_width == 1 && mip_height == 1)
+        {
+            break;
+        }
+    }
 
-                tile_i++;
-                for (int32_t v = 0; v < 3; v++)
-                {
-                    tile_i_edges[v] += tile_edge_dxs[v];
-                    tile_i_edge_trivRejs[v] += tile_edge_dxs[v];
-                    tile_i_edge_trivAccs[v] += tile_edge_dxs[v];
-                }
-            }
+    // the texels are gathered with 32 bit offsets in bytes
+    assert(num_texels <= (uint64_t)INT32_MAX / sizeof(uint32_t));
 
-            tile_row_start += fb->width_in_tiles;
-            for (int32_t v = 0; v < 3; v++)
+    tex->texels = (uint32_t*)_aligned_malloc((size_t)num_texels * sizeof(uint32_t), 64);
+    assert(tex->texels);
+
+    for (int32_t y = 0; y < height; y++)
+    {
+        for (int32_t x = 0; x < width; x++)
+        {
+            tex->texels[texture_texel_index(&tex->mips[0], x, y)] = colors[y * width + x];
+        }
+    }
+
+    // every texel of a mip is the average of the 2x2 texels it covers in the mip above it (or 2x1, once one side is down to 1)
+    for (int32_t mip_i = 1; mip_i < tex->num_mips; mip_i++)
+    {
+        const texture_mip_t* src_mip = &tex->mips[mip_i - 1];
+        const texture_mip_t* mip = &tex->mips[mip_i];
+        int32_t src_dx = src_mip->width > 1 ? 1 : 0;
+        int32_t src_dy = src_mip->height > 1 ? 1 : 0;
+
+        for (int32_t y = 0; y < mip->height; y++)
+        {
+            for (int32_t x = 0; x < mip->width; x++)
             {
-                edges[v] += tile_edge_dys[v];
-                edge_trivRejs[v] += tile_edge_dys[v];
-                edge_trivAccs[v] += tile_edge_dys[v];
+                int32_t src_x = x * (src_dx + 1);
+                int32_t src_y = y * (src_dy + 1);
+                uint32_t c00 = tex->texels[texture_texel_index(src_mip, src_x, src_y)];
+                uint32_t c10 = tex->texels[texture_texel_index(src_mip, src_x + src_dx, src_y)];
+                uint32_t c01 = tex->texels[texture_texel_index(src_mip, src_x, src_y + src_dy)];
+                uint32_t c11 = tex->texels[texture_texel_index(src_mip, src_x + src_dx, src_y + src_dy)];
+
+                uint32_t color = 0;
+                for (int32_t shift = 0; shift < 32; shift += 8)
+                {
+                    uint32_t sum = ((c00 >> shift) & 0xFF) + ((c10 >> shift) & 0xFF) + ((c01 >> shift) & 0xFF) + ((c11 >> shift) & 0xFF);
+                    color |= ((sum + 2) >> 2) << shift;
+                }
+                tex->texels[texture_texel_index(mip, x, y)] = color;
             }
         }
     }
 
-setup_end:;
-    if (is_large)
+    instructionset_t supported_instruction_set = detect_instruction_set();
+    if (config->instruction_set == instructionset_auto || config->instruction_set > supported_instruction_set)
     {
-#ifdef ENABLE_PERFCOUNTERS
-        fb->perfcounters.largetri_setup += qpc() - setup_start_pc;
-#endif
+        tex->instruction_set = supported_instruction_set;
     }
     else
     {
-#ifdef ENABLE_PERFCOUNTERS
-        fb->perfcounters.smalltri_setup += qpc() - setup_start_pc;
-#endif
+        tex->instruction_set = config->instruction_set;
     }
-} 
 
-void framebuffer_draw(
-    framebuffer_t* fb,
-    const int32_t* vertices,
-    uint32_t num_vertices)
-{
-    assert(fb);
-    assert(vertices);
-    assert(num_vertices % 3 == 0);
+    return tex;
+}
 
-    for (uint32_t vertex_id = 0, cmpt_id = 0; vertex_id < num_vertices; vertex_id += 3, cmpt_id += 12)
-    {
-        xyzw_i32_t verts[3];
+void delete_texture(texture_t* tex)
+{
+    if (!tex)
+        return;
 
-        verts[0].x = vertices[cmpt_id + 0];
-        verts[0].y = vertices[cmpt_id + 1];
-        verts[0].z = vertices[cmpt_id + 2];
-        verts[0].w = vertices[cmpt_id + 3];
-        verts[1].x = vertices[cmpt_id + 4];
-        verts[1].y = vertices[cmpt_id + 5];
-        verts[1].z = vertices[cmpt_id + 6];
-        verts[1].w = vertices[cmpt_id + 7];
-        verts[2].x = vertices[cmpt_id + 8];
-        verts[2].y = vertices[cmpt_id + 9];
-        verts[2].z = vertices[cmpt_id + 10];
-        verts[2].w = vertices[cmpt_id + 11];
+    _aligned_free(tex->texels);
+    free(tex);
+}
 
-        rasterize_triangle(fb, verts);
-    }
+instructionset_t texture_get_instruction_set(texture_t* tex)
+{
+    assert(tex);
+    return tex->instruction_set;
 }
 
-void framebuffer_draw_indexed(
-    framebuffer_t* fb,
-    const int32_t* vertices,
-    const uint32_t* indices,
-    uint32_t num_indices)
+// the mip of each 2x2 quad of a 4x2 block (lanes 0-3 and 4-7), from how far apart the texcoords of the lanes next to each other are, in texels.
+// only lanes that show the same triangle are compared. a quad that has none takes the mip of the other quad, and the first mip if neither has any.
+static void texture_pick_mips(const texture_t* tex, const framebuffer_pixels_t* pixels, int32_t u_varying, int32_t v_varying, int32_t mips[2])
 {
-    assert(fb);
-    assert(vertices);
-    assert(indices);
-    assert(num_indices % 3 == 0);
+    // lane i of a quad is at (i & 1, i >> 1)
+    static const int32_t kPairs[4][2] = { { 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 } };
 
-    for (uint32_t index_id = 0; index_id < num_indices; index_id += 3)
+    const float* u = pixels->varyings[u_varying];
+    const float* v = pixels->varyings[v_varying];
+
+    float rho2[2] = { -1.0f, -1.0f };
+    for (int32_t quad = 0; quad < 2; quad++)
     {
-        xyzw_i32_t verts[3];
+        for (int32_t pair = 0; pair < 4; pair++)
+        {
+            int32_t i = quad * 4 + kPairs[pair][0];
+            int32_t j = quad * 4 + kPairs[pair][1];
+            if (!(pixels->mask & (1 << i)) || !(pixels->mask & (1 << j)) ||
+                pixels->triangle_indices[i] != pixels->triangle_indices[j] || pixels->draw_ids[i] != pixels->draw_ids[j])
+            {
+                continue;
+            }
 
-        uint32_t cmpt_i0 = indices[index_id + 0] * 4;
-        uint32_t cmpt_i1 = indices[index_id + 1] * 4;
-        uint32_t cmpt_i2 = indices[index_id + 2] * 4;
+            float du = (u[j] - u[i]) * (float)tex->width;
+            float dv = (v[j] - v[i]) * (float)tex->height;
+            rho2[quad] = std::max(rho2[quad], du * du + dv * dv);
+        }
+    }
 
-        verts[0].x = vertices[cmpt_i0 + 0];
-        verts[0].y = vertices[cmpt_i0 + 1];
-        verts[0].z = vertices[cmpt_i0 + 2];
-        verts[0].w = vertices[cmpt_i0 + 3];
-        verts[1].x = vertices[cmpt_i1 + 0];
-        verts[1].y = vertices[cmpt_i1 + 1];
-        verts[1].z = vertices[cmpt_i1 + 2];
-        verts[1].w = vertices[cmpt_i1 + 3];
-        verts[2].x = vertices[cmpt_i2 + 0];
-        verts[2].y = vertices[cmpt_i2 + 1];
-        verts[2].z = vertices[cmpt_i2 + 2];
-        verts[2].w = vertices[cmpt_i2 + 3];
+    if (rho2[0] < 0.0f)
+        rho2[0] = rho2[1];
+    if (rho2[1] < 0.0f)
+        rho2[1] = rho2[0];
 
-        rasterize_triangle(fb, verts);
+    // the nearest mip to log2(rho): the last one whose rho is at least 2^(mip - 1/2)
+    for (int32_t quad = 0; quad < 2; quad++)
+    {
+        int32_t mip = 0;
+        while (mip + 1 < tex->num_mips && rho2[quad] >= (float)(2 << (2 * mip)))
+        {
+            mip++;
+        }
+        mips[quad] = mip;
     }
 }
 
-int32_t framebuffer_get_total_num_tiles(framebuffer_t* fb)
+// bilinear filtering weights are 8 bit fractions, like GPUs', so every instruction set filters the same
+static uint32_t texture_sample_bilinear_scalar(const texture_t* tex, const texture_mip_t* mip, float u, float v)
 {
-    assert(fb);
-    return fb->total_num_tiles;
+    // texcoords repeat, and texel centers are at half texels
+    float tu = (u - floorf(u)) * (float)mip->width - 0.5f;
+    float tv = (v - floorf(v)) * (float)mip->height - 0.5f;
+    float x0f = floorf(tu);
+    float y0f = floorf(tv);
+    int32_t fx = (int32_t)((tu - x0f) * 256.0f);
+    int32_t fy = (int32_t)((tv - y0f) * 256.0f);
+
+    uint32_t x0 = (uint32_t)(int32_t)x0f & (uint32_t)(mip->width - 1);
+    uint32_t y0 = (uint32_t)(int32_t)y0f & (uint32_t)(mip->height - 1);
+    uint32_t x1 = (x0 + 1) & (uint32_t)(mip->width - 1);
+    uint32_t y1 = (y0 + 1) & (uint32_t)(mip->height - 1);
+
+    uint32_t c00 = tex->texels[texture_texel_index(mip, x0, y0)];
+    uint32_t c10 = tex->texels[texture_texel_index(mip, x1, y0)];
+    uint32_t c01 = tex->texels[texture_texel_index(mip, x0, y1)];
+    uint32_t c11 = tex->texels[texture_texel_index(mip, x1, y1)];
+
+    // the weights add up to 1 << 16
+    uint32_t w00 = (uint32_t)((256 - fx) * (256 - fy));
+    uint32_t w10 = (uint32_t)(fx * (256 - fy));
+    uint32_t w01 = (uint32_t)((256 - fx) * fy);
+    uint32_t w11 = (uint32_t)(fx * fy);
+
+    uint32_t color = 0;
+    for (int32_t shift = 0; shift < 32; shift += 8)
+    {
+        uint32_t sum = ((c00 >> shift) & 0xFF) * w00 + ((c10 >> shift) & 0xFF) * w10 + ((c01 >> shift) & 0xFF) * w01 + ((c11 >> shift) & 0xFF) * w11;
+        color |= ((sum + 0x8000) >> 16) << shift;
+    }
+    return color;
 }
 
-uint64_t framebuffer_get_perfcounter_frequency(framebuffer_t* fb)
+// a value for the lanes of each quad
+TARGET_AVX2 static __forceinline __m256i texture_quads_epi32(int32_t quad0, int32_t quad1)
 {
-    assert(fb);
-#ifdef ENABLE_PERFCOUNTERS
-    return fb->pc_frequency;
-#else
-    return 1;
-#endif
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(quad0)), _mm_set1_epi32(quad1), 1);
 }
 
-void framebuffer_reset_perfcounters(framebuffer_t* fb)
+TARGET_AVX2 static __forceinline __m256i morton_encode_x_avx2(__m256i x)
 {
-#ifdef ENABLE_PERFCOUNTERS
-    memset(&fb->perfcounters, 0, sizeof(framebuffer_perfcounters_t));
-    memset(fb->tile_perfcounters, 0, sizeof(framebuffer_tile_perfcounters_t) * fb->total_num_tiles);
-#endif
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00FF00FF));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0F0F0F0F));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x33333333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x55555555));
+    return x;
 }
 
-int32_t framebuffer_get_num_perfcounters(framebuffer_t* fb)
+// the same as texture_sample_bilinear_scalar on all 8 lanes, with the mips of each quad
+TARGET_AVX2 static void texture_sample_bilinear_avx2(const texture_t* tex, const framebuffer_pixels_t* pixels, uint32_t mask, int32_t u_varying, int32_t v_varying, const int32_t mips[2], uint32_t colors[8])
 {
-    assert(fb);
-
-#ifdef ENABLE_PERFCOUNTERS
-    return sizeof(framebuffer_perfcounters_t) / sizeof(uint64_t);
-#else
-    return 0;
-#endif
-}
+    const texture_mip_t* mip0 = &tex->mips[mips[0]];
+    const texture_mip_t* mip1 = &tex->mips[mips[1]];
+
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i lane_mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int32_t)mask), lane_bits), lane_bits);
+
+    // the lanes that aren't sampled hold garbage, so they're moved to 0 to keep their conversions defined
+    __m256 u = _mm256_and_ps(_mm256_loadu_ps(pixels->varyings[u_varying]), _mm256_castsi256_ps(lane_mask));
+    __m256 v = _mm256_and_ps(_mm256_loadu_ps(pixels->varyings[v_varying]), _mm256_castsi256_ps(lane_mask));
+
+    __m256i width_mask = texture_quads_epi32(mip0->width - 1, mip1->width - 1);
+    __m256i height_mask = texture_quads_epi32(mip0->height - 1, mip1->height - 1);
+
+    __m256 tu = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(u, _mm256_floor_ps(u)), _mm256_cvtepi32_ps(texture_quads_epi32(mip0->width, mip1->width))), _mm256_set1_ps(0.5f));
+    __m256 tv = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(v, _mm256_floor_ps(v)), _mm256_cvtepi32_ps(texture_quads_epi32(mip0->height, mip1->height))), _mm256_set1_ps(0.5f));
+    __m256 x0f = _mm256_floor_ps(tu);
+    __m256 y0f = _mm256_floor_ps(tv);
+    __m256i fx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(tu, x0f), _mm256_set1_ps(256.0f)));
+    __m256i fy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(tv, y0f), _mm256_set1_ps(256.0f)));
+
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i x0 = _mm256_and_si256(_mm256_cvttps_epi32(x0f), width_mask);
+    __m256i y0 = _mm256_and_si256(_mm256_cvttps_epi32(y0f), height_mask);
+    __m256i x1 = _mm256_and_si256(_mm256_add_epi32(x0, one), width_mask);
+    __m256i y1 = _mm256_and_si256(_mm256_add_epi32(y0, one), height_mask);
+
+    // texture_texel_index, split in the parts that only depend on x or y
+    __m256i log2_tile_width = texture_quads_epi32(mip0->log2_tile_width, mip1->log2_tile_width);
+    __m256i tile_mask = _mm256_sub_epi32(_mm256_sllv_epi32(one, log2_tile_width), one);
+    __m256i log2_tile_texels = _mm256_add_epi32(log2_tile_width, log2_tile_width);
+    __m256i width_in_tiles = texture_quads_epi32(mip0->width_in_tiles, mip1->width_in_tiles);
+    __m256i first_texel = texture_quads_epi32((int32_t)mip0->first_texel, (int32_t)mip1->first_texel);
+
+    __m256i xs[2] = { x0, x1 };
+    __m256i ys[2] = { y0, y1 };
+    __m256i x_parts[2], y_parts[2];
+    for (int32_t i = 0; i < 2; i++)
+    {
+        x_parts[i] = _mm256_add_epi32(
+            _mm256_sllv_epi32(_mm256_srlv_epi32(xs[i], log2_tile_width), log2_tile_texels),
+            morton_encode_x_avx2(_mm256_and_si256(xs[i], tile_mask)));
+
+        __m256i tile_y = _mm256_mullo_epi32(_mm256_srlv_epi32(ys[i], log2_tile_width), width_in_tiles);
+        y_parts[i] = _mm256_add_epi32(
+            _mm256_add_epi32(first_texel, _mm256_sllv_epi32(tile_y, log2_tile_texels)),
+            _mm256_slli_epi32(morton_encode_x_avx2(_mm256_and_si256(ys[i], tile_mask)), 1));
+    }
 
-void framebuffer_get_perfcounter_names(framebuffer_t* fb, const char** names)
-{
-    assert(fb);
-    assert(names);
+    const int* texels = (const int*)tex->texels;
+    __m256i c00 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x_parts[0], y_parts[0]), 4);
+    __m256i c10 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x_parts[1], y_parts[0]), 4);
+    __m256i c01 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x_parts[0], y_parts[1]), 4);
+    __m256i c11 = _mm256_i32gather_epi32(texels, _mm256_add_epi32(x_parts[1], y_parts[1]), 4);
+
+    __m256i inv_fx = _mm256_sub_epi32(_mm256_set1_epi32(256), fx);
+    __m256i inv_fy = _mm256_sub_epi32(_mm256_set1_epi32(256), fy);
+    __m256i w00 = _mm256_mullo_epi32(inv_fx, inv_fy);
+    __m256i w10 = _mm256_mullo_epi32(fx, inv_fy);
+    __m256i w01 = _mm256_mullo_epi32(inv_fx, fy);
+    __m256i w11 = _mm256_mullo_epi32(fx, fy);
+
+    __m256i channel_mask = _mm256_set1_epi32(0xFF);
+    __m256i rounding = _mm256_set1_epi32(0x8000);
+    __m256i color = _mm256_setzero_si256();
+    for (int32_t shift = 0; shift < 32; shift += 8)
+    {
+        __m128i count = _mm_cvtsi32_si128(shift);
+        __m256i sum = _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(c00, count), channel_mask), w00);
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(c10, count), channel_mask), w10));
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(c01, count), channel_mask), w01));
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_and_si256(_mm256_srl_epi32(c11, count), channel_mask), w11));
+        color = _mm256_or_si256(color, _mm256_sll_epi32(_mm256_srli_epi32(_mm256_add_epi32(sum, rounding), 16), count));
+    }
 
-#ifdef ENABLE_PERFCOUNTERS
-    memcpy(names, kFramebufferPerfcounterNames, sizeof(kFramebufferPerfcounterNames));
-#endif
+    _mm256_maskstore_epi32((int*)colors, lane_mask, color);
 }
 
-void framebuffer_get_perfcounters(framebuffer_t* fb, uint64_t* pcs)
+void texture_sample(const texture_t* tex, const framebuffer_pixels_t* pixels, uint32_t mask, int32_t u_varying, int32_t v_varying, uint32_t colors[8])
 {
-    assert(fb);
-    assert(pcs);
-
-#ifdef ENABLE_PERFCOUNTERS
-    memcpy(pcs, &fb->perfcounters, sizeof(framebuffer_perfcounters_t));
-#endif
-}
+    assert(tex);
+    assert(pixels);
+    assert((mask & ~pixels->mask) == 0);
+    assert(u_varying >= 0 && u_varying < FRAMEBUFFER_MAX_VARYINGS);
+    assert(v_varying >= 0 && v_varying < FRAMEBUFFER_MAX_VARYINGS);
+    assert(colors);
+
+    if (!mask)
+    {
+        return;
+    }
 
-int32_t framebuffer_get_num_tile_perfcounters(framebuffer_t* fb)
-{
-    assert(fb);
-    
-#ifdef ENABLE_PERFCOUNTERS
-    return sizeof(framebuffer_tile_perfcounters_t) / sizeof(uint64_t);
-#else
-    return 0;
-#endif
-}
+    int32_t mips[2];
+    texture_pick_mips(tex, pixels, u_varying, v_varying, mips);
 
-void framebuffer_get_tile_perfcounter_names(framebuffer_t* fb, const char** names)
-{
-    assert(fb);
-    assert(names);
+    if (tex->instruction_set >= instructionset_avx2)
+    {
+        texture_sample_bilinear_avx2(tex, pixels, mask, u_varying, v_varying, mips, colors);
+        return;
+    }
 
-#ifdef ENABLE_PERFCOUNTERS
-    memcpy(names, kFramebufferTilePerfcounterNames, sizeof(kFramebufferTilePerfcounterNames));
-#endif
+    for (int32_t lane = 0; lane < 8; lane++)
+    {
+        if (mask & (1 << lane))
+        {
+            colors[lane] = texture_sample_bilinear_scalar(tex, &tex->mips[mips[lane / 4]], pixels->varyings[u_varying][lane], pixels->varyings[v_varying][lane]);
+        }
+    }
 }
-
-void framebuffer_get_tile_perfcounters(framebuffer_t* fb, uint64_t* tile_pcs)
-{
-    assert(fb);
-    assert(tile_pcs);
-
-#ifdef ENABLE_PERFCOUNTERS
-    memcpy(tile_pcs, fb->tile_perfcounters, sizeof(framebuffer_tile_perfcounters_t) * fb->total_num_tiles);
-#endif
-}
\ No newline at end of file
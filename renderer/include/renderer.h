@@ -18,11 +18,50 @@ extern "C" {
 
 struct renderer_t;
 struct scene_t;
+struct scene_snapshot_t;
 struct framebuffer_t;
+struct framebuffer_config_t;
+struct framebuffer_pixels_t;
+
+// the same as the rasterizer's framebuffer_shader_fn_t
+typedef void(*renderer_shader_fn_t)(void* ctx, const framebuffer_pixels_t* pixels, uint32_t colors[8]);
+
+typedef struct model_load_config_t
+{
+    // reorders the triangles of every model to reuse transformed vertices (and stay close together on screen),
+    // then the vertices in the order the triangles first use them. a one time cost when loading the models.
+    int32_t optimize_vertex_order;
+
+    // the number of vertices of the FIFO vertex cache that the order is optimized and measured for. 0 uses the default (16).
+    int32_t vertex_cache_size;
+} model_load_config_t;
 
 RENDERER_API renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight);
+// the framebuffer's threads also cull and transform the instances.
+// with a visibility buffer, the visible pixels are shaded once the scene is drawn, from the texcoords, normals and textures of the models.
+RENDERER_API renderer_t* new_renderer_ex(int32_t fbwidth, int32_t fbheight, const framebuffer_config_t* config);
 RENDERER_API void delete_renderer(renderer_t* rd);
 RENDERER_API void renderer_render_scene(renderer_t* rd, scene_t* sc);
+
+// a view of the scene for renderer_render_views, in s15.16 and column major like scene_set_view and scene_set_projection
+typedef struct renderer_view_t
+{
+    // NULL for the renderer's own framebuffer. the others are best made with share_threads_with set to it.
+    framebuffer_t* fb;
+    int32_t view[16];
+    int32_t proj[16];
+} renderer_view_t;
+
+// renders the scene in several views at once (the faces of a cubemap, shadow cascades, split-screen), each in a framebuffer of its own,
+// ignoring the scene's view and projection. every framebuffer gets its perfcounters reset and gets cleared, and resolved once the scene is drawn in all of them.
+// the instances of every view are culled and transformed together on the renderer's framebuffer's threads, batched as if they were one view.
+// only the renderer's own framebuffer gets shaded, so the others are drawn without varyings. a framebuffer can only be in one of the views.
+RENDERER_API void renderer_render_views(renderer_t* rd, scene_t* sc, const renderer_view_t* views, int32_t num_views);
+
+// the same, from a snapshot of the scene (see scene_take_snapshot), which is all they read of the scene apart from its models.
+// the scene can keep changing on another thread while they render, as long as no models get added.
+RENDERER_API void renderer_render_snapshot(renderer_t* rd, const scene_snapshot_t* ss);
+RENDERER_API void renderer_render_snapshot_views(renderer_t* rd, const scene_snapshot_t* ss, const renderer_view_t* views, int32_t num_views);
 RENDERER_API framebuffer_t* renderer_get_framebuffer(renderer_t* rd);
 
 RENDERER_API uint64_t renderer_get_perfcounter_frequency(renderer_t* rd);
@@ -30,15 +69,55 @@ RENDERER_API void renderer_reset_perfcounters(renderer_t* rd);
 RENDERER_API int32_t renderer_get_num_perfcounters(renderer_t* rd);
 RENDERER_API void renderer_get_perfcounters(renderer_t* rd, uint64_t* pcs);
 RENDERER_API void renderer_get_perfcounter_names(renderer_t* rd, const char** names);
+// stats are counts of instances, clusters and vertices of the last frame rendered
+RENDERER_API int32_t renderer_get_num_stats(renderer_t* rd);
+RENDERER_API void renderer_get_stat_names(renderer_t* rd, const char** names);
+RENDERER_API void renderer_get_stats(renderer_t* rd, uint64_t* stats);
+
+// instances out of the view are culled by walking a tree of their bounds. models are split in clusters of triangles when they're loaded,
+// and clusters that are out of the view, or that only have back facing triangles, are culled before transforming their vertices.
+// on by default, and it never changes the image.
+RENDERER_API void renderer_set_cluster_culling(renderer_t* rd, int32_t enable);
+
+// replaces the shader used with a visibility buffer, or puts back the default one when shader is NULL. the default one lights the normals
+// with lambert, on the diffuse texture of the model's material (or a checkerboard of the texcoords when it doesn't have one).
+// the varyings of the pixels are the texcoord u and v, then the world space normal xyz, which isn't normalized. the draw ids are the model ids.
+RENDERER_API void renderer_set_shader(renderer_t* rd, renderer_shader_fn_t shader, void* ctx);
+
+// debugging filters: only draw up to 3 triangles of every model (-1 for none), or only the instance at the given position in the scene (-1 for all)
+RENDERER_API void renderer_set_triangle_filter(renderer_t* rd, int32_t enable, int32_t triangle_id0, int32_t triangle_id1, int32_t triangle_id2);
+RENDERER_API void renderer_set_instance_filter(renderer_t* rd, int32_t enable, int32_t instance_index);
+
+// captures a trace of everything rendered in between, with every instance next to the framebuffer's own events
+RENDERER_API void renderer_begin_trace_capture(renderer_t* rd);
+RENDERER_API int32_t renderer_end_trace_capture(renderer_t* rd, const char* filename); // returns 0 if the file couldn't be written
 
 RENDERER_API scene_t* new_scene();
 RENDERER_API void delete_scene(scene_t* sc);
 RENDERER_API int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_basepath, uint32_t* first_model_id, uint32_t* num_added_models);
+RENDERER_API int32_t scene_add_models_ex(scene_t* sc, const char* filename, const char* mtl_basepath, const model_load_config_t* config, uint32_t* first_model_id, uint32_t* num_added_models);
+// average number of vertices transformed per triangle of a range of models (ACMR), in the order of the file and in the order they're drawn in
+RENDERER_API void scene_get_model_acmr(scene_t* sc, uint32_t first_model_id, uint32_t num_models, float* acmr_before, float* acmr_after);
 RENDERER_API void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id);
 RENDERER_API void scene_remove_instance(scene_t* sc, uint32_t instance_id);
+// the same for many instances at once. adding grows the scene's memory once for all of them, if it has to. instance_ids can be NULL.
+RENDERER_API void scene_add_instances(scene_t* sc, const uint32_t* model_ids, uint32_t num_instances, uint32_t* instance_ids);
+RENDERER_API void scene_remove_instances(scene_t* sc, const uint32_t* instance_ids, uint32_t num_instances);
+// model to world, in s15.16 and column major like the view, without projection. instances start out with the identity.
+RENDERER_API void scene_set_instance_transform(scene_t* sc, uint32_t instance_id, int32_t transform[16]);
+// the bounding box of a model, in s15.16 model space
+RENDERER_API void scene_get_model_bounds(scene_t* sc, uint32_t model_id, int32_t min_position[3], int32_t max_position[3]);
 RENDERER_API void scene_set_view(scene_t* sc, int32_t view[16]);
 RENDERER_API void scene_set_projection(scene_t* sc, int32_t proj[16]);
 
+// a copy of the instances of a scene, their transforms and bounds, and the view and projection, to render while the scene gets updated.
+// keep two to overlap frames: take the next frame's snapshot on the thread that updates the scene while the other one renders, then swap them.
+// taking a snapshot reuses its memory, so once it has held as many instances as the scene has, it doesn't allocate.
+// the models are the scene's, so the scene must outlive its snapshots.
+RENDERER_API scene_snapshot_t* new_scene_snapshot();
+RENDERER_API void delete_scene_snapshot(scene_snapshot_t* ss);
+RENDERER_API void scene_take_snapshot(scene_t* sc, scene_snapshot_t* ss);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
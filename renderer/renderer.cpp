@@ -1,6 +1,9 @@
 #include <renderer.h>
 
 #include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
 
 #include <rasterizer.h>
 #include <s1516.h>
@@ -10,9 +13,44 @@
 #include <tiny_obj_loader.h>
 
 #define SCENE_MAX_NUM_MODELS 512
-#define SCENE_MAX_NUM_INSTANCES 512
+// every model has at most one texture
+#define SCENE_MAX_NUM_TEXTURES SCENE_MAX_NUM_MODELS
+// the most the freelist's 16 bit indices can hold
+#define SCENE_MAX_NUM_INSTANCES 65534
+
+// bump when the layout of the mesh cache or the conversion of models changes, so old caches get rebuilt
+#define MESH_CACHE_MAGIC 0x48534D56 // "VMSH"
+#define MESH_CACHE_VERSION 5
+
+// every array of the mesh cache starts on its own cache line
+#define MESH_CACHE_ALIGNMENT 64
+
+// floats of attributes per vertex of a model: the texcoord uv, then the normal xyz.
+// they're the varyings the visible pixels are shaded with, when the framebuffer is a visibility buffer.
+#define MODEL_NUM_ATTRIBUTES 5
+
+// the size of the FIFO vertex cache that the triangle order is optimized and measured for, by default
+#define DEFAULT_VERTEX_CACHE_SIZE 16
+
+// models are split in clusters of this many triangles, which get culled as a whole before their vertices are transformed
+#define CLUSTER_MAX_TRIANGLES 64
+
+// consecutive instances are drawn together until they have at least this many triangles,
+// so the rasterizer has enough of them to bin on all of its threads, and the instances are culled and transformed in parallel
+#define RENDERER_BATCH_MIN_TRIANGLES 32768
+
+// clusters are only culled when they're out by more than this, relative to their distance, so float rounding
+// never culls a triangle that the fixed point rasterizer would have drawn
+#define CLUSTER_CULL_EPSILON 1e-4f
 
-#include <imgui.h>
+// how much wider than their normals the cones are made when testing them, as the sine of an angle.
+// the rasterizer's fixed point snapping can turn a small triangle that's nearly edge on to face the other way.
+#define CLUSTER_CONE_MARGIN 1e-2f
+
+// the tree over the instances is walked with a stack this deep. it's kept balanced, so that's far more than SCENE_MAX_NUM_INSTANCES needs.
+#define INSTANCE_TREE_MAX_DEPTH 64
+
+#define NO_NODE -1
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -20,6 +58,20 @@
 #include <Windows.h>
 #endif
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+
+// lets the AVX2 code be compiled without building the whole renderer for AVX2.
+// it only runs if the rasterizer picked AVX2 or better, which means the CPU supports it.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
 #ifdef _WIN32
 uint64_t qpc()
 {
@@ -42,31 +94,250 @@ uint64_t qpf()
 "Missing QPF implementation for this platform!";
 #endif
 
+// a whole file mapped read-only in memory
+typedef struct mapped_file_t
+{
+    const uint8_t* data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file_t;
+
+#ifdef _WIN32
+// the size and last write time of a file, to know whether a file made from it is out of date
+static bool get_file_version(const char* filename, uint64_t* size, uint64_t* write_time)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    FILETIME file_write_time;
+    bool ok = GetFileSizeEx(file, &file_size) && GetFileTime(file, NULL, NULL, &file_write_time);
+    CloseHandle(file);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    *size = (uint64_t)file_size.QuadPart;
+    *write_time = ((uint64_t)file_write_time.dwHighDateTime << 32) | file_write_time.dwLowDateTime;
+    return true;
+}
+
+static bool map_file(const char* filename, mapped_file_t* mf)
+{
+    mf->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(mf->file, &file_size) || file_size.QuadPart == 0)
+    {
+        CloseHandle(mf->file);
+        return false;
+    }
+
+    mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mf->mapping)
+    {
+        CloseHandle(mf->file);
+        return false;
+    }
+
+    mf->data = (const uint8_t*)MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mf->data)
+    {
+        CloseHandle(mf->mapping);
+        CloseHandle(mf->file);
+        return false;
+    }
+
+    mf->size = (uint64_t)file_size.QuadPart;
+    return true;
+}
+
+static void unmap_file(mapped_file_t* mf)
+{
+    UnmapViewOfFile(mf->data);
+    CloseHandle(mf->mapping);
+    CloseHandle(mf->file);
+}
+
+// writes next to the file first and then replaces it, so a half written file is never left behind
+static bool write_file(const char* filename, const void* data, uint64_t size)
+{
+    std::string tmp_filename = std::string(filename) + ".tmp";
+
+    HANDLE file = CreateFileA(tmp_filename.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (ok && size > 0)
+    {
+        DWORD num_to_write = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        DWORD num_written;
+        ok = WriteFile(file, bytes, num_to_write, &num_written, NULL) && num_written == num_to_write;
+        bytes += num_to_write;
+        size -= num_to_write;
+    }
+    ok = CloseHandle(file) && ok;
+
+    // fails while another scene still has the old file mapped
+    ok = ok && MoveFileExA(tmp_filename.c_str(), filename, MOVEFILE_REPLACE_EXISTING);
+    if (!ok)
+    {
+        DeleteFileA(tmp_filename.c_str());
+    }
+    return ok;
+}
+#else
+"Missing file mapping implementation for this platform!";
+#endif
+
+// a run of triangles of a model, with what's needed to know when none of them can be visible
+typedef struct cluster_t
+{
+    uint32_t first_index;
+    uint32_t index_count;
+
+    // bounding box, in s15.16 model space
+    int32_t min_position[3];
+    int32_t max_position[3];
+
+    // bounding sphere
+    float center[3];
+    float radius;
+
+    // the front face normals of all triangles are within the cone around cone_axis.
+    // cone_cutoff is the sine of the cone's half angle, or more than 1 when the triangles face in too many directions to all be back facing at once.
+    float cone_axis[3];
+    float cone_cutoff;
+} cluster_t;
+
 typedef struct model_t
 {
     int32_t* positions;
     uint32_t* indices;
+    cluster_t* clusters;
+
+    // MODEL_NUM_ATTRIBUTES per vertex, in model space. 0 for the texcoords or normals the OBJ doesn't have.
+    float* attributes;
+
+    // the diffuse texture of the model's material, owned by the scene. NULL if it doesn't have one, or it couldn't be loaded.
+    const texture_t* texture;
 
     uint32_t vertex_count;
     uint32_t index_count;
+    uint32_t cluster_count;
+
+    // bounding box of every cluster, in s15.16 model space
+    int32_t min_position[3];
+    int32_t max_position[3];
+
+    // the arrays of the model point into a mapped mesh cache, instead of being allocated
+    bool is_mapped;
+
+    // average number of vertices transformed per triangle with a FIFO vertex cache, in the OBJ's order and in the final order
+    float acmr_before;
+    float acmr_after;
 } model_t;
 
 typedef struct instance_t
 {
     int32_t model_id;
+
+    // model to world, in s15.16 and column major like the view and projection
+    int32_t transform[16];
+
+    // the leaf of the scene's instance tree
+    int32_t node_id;
 } instance_t;
 
+// a node of the tree of instance bounds. leaves have no children and stand for an instance.
+typedef struct instance_node_t
+{
+    // world space bounding box of the instance, or of both children
+    float min_position[3];
+    float max_position[3];
+
+    // the next unused node instead, for unused nodes
+    int32_t parent;
+    int32_t children[2];
+
+    // the longest path down to a leaf. 0 for leaves.
+    int32_t height;
+
+    // for leaves, where the instance is in the scene's instances, which the freelist keeps packed.
+    // snapshots copy the instances in the same order, so their copies of the nodes stay right.
+    uint32_t instance_index;
+} instance_node_t;
+
+// a texture of the scene, loaded once for all the models that use it
+typedef struct scene_texture_t
+{
+    char* filename;
+
+    // NULL when it couldn't be loaded, so it isn't tried again
+    texture_t* texture;
+} scene_texture_t;
+
 typedef struct scene_t
 {
     model_t* models;
     uint32_t model_count;
 
+    scene_texture_t* textures;
+    uint32_t texture_count;
+
     freelist_t<instance_t>* instances;
 
+    // bounding volume hierarchy over the instances, kept balanced as instances are added, moved and removed,
+    // so the instances out of the view are culled without going through every one of them
+    instance_node_t* nodes;
+    int32_t node_capacity;
+    int32_t free_node;
+    int32_t root_node;
+
+    // the mesh caches that models were loaded from, mapped until the scene is deleted
+    mapped_file_t* mesh_caches;
+    uint32_t mesh_cache_count;
+
     int32_t view[16];
     int32_t proj[16];
 } scene_t;
 
+// what the renderer reads of a scene while rendering it. renderer_render_scene points one at the scene itself,
+// and scene_take_snapshot copies the scene into one, so the scene can change while it renders.
+typedef struct scene_snapshot_t
+{
+    // the models (and textures) are the scene's, which never change once they're loaded
+    const scene_t* scene;
+
+    // in the order of the scene
+    instance_t* instances;
+    uint32_t instance_count;
+    uint32_t instance_capacity;
+
+    instance_node_t* nodes;
+    int32_t node_capacity;
+    int32_t root_node;
+
+    int32_t view[16];
+    int32_t proj[16];
+} scene_snapshot_t;
+
 typedef struct renderer_perfcounters_t
 {
     uint64_t renderinstance;
@@ -78,34 +349,261 @@ const char* kRendererPerfCounterNames[] =  {
 
 static_assert(sizeof(kRendererPerfCounterNames) / sizeof(kRendererPerfCounterNames) == sizeof(renderer_perfcounters_t) / sizeof(uint64_t), "Renderer names count");
 
+// counted for every frame, since the start of renderer_render_scene
+typedef struct renderer_stats_t
+{
+    uint64_t instances;
+    uint64_t instances_culled_frustum;
+    uint64_t instance_nodes_visited;
+    uint64_t clusters;
+    uint64_t clusters_culled_frustum;
+    uint64_t clusters_culled_backface;
+    uint64_t vertices_transformed;
+} renderer_stats_t;
+
+const char* kRendererStatNames[] = {
+    "instances",
+    "instances_culled_frustum",
+    "instance_nodes_visited",
+    "clusters",
+    "clusters_culled_frustum",
+    "clusters_culled_backface",
+    "vertices_transformed"
+};
+
+static_assert(sizeof(kRendererStatNames) / sizeof(*kRendererStatNames) == sizeof(renderer_stats_t) / sizeof(uint64_t), "Renderer stat names count");
+
+// the view of an instance being rendered, as needed to test its clusters against it
+typedef struct cluster_culling_t
+{
+    // viewproj in floats
+    float viewproj[16];
+
+    // the model space position of the eye, where every direction meets in clip space. only known for perspective projections.
+    bool has_eye;
+    float eye[3];
+
+    // -1 when viewproj mirrors the scene, so the triangles that face away from the eye are the ones that end up front facing
+    float facing;
+} cluster_culling_t;
+
+// a view of the scene being rendered, and the framebuffer it goes in
+typedef struct render_view_t
+{
+    framebuffer_t* fb;
+    int32_t viewproj[16];
+
+    // only the renderer's own framebuffer is shaded
+    bool shade;
+} render_view_t;
+
+// an instance that might be visible in one of the views being rendered
+typedef struct visible_instance_t
+{
+    const instance_t* instance;
+    int32_t view_id;
+} visible_instance_t;
+
+// an instance of the batch being rendered, in one of the views
+typedef struct batch_instance_t
+{
+    const model_t* model;
+    uint32_t model_id;
+    int32_t view_id;
+
+    // world view projection
+    int32_t mvp[16];
+    cluster_culling_t culling;
+
+    // model to world for the normals, column major. only used when shading.
+    float normal_matrix[9];
+
+    // where the instance's vertices go in clip_positions (and varyings), and its clusters in visible_clusters
+    uint32_t first_vertex;
+    uint32_t first_cluster;
+
+    // filled in by culling. the indices of the visible clusters go in visible_indices from first_index on.
+    uint32_t num_visible_clusters;
+    uint32_t first_index;
+    uint32_t num_indices;
+
+    // stats of the instance, summed once the batch is done
+    uint32_t num_clusters_culled_frustum;
+    uint32_t num_clusters_culled_backface;
+    uint32_t num_vertices_transformed;
+} batch_instance_t;
+
+// scratch space of one of the threads that transform instances
+typedef struct renderer_worker_t
+{
+    // the vertices used by the visible clusters of an instance, each once. a vertex is already in the list when its stamp
+    // is the one of the instance being transformed.
+    uint32_t* vertex_ids;
+    uint32_t* vertex_stamps;
+    uint32_t vertex_stamp;
+    uint32_t capacity; // in vertices
+} renderer_worker_t;
+
 typedef struct renderer_t
 {
     framebuffer_t* fb;
 
+    // clip space positions (xyzw) of the vertices of the batch of instances being rendered. every instance gets room for all of its vertices.
+    int32_t* clip_positions;
+    uint32_t clip_positions_capacity; // in vertices
+
+    // the attributes of the same vertices, with world space normals. only filled in when shading.
+    float* varyings;
+    uint32_t varyings_capacity; // in vertices
+
+    // the indices of the clusters of the batch that weren't culled, pointing into clip_positions
+    uint32_t* visible_indices;
+    uint32_t visible_indices_capacity;
+
+    // the ids of the clusters of every instance of the batch that weren't culled. every instance gets room for all of its clusters.
+    uint32_t* visible_clusters;
+    uint32_t visible_clusters_capacity;
+
+    batch_instance_t* batch_instances;
+    uint32_t batch_instances_capacity;
+
+    // the views of the scene being rendered
+    render_view_t* views;
+    int32_t views_capacity;
+    // the framebuffers of the views, to resolve them together
+    framebuffer_t** view_fbs;
+
+    // the instances of the scene that weren't culled, one view after the other, in the order of the scene
+    visible_instance_t* visible_instances;
+    uint32_t visible_instances_capacity;
+
+    // one per thread of the framebuffer
+    int32_t num_workers;
+    renderer_worker_t* workers;
+
+    bool cull_clusters;
+
+    // whether the framebuffer is a visibility buffer, which gets shaded with shader once the scene is drawn
+    bool shade;
+    renderer_shader_fn_t shader;
+    void* shader_ctx;
+
+    // the scene being shaded, for the default shader to find the textures of the models
+    const scene_t* shade_scene;
+
+    // whether vertices can be transformed 8 at a time
+    bool use_avx2;
+
     uint64_t pc_frequency;
     renderer_perfcounters_t perfcounters;
+    renderer_stats_t stats;
+
+    // debugging filters, set by whoever shows the UI for them
+    bool filter_triangles;
+    int32_t filter_triangle_ids[3];
+    bool filter_instances;
+    int32_t filter_instance_index;
 } renderer_t;
 
-renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight)
+static void default_shader(void* ctx, const framebuffer_pixels_t* pixels, uint32_t colors[8]);
+
+// the renderer owns the framebuffer
+static renderer_t* new_renderer_for_framebuffer(framebuffer_t* fb, bool shade)
 {
+    assert(fb);
+
     renderer_t* rd = (renderer_t*)malloc(sizeof(renderer_t));
     assert(rd);
 
-    rd->fb = new_framebuffer(fbwidth, fbheight);
-    assert(rd->fb);
+    rd->fb = fb;
+
+    rd->clip_positions = NULL;
+    rd->clip_positions_capacity = 0;
+
+    rd->varyings = NULL;
+    rd->varyings_capacity = 0;
+
+    rd->visible_indices = NULL;
+    rd->visible_indices_capacity = 0;
+
+    rd->visible_clusters = NULL;
+    rd->visible_clusters_capacity = 0;
+
+    rd->batch_instances = NULL;
+    rd->batch_instances_capacity = 0;
+
+    rd->views = NULL;
+    rd->views_capacity = 0;
+    rd->view_fbs = NULL;
+
+    rd->visible_instances = NULL;
+    rd->visible_instances_capacity = 0;
+
+    rd->num_workers = framebuffer_get_num_threads(rd->fb);
+    rd->workers = (renderer_worker_t*)malloc(sizeof(renderer_worker_t) * rd->num_workers);
+    assert(rd->workers);
+    for (int32_t i = 0; i < rd->num_workers; i++)
+    {
+        rd->workers[i].vertex_ids = NULL;
+        rd->workers[i].vertex_stamps = NULL;
+        rd->workers[i].vertex_stamp = 0;
+        rd->workers[i].capacity = 0;
+    }
+
+    rd->cull_clusters = true;
+
+    rd->shade = shade;
+    rd->shader = default_shader;
+    rd->shader_ctx = rd;
+    rd->shade_scene = NULL;
+
+    rd->use_avx2 = framebuffer_get_instruction_set(rd->fb) >= instructionset_avx2;
 
     rd->pc_frequency = qpf();
     memset(&rd->perfcounters, 0, sizeof(renderer_perfcounters_t));
+    memset(&rd->stats, 0, sizeof(renderer_stats_t));
+
+    rd->filter_triangles = false;
+    rd->filter_triangle_ids[0] = -1;
+    rd->filter_triangle_ids[1] = -1;
+    rd->filter_triangle_ids[2] = -1;
+    rd->filter_instances = false;
+    rd->filter_instance_index = -1;
 
     return rd;
 }
 
+renderer_t* new_renderer(int32_t fbwidth, int32_t fbheight)
+{
+    return new_renderer_for_framebuffer(new_framebuffer(fbwidth, fbheight), false);
+}
+
+renderer_t* new_renderer_ex(int32_t fbwidth, int32_t fbheight, const framebuffer_config_t* config)
+{
+    assert(config);
+    return new_renderer_for_framebuffer(new_framebuffer_ex(fbwidth, fbheight, config), config->visibility_buffer != 0);
+}
+
 void delete_renderer(renderer_t* rd)
 {
     if (!rd)
         return;
 
     delete_framebuffer(rd->fb);
+    free(rd->clip_positions);
+    free(rd->varyings);
+    free(rd->visible_indices);
+    free(rd->visible_clusters);
+    free(rd->batch_instances);
+    free(rd->views);
+    free(rd->view_fbs);
+    free(rd->visible_instances);
+    for (int32_t i = 0; i < rd->num_workers; i++)
+    {
+        free(rd->workers[i].vertex_ids);
+        free(rd->workers[i].vertex_stamps);
+    }
+    free(rd->workers);
     free(rd);
 }
 
@@ -129,173 +627,2192 @@ static void s15164x4_mul(const int32_t* a, const int32_t* b, int32_t* dst)
     dst[15] = s1516_fma(a[3], b[12], s1516_fma(a[7], b[13], s1516_fma(a[11], b[14], s1516_mul(a[15], b[15]))));
 }
 
-static bool g_FilterTriangles = false;
-static int g_FilterTriangle0 = -1;
-static int g_FilterTriangle1 = -1;
-static int g_FilterTriangle2 = -1;
-
-static bool g_FilterInstances = false;
-static int g_FilterInstance0 = -1;
-
-static void renderer_render_instance(renderer_t* rd, scene_t* sc, instance_t* instance, int32_t* viewproj)
+// s1516_fma on 8 lanes at once, with the same rounding and saturation
+TARGET_AVX2 static __forceinline __m256i s1516_fma_avx2(__m256i a, __m256i b, __m256i c)
 {
-    int32_t model_id = instance->model_id;
-    model_t* model = &sc->models[model_id];
+    // 64 bit products of the even and odd lanes: a * b + (c << 16) + rounding
+    const __m256i c_scale = _mm256_set1_epi32(1 << 16);
+    const __m256i rounding = _mm256_set1_epi64x(1 << 15);
+    __m256i temp_even = _mm256_add_epi64(_mm256_mul_epi32(a, b), _mm256_mul_epi32(c, c_scale));
+    __m256i temp_odd = _mm256_add_epi64(
+        _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)),
+        _mm256_mul_epi32(_mm256_srli_epi64(c, 32), c_scale));
+    temp_even = _mm256_add_epi64(temp_even, rounding);
+    temp_odd = _mm256_add_epi64(temp_odd, rounding);
+
+    // the low 32 bits of temp >> 16, back in the lanes they came from
+    __m256i result = _mm256_blend_epi32(
+        _mm256_srli_epi64(temp_even, 16),
+        _mm256_slli_epi64(_mm256_srli_epi64(temp_odd, 16), 32),
+        0xAA);
+
+    // the high 32 bits of temp, to check if temp >> 16 fits in 32 bits
+    __m256i temp_hi = _mm256_blend_epi32(
+        _mm256_shuffle_epi32(temp_even, _MM_SHUFFLE(3, 3, 1, 1)),
+        temp_odd,
+        0xAA);
+
+    // fits if bits 47 to 63 of temp are all the same as the sign bit
+    __m256i sign = _mm256_srai_epi32(temp_hi, 31);
+    __m256i fits = _mm256_cmpeq_epi32(_mm256_srai_epi32(temp_hi, 15), sign);
+
+    // saturate to INT32_MIN for negative values and INT32_MAX for positive values
+    __m256i saturated = _mm256_xor_si256(sign, _mm256_set1_epi32(0x7FFFFFFF));
+
+    return _mm256_blendv_epi8(saturated, result, fits);
+}
 
-    uint64_t renderinstance_start_pc = qpc();
+// transforms 8 vertices, and transposes them to xyzw. vertex i ends up in the low half of verts[i % 4] if i < 4, or in the high half otherwise.
+TARGET_AVX2 static __forceinline void transform_8_vertices_avx2(const __m256i m[16], __m256i vx, __m256i vy, __m256i vz, __m256i verts[4])
+{
+    __m256i x = s1516_fma_avx2(m[0], vx, s1516_fma_avx2(m[4], vy, s1516_fma_avx2(m[8], vz, m[12])));
+    __m256i y = s1516_fma_avx2(m[1], vx, s1516_fma_avx2(m[5], vy, s1516_fma_avx2(m[9], vz, m[13])));
+    __m256i z = s1516_fma_avx2(m[2], vx, s1516_fma_avx2(m[6], vy, s1516_fma_avx2(m[10], vz, m[14])));
+    __m256i w = s1516_fma_avx2(m[3], vx, s1516_fma_avx2(m[7], vy, s1516_fma_avx2(m[11], vz, m[15])));
+
+    // transpose from 4 vectors of 8 components to 8 vertices of xyzw
+    __m256i xy_lo = _mm256_unpacklo_epi32(x, y);
+    __m256i xy_hi = _mm256_unpackhi_epi32(x, y);
+    __m256i zw_lo = _mm256_unpacklo_epi32(z, w);
+    __m256i zw_hi = _mm256_unpackhi_epi32(z, w);
+    verts[0] = _mm256_unpacklo_epi64(xy_lo, zw_lo);
+    verts[1] = _mm256_unpackhi_epi64(xy_lo, zw_lo);
+    verts[2] = _mm256_unpacklo_epi64(xy_hi, zw_hi);
+    verts[3] = _mm256_unpackhi_epi64(xy_hi, zw_hi);
+}
 
-    for (uint32_t index_id = 0; index_id < model->index_count; index_id += 3)
+// transforms vertices 8 at a time, and returns how many were transformed
+TARGET_AVX2 static uint32_t transform_vertices_avx2(const int32_t* positions, uint32_t num_vertices, const int32_t* xform, int32_t* clip_positions)
+{
+    __m256i m[16];
+    for (int32_t i = 0; i < 16; i++)
     {
-        if (g_FilterTriangles && (g_FilterTriangle0 != -1 || g_FilterTriangle1 != -1 || g_FilterTriangle2 != -1) &&
-            index_id / 3 != g_FilterTriangle0 && index_id / 3 != g_FilterTriangle1 && index_id / 3 != g_FilterTriangle2)
-        {
-            continue;
-        }
-
-        int32_t xverts[3][4];
-
-        // TODO: cache transformations based on vertex_id
-
-        for (uint32_t index_off = 0; index_off < 3; index_off++)
-        {
-            uint32_t vertex_id = model->indices[index_id + index_off];
-            int32_t vert[3];
-            vert[0] = model->positions[vertex_id * 3 + 0];
-            vert[1] = model->positions[vertex_id * 3 + 1];
-            vert[2] = model->positions[vertex_id * 3 + 2];
+        m[i] = _mm256_set1_epi32(xform[i]);
+    }
 
-            // TODO: incorporate modelworld matrix
-            xverts[index_off][0] = s1516_fma(viewproj[0], vert[0], s1516_fma(viewproj[4], vert[1], s1516_fma(viewproj[8], vert[2],  viewproj[12])));
-            xverts[index_off][1] = s1516_fma(viewproj[1], vert[0], s1516_fma(viewproj[5], vert[1], s1516_fma(viewproj[9], vert[2],  viewproj[13])));
-            xverts[index_off][2] = s1516_fma(viewproj[2], vert[0], s1516_fma(viewproj[6], vert[1], s1516_fma(viewproj[10], vert[2], viewproj[14])));
-            xverts[index_off][3] = s1516_fma(viewproj[3], vert[0], s1516_fma(viewproj[7], vert[1], s1516_fma(viewproj[11], vert[2], viewproj[15])));
-        }
+    // positions are stored as xyz, so each component is every 3rd int
+    const __m256i position_offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
 
-        // TODO: buffer up more triangles to draw
-        framebuffer_draw(rd->fb, &xverts[0][0], 3);
+    uint32_t vertex_id = 0;
+    for (; vertex_id + 8 <= num_vertices; vertex_id += 8)
+    {
+        const int32_t* first_position = &positions[vertex_id * 3];
+        __m256i vx = _mm256_i32gather_epi32((const int*)first_position + 0, position_offsets, 4);
+        __m256i vy = _mm256_i32gather_epi32((const int*)first_position + 1, position_offsets, 4);
+        __m256i vz = _mm256_i32gather_epi32((const int*)first_position + 2, position_offsets, 4);
+
+        __m256i verts[4];
+        transform_8_vertices_avx2(m, vx, vy, vz, verts);
+
+        __m256i* dst = (__m256i*)&clip_positions[vertex_id * 4];
+        _mm256_storeu_si256(dst + 0, _mm256_permute2x128_si256(verts[0], verts[1], 0x20));
+        _mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(verts[2], verts[3], 0x20));
+        _mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(verts[0], verts[1], 0x31));
+        _mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(verts[2], verts[3], 0x31));
     }
 
-    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+    return vertex_id;
 }
 
-void renderer_render_scene(renderer_t* rd, scene_t* sc)
+// same, for the vertices in a list of ids, which land at their id in clip_positions
+TARGET_AVX2 static uint32_t transform_vertex_list_avx2(const int32_t* positions, const uint32_t* vertex_ids, uint32_t num_vertices, const int32_t* xform, int32_t* clip_positions)
 {
-    assert(rd);
-    assert(sc);
-
-    if (ImGui::Begin("Renderer"))
+    __m256i m[16];
+    for (int32_t i = 0; i < 16; i++)
     {
-        ImGui::Checkbox("Filter triangles", &g_FilterTriangles);
-        ImGui::SliderInt("Filter Triangle 0", &g_FilterTriangle0, -1, 1000);
-        ImGui::SliderInt("Filter Triangle 1", &g_FilterTriangle1, -1, 1000);
-        ImGui::SliderInt("Filter Triangle 2", &g_FilterTriangle2, -1, 1000);
-        
-        ImGui::Checkbox("Filter instances", &g_FilterInstances);
-        ImGui::SliderInt("Filter Instance 0", &g_FilterInstance0, -1, (int)sc->instances->size() - 1);
+        m[i] = _mm256_set1_epi32(xform[i]);
     }
-    ImGui::End();
 
-    framebuffer_reset_perfcounters(rd->fb);
-    framebuffer_clear(rd->fb, 0x00000000);
+    uint32_t id_i = 0;
+    for (; id_i + 8 <= num_vertices; id_i += 8)
+    {
+        __m256i ids = _mm256_loadu_si256((const __m256i*)&vertex_ids[id_i]);
+        __m256i position_offsets = _mm256_add_epi32(ids, _mm256_add_epi32(ids, ids));
+        __m256i vx = _mm256_i32gather_epi32((const int*)positions + 0, position_offsets, 4);
+        __m256i vy = _mm256_i32gather_epi32((const int*)positions + 1, position_offsets, 4);
+        __m256i vz = _mm256_i32gather_epi32((const int*)positions + 2, position_offsets, 4);
 
-    int32_t viewproj[16];
-    s15164x4_mul(sc->proj, sc->view, viewproj);
+        __m256i verts[4];
+        transform_8_vertices_avx2(m, vx, vy, vz, verts);
 
-    uint32_t instance_index = 0;
-    for (uint32_t instance_id : *sc->instances)
-    {
-        if (g_FilterInstances && (g_FilterInstance0 != -1) &&
-            instance_index != g_FilterInstance0)
+        for (int32_t v = 0; v < 4; v++)
         {
-            goto skipinstance;
+            _mm_storeu_si128((__m128i*)&clip_positions[vertex_ids[id_i + v] * 4], _mm256_castsi256_si128(verts[v]));
+            _mm_storeu_si128((__m128i*)&clip_positions[vertex_ids[id_i + v + 4] * 4], _mm256_extracti128_si256(verts[v], 1));
         }
-
-        instance_t* instance = &(*sc->instances)[instance_id];
-        renderer_render_instance(rd, sc, instance, viewproj);
-        framebuffer_resolve(rd->fb);
-
-    skipinstance:
-        instance_index++;
     }
 
-    framebuffer_resolve(rd->fb);
+    return id_i;
 }
 
-framebuffer_t* renderer_get_framebuffer(renderer_t* rd)
+static void transform_vertex(const int32_t* viewproj, const int32_t* vert, int32_t* xvert)
 {
-    assert(rd);
-    return rd->fb;
+    xvert[0] = s1516_fma(viewproj[0], vert[0], s1516_fma(viewproj[4], vert[1], s1516_fma(viewproj[8], vert[2],  viewproj[12])));
+    xvert[1] = s1516_fma(viewproj[1], vert[0], s1516_fma(viewproj[5], vert[1], s1516_fma(viewproj[9], vert[2],  viewproj[13])));
+    xvert[2] = s1516_fma(viewproj[2], vert[0], s1516_fma(viewproj[6], vert[1], s1516_fma(viewproj[10], vert[2], viewproj[14])));
+    xvert[3] = s1516_fma(viewproj[3], vert[0], s1516_fma(viewproj[7], vert[1], s1516_fma(viewproj[11], vert[2], viewproj[15])));
 }
 
-uint64_t renderer_get_perfcounter_frequency(renderer_t* rd)
+static void transform_vertices(const renderer_t* rd, const model_t* model, const int32_t* mvp, int32_t* clip_positions)
 {
-    assert(rd);
-    return rd->pc_frequency;
-}
+    uint32_t num_transformed = 0;
+    if (rd->use_avx2)
+    {
+        num_transformed = transform_vertices_avx2(model->positions, model->vertex_count, mvp, clip_positions);
+    }
 
-void renderer_reset_perfcounters(renderer_t* rd)
-{
-    assert(rd);
-    memset(&rd->perfcounters, 0, sizeof(renderer_perfcounters_t));
+    for (uint32_t vertex_id = num_transformed; vertex_id < model->vertex_count; vertex_id++)
+    {
+        transform_vertex(mvp, &model->positions[vertex_id * 3], &clip_positions[vertex_id * 4]);
+    }
 }
 
-int32_t renderer_get_num_perfcounters(renderer_t* rd)
+static void transform_vertex_list(const renderer_t* rd, const model_t* model, const uint32_t* vertex_ids, uint32_t num_vertices, const int32_t* mvp, int32_t* clip_positions)
 {
-    assert(rd);
+    uint32_t num_transformed = 0;
+    if (rd->use_avx2)
+    {
+        num_transformed = transform_vertex_list_avx2(model->positions, vertex_ids, num_vertices, mvp, clip_positions);
+    }
 
-    return sizeof(rd->perfcounters) / sizeof(uint64_t);
+    for (uint32_t id_i = num_transformed; id_i < num_vertices; id_i++)
+    {
+        uint32_t vertex_id = vertex_ids[id_i];
+        transform_vertex(mvp, &model->positions[vertex_id * 3], &clip_positions[vertex_id * 4]);
+    }
 }
 
-void renderer_get_perfcounters(renderer_t* rd, uint64_t* pcs)
+// the upper 3x3 of a model to world transform. normals that aren't perpendicular to the surface anymore with non-uniform scaling are good enough for shading.
+static void setup_normal_matrix(const int32_t* transform, float* normal_matrix)
 {
-    assert(rd);
-    assert(pcs);
+    for (int32_t col = 0; col < 3; col++)
+    {
+        for (int32_t row = 0; row < 3; row++)
+        {
+            normal_matrix[col * 3 + row] = (float)transform[col * 4 + row] / 65536.0f;
+        }
+    }
+}
 
-    memcpy(pcs, &rd->perfcounters, sizeof(rd->perfcounters));
+static void transform_attributes_of_vertex(const float* normal_matrix, const float* attributes, float* varyings)
+{
+    const float* n = &attributes[2];
+    varyings[0] = attributes[0];
+    varyings[1] = attributes[1];
+    varyings[2] = normal_matrix[0] * n[0] + normal_matrix[3] * n[1] + normal_matrix[6] * n[2];
+    varyings[3] = normal_matrix[1] * n[0] + normal_matrix[4] * n[1] + normal_matrix[7] * n[2];
+    varyings[4] = normal_matrix[2] * n[0] + normal_matrix[5] * n[1] + normal_matrix[8] * n[2];
 }
 
-void renderer_get_perfcounter_names(renderer_t* rd, const char** names)
+static void transform_attributes(const model_t* model, const float* normal_matrix, float* varyings)
 {
-    assert(rd);
-    assert(names);
+    for (uint32_t vertex_id = 0; vertex_id < model->vertex_count; vertex_id++)
+    {
+        transform_attributes_of_vertex(normal_matrix, &model->attributes[vertex_id * MODEL_NUM_ATTRIBUTES], &varyings[vertex_id * MODEL_NUM_ATTRIBUTES]);
+    }
+}
 
-    memcpy(names, kRendererPerfCounterNames, sizeof(kRendererPerfCounterNames));
+static void transform_attribute_list(const model_t* model, const uint32_t* vertex_ids, uint32_t num_vertices, const float* normal_matrix, float* varyings)
+{
+    for (uint32_t id_i = 0; id_i < num_vertices; id_i++)
+    {
+        uint32_t vertex_id = vertex_ids[id_i];
+        transform_attributes_of_vertex(normal_matrix, &model->attributes[vertex_id * MODEL_NUM_ATTRIBUTES], &varyings[vertex_id * MODEL_NUM_ATTRIBUTES]);
+    }
 }
 
-scene_t* new_scene()
+static void setup_cluster_culling(const int32_t* viewproj, cluster_culling_t* culling)
 {
-    scene_t* sc = (scene_t*)malloc(sizeof(scene_t));
-    assert(sc);
+    double m[16];
+    for (int32_t i = 0; i < 16; i++)
+    {
+        m[i] = viewproj[i] / 65536.0;
+        culling->viewproj[i] = (float)m[i];
+    }
 
-    sc->models = (model_t*)malloc(sizeof(model_t) * SCENE_MAX_NUM_MODELS);
-    assert(sc->models);
+    // the eye is the point that x, y and w of clip space are all 0 at, so it's orthogonal to those 3 rows of viewproj (stored column major).
+    // its coordinates are the cofactors of the 4th row of the matrix made of those 3 rows and any 4th one.
+    const int32_t rows[3] = { 0, 1, 3 };
+    double eye[4];
+    for (int32_t col = 0; col < 4; col++)
+    {
+        double minor[3][3];
+        for (int32_t r = 0; r < 3; r++)
+        {
+            for (int32_t c = 0, minor_c = 0; c < 4; c++)
+            {
+                if (c != col)
+                    minor[r][minor_c++] = m[c * 4 + rows[r]];
+            }
+        }
 
-    sc->model_count = 0;
+        double det = minor[0][0] * (minor[1][1] * minor[2][2] - minor[1][2] * minor[2][1]) -
+            minor[0][1] * (minor[1][0] * minor[2][2] - minor[1][2] * minor[2][0]) +
+            minor[0][2] * (minor[1][0] * minor[2][1] - minor[1][1] * minor[2][0]);
+        eye[col] = (col % 2 == 0) ? det : -det;
+    }
 
-    sc->instances = new freelist_t<instance_t>(SCENE_MAX_NUM_INSTANCES);
-    assert(sc->instances);
-    
-    return sc;
+    // orthographic projections have their eye infinitely far away
+    culling->has_eye = fabs(eye[3]) > 1e-12;
+    if (culling->has_eye)
+    {
+        culling->eye[0] = (float)(eye[0] / eye[3]);
+        culling->eye[1] = (float)(eye[1] / eye[3]);
+        culling->eye[2] = (float)(eye[2] / eye[3]);
+    }
+
+    // right handed views with OpenGL style projections have a negative determinant, and triangles end up front facing when they face the eye.
+    // a positive determinant mirrors the scene, so it's the other way around.
+    // the determinant is expanded along the z row, the one that the eye doesn't depend on.
+    double det = 0.0;
+    for (int32_t col = 0; col < 4; col++)
+    {
+        double minor[3][3];
+        for (int32_t r = 0, minor_r = 0; r < 4; r++)
+        {
+            if (r == 2)
+                continue;
+
+            for (int32_t c = 0, minor_c = 0; c < 4; c++)
+            {
+                if (c != col)
+                    minor[minor_r][minor_c++] = m[c * 4 + r];
+            }
+            minor_r++;
+        }
+
+        double minor_det = minor[0][0] * (minor[1][1] * minor[2][2] - minor[1][2] * minor[2][1]) -
+            minor[0][1] * (minor[1][0] * minor[2][2] - minor[1][2] * minor[2][0]) +
+            minor[0][2] * (minor[1][0] * minor[2][1] - minor[1][1] * minor[2][0]);
+        det += ((2 + col) % 2 == 0 ? 1.0 : -1.0) * m[col * 4 + 2] * minor_det;
+    }
+
+    culling->facing = det <= 0.0 ? 1.0f : -1.0f;
 }
 
-void delete_scene(scene_t* sc)
+// whether the whole bounding box is out of the view frustum, by being outside of the same plane
+static bool is_cluster_outside_frustum(const cluster_culling_t* culling, const cluster_t* cluster)
 {
-    delete sc->instances;
+    const float* m = culling->viewproj;
 
-    for (uint32_t i = 0; i < sc->model_count; i++)
+    uint32_t outside_all = 0x3F;
+    for (int32_t corner = 0; corner < 8 && outside_all; corner++)
     {
-        free(sc->models[i].positions);
-        free(sc->models[i].indices);
+        float x = (corner & 1 ? cluster->max_position[0] : cluster->min_position[0]) / 65536.0f;
+        float y = (corner & 2 ? cluster->max_position[1] : cluster->min_position[1]) / 65536.0f;
+        float z = (corner & 4 ? cluster->max_position[2] : cluster->min_position[2]) / 65536.0f;
+
+        float cx = m[0] * x + m[4] * y + m[8] * z + m[12];
+        float cy = m[1] * x + m[5] * y + m[9] * z + m[13];
+        float cz = m[2] * x + m[6] * y + m[10] * z + m[14];
+        float cw = m[3] * x + m[7] * y + m[11] * z + m[15];
+
+        // the same planes as the rasterizer's, but the viewport's instead of the guard band's
+        float epsilon = CLUSTER_CULL_EPSILON * (fabsf(cx) + fabsf(cy) + fabsf(cz) + fabsf(cw)) + CLUSTER_CULL_EPSILON;
+        uint32_t outside = 0;
+        outside |= (cz < -epsilon) ? 0x01 : 0;
+        outside |= (cw - cz < -epsilon) ? 0x02 : 0;
+        outside |= (cw + cx < -epsilon) ? 0x04 : 0;
+        outside |= (cw - cx < -epsilon) ? 0x08 : 0;
+        outside |= (cw + cy < -epsilon) ? 0x10 : 0;
+        outside |= (cw - cy < -epsilon) ? 0x20 : 0;
+        outside_all &= outside;
     }
-    free(sc->models);
 
-    free(sc);
+    return outside_all != 0;
 }
 
-int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_basepath, uint32_t* first_model_id, uint32_t* num_added_models)
+// whether every triangle faces away from the eye, from anywhere in the bounding sphere
+static bool is_cluster_backfacing(const cluster_culling_t* culling, const cluster_t* cluster)
 {
-    assert(sc);
-    assert(filename);
+    if (!culling->has_eye || cluster->cone_cutoff > 1.0f)
+    {
+        return false;
+    }
+
+    float to_center[3] = {
+        cluster->center[0] - culling->eye[0],
+        cluster->center[1] - culling->eye[1],
+        cluster->center[2] - culling->eye[2]
+    };
+
+    float distance = sqrtf(to_center[0] * to_center[0] + to_center[1] * to_center[1] + to_center[2] * to_center[2]);
+    float along_axis = culling->facing * (to_center[0] * cluster->cone_axis[0] + to_center[1] * cluster->cone_axis[1] + to_center[2] * cluster->cone_axis[2]);
+
+    return along_axis >= (cluster->cone_cutoff + CLUSTER_CONE_MARGIN) * distance + cluster->radius;
+}
+
+// Instance tree
+// ------------------
+// A dynamic AABB tree over the world space bounds of the instances, like Box2D's b2DynamicTree.
+// Leaves are inserted next to the node that grows the tree's surface area the least, and AVL style rotations keep it balanced on the way back up,
+// so adding, moving or removing an instance costs O(log n). Moving an instance takes its leaf out and inserts it again.
+
+static int32_t allocate_instance_node(scene_t* sc)
+{
+    if (sc->free_node == NO_NODE)
+    {
+        int32_t new_capacity = std::max(sc->node_capacity * 2, 64);
+        sc->nodes = (instance_node_t*)realloc(sc->nodes, sizeof(instance_node_t) * new_capacity);
+        assert(sc->nodes);
+
+        for (int32_t node_id = sc->node_capacity; node_id < new_capacity; node_id++)
+        {
+            sc->nodes[node_id].parent = node_id + 1 < new_capacity ? node_id + 1 : NO_NODE;
+        }
+        sc->free_node = sc->node_capacity;
+        sc->node_capacity = new_capacity;
+    }
+
+    int32_t node_id = sc->free_node;
+    instance_node_t* node = &sc->nodes[node_id];
+    sc->free_node = node->parent;
+
+    node->parent = NO_NODE;
+    node->children[0] = NO_NODE;
+    node->children[1] = NO_NODE;
+    node->height = 0;
+    node->instance_index = 0;
+    return node_id;
+}
+
+static void free_instance_node(scene_t* sc, int32_t node_id)
+{
+    sc->nodes[node_id].parent = sc->free_node;
+    sc->free_node = node_id;
+}
+
+// the world space box around the model's box, for transforms that don't project
+static void compute_instance_bounds(const scene_t* sc, const instance_t* instance, float min_position[3], float max_position[3])
+{
+    const model_t* model = &sc->models[instance->model_id];
+
+    float center[3], extent[3];
+    for (int32_t c = 0; c < 3; c++)
+    {
+        center[c] = ((float)model->min_position[c] + (float)model->max_position[c]) / 2.0f / 65536.0f;
+        extent[c] = ((float)model->max_position[c] - (float)model->min_position[c]) / 2.0f / 65536.0f;
+    }
+
+    float m[16];
+    for (int32_t i = 0; i < 16; i++)
+    {
+        m[i] = instance->transform[i] / 65536.0f;
+    }
+
+    for (int32_t r = 0; r < 3; r++)
+    {
+        float world_center = m[r] * center[0] + m[4 + r] * center[1] + m[8 + r] * center[2] + m[12 + r];
+        float world_extent = fabsf(m[r]) * extent[0] + fabsf(m[4 + r]) * extent[1] + fabsf(m[8 + r]) * extent[2];
+        min_position[r] = world_center - world_extent;
+        max_position[r] = world_center + world_extent;
+    }
+}
+
+static float box_surface_area(const float min_position[3], const float max_position[3])
+{
+    float dx = max_position[0] - min_position[0];
+    float dy = max_position[1] - min_position[1];
+    float dz = max_position[2] - min_position[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+// the surface area of the box around both nodes
+static float union_surface_area(const instance_node_t* a, const instance_node_t* b)
+{
+    float min_position[3], max_position[3];
+    for (int32_t c = 0; c < 3; c++)
+    {
+        min_position[c] = std::min(a->min_position[c], b->min_position[c]);
+        max_position[c] = std::max(a->max_position[c], b->max_position[c]);
+    }
+    return box_surface_area(min_position, max_position);
+}
+
+// the box and height of an inner node, from those of its children
+static void refit_instance_node(scene_t* sc, int32_t node_id)
+{
+    instance_node_t* node = &sc->nodes[node_id];
+    const instance_node_t* child0 = &sc->nodes[node->children[0]];
+    const instance_node_t* child1 = &sc->nodes[node->children[1]];
+
+    for (int32_t c = 0; c < 3; c++)
+    {
+        node->min_position[c] = std::min(child0->min_position[c], child1->min_position[c]);
+        node->max_position[c] = std::max(child0->max_position[c], child1->max_position[c]);
+    }
+    node->height = 1 + std::max(child0->height, child1->height);
+}
+
+// makes the node's taller child take its place when one child is more than one level taller than the other. returns the node now in its place.
+static int32_t balance_instance_node(scene_t* sc, int32_t a_id)
+{
+    instance_node_t* a = &sc->nodes[a_id];
+    if (a->height < 2)
+    {
+        return a_id;
+    }
+
+    int32_t balance = sc->nodes[a->children[1]].height - sc->nodes[a->children[0]].height;
+    if (balance >= -1 && balance <= 1)
+    {
+        return a_id;
+    }
+
+    // b is the taller child, which replaces a. a keeps its other child, and takes the shorter of b's children.
+    int32_t taller = balance > 0 ? 1 : 0;
+    int32_t b_id = a->children[taller];
+    instance_node_t* b = &sc->nodes[b_id];
+
+    int32_t b_taller = sc->nodes[b->children[1]].height > sc->nodes[b->children[0]].height ? 1 : 0;
+    int32_t kept_id = b->children[b_taller];
+    int32_t moved_id = b->children[1 - b_taller];
+
+    b->parent = a->parent;
+    if (b->parent == NO_NODE)
+    {
+        sc->root_node = b_id;
+    }
+    else
+    {
+        instance_node_t* parent = &sc->nodes[b->parent];
+        parent->children[parent->children[0] == a_id ? 0 : 1] = b_id;
+    }
+
+    a->parent = b_id;
+    a->children[taller] = moved_id;
+    sc->nodes[moved_id].parent = a_id;
+    b->children[0] = a_id;
+    b->children[1] = kept_id;
+
+    refit_instance_node(sc, a_id);
+    refit_instance_node(sc, b_id);
+    return b_id;
+}
+
+// rebalances and refits every node from this one up to the root
+static void refit_instance_tree(scene_t* sc, int32_t node_id)
+{
+    while (node_id != NO_NODE)
+    {
+        node_id = balance_instance_node(sc, node_id);
+        refit_instance_node(sc, node_id);
+        node_id = sc->nodes[node_id].parent;
+    }
+}
+
+static void insert_instance_leaf(scene_t* sc, int32_t leaf_id)
+{
+    if (sc->root_node == NO_NODE)
+    {
+        sc->root_node = leaf_id;
+        sc->nodes[leaf_id].parent = NO_NODE;
+        return;
+    }
+
+    // goes down to the sibling that costs the least surface area, counting how much every node above it grows
+    const instance_node_t* leaf = &sc->nodes[leaf_id];
+    int32_t sibling_id = sc->root_node;
+    while (sc->nodes[sibling_id].height > 0)
+    {
+        const instance_node_t* node = &sc->nodes[sibling_id];
+
+        float area = box_surface_area(node->min_position, node->max_position);
+        float combined_area = union_surface_area(node, leaf);
+
+        // making the leaf and this node children of a new node
+        float cost = 2.0f * combined_area;
+        float inherited_cost = 2.0f * (combined_area - area);
+
+        // going down either child instead
+        float child_costs[2];
+        for (int32_t i = 0; i < 2; i++)
+        {
+            const instance_node_t* child = &sc->nodes[node->children[i]];
+            float child_area = union_surface_area(child, leaf);
+            if (child->height > 0)
+            {
+                child_area -= box_surface_area(child->min_position, child->max_position);
+            }
+            child_costs[i] = child_area + inherited_cost;
+        }
+
+        if (cost < child_costs[0] && cost < child_costs[1])
+        {
+            break;
+        }
+
+        sibling_id = node->children[child_costs[0] < child_costs[1] ? 0 : 1];
+    }
+
+    int32_t old_parent_id = sc->nodes[sibling_id].parent;
+    int32_t new_parent_id = allocate_instance_node(sc);
+    instance_node_t* new_parent = &sc->nodes[new_parent_id];
+    new_parent->parent = old_parent_id;
+    new_parent->children[0] = sibling_id;
+    new_parent->children[1] = leaf_id;
+    sc->nodes[sibling_id].parent = new_parent_id;
+    sc->nodes[leaf_id].parent = new_parent_id;
+
+    if (old_parent_id == NO_NODE)
+    {
+        sc->root_node = new_parent_id;
+    }
+    else
+    {
+        instance_node_t* old_parent = &sc->nodes[old_parent_id];
+        old_parent->children[old_parent->children[0] == sibling_id ? 0 : 1] = new_parent_id;
+    }
+
+    refit_instance_tree(sc, new_parent_id);
+}
+
+// the leaf's parent goes away, and its sibling takes the parent's place
+static void remove_instance_leaf(scene_t* sc, int32_t leaf_id)
+{
+    if (leaf_id == sc->root_node)
+    {
+        sc->root_node = NO_NODE;
+        return;
+    }
+
+    int32_t parent_id = sc->nodes[leaf_id].parent;
+    const instance_node_t* parent = &sc->nodes[parent_id];
+    int32_t grandparent_id = parent->parent;
+    int32_t sibling_id = parent->children[parent->children[0] == leaf_id ? 1 : 0];
+
+    sc->nodes[sibling_id].parent = grandparent_id;
+    if (grandparent_id == NO_NODE)
+    {
+        sc->root_node = sibling_id;
+    }
+    else
+    {
+        instance_node_t* grandparent = &sc->nodes[grandparent_id];
+        grandparent->children[grandparent->children[0] == parent_id ? 0 : 1] = sibling_id;
+    }
+
+    free_instance_node(sc, parent_id);
+    refit_instance_tree(sc, grandparent_id);
+}
+
+// puts the instances whose bounds might be in the frustum of a view in visible_instances, in the order of the scene
+static uint32_t cull_instances(renderer_t* rd, const scene_snapshot_t* ss, int32_t view_id, visible_instance_t* visible_instances)
+{
+    const int32_t* viewproj = rd->views[view_id].viewproj;
+
+    // the planes of the view frustum in world space, the same ones as is_cluster_outside_frustum's: z >= 0, z <= w, -w <= x <= w, -w <= y <= w.
+    // rows of viewproj, which is column major
+    float rows[4][4];
+    for (int32_t r = 0; r < 4; r++)
+    {
+        for (int32_t c = 0; c < 4; c++)
+        {
+            rows[r][c] = viewproj[c * 4 + r] / 65536.0f;
+        }
+    }
+
+    float planes[6][4];
+    for (int32_t c = 0; c < 4; c++)
+    {
+        planes[0][c] = rows[2][c];
+        planes[1][c] = rows[3][c] - rows[2][c];
+        planes[2][c] = rows[3][c] + rows[0][c];
+        planes[3][c] = rows[3][c] - rows[0][c];
+        planes[4][c] = rows[3][c] + rows[1][c];
+        planes[5][c] = rows[3][c] - rows[1][c];
+    }
+
+    // nodes to visit, each with the planes that its parent wasn't entirely inside of. the children of a node inside of every plane are all visible.
+    int32_t stack_node_ids[INSTANCE_TREE_MAX_DEPTH];
+    uint32_t stack_plane_masks[INSTANCE_TREE_MAX_DEPTH];
+    int32_t stack_size = 0;
+    if (ss->root_node != NO_NODE)
+    {
+        stack_node_ids[stack_size] = ss->root_node;
+        stack_plane_masks[stack_size] = 0x3F;
+        stack_size++;
+    }
+
+    uint32_t num_visible_instances = 0;
+    while (stack_size > 0)
+    {
+        stack_size--;
+        const instance_node_t* node = &ss->nodes[stack_node_ids[stack_size]];
+        uint32_t plane_mask = stack_plane_masks[stack_size];
+        rd->stats.instance_nodes_visited++;
+
+        bool outside = false;
+        for (int32_t plane_i = 0; plane_i < 6 && !outside; plane_i++)
+        {
+            if (!(plane_mask & (1 << plane_i)))
+            {
+                continue;
+            }
+
+            // the corners of the box that are the furthest in and out of the plane
+            const float* plane = planes[plane_i];
+            float inner = plane[3];
+            float outer = plane[3];
+            float magnitude = fabsf(plane[3]);
+            for (int32_t c = 0; c < 3; c++)
+            {
+                float a = plane[c] * node->min_position[c];
+                float b = plane[c] * node->max_position[c];
+                inner = plane[c] >= 0.0f ? inner + b : inner + a;
+                outer = plane[c] >= 0.0f ? outer + a : outer + b;
+                magnitude += std::max(fabsf(a), fabsf(b));
+            }
+
+            float epsilon = CLUSTER_CULL_EPSILON * magnitude + CLUSTER_CULL_EPSILON;
+            if (inner < -epsilon)
+            {
+                outside = true;
+            }
+            else if (outer > epsilon)
+            {
+                plane_mask &= ~(1 << plane_i);
+            }
+        }
+
+        if (outside)
+        {
+            continue;
+        }
+
+        if (node->height == 0)
+        {
+            visible_instances[num_visible_instances].instance = &ss->instances[node->instance_index];
+            visible_instances[num_visible_instances].view_id = view_id;
+            num_visible_instances++;
+            continue;
+        }
+
+        assert(stack_size + 2 <= INSTANCE_TREE_MAX_DEPTH);
+        for (int32_t i = 0; i < 2; i++)
+        {
+            stack_node_ids[stack_size] = node->children[i];
+            stack_plane_masks[stack_size] = plane_mask;
+            stack_size++;
+        }
+    }
+
+    // the instances are packed in the order of the scene, so sorting by address puts them back in that order.
+    // it only matters to triangles at the same depth, but it keeps the image the same as when every instance is drawn.
+    std::sort(visible_instances, visible_instances + num_visible_instances, [](const visible_instance_t& a, const visible_instance_t& b) { return a.instance < b.instance; });
+
+    return num_visible_instances;
+}
+
+// only draws the triangles picked by the triangle filter, of every instance, one instance at a time
+static void renderer_render_filtered_instance(renderer_t* rd, const scene_snapshot_t* ss, const instance_t* instance, const render_view_t* view)
+{
+    const model_t* model = &ss->scene->models[instance->model_id];
+
+    if (model->vertex_count > rd->clip_positions_capacity)
+    {
+        rd->clip_positions = (int32_t*)realloc(rd->clip_positions, model->vertex_count * 4 * sizeof(int32_t));
+        assert(rd->clip_positions);
+        rd->clip_positions_capacity = model->vertex_count;
+    }
+
+    int32_t mvp[16];
+    s15164x4_mul(view->viewproj, instance->transform, mvp);
+    transform_vertices(rd, model, mvp, rd->clip_positions);
+    rd->stats.vertices_transformed += model->vertex_count;
+
+    framebuffer_varyings_t varyings;
+    varyings.varyings = rd->varyings;
+    varyings.num_varyings = MODEL_NUM_ATTRIBUTES;
+    varyings.draw_id = (uint32_t)instance->model_id;
+    if (view->shade)
+    {
+        if (model->vertex_count > rd->varyings_capacity)
+        {
+            rd->varyings = (float*)realloc(rd->varyings, model->vertex_count * MODEL_NUM_ATTRIBUTES * sizeof(float));
+            assert(rd->varyings);
+            rd->varyings_capacity = model->vertex_count;
+        }
+
+        float normal_matrix[9];
+        setup_normal_matrix(instance->transform, normal_matrix);
+        transform_attributes(model, normal_matrix, rd->varyings);
+        varyings.varyings = rd->varyings;
+    }
+
+    // in the order they appear in the model
+    const int32_t* filter_ids = rd->filter_triangle_ids;
+    uint32_t filtered_indices[9];
+    uint32_t num_filtered_indices = 0;
+    for (uint32_t index_id = 0; index_id < model->index_count; index_id += 3)
+    {
+        // a model has less than 2^31 triangles, so an id of -1 never matches one
+        int32_t triangle_id = (int32_t)(index_id / 3);
+        if (triangle_id != filter_ids[0] && triangle_id != filter_ids[1] && triangle_id != filter_ids[2])
+        {
+            continue;
+        }
+
+        filtered_indices[num_filtered_indices + 0] = model->indices[index_id + 0];
+        filtered_indices[num_filtered_indices + 1] = model->indices[index_id + 1];
+        filtered_indices[num_filtered_indices + 2] = model->indices[index_id + 2];
+        num_filtered_indices += 3;
+    }
+
+    framebuffer_draw_indexed_ex(view->fb, rd->clip_positions, filtered_indices, num_filtered_indices, view->shade ? &varyings : NULL);
+}
+
+// keeps the clusters of an instance of the batch that might be visible, in the order they are in the model
+static void renderer_cull_instance_task(void* ctx, int32_t batch_instance_id, int32_t /*worker_id*/)
+{
+    renderer_t* rd = (renderer_t*)ctx;
+    batch_instance_t* bi = &rd->batch_instances[batch_instance_id];
+    const model_t* model = bi->model;
+
+    setup_cluster_culling(bi->mvp, &bi->culling);
+
+    uint32_t* visible_clusters = &rd->visible_clusters[bi->first_cluster];
+    bi->num_visible_clusters = 0;
+    bi->num_indices = 0;
+    bi->num_clusters_culled_frustum = 0;
+    bi->num_clusters_culled_backface = 0;
+
+    for (uint32_t cluster_id = 0; cluster_id < model->cluster_count; cluster_id++)
+    {
+        const cluster_t* cluster = &model->clusters[cluster_id];
+
+        if (rd->cull_clusters)
+        {
+            if (is_cluster_outside_frustum(&bi->culling, cluster))
+            {
+                bi->num_clusters_culled_frustum++;
+                continue;
+            }
+
+            if (is_cluster_backfacing(&bi->culling, cluster))
+            {
+                bi->num_clusters_culled_backface++;
+                continue;
+            }
+
+            // no occlusion test: the framebuffer is resolved once per frame, after every batch is drawn, so the max depths
+            // that framebuffer_test_bbox reads are still the cleared ones here. the previous frame's would cull clusters
+            // that the camera or the instances moved into view.
+        }
+
+        visible_clusters[bi->num_visible_clusters++] = cluster_id;
+        bi->num_indices += cluster->index_count;
+    }
+}
+
+// transforms the vertices of the visible clusters of an instance of the batch, and writes their indices
+static void renderer_transform_instance_task(void* ctx, int32_t batch_instance_id, int32_t worker_id)
+{
+    renderer_t* rd = (renderer_t*)ctx;
+    batch_instance_t* bi = &rd->batch_instances[batch_instance_id];
+    const model_t* model = bi->model;
+    renderer_worker_t* worker = &rd->workers[worker_id];
+
+    int32_t* clip_positions = &rd->clip_positions[bi->first_vertex * 4];
+    uint32_t* indices = &rd->visible_indices[bi->first_index];
+    const uint32_t* visible_clusters = &rd->visible_clusters[bi->first_cluster];
+
+    if (bi->num_visible_clusters == model->cluster_count)
+    {
+        // nothing was culled, so transform every vertex in order, rather than just the ones that are used
+        transform_vertices(rd, model, bi->mvp, clip_positions);
+        bi->num_vertices_transformed = model->vertex_count;
+
+        if (rd->views[bi->view_id].shade)
+        {
+            transform_attributes(model, bi->normal_matrix, &rd->varyings[bi->first_vertex * MODEL_NUM_ATTRIBUTES]);
+        }
+
+        for (uint32_t index_id = 0; index_id < model->index_count; index_id++)
+        {
+            indices[index_id] = bi->first_vertex + model->indices[index_id];
+        }
+        return;
+    }
+
+    worker->vertex_stamp++;
+    if (worker->vertex_stamp == 0)
+    {
+        memset(worker->vertex_stamps, 0, worker->capacity * sizeof(uint32_t));
+        worker->vertex_stamp = 1;
+    }
+
+    uint32_t num_indices = 0;
+    uint32_t num_vertex_ids = 0;
+    for (uint32_t visible_cluster_i = 0; visible_cluster_i < bi->num_visible_clusters; visible_cluster_i++)
+    {
+        const cluster_t* cluster = &model->clusters[visible_clusters[visible_cluster_i]];
+
+        for (uint32_t index_id = cluster->first_index; index_id < cluster->first_index + cluster->index_count; index_id++)
+        {
+            uint32_t vertex_id = model->indices[index_id];
+            indices[num_indices++] = bi->first_vertex + vertex_id;
+
+            if (worker->vertex_stamps[vertex_id] != worker->vertex_stamp)
+            {
+                worker->vertex_stamps[vertex_id] = worker->vertex_stamp;
+                worker->vertex_ids[num_vertex_ids++] = vertex_id;
+            }
+        }
+    }
+
+    // every vertex of the visible clusters once, even when several clusters share it
+    transform_vertex_list(rd, model, worker->vertex_ids, num_vertex_ids, bi->mvp, clip_positions);
+    bi->num_vertices_transformed = num_vertex_ids;
+
+    if (rd->views[bi->view_id].shade)
+    {
+        transform_attribute_list(model, worker->vertex_ids, num_vertex_ids, bi->normal_matrix, &rd->varyings[bi->first_vertex * MODEL_NUM_ATTRIBUTES]);
+    }
+}
+
+// culls and transforms a batch of instances in parallel, then draws all of those of each view at once, in order.
+// the instances of a view are next to each other in the batch.
+static void renderer_render_batch(renderer_t* rd, const scene_snapshot_t* ss, const visible_instance_t* instances, uint32_t num_instances)
+{
+    uint64_t renderinstance_start_pc = qpc();
+    uint64_t trace_start = framebuffer_get_trace_timestamp(rd->fb);
+
+    if (num_instances > rd->batch_instances_capacity)
+    {
+        rd->batch_instances = (batch_instance_t*)realloc(rd->batch_instances, num_instances * sizeof(batch_instance_t));
+        assert(rd->batch_instances);
+        rd->batch_instances_capacity = num_instances;
+    }
+
+    uint32_t num_vertices = 0;
+    uint32_t num_clusters = 0;
+    uint32_t max_num_indices = 0;
+    uint32_t max_model_vertices = 0;
+    for (uint32_t i = 0; i < num_instances; i++)
+    {
+        batch_instance_t* bi = &rd->batch_instances[i];
+        const instance_t* instance = instances[i].instance;
+        const render_view_t* view = &rd->views[instances[i].view_id];
+        bi->model = &ss->scene->models[instance->model_id];
+        bi->model_id = instance->model_id;
+        bi->view_id = instances[i].view_id;
+        s15164x4_mul(view->viewproj, instance->transform, bi->mvp);
+        if (view->shade)
+        {
+            setup_normal_matrix(instance->transform, bi->normal_matrix);
+        }
+
+        bi->first_vertex = num_vertices;
+        bi->first_cluster = num_clusters;
+        num_vertices += bi->model->vertex_count;
+        num_clusters += bi->model->cluster_count;
+        max_num_indices += bi->model->index_count;
+        max_model_vertices = std::max(max_model_vertices, bi->model->vertex_count);
+    }
+
+    if (num_vertices > rd->clip_positions_capacity)
+    {
+        rd->clip_positions = (int32_t*)realloc(rd->clip_positions, num_vertices * 4 * sizeof(int32_t));
+        assert(rd->clip_positions);
+        rd->clip_positions_capacity = num_vertices;
+    }
+
+    if (rd->shade && num_vertices > rd->varyings_capacity)
+    {
+        rd->varyings = (float*)realloc(rd->varyings, num_vertices * MODEL_NUM_ATTRIBUTES * sizeof(float));
+        assert(rd->varyings);
+        rd->varyings_capacity = num_vertices;
+    }
+
+    if (max_num_indices > rd->visible_indices_capacity)
+    {
+        rd->visible_indices = (uint32_t*)realloc(rd->visible_indices, max_num_indices * sizeof(uint32_t));
+        assert(rd->visible_indices);
+        rd->visible_indices_capacity = max_num_indices;
+    }
+
+    if (num_clusters > rd->visible_clusters_capacity)
+    {
+        rd->visible_clusters = (uint32_t*)realloc(rd->visible_clusters, num_clusters * sizeof(uint32_t));
+        assert(rd->visible_clusters);
+        rd->visible_clusters_capacity = num_clusters;
+    }
+
+    for (int32_t worker_id = 0; worker_id < rd->num_workers; worker_id++)
+    {
+        renderer_worker_t* worker = &rd->workers[worker_id];
+        if (max_model_vertices <= worker->capacity)
+        {
+            continue;
+        }
+
+        worker->vertex_ids = (uint32_t*)realloc(worker->vertex_ids, max_model_vertices * sizeof(uint32_t));
+        assert(worker->vertex_ids);
+
+        // stamps start at 1, so new vertices are never in the list
+        worker->vertex_stamps = (uint32_t*)realloc(worker->vertex_stamps, max_model_vertices * sizeof(uint32_t));
+        assert(worker->vertex_stamps);
+        memset(worker->vertex_stamps + worker->capacity, 0, (max_model_vertices - worker->capacity) * sizeof(uint32_t));
+
+        worker->capacity = max_model_vertices;
+    }
+
+    framebuffer_run_tasks(rd->fb, renderer_cull_instance_task, rd, (int32_t)num_instances);
+
+    // the visible indices of the instances go one after the other, in the order of the instances
+    uint32_t num_indices = 0;
+    for (uint32_t i = 0; i < num_instances; i++)
+    {
+        batch_instance_t* bi = &rd->batch_instances[i];
+        bi->first_index = num_indices;
+        num_indices += bi->num_indices;
+    }
+
+    framebuffer_run_tasks(rd->fb, renderer_transform_instance_task, rd, (int32_t)num_instances);
+
+    for (uint32_t i = 0; i < num_instances; i++)
+    {
+        const batch_instance_t* bi = &rd->batch_instances[i];
+        rd->stats.clusters += bi->model->cluster_count;
+        rd->stats.clusters_culled_frustum += bi->num_clusters_culled_frustum;
+        rd->stats.clusters_culled_backface += bi->num_clusters_culled_backface;
+        rd->stats.vertices_transformed += bi->num_vertices_transformed;
+    }
+
+    framebuffer_add_trace_event(rd->fb, "cull and transform batch", "instances", (int32_t)num_instances, trace_start, framebuffer_get_trace_timestamp(rd->fb));
+
+    // the instances of a view one after the other
+    uint32_t view_start = 0;
+    while (view_start < num_instances)
+    {
+        const batch_instance_t* first_bi = &rd->batch_instances[view_start];
+        const render_view_t* view = &rd->views[first_bi->view_id];
+
+        uint32_t view_end = view_start;
+        uint32_t view_num_indices = 0;
+        while (view_end < num_instances && rd->batch_instances[view_end].view_id == first_bi->view_id)
+        {
+            view_num_indices += rd->batch_instances[view_end].num_indices;
+            view_end++;
+        }
+
+        if (view_num_indices > 0 && !view->shade)
+        {
+            framebuffer_draw_indexed(view->fb, rd->clip_positions, &rd->visible_indices[first_bi->first_index], view_num_indices);
+        }
+        else if (view_num_indices > 0)
+        {
+            // every instance is a draw of its own, for the shader to know the model of every pixel from its draw id.
+            // the rasterizer copies the varyings of the triangles it keeps, so the next batch can reuse them.
+            for (uint32_t i = view_start; i < view_end; i++)
+            {
+                const batch_instance_t* bi = &rd->batch_instances[i];
+                if (bi->num_indices == 0)
+                {
+                    continue;
+                }
+
+                framebuffer_varyings_t varyings;
+                varyings.varyings = rd->varyings;
+                varyings.num_varyings = MODEL_NUM_ATTRIBUTES;
+                varyings.draw_id = bi->model_id;
+                framebuffer_draw_indexed_ex(view->fb, rd->clip_positions, &rd->visible_indices[bi->first_index], bi->num_indices, &varyings);
+            }
+        }
+
+        view_start = view_end;
+    }
+
+    rd->perfcounters.renderinstance += qpc() - renderinstance_start_pc;
+}
+
+// a snapshot of the scene as it is right now, without copying anything
+static void get_live_snapshot(scene_t* sc, scene_snapshot_t* ss)
+{
+    ss->scene = sc;
+    ss->instances = sc->instances->data();
+    ss->instance_count = (uint32_t)sc->instances->size();
+    ss->instance_capacity = 0;
+    ss->nodes = sc->nodes;
+    ss->node_capacity = sc->node_capacity;
+    ss->root_node = sc->root_node;
+    memcpy(ss->view, sc->view, sizeof(ss->view));
+    memcpy(ss->proj, sc->proj, sizeof(ss->proj));
+}
+
+void renderer_render_scene(renderer_t* rd, scene_t* sc)
+{
+    assert(rd);
+    assert(sc);
+
+    scene_snapshot_t live;
+    get_live_snapshot(sc, &live);
+    renderer_render_snapshot(rd, &live);
+}
+
+void renderer_render_views(renderer_t* rd, scene_t* sc, const renderer_view_t* views, int32_t num_views)
+{
+    assert(rd);
+    assert(sc);
+
+    scene_snapshot_t live;
+    get_live_snapshot(sc, &live);
+    renderer_render_snapshot_views(rd, &live, views, num_views);
+}
+
+void renderer_render_snapshot(renderer_t* rd, const scene_snapshot_t* ss)
+{
+    assert(rd);
+    assert(ss);
+
+    renderer_view_t view;
+    view.fb = NULL;
+    memcpy(view.view, ss->view, sizeof(view.view));
+    memcpy(view.proj, ss->proj, sizeof(view.proj));
+    renderer_render_snapshot_views(rd, ss, &view, 1);
+}
+
+void renderer_render_snapshot_views(renderer_t* rd, const scene_snapshot_t* ss, const renderer_view_t* views, int32_t num_views)
+{
+    assert(rd);
+    assert(ss);
+    assert(views || num_views == 0);
+    assert(num_views >= 0);
+
+    framebuffer_reset_perfcounters(rd->fb);
+    memset(&rd->stats, 0, sizeof(renderer_stats_t));
+
+    if (num_views > rd->views_capacity)
+    {
+        rd->views = (render_view_t*)realloc(rd->views, num_views * sizeof(render_view_t));
+        assert(rd->views);
+        rd->view_fbs = (framebuffer_t**)realloc(rd->view_fbs, num_views * sizeof(framebuffer_t*));
+        assert(rd->view_fbs);
+        rd->views_capacity = num_views;
+    }
+
+    for (int32_t view_id = 0; view_id < num_views; view_id++)
+    {
+        render_view_t* view = &rd->views[view_id];
+        view->fb = views[view_id].fb ? views[view_id].fb : rd->fb;
+        rd->view_fbs[view_id] = view->fb;
+        view->shade = rd->shade && view->fb == rd->fb;
+        s15164x4_mul(views[view_id].proj, views[view_id].view, view->viewproj);
+
+        for (int32_t other_view_id = 0; other_view_id < view_id; other_view_id++)
+        {
+            assert(rd->views[other_view_id].fb != view->fb);
+        }
+
+        // the counters of the other framebuffers would keep adding up over the frames otherwise
+        if (view->fb != rd->fb)
+        {
+            framebuffer_reset_perfcounters(view->fb);
+        }
+
+        framebuffer_clear(view->fb, 0x00000000);
+    }
+
+    uint32_t max_num_visible_instances = ss->instance_count * (uint32_t)num_views;
+    if (max_num_visible_instances > rd->visible_instances_capacity)
+    {
+        rd->visible_instances = (visible_instance_t*)realloc(rd->visible_instances, max_num_visible_instances * sizeof(visible_instance_t));
+        assert(rd->visible_instances);
+        rd->visible_instances_capacity = max_num_visible_instances;
+    }
+
+    uint32_t num_visible_instances = 0;
+    for (int32_t view_id = 0; view_id < num_views; view_id++)
+    {
+        visible_instance_t* view_instances = &rd->visible_instances[num_visible_instances];
+        uint32_t num_view_instances = 0;
+        if (rd->filter_instances && rd->filter_instance_index != -1)
+        {
+            if ((uint32_t)rd->filter_instance_index < ss->instance_count)
+            {
+                view_instances[num_view_instances].instance = &ss->instances[rd->filter_instance_index];
+                view_instances[num_view_instances].view_id = view_id;
+                num_view_instances++;
+            }
+        }
+        else if (rd->cull_clusters)
+        {
+            uint64_t trace_start = framebuffer_get_trace_timestamp(rd->fb);
+            num_view_instances = cull_instances(rd, ss, view_id, view_instances);
+            framebuffer_add_trace_event(rd->fb, "cull instances", "visible", (int32_t)num_view_instances, trace_start, framebuffer_get_trace_timestamp(rd->fb));
+        }
+        else
+        {
+            for (uint32_t instance_index = 0; instance_index < ss->instance_count; instance_index++)
+            {
+                view_instances[num_view_instances].instance = &ss->instances[instance_index];
+                view_instances[num_view_instances].view_id = view_id;
+                num_view_instances++;
+            }
+        }
+
+        num_visible_instances += num_view_instances;
+    }
+
+    rd->stats.instances = max_num_visible_instances;
+    rd->stats.instances_culled_frustum = max_num_visible_instances - num_visible_instances;
+
+    const int32_t* filter_ids = rd->filter_triangle_ids;
+    bool filter_triangles = rd->filter_triangles && (filter_ids[0] != -1 || filter_ids[1] != -1 || filter_ids[2] != -1);
+
+    // consecutive instances are batched until they have enough triangles, even across views
+    uint32_t batch_start = 0;
+    uint32_t batch_triangles = 0;
+    for (uint32_t i = 0; i < num_visible_instances; i++)
+    {
+        const visible_instance_t* visible_instance = &rd->visible_instances[i];
+        if (filter_triangles)
+        {
+            renderer_render_filtered_instance(rd, ss, visible_instance->instance, &rd->views[visible_instance->view_id]);
+            continue;
+        }
+
+        batch_triangles += ss->scene->models[visible_instance->instance->model_id].index_count / 3;
+        if (batch_triangles >= RENDERER_BATCH_MIN_TRIANGLES)
+        {
+            renderer_render_batch(rd, ss, &rd->visible_instances[batch_start], i + 1 - batch_start);
+            batch_start = i + 1;
+            batch_triangles = 0;
+        }
+    }
+
+    if (!filter_triangles && batch_start < num_visible_instances)
+    {
+        renderer_render_batch(rd, ss, &rd->visible_instances[batch_start], num_visible_instances - batch_start);
+    }
+
+    // every view is binned before any of them is resolved, so the tiles one view flushed got resolved while the next ones were binning,
+    // and the views that share threads have their tiles resolved together
+    framebuffer_resolve_many(rd->view_fbs, num_views);
+
+    for (int32_t view_id = 0; view_id < num_views; view_id++)
+    {
+        if (rd->views[view_id].shade)
+        {
+            rd->shade_scene = ss->scene;
+            framebuffer_shade(rd->fb, rd->shader, rd->shader_ctx);
+            rd->shade_scene = NULL;
+        }
+    }
+}
+
+framebuffer_t* renderer_get_framebuffer(renderer_t* rd)
+{
+    assert(rd);
+    return rd->fb;
+}
+
+uint64_t renderer_get_perfcounter_frequency(renderer_t* rd)
+{
+    assert(rd);
+    return rd->pc_frequency;
+}
+
+void renderer_reset_perfcounters(renderer_t* rd)
+{
+    assert(rd);
+    memset(&rd->perfcounters, 0, sizeof(renderer_perfcounters_t));
+}
+
+int32_t renderer_get_num_perfcounters(renderer_t* rd)
+{
+    assert(rd);
+
+    return sizeof(rd->perfcounters) / sizeof(uint64_t);
+}
+
+void renderer_get_perfcounters(renderer_t* rd, uint64_t* pcs)
+{
+    assert(rd);
+    assert(pcs);
+
+    memcpy(pcs, &rd->perfcounters, sizeof(rd->perfcounters));
+}
+
+void renderer_get_perfcounter_names(renderer_t* rd, const char** names)
+{
+    assert(rd);
+    assert(names);
+
+    memcpy(names, kRendererPerfCounterNames, sizeof(kRendererPerfCounterNames));
+}
+
+int32_t renderer_get_num_stats(renderer_t* rd)
+{
+    assert(rd);
+    return sizeof(renderer_stats_t) / sizeof(uint64_t);
+}
+
+void renderer_get_stat_names(renderer_t* rd, const char** names)
+{
+    assert(rd);
+    assert(names);
+    memcpy(names, kRendererStatNames, sizeof(kRendererStatNames));
+}
+
+void renderer_get_stats(renderer_t* rd, uint64_t* stats)
+{
+    assert(rd);
+    assert(stats);
+    memcpy(stats, &rd->stats, sizeof(renderer_stats_t));
+}
+
+void renderer_set_cluster_culling(renderer_t* rd, int32_t enable)
+{
+    assert(rd);
+    rd->cull_clusters = enable != 0;
+}
+
+// the direction the light comes from, in world space
+static const float kLightDirection[3] = { 0.40824829f, 0.81649658f, -0.40824829f };
+
+// lambert lit normals, on the texture of the model, or on a checkerboard of the texcoords if it doesn't have one
+static void default_shader(void* ctx, const framebuffer_pixels_t* pixels, uint32_t colors[8])
+{
+    const renderer_t* rd = (const renderer_t*)ctx;
+
+    // the lanes of every model are sampled together
+    uint32_t albedos[8];
+    uint32_t lanes_left = pixels->mask;
+    while (lanes_left)
+    {
+        int32_t first_lane = 0;
+        while (!(lanes_left & (1 << first_lane)))
+        {
+            first_lane++;
+        }
+
+        uint32_t draw_id = pixels->draw_ids[first_lane];
+        uint32_t draw_mask = 0;
+        for (int32_t lane = 0; lane < 8; lane++)
+        {
+            if ((lanes_left & (1 << lane)) && pixels->draw_ids[lane] == draw_id)
+            {
+                draw_mask |= 1 << lane;
+            }
+        }
+        lanes_left &= ~draw_mask;
+
+        const texture_t* texture = NULL;
+        if (rd->shade_scene && draw_id < rd->shade_scene->model_count)
+        {
+            texture = rd->shade_scene->models[draw_id].texture;
+        }
+
+        if (texture)
+        {
+            texture_sample(texture, pixels, draw_mask, 0, 1, albedos);
+            continue;
+        }
+
+        for (int32_t lane = 0; lane < 8; lane++)
+        {
+            if (draw_mask & (1 << lane))
+            {
+                float u = pixels->varyings[0][lane];
+                float v = pixels->varyings[1][lane];
+                bool odd_square = (((int32_t)floorf(u * 8.0f) + (int32_t)floorf(v * 8.0f)) & 1) != 0;
+                albedos[lane] = odd_square ? 0xFF999999 : 0xFFE6E6E6;
+            }
+        }
+    }
+
+    for (int32_t lane = 0; lane < 8; lane++)
+    {
+        if (!(pixels->mask & (1 << lane)))
+        {
+            continue;
+        }
+
+        float nx = pixels->varyings[2][lane];
+        float ny = pixels->varyings[3][lane];
+        float nz = pixels->varyings[4][lane];
+
+        // models without normals are unlit
+        float light = 1.0f;
+        float length_squared = nx * nx + ny * ny + nz * nz;
+        if (length_squared > 0.0f)
+        {
+            float n_dot_l = (nx * kLightDirection[0] + ny * kLightDirection[1] + nz * kLightDirection[2]) / sqrtf(length_squared);
+            light = 0.2f + 0.8f * std::max(n_dot_l, 0.0f);
+        }
+
+        // scale the rgb of the albedo and keep its alpha
+        uint32_t albedo = albedos[lane];
+        uint32_t color = albedo & 0xFF000000;
+        for (int32_t shift = 0; shift < 24; shift += 8)
+        {
+            color |= (uint32_t)((float)((albedo >> shift) & 0xFF) * light + 0.5f) << shift;
+        }
+        colors[lane] = color;
+    }
+}
+
+void renderer_set_shader(renderer_t* rd, renderer_shader_fn_t shader, void* ctx)
+{
+    assert(rd);
+
+    rd->shader = shader ? shader : default_shader;
+    rd->shader_ctx = shader ? ctx : rd;
+}
+
+void renderer_set_triangle_filter(renderer_t* rd, int32_t enable, int32_t triangle_id0, int32_t triangle_id1, int32_t triangle_id2)
+{
+    assert(rd);
+
+    rd->filter_triangles = enable != 0;
+    rd->filter_triangle_ids[0] = triangle_id0;
+    rd->filter_triangle_ids[1] = triangle_id1;
+    rd->filter_triangle_ids[2] = triangle_id2;
+}
+
+void renderer_set_instance_filter(renderer_t* rd, int32_t enable, int32_t instance_index)
+{
+    assert(rd);
+
+    rd->filter_instances = enable != 0;
+    rd->filter_instance_index = instance_index;
+}
+
+void renderer_begin_trace_capture(renderer_t* rd)
+{
+    assert(rd);
+    framebuffer_begin_trace_capture(rd->fb);
+}
+
+int32_t renderer_end_trace_capture(renderer_t* rd, const char* filename)
+{
+    assert(rd);
+    assert(filename);
+
+    framebuffer_end_trace_capture(rd->fb);
+    return framebuffer_write_trace_capture(rd->fb, filename);
+}
+
+scene_t* new_scene()
+{
+    scene_t* sc = (scene_t*)malloc(sizeof(scene_t));
+    assert(sc);
+
+    sc->models = (model_t*)malloc(sizeof(model_t) * SCENE_MAX_NUM_MODELS);
+    assert(sc->models);
+
+    sc->model_count = 0;
+
+    sc->textures = (scene_texture_t*)malloc(sizeof(scene_texture_t) * SCENE_MAX_NUM_TEXTURES);
+    assert(sc->textures);
+
+    sc->texture_count = 0;
+
+    sc->instances = new freelist_t<instance_t>(SCENE_MAX_NUM_INSTANCES);
+    assert(sc->instances);
+
+    sc->nodes = NULL;
+    sc->node_capacity = 0;
+    sc->free_node = NO_NODE;
+    sc->root_node = NO_NODE;
+
+    // every call to scene_add_models maps at most one cache, and adds at least one model when it does
+    sc->mesh_caches = (mapped_file_t*)malloc(sizeof(mapped_file_t) * SCENE_MAX_NUM_MODELS);
+    assert(sc->mesh_caches);
+
+    sc->mesh_cache_count = 0;
+    
+    return sc;
+}
+
+void delete_scene(scene_t* sc)
+{
+    delete sc->instances;
+    free(sc->nodes);
+
+    for (uint32_t i = 0; i < sc->model_count; i++)
+    {
+        if (!sc->models[i].is_mapped)
+        {
+            free(sc->models[i].positions);
+            free(sc->models[i].indices);
+            free(sc->models[i].clusters);
+            free(sc->models[i].attributes);
+        }
+    }
+    free(sc->models);
+
+    for (uint32_t i = 0; i < sc->texture_count; i++)
+    {
+        free(sc->textures[i].filename);
+        delete_texture(sc->textures[i].texture);
+    }
+    free(sc->textures);
+
+    for (uint32_t i = 0; i < sc->mesh_cache_count; i++)
+    {
+        unmap_file(&sc->mesh_caches[i]);
+    }
+    free(sc->mesh_caches);
+
+    free(sc);
+}
+
+// Mesh optimization
+// ------------------
+// Reorders the triangles of a model so that consecutive triangles share vertices, which also keeps them close together on screen,
+// with Tipsify from "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw" (Sander, Nehab, Barczak 2007).
+// Then renumbers the vertices in the order the triangles first use them, so they're fetched in order too.
+#define NO_VERTEX 0xFFFFFFFF
+
+// average number of vertices transformed per triangle, with a FIFO cache of cache_size vertices
+static float compute_acmr(const uint32_t* indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size)
+{
+    if (index_count < 3)
+    {
+        return 0.0f;
+    }
+
+    // a vertex is in the cache while fewer than cache_size vertices were added after it
+    std::vector<uint32_t> cache_times(vertex_count, 0);
+    uint32_t time = cache_size + 1;
+    uint32_t num_misses = 0;
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        uint32_t v = indices[i];
+        if (time - cache_times[v] > cache_size)
+        {
+            cache_times[v] = time;
+            time++;
+            num_misses++;
+        }
+    }
+
+    return (float)num_misses / (index_count / 3);
+}
+
+static void tipsify(const uint32_t* indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size, uint32_t* new_indices)
+{
+    uint32_t triangle_count = index_count / 3;
+
+    // the triangles that use each vertex
+    std::vector<uint32_t> adjacency_offsets(vertex_count + 1, 0);
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        adjacency_offsets[indices[i] + 1]++;
+    }
+    for (uint32_t v = 0; v < vertex_count; v++)
+    {
+        adjacency_offsets[v + 1] += adjacency_offsets[v];
+    }
+
+    std::vector<uint32_t> adjacency(index_count);
+    std::vector<uint32_t> adjacency_fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+    for (uint32_t i = 0; i < index_count; i++)
+    {
+        adjacency[adjacency_fill[indices[i]]++] = i / 3;
+    }
+
+    // how many triangles that use each vertex are still to be emitted
+    std::vector<uint32_t> live_counts(vertex_count);
+    for (uint32_t v = 0; v < vertex_count; v++)
+    {
+        live_counts[v] = adjacency_offsets[v + 1] - adjacency_offsets[v];
+    }
+
+    std::vector<uint32_t> cache_times(vertex_count, 0);
+    std::vector<uint8_t> emitted(triangle_count, 0);
+    std::vector<uint32_t> dead_end_stack;
+    std::vector<uint32_t> candidates;
+    uint32_t time = cache_size + 1;
+    uint32_t num_new_indices = 0;
+
+    // the next vertex in order to look at when the dead end stack runs out
+    uint32_t cursor = 0;
+
+    uint32_t fanning_vertex = NO_VERTEX;
+    for (; cursor < vertex_count && fanning_vertex == NO_VERTEX; cursor++)
+    {
+        if (live_counts[cursor] > 0)
+            fanning_vertex = cursor;
+    }
+
+    while (fanning_vertex != NO_VERTEX)
+    {
+        // emit every triangle around the fanning vertex
+        candidates.clear();
+        for (uint32_t a = adjacency_offsets[fanning_vertex]; a < adjacency_offsets[fanning_vertex + 1]; a++)
+        {
+            uint32_t t = adjacency[a];
+            if (emitted[t])
+            {
+                continue;
+            }
+
+            for (uint32_t c = 0; c < 3; c++)
+            {
+                uint32_t v = indices[t * 3 + c];
+                new_indices[num_new_indices++] = v;
+                dead_end_stack.push_back(v);
+                candidates.push_back(v);
+                live_counts[v]--;
+
+                if (time - cache_times[v] > cache_size)
+                {
+                    cache_times[v] = time;
+                    time++;
+                }
+            }
+
+            emitted[t] = 1;
+        }
+
+        // fan around the candidate that entered the cache the longest ago,
+        // among the ones whose triangles can all be emitted before it's pushed out of the cache
+        fanning_vertex = NO_VERTEX;
+        int64_t best_priority = -1;
+        for (uint32_t v : candidates)
+        {
+            if (live_counts[v] == 0)
+            {
+                continue;
+            }
+
+            int64_t priority = 0;
+            if ((int64_t)(time - cache_times[v]) + 2 * (int64_t)live_counts[v] <= (int64_t)cache_size)
+            {
+                priority = time - cache_times[v];
+            }
+
+            if (priority > best_priority)
+            {
+                best_priority = priority;
+                fanning_vertex = v;
+            }
+        }
+
+        // dead end: go back to the last vertex used that still has triangles left, or else the next one in order
+        while (fanning_vertex == NO_VERTEX && !dead_end_stack.empty())
+        {
+            uint32_t v = dead_end_stack.back();
+            dead_end_stack.pop_back();
+            if (live_counts[v] > 0)
+                fanning_vertex = v;
+        }
+
+        for (; cursor < vertex_count && fanning_vertex == NO_VERTEX; cursor++)
+        {
+            if (live_counts[cursor] > 0)
+                fanning_vertex = cursor;
+        }
+    }
+
+    assert(num_new_indices == triangle_count * 3);
+}
+
+// renumbers the vertices in the order the indices first use them. vertices that no triangle uses are dropped.
+static void reorder_vertices(model_t* mdl)
+{
+    std::vector<uint32_t> remap(mdl->vertex_count, NO_VERTEX);
+    uint32_t new_vertex_count = 0;
+    for (uint32_t i = 0; i < mdl->index_count; i++)
+    {
+        uint32_t v = mdl->indices[i];
+        if (remap[v] == NO_VERTEX)
+        {
+            remap[v] = new_vertex_count;
+            new_vertex_count++;
+        }
+        mdl->indices[i] = remap[v];
+    }
+
+    int32_t* new_positions = (int32_t*)malloc(sizeof(int32_t) * 3 * new_vertex_count);
+    assert(new_positions);
+
+    for (uint32_t v = 0; v < mdl->vertex_count; v++)
+    {
+        if (remap[v] != NO_VERTEX)
+        {
+            new_positions[remap[v] * 3 + 0] = mdl->positions[v * 3 + 0];
+            new_positions[remap[v] * 3 + 1] = mdl->positions[v * 3 + 1];
+            new_positions[remap[v] * 3 + 2] = mdl->positions[v * 3 + 2];
+        }
+    }
+
+    float* new_attributes = (float*)malloc(sizeof(float) * MODEL_NUM_ATTRIBUTES * new_vertex_count);
+    assert(new_attributes);
+
+    for (uint32_t v = 0; v < mdl->vertex_count; v++)
+    {
+        if (remap[v] != NO_VERTEX)
+        {
+            memcpy(&new_attributes[remap[v] * MODEL_NUM_ATTRIBUTES], &mdl->attributes[v * MODEL_NUM_ATTRIBUTES], sizeof(float) * MODEL_NUM_ATTRIBUTES);
+        }
+    }
+
+    free(mdl->positions);
+    mdl->positions = new_positions;
+    free(mdl->attributes);
+    mdl->attributes = new_attributes;
+    mdl->vertex_count = new_vertex_count;
+}
+
+static void optimize_model(model_t* mdl, uint32_t cache_size)
+{
+    if (mdl->index_count < 3)
+    {
+        return;
+    }
+
+    std::vector<uint32_t> new_indices(mdl->index_count);
+    tipsify(mdl->indices, mdl->index_count, mdl->vertex_count, cache_size, new_indices.data());
+    memcpy(mdl->indices, new_indices.data(), sizeof(uint32_t) * mdl->index_count);
+
+    reorder_vertices(mdl);
+}
+
+// Clusters
+// ------------------
+// Splits the triangles of a model in runs of CLUSTER_MAX_TRIANGLES, in the order they're drawn in.
+// Those are only tight when the triangles that are next to each other in the index buffer are also close together in space,
+// which is the case for most models, and always after optimizing the vertex order.
+static void build_cluster(const model_t* mdl, uint32_t first_index, uint32_t index_count, cluster_t* cluster)
+{
+    cluster->first_index = first_index;
+    cluster->index_count = index_count;
+
+    for (int32_t c = 0; c < 3; c++)
+    {
+        cluster->min_position[c] = INT32_MAX;
+        cluster->max_position[c] = INT32_MIN;
+    }
+
+    for (uint32_t i = first_index; i < first_index + index_count; i++)
+    {
+        uint32_t v = mdl->indices[i];
+        for (int32_t c = 0; c < 3; c++)
+        {
+            cluster->min_position[c] = std::min(cluster->min_position[c], mdl->positions[v * 3 + c]);
+            cluster->max_position[c] = std::max(cluster->max_position[c], mdl->positions[v * 3 + c]);
+        }
+    }
+
+    // the sphere around the center of the box that contains every vertex
+    for (int32_t c = 0; c < 3; c++)
+    {
+        cluster->center[c] = (float)(((double)cluster->min_position[c] + cluster->max_position[c]) / 2.0 / 65536.0);
+    }
+
+    float radius_squared = 0.0f;
+    for (uint32_t i = first_index; i < first_index + index_count; i++)
+    {
+        const int32_t* position = &mdl->positions[mdl->indices[i] * 3];
+        float dx = position[0] / 65536.0f - cluster->center[0];
+        float dy = position[1] / 65536.0f - cluster->center[1];
+        float dz = position[2] / 65536.0f - cluster->center[2];
+        radius_squared = std::max(radius_squared, dx * dx + dy * dy + dz * dz);
+    }
+
+    // rounded up, so the sphere stays around every vertex
+    cluster->radius = sqrtf(radius_squared) * (1.0f + CLUSTER_CULL_EPSILON) + CLUSTER_CULL_EPSILON;
+
+    // the cone around the average of the triangles' front face normals, that contains every one of them.
+    // the models are wound CW, so the front face normals are the cross products of the edges in CCW order.
+    std::vector<float> normals;
+    float axis[3] = { 0.0f, 0.0f, 0.0f };
+    for (uint32_t i = first_index; i < first_index + index_count; i += 3)
+    {
+        const int32_t* p0 = &mdl->positions[mdl->indices[i + 0] * 3];
+        const int32_t* p1 = &mdl->positions[mdl->indices[i + 2] * 3];
+        const int32_t* p2 = &mdl->positions[mdl->indices[i + 1] * 3];
+
+        double e1[3], e2[3];
+        for (int32_t c = 0; c < 3; c++)
+        {
+            e1[c] = ((double)p1[c] - p0[c]) / 65536.0;
+            e2[c] = ((double)p2[c] - p0[c]) / 65536.0;
+        }
+
+        double n[3] = {
+            e1[1] * e2[2] - e1[2] * e2[1],
+            e1[2] * e2[0] - e1[0] * e2[2],
+            e1[0] * e2[1] - e1[1] * e2[0]
+        };
+
+        // degenerate triangles aren't drawn, so they don't bound the cone
+        double length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length == 0.0)
+        {
+            continue;
+        }
+
+        for (int32_t c = 0; c < 3; c++)
+        {
+            normals.push_back((float)(n[c] / length));
+            axis[c] += normals.back();
+        }
+    }
+
+    cluster->cone_cutoff = 2.0f;
+    cluster->cone_axis[0] = 0.0f;
+    cluster->cone_axis[1] = 0.0f;
+    cluster->cone_axis[2] = 0.0f;
+
+    float axis_length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    if (normals.empty() || axis_length < 1e-6f)
+    {
+        return;
+    }
+
+    for (int32_t c = 0; c < 3; c++)
+    {
+        axis[c] /= axis_length;
+    }
+
+    float min_dot = 1.0f;
+    for (size_t n = 0; n < normals.size(); n += 3)
+    {
+        min_dot = std::min(min_dot, normals[n + 0] * axis[0] + normals[n + 1] * axis[1] + normals[n + 2] * axis[2]);
+    }
+
+    // a cone that's as wide as a half space or more can't tell anything
+    if (min_dot <= 0.0f)
+    {
+        return;
+    }
+
+    cluster->cone_axis[0] = axis[0];
+    cluster->cone_axis[1] = axis[1];
+    cluster->cone_axis[2] = axis[2];
+    cluster->cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+}
+
+// the box around every cluster, or an empty one at the origin for a model without triangles
+static void compute_model_bounds(model_t* mdl)
+{
+    for (int32_t c = 0; c < 3; c++)
+    {
+        mdl->min_position[c] = mdl->cluster_count > 0 ? INT32_MAX : 0;
+        mdl->max_position[c] = mdl->cluster_count > 0 ? INT32_MIN : 0;
+    }
+
+    for (uint32_t cluster_id = 0; cluster_id < mdl->cluster_count; cluster_id++)
+    {
+        for (int32_t c = 0; c < 3; c++)
+        {
+            mdl->min_position[c] = std::min(mdl->min_position[c], mdl->clusters[cluster_id].min_position[c]);
+            mdl->max_position[c] = std::max(mdl->max_position[c], mdl->clusters[cluster_id].max_position[c]);
+        }
+    }
+}
+
+static void build_clusters(model_t* mdl)
+{
+    uint32_t cluster_index_count = CLUSTER_MAX_TRIANGLES * 3;
+    mdl->cluster_count = (mdl->index_count + cluster_index_count - 1) / cluster_index_count;
+    mdl->clusters = (cluster_t*)malloc(sizeof(cluster_t) * std::max(mdl->cluster_count, 1u));
+    assert(mdl->clusters);
+
+    for (uint32_t cluster_id = 0; cluster_id < mdl->cluster_count; cluster_id++)
+    {
+        uint32_t first_index = cluster_id * cluster_index_count;
+        build_cluster(mdl, first_index, std::min(cluster_index_count, mdl->index_count - first_index), &mdl->clusters[cluster_id]);
+    }
+}
+
+// Textures
+// ------------------
+// Only TGA textures are loaded: uncompressed or run-length encoded 8 bit grayscale, or 24 and 32 bit color, with sides that are powers of two.
+// The first row of the textures is the bottom row of the image, where the texcoords of OBJs have v = 0.
+static texture_t* load_tga(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t buffer[65536];
+    size_t num_read;
+    while ((num_read = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    {
+        data.insert(data.end(), buffer, buffer + num_read);
+    }
+    fclose(f);
+
+    if (data.size() < 18)
+    {
+        return NULL;
+    }
+
+    uint32_t id_length = data[0];
+    uint32_t colormap_type = data[1];
+    uint32_t image_type = data[2];
+    int32_t width = data[12] | (data[13] << 8);
+    int32_t height = data[14] | (data[15] << 8);
+    uint32_t bits_per_pixel = data[16];
+    uint32_t descriptor = data[17];
+
+    bool is_gray = image_type == 3 || image_type == 11;
+    bool is_rle = image_type == 10 || image_type == 11;
+    bool is_color = image_type == 2 || image_type == 10;
+    if (colormap_type != 0 || !(is_gray || is_color) ||
+        (is_gray && bits_per_pixel != 8) || (is_color && bits_per_pixel != 24 && bits_per_pixel != 32) ||
+        width == 0 || height == 0 || (width & (width - 1)) != 0 || (height & (height - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    uint32_t bytes_per_pixel = bits_per_pixel / 8;
+    size_t num_pixels = (size_t)width * height;
+    std::vector<uint32_t> colors(num_pixels);
+
+    // in the order of the file: bottom to top by default, and left to right
+    size_t src_i = 18 + id_length;
+    size_t pixel_i = 0;
+    while (pixel_i < num_pixels)
+    {
+        // a packet of raw pixels, or of copies of a single pixel
+        size_t packet_size = num_pixels - pixel_i;
+        bool is_run = false;
+        if (is_rle)
+        {
+            if (src_i >= data.size())
+            {
+                return NULL;
+            }
+            packet_size = std::min(packet_size, (size_t)(data[src_i] & 0x7F) + 1);
+            is_run = (data[src_i] & 0x80) != 0;
+            src_i++;
+        }
+
+        size_t packet_bytes = (is_run ? 1 : packet_size) * bytes_per_pixel;
+        if (packet_bytes > data.size() - src_i)
+        {
+            return NULL;
+        }
+
+        for (size_t i = 0; i < packet_size; i++)
+        {
+            const uint8_t* src = &data[src_i + (is_run ? 0 : i * bytes_per_pixel)];
+            uint32_t color;
+            if (is_gray)
+                color = 0xFF000000 | (src[0] << 16) | (src[0] << 8) | src[0];
+            else
+                color = (bytes_per_pixel == 4 ? (uint32_t)src[3] << 24 : 0xFF000000) | (src[2] << 16) | (src[1] << 8) | src[0];
+            colors[pixel_i + i] = color;
+        }
+
+        src_i += packet_bytes;
+        pixel_i += packet_size;
+    }
+
+    bool is_top_to_bottom = (descriptor & 0x20) != 0;
+    bool is_right_to_left = (descriptor & 0x10) != 0;
+    for (int32_t y = 0; is_top_to_bottom && y < height / 2; y++)
+    {
+        std::swap_ranges(&colors[(size_t)y * width], &colors[(size_t)y * width] + width, &colors[(size_t)(height - 1 - y) * width]);
+    }
+    for (int32_t y = 0; is_right_to_left && y < height; y++)
+    {
+        std::reverse(&colors[(size_t)y * width], &colors[(size_t)y * width] + width);
+    }
+
+    return new_texture(width, height, colors.data());
+}
+
+// loads every texture once, for all the models that use it. models of different files can share textures too.
+static const texture_t* scene_load_texture(scene_t* sc, const char* mtl_basepath, const std::string& texture_name)
+{
+    if (texture_name.empty())
+    {
+        return NULL;
+    }
+
+    // MTLs of Windows tools use backslashes, which work with forward slashes everywhere
+    std::string filename = std::string(mtl_basepath ? mtl_basepath : "") + texture_name;
+    std::replace(filename.begin(), filename.end(), '\\', '/');
+
+    for (uint32_t i = 0; i < sc->texture_count; i++)
+    {
+        if (filename == sc->textures[i].filename)
+        {
+            return sc->textures[i].texture;
+        }
+    }
+
+    assert(sc->texture_count + 1 <= SCENE_MAX_NUM_TEXTURES);
+    scene_texture_t* scene_texture = &sc->textures[sc->texture_count];
+    sc->texture_count++;
+
+    scene_texture->filename = (char*)malloc(filename.size() + 1);
+    assert(scene_texture->filename);
+    memcpy(scene_texture->filename, filename.c_str(), filename.size() + 1);
+
+    scene_texture->texture = load_tga(filename.c_str());
+    if (!scene_texture->texture)
+    {
+        fprintf(stderr, "Couldn't load texture %s\n", filename.c_str());
+    }
+
+    return scene_texture->texture;
+}
+
+// Mesh cache
+// ------------------
+// Parsing an OBJ and converting it is slow for big models, so the converted models are saved next to it in a binary file.
+// Later loads map that file and point the models straight into it, without copying anything.
+// The file is a mesh_cache_header_t, then a mesh_cache_model_t per model, then the arrays they point to.
+typedef struct mesh_cache_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+
+    // the OBJ the cache was made from, to know when the cache is out of date
+    uint64_t obj_size;
+    uint64_t obj_write_time;
+
+    uint32_t num_models;
+
+    // how the models were loaded, since the cache only holds the result
+    uint32_t optimize_vertex_order;
+    uint32_t vertex_cache_size;
+    uint32_t padding;
+} mesh_cache_header_t;
+
+static_assert(sizeof(mesh_cache_header_t) == 40, "mesh cache header layout");
+
+typedef struct mesh_cache_model_t
+{
+    uint32_t vertex_count;
+    uint32_t index_count;
+
+    // from the start of the file. xyz s15.16 positions, and indices with the winding already flipped.
+    uint64_t positions_offset;
+    uint64_t indices_offset;
+
+    float acmr_before;
+    float acmr_after;
+
+    uint64_t clusters_offset;
+    uint32_t cluster_count;
+
+    // the diffuse texture of the model's material, as the MTL names it, relative to mtl_basepath. not null terminated.
+    uint32_t texture_name_length;
+
+    // MODEL_NUM_ATTRIBUTES floats per vertex
+    uint64_t attributes_offset;
+
+    uint64_t texture_name_offset;
+} mesh_cache_model_t;
+
+static_assert(sizeof(mesh_cache_model_t) == 64, "mesh cache model layout");
+static_assert(sizeof(cluster_t) % sizeof(uint32_t) == 0, "clusters are stored as dwords");
+
+static uint64_t mesh_cache_align(uint64_t offset)
+{
+    return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+}
+
+// whether an array of the cache is inside the file, and aligned
+static bool mesh_cache_array_fits(const mapped_file_t* mf, uint64_t offset, uint64_t num_elements)
+{
+    return offset % MESH_CACHE_ALIGNMENT == 0 && offset <= mf->size && num_elements <= (mf->size - offset) / sizeof(uint32_t);
+}
+
+static void write_mesh_cache(const char* cache_filename, uint64_t obj_size, uint64_t obj_write_time, const model_load_config_t* config, const model_t* models, const std::string* texture_names, uint32_t num_models)
+{
+    uint64_t table_size = sizeof(mesh_cache_header_t) + sizeof(mesh_cache_model_t) * num_models;
+
+    std::vector<mesh_cache_model_t> table(num_models);
+    memset(table.data(), 0, sizeof(mesh_cache_model_t) * num_models);
+    uint64_t file_size = mesh_cache_align(table_size);
+    for (uint32_t i = 0; i < num_models; i++)
+    {
+        table[i].vertex_count = models[i].vertex_count;
+        table[i].index_count = models[i].index_count;
+        table[i].acmr_before = models[i].acmr_before;
+        table[i].acmr_after = models[i].acmr_after;
+
+        table[i].positions_offset = file_size;
+        file_size = mesh_cache_align(file_size + sizeof(int32_t) * 3 * (uint64_t)models[i].vertex_count);
+
+        table[i].indices_offset = file_size;
+        file_size = mesh_cache_align(file_size + sizeof(uint32_t) * (uint64_t)models[i].index_count);
+
+        table[i].cluster_count = models[i].cluster_count;
+        table[i].clusters_offset = file_size;
+        file_size = mesh_cache_align(file_size + sizeof(cluster_t) * (uint64_t)models[i].cluster_count);
+
+        table[i].attributes_offset = file_size;
+        file_size = mesh_cache_align(file_size + sizeof(float) * MODEL_NUM_ATTRIBUTES * (uint64_t)models[i].vertex_count);
+
+        table[i].texture_name_length = (uint32_t)texture_names[i].size();
+        table[i].texture_name_offset = file_size;
+        file_size = mesh_cache_align(file_size + texture_names[i].size());
+    }
+
+    std::vector<uint8_t> file_data((size_t)file_size);
+
+    mesh_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.obj_size = obj_size;
+    header.obj_write_time = obj_write_time;
+    header.num_models = num_models;
+    header.optimize_vertex_order = config->optimize_vertex_order;
+    header.vertex_cache_size = config->vertex_cache_size;
+    memcpy(&file_data[0], &header, sizeof(header));
+
+    if (num_models > 0)
+    {
+        memcpy(&file_data[sizeof(header)], table.data(), sizeof(mesh_cache_model_t) * num_models);
+    }
+
+    for (uint32_t i = 0; i < num_models; i++)
+    {
+        memcpy(&file_data[(size_t)table[i].positions_offset], models[i].positions, sizeof(int32_t) * 3 * models[i].vertex_count);
+        memcpy(&file_data[(size_t)table[i].indices_offset], models[i].indices, sizeof(uint32_t) * models[i].index_count);
+        memcpy(&file_data[(size_t)table[i].clusters_offset], models[i].clusters, sizeof(cluster_t) * models[i].cluster_count);
+        memcpy(&file_data[(size_t)table[i].attributes_offset], models[i].attributes, sizeof(float) * MODEL_NUM_ATTRIBUTES * models[i].vertex_count);
+        memcpy(&file_data[(size_t)table[i].texture_name_offset], texture_names[i].data(), texture_names[i].size());
+    }
+
+    // failing to write the cache only means the next load parses the OBJ again
+    if (!write_file(cache_filename, file_data.data(), file_size))
+    {
+        fprintf(stderr, "Couldn't write mesh cache %s\n", cache_filename);
+    }
+}
+
+// adds the models of the cache if it's valid and up to date with the OBJ
+static bool scene_add_cached_models(scene_t* sc, const char* cache_filename, const char* mtl_basepath, uint64_t obj_size, uint64_t obj_write_time, const model_load_config_t* config, uint32_t* first_model_id, uint32_t* num_added_models)
+{
+    mapped_file_t mf;
+    if (!map_file(cache_filename, &mf))
+    {
+        return false;
+    }
+
+    const mesh_cache_header_t* header = (const mesh_cache_header_t*)mf.data;
+    const mesh_cache_model_t* table = (const mesh_cache_model_t*)(mf.data + sizeof(mesh_cache_header_t));
+
+    bool valid = mf.size >= sizeof(mesh_cache_header_t) &&
+        header->magic == MESH_CACHE_MAGIC &&
+        header->version == MESH_CACHE_VERSION &&
+        header->obj_size == obj_size &&
+        header->obj_write_time == obj_write_time &&
+        header->optimize_vertex_order == (uint32_t)config->optimize_vertex_order &&
+        header->vertex_cache_size == (uint32_t)config->vertex_cache_size &&
+        header->num_models > 0 &&
+        header->num_models <= SCENE_MAX_NUM_MODELS - sc->model_count &&
+        (mf.size - sizeof(mesh_cache_header_t)) / sizeof(mesh_cache_model_t) >= header->num_models;
+
+    for (uint32_t i = 0; valid && i < header->num_models; i++)
+    {
+        valid = mesh_cache_array_fits(&mf, table[i].positions_offset, 3 * (uint64_t)table[i].vertex_count) &&
+            mesh_cache_array_fits(&mf, table[i].indices_offset, table[i].index_count) &&
+            mesh_cache_array_fits(&mf, table[i].clusters_offset, (sizeof(cluster_t) / sizeof(uint32_t)) * (uint64_t)table[i].cluster_count) &&
+            mesh_cache_array_fits(&mf, table[i].attributes_offset, MODEL_NUM_ATTRIBUTES * (uint64_t)table[i].vertex_count) &&
+            mesh_cache_array_fits(&mf, table[i].texture_name_offset, ((uint64_t)table[i].texture_name_length + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+
+        // the renderer trusts the clusters to stay within the model
+        const cluster_t* clusters = (const cluster_t*)(mf.data + table[i].clusters_offset);
+        for (uint32_t cluster_id = 0; valid && cluster_id < table[i].cluster_count; cluster_id++)
+        {
+            valid = clusters[cluster_id].first_index <= table[i].index_count &&
+                clusters[cluster_id].index_count <= table[i].index_count - clusters[cluster_id].first_index;
+        }
+
+        // and its indices to stay within its vertices, since they're used to gather them
+        const uint32_t* indices = (const uint32_t*)(mf.data + table[i].indices_offset);
+        uint32_t max_index = 0;
+        for (uint32_t index_id = 0; valid && index_id < table[i].index_count; index_id++)
+        {
+            if (indices[index_id] > max_index)
+                max_index = indices[index_id];
+        }
+        valid = valid && (table[i].index_count == 0 || max_index < table[i].vertex_count);
+    }
+
+    if (!valid)
+    {
+        unmap_file(&mf);
+        return false;
+    }
+
+    *first_model_id = sc->model_count;
+    *num_added_models = header->num_models;
+
+    for (uint32_t i = 0; i < header->num_models; i++)
+    {
+        model_t* mdl = &sc->models[sc->model_count];
+
+        // read-only, since nothing writes to models after loading them
+        mdl->positions = (int32_t*)(mf.data + table[i].positions_offset);
+        mdl->indices = (uint32_t*)(mf.data + table[i].indices_offset);
+        mdl->clusters = (cluster_t*)(mf.data + table[i].clusters_offset);
+        mdl->attributes = (float*)(mf.data + table[i].attributes_offset);
+        mdl->texture = scene_load_texture(sc, mtl_basepath, std::string((const char*)(mf.data + table[i].texture_name_offset), table[i].texture_name_length));
+        mdl->vertex_count = table[i].vertex_count;
+        mdl->index_count = table[i].index_count;
+        mdl->cluster_count = table[i].cluster_count;
+        compute_model_bounds(mdl);
+        mdl->is_mapped = true;
+        mdl->acmr_before = table[i].acmr_before;
+        mdl->acmr_after = table[i].acmr_after;
+
+        sc->model_count++;
+    }
+
+    sc->mesh_caches[sc->mesh_cache_count] = mf;
+    sc->mesh_cache_count++;
+
+    return true;
+}
+
+int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_basepath, uint32_t* first_model_id, uint32_t* num_added_models)
+{
+    model_load_config_t config;
+    config.optimize_vertex_order = 0;
+    config.vertex_cache_size = 0;
+    return scene_add_models_ex(sc, filename, mtl_basepath, &config, first_model_id, num_added_models);
+}
+
+int32_t scene_add_models_ex(scene_t* sc, const char* filename, const char* mtl_basepath, const model_load_config_t* config_in, uint32_t* first_model_id, uint32_t* num_added_models)
+{
+    assert(sc);
+    assert(filename);
+    assert(config_in);
+
+    model_load_config_t config = *config_in;
+    config.optimize_vertex_order = config.optimize_vertex_order != 0;
+    if (config.vertex_cache_size == 0)
+    {
+        config.vertex_cache_size = DEFAULT_VERTEX_CACHE_SIZE;
+    }
+    assert(config.vertex_cache_size > 0);
+
+    std::string cache_filename = std::string(filename) + ".meshcache";
+
+    uint64_t obj_size, obj_write_time;
+    bool has_obj_version = get_file_version(filename, &obj_size, &obj_write_time);
+
+    uint32_t cached_first_model_id, cached_num_models;
+    if (has_obj_version && scene_add_cached_models(sc, cache_filename.c_str(), mtl_basepath, obj_size, obj_write_time, &config, &cached_first_model_id, &cached_num_models))
+    {
+        if (first_model_id)
+            *first_model_id = cached_first_model_id;
+
+        if (num_added_models)
+            *num_added_models = cached_num_models;
+
+        return 1;
+    }
 
     std::string error;
     std::vector<tinyobj::shape_t> shapes;
@@ -309,6 +2826,7 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
 
     uint32_t tmp_first_model_id = sc->model_count;
     uint32_t tmp_num_added_models = 0;
+    std::vector<std::string> texture_names;
 
     for (size_t shapeIdx = 0; shapeIdx < shapes.size(); shapeIdx++)
     {
@@ -328,6 +2846,7 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
 
         mdl->vertex_count = (uint32_t)(tobj_m.positions.size() / 3);
         mdl->index_count = (uint32_t)tobj_m.indices.size();
+        mdl->is_mapped = false;
 
         sc->model_count++;
 
@@ -337,6 +2856,31 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
             mdl->positions[i] = as_s1516;
         }
 
+        // the material of the first face, for the whole model
+        std::string texture_name;
+        if (!tobj_m.material_ids.empty() && tobj_m.material_ids[0] >= 0 && tobj_m.material_ids[0] < (int)materials.size())
+        {
+            texture_name = materials[tobj_m.material_ids[0]].diffuse_texname;
+        }
+        mdl->texture = scene_load_texture(sc, mtl_basepath, texture_name);
+        texture_names.push_back(texture_name);
+
+        // tinyobjloader already split the vertices that have more than one texcoord or normal
+        mdl->attributes = (float*)malloc(sizeof(float) * MODEL_NUM_ATTRIBUTES * mdl->vertex_count);
+        assert(mdl->attributes);
+
+        bool has_texcoords = tobj_m.texcoords.size() == 2 * (size_t)mdl->vertex_count;
+        bool has_normals = tobj_m.normals.size() == 3 * (size_t)mdl->vertex_count;
+        for (uint32_t v = 0; v < mdl->vertex_count; v++)
+        {
+            float* attributes = &mdl->attributes[v * MODEL_NUM_ATTRIBUTES];
+            attributes[0] = has_texcoords ? tobj_m.texcoords[v * 2 + 0] : 0.0f;
+            attributes[1] = has_texcoords ? tobj_m.texcoords[v * 2 + 1] : 0.0f;
+            attributes[2] = has_normals ? tobj_m.normals[v * 3 + 0] : 0.0f;
+            attributes[3] = has_normals ? tobj_m.normals[v * 3 + 1] : 0.0f;
+            attributes[4] = has_normals ? tobj_m.normals[v * 3 + 2] : 0.0f;
+        }
+
         for (size_t i = 0; i < tobj_m.indices.size(); i += 3)
         {
             // flip winding (CCW to CW)
@@ -344,6 +2888,21 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
             mdl->indices[i + 1] = tobj_m.indices[i + 2];
             mdl->indices[i + 2] = tobj_m.indices[i + 1];
         }
+
+        mdl->acmr_before = compute_acmr(mdl->indices, mdl->index_count, mdl->vertex_count, config.vertex_cache_size);
+        if (config.optimize_vertex_order)
+        {
+            optimize_model(mdl, config.vertex_cache_size);
+        }
+        mdl->acmr_after = compute_acmr(mdl->indices, mdl->index_count, mdl->vertex_count, config.vertex_cache_size);
+
+        build_clusters(mdl);
+        compute_model_bounds(mdl);
+    }
+
+    if (has_obj_version && tmp_num_added_models > 0)
+    {
+        write_mesh_cache(cache_filename.c_str(), obj_size, obj_write_time, &config, &sc->models[tmp_first_model_id], texture_names.data(), tmp_num_added_models);
     }
 
     if (first_model_id)
@@ -355,6 +2914,58 @@ int32_t scene_add_models(scene_t* sc, const char* filename, const char* mtl_base
     return 1;
 }
 
+void scene_get_model_acmr(scene_t* sc, uint32_t first_model_id, uint32_t num_models, float* acmr_before, float* acmr_after)
+{
+    assert(sc);
+    assert(first_model_id + num_models <= sc->model_count);
+    assert(acmr_before);
+    assert(acmr_after);
+
+    // weighted by the number of triangles of each model
+    double total_before = 0.0;
+    double total_after = 0.0;
+    uint64_t total_triangles = 0;
+    for (uint32_t model_id = first_model_id; model_id < first_model_id + num_models; model_id++)
+    {
+        const model_t* mdl = &sc->models[model_id];
+        uint32_t triangle_count = mdl->index_count / 3;
+        total_before += (double)mdl->acmr_before * triangle_count;
+        total_after += (double)mdl->acmr_after * triangle_count;
+        total_triangles += triangle_count;
+    }
+
+    *acmr_before = total_triangles ? (float)(total_before / total_triangles) : 0.0f;
+    *acmr_after = total_triangles ? (float)(total_after / total_triangles) : 0.0f;
+}
+
+// makes sure that adding this many instances won't grow the tree, which takes two nodes per instance
+static void reserve_instance_nodes(scene_t* sc, uint32_t num_instances)
+{
+    int32_t num_free_nodes = 0;
+    for (int32_t node_id = sc->free_node; node_id != NO_NODE; node_id = sc->nodes[node_id].parent)
+    {
+        num_free_nodes++;
+    }
+
+    int32_t num_new_nodes = (int32_t)num_instances * 2 - num_free_nodes;
+    if (num_new_nodes <= 0)
+    {
+        return;
+    }
+
+    int32_t new_capacity = std::max(sc->node_capacity * 2, sc->node_capacity + num_new_nodes);
+    sc->nodes = (instance_node_t*)realloc(sc->nodes, sizeof(instance_node_t) * new_capacity);
+    assert(sc->nodes);
+
+    // the new nodes go in front of the free ones
+    for (int32_t node_id = sc->node_capacity; node_id < new_capacity; node_id++)
+    {
+        sc->nodes[node_id].parent = node_id + 1 < new_capacity ? node_id + 1 : sc->free_node;
+    }
+    sc->free_node = sc->node_capacity;
+    sc->node_capacity = new_capacity;
+}
+
 void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id)
 {
     assert(sc);
@@ -365,15 +2976,87 @@ void scene_add_instance(scene_t* sc, uint32_t model_id, uint32_t* instance_id)
     instance_t* instance = &(*sc->instances)[tmp_instance_id];
     instance->model_id = model_id;
 
+    memset(instance->transform, 0, sizeof(instance->transform));
+    instance->transform[0] = s1516_int(1);
+    instance->transform[5] = s1516_int(1);
+    instance->transform[10] = s1516_int(1);
+    instance->transform[15] = s1516_int(1);
+
+    // new instances go at the end of the freelist's packed instances
+    instance->node_id = allocate_instance_node(sc);
+    instance_node_t* node = &sc->nodes[instance->node_id];
+    node->instance_index = (uint32_t)sc->instances->size() - 1;
+    compute_instance_bounds(sc, instance, node->min_position, node->max_position);
+    insert_instance_leaf(sc, instance->node_id);
+
     if (instance_id)
         *instance_id = tmp_instance_id;
 }
 
+void scene_add_instances(scene_t* sc, const uint32_t* model_ids, uint32_t num_instances, uint32_t* instance_ids)
+{
+    assert(sc);
+    assert(model_ids || num_instances == 0);
+    assert(sc->instances->size() + num_instances <= sc->instances->capacity());
+
+    reserve_instance_nodes(sc, num_instances);
+
+    for (uint32_t i = 0; i < num_instances; i++)
+    {
+        scene_add_instance(sc, model_ids[i], instance_ids ? &instance_ids[i] : NULL);
+    }
+}
+
 void scene_remove_instance(scene_t* sc, uint32_t instance_id)
 {
     assert(sc);
 
+    int32_t node_id = (*sc->instances)[instance_id].node_id;
+    uint32_t instance_index = sc->nodes[node_id].instance_index;
+    remove_instance_leaf(sc, node_id);
+    free_instance_node(sc, node_id);
+
     sc->instances->erase(instance_id);
+
+    // the freelist moved its last instance into the hole
+    if (instance_index < sc->instances->size())
+    {
+        sc->nodes[sc->instances->data()[instance_index].node_id].instance_index = instance_index;
+    }
+}
+
+void scene_remove_instances(scene_t* sc, const uint32_t* instance_ids, uint32_t num_instances)
+{
+    assert(sc);
+    assert(instance_ids || num_instances == 0);
+
+    for (uint32_t i = 0; i < num_instances; i++)
+    {
+        scene_remove_instance(sc, instance_ids[i]);
+    }
+}
+
+void scene_set_instance_transform(scene_t* sc, uint32_t instance_id, int32_t transform[16])
+{
+    assert(sc);
+
+    instance_t* instance = &(*sc->instances)[instance_id];
+    memcpy(instance->transform, transform, sizeof(int32_t) * 16);
+
+    // moves the leaf to where the new bounds fit best
+    instance_node_t* node = &sc->nodes[instance->node_id];
+    remove_instance_leaf(sc, instance->node_id);
+    compute_instance_bounds(sc, instance, node->min_position, node->max_position);
+    insert_instance_leaf(sc, instance->node_id);
+}
+
+void scene_get_model_bounds(scene_t* sc, uint32_t model_id, int32_t min_position[3], int32_t max_position[3])
+{
+    assert(sc);
+    assert(model_id < sc->model_count);
+
+    memcpy(min_position, sc->models[model_id].min_position, sizeof(int32_t) * 3);
+    memcpy(max_position, sc->models[model_id].max_position, sizeof(int32_t) * 3);
 }
 
 void scene_set_view(scene_t* sc, int32_t view[16])
@@ -384,4 +3067,66 @@ void scene_set_view(scene_t* sc, int32_t view[16])
 void scene_set_projection(scene_t* sc, int32_t proj[16])
 {
     memcpy(sc->proj, proj, sizeof(int32_t) * 16);
-}
\ No newline at end of file
+}
+
+scene_snapshot_t* new_scene_snapshot()
+{
+    scene_snapshot_t* ss = (scene_snapshot_t*)malloc(sizeof(scene_snapshot_t));
+    assert(ss);
+
+    ss->scene = NULL;
+    ss->instances = NULL;
+    ss->instance_count = 0;
+    ss->instance_capacity = 0;
+    ss->nodes = NULL;
+    ss->node_capacity = 0;
+    ss->root_node = NO_NODE;
+    memset(ss->view, 0, sizeof(ss->view));
+    memset(ss->proj, 0, sizeof(ss->proj));
+
+    return ss;
+}
+
+void delete_scene_snapshot(scene_snapshot_t* ss)
+{
+    if (!ss)
+        return;
+
+    free(ss->instances);
+    free(ss->nodes);
+    free(ss);
+}
+
+void scene_take_snapshot(scene_t* sc, scene_snapshot_t* ss)
+{
+    assert(sc);
+    assert(ss);
+
+    ss->scene = sc;
+
+    // the arrays only grow, to the most the scene ever had
+    uint32_t instance_count = (uint32_t)sc->instances->size();
+    if (instance_count > ss->instance_capacity)
+    {
+        uint32_t new_capacity = std::max(instance_count, ss->instance_capacity * 2);
+        ss->instances = (instance_t*)realloc(ss->instances, new_capacity * sizeof(instance_t));
+        assert(ss->instances);
+        ss->instance_capacity = new_capacity;
+    }
+
+    if (sc->node_capacity > ss->node_capacity)
+    {
+        ss->nodes = (instance_node_t*)realloc(ss->nodes, sc->node_capacity * sizeof(instance_node_t));
+        assert(ss->nodes);
+        ss->node_capacity = sc->node_capacity;
+    }
+
+    // the instances are copied in the order the freelist packs them, which is what the leaves of the tree point to
+    memcpy(ss->instances, sc->instances->data(), instance_count * sizeof(instance_t));
+    ss->instance_count = instance_count;
+    memcpy(ss->nodes, sc->nodes, sc->node_capacity * sizeof(instance_node_t));
+    ss->root_node = sc->root_node;
+
+    memcpy(ss->view, sc->view, sizeof(ss->view));
+    memcpy(ss->proj, sc->proj, sizeof(ss->proj));
+}
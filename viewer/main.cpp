@@ -28,7 +28,6 @@
 #pragma comment(lib, "OpenGL32.lib")
 #pragma comment(lib, "glu32.lib")
 
-#define TILE_WIDTH_IN_PIXELS 64
 #define COARSE_BLOCK_WIDTH_IN_PIXELS 16
 #define FINE_BLOCK_WIDTH_IN_PIXELS 4
 
@@ -72,6 +71,17 @@ void APIENTRY DebugCallbackGL(GLenum source, GLenum type, GLuint id, GLenum seve
 
 HWND g_hWnd;
 
+const char* instruction_set_name(instructionset_t instruction_set)
+{
+    switch (instruction_set)
+    {
+    case instructionset_scalar: return "Scalar";
+    case instructionset_avx2: return "AVX2";
+    case instructionset_avx512: return "AVX-512";
+    default: return "Unknown";
+    }
+}
+
 void init_window(int32_t width, int32_t height)
 {
     WNDCLASSEX wc;
@@ -362,6 +372,7 @@ int main()
 
     renderer_t* rd = new_renderer(fbwidth, fbheight);
     framebuffer_t* fb = renderer_get_framebuffer(rd);
+    framebuffer_enable_perfcounters(fb, 1);
 
     const char* all_model_names[] = {
         "cube",
@@ -434,6 +445,13 @@ int main()
 
     bool show_depth = false;
 
+    bool filter_triangles = false;
+    int filter_triangle_ids[3] = { -1, -1, -1 };
+    bool filter_instances = false;
+    int filter_instance_index = -1;
+
+    bool cull_clusters = true;
+
     uint8_t* rgba8_pixels = (uint8_t*)malloc(fbwidth * fbheight * 4);
     assert(rgba8_pixels);
 
@@ -443,6 +461,22 @@ int main()
     uint32_t* d32_pixels = (uint32_t*)malloc(fbwidth * fbheight * sizeof(uint32_t));
     assert(d32_pixels);
 
+    // when the driver supports it, the rasterizer packs the presented image straight into a persistently mapped pixel buffer.
+    // otherwise it's packed into rgba8_pixels_dirty and uploaded from there.
+    GLuint present_pbo = 0;
+    uint8_t* present_pbo_pixels = NULL;
+    GLsync present_pbo_fence = 0;
+    if (glBufferStorage)
+    {
+        const GLbitfield present_pbo_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &present_pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, present_pbo);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, fbwidth * fbheight * 4, NULL, present_pbo_flags);
+        present_pbo_pixels = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, fbwidth * fbheight * 4, present_pbo_flags);
+        assert(present_pbo_pixels);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
     const int kZoomTextureWidth = 8;
     GLuint zoomTexture;
     glGenTextures(1, &zoomTexture);
@@ -470,6 +504,9 @@ int main()
         bool requested_screenshot = false;
         std::string screenshot_filename;
 
+        bool requested_trace = false;
+        std::string trace_filename;
+
         ImGui::SetNextWindowSize(ImVec2(400, 375), ImGuiSetCond_Once);
         if (ImGui::Begin("Toolbox"))
         {
@@ -582,6 +619,20 @@ int main()
                 }
             }
 
+            if (ImGui::Button("Capture trace of next frame"))
+            {
+                trace_filename = GetSaveFileNameEasy();
+                if (!trace_filename.empty())
+                {
+                    requested_trace = true;
+                    size_t found_dot = trace_filename.find_last_of('.');
+                    if (found_dot == std::string::npos || trace_filename.substr(found_dot) != std::string(".json"))
+                    {
+                        trace_filename += ".json";
+                    }
+                }
+            }
+
             if (ImGui::ListBox("Model selection", &curr_model_index, all_model_names, num_models))
             {
                 switched_model = true;
@@ -621,6 +672,7 @@ int main()
                 memcpy(cpuname + 32, cpuInfo, sizeof(cpuInfo));
 
                 fprintf(f, "cpu,%s\n", cpuname);
+                fprintf(f, "instruction set,%s\n", instruction_set_name(framebuffer_get_instruction_set(fb)));
 
                 fprintf(f, "\n");
 
@@ -866,7 +918,9 @@ int main()
             {
                 std::string filename = std::string("assets/") + all_model_names[curr_model_index] + "/" + all_model_names[curr_model_index] + ".obj";
                 std::string mtl_basepath = std::string("assets/") + all_model_names[curr_model_index] + "/";
-                scene_add_models(sc, filename.c_str(), mtl_basepath.c_str(), &loaded_model_first_ids[curr_model_index], &loaded_model_num_ids[curr_model_index]);
+                model_load_config_t model_load_config = {};
+                model_load_config.optimize_vertex_order = 1;
+                scene_add_models_ex(sc, filename.c_str(), mtl_basepath.c_str(), &model_load_config, &loaded_model_first_ids[curr_model_index], &loaded_model_num_ids[curr_model_index]);
             }
 
             for (uint32_t model_id = loaded_model_first_ids[curr_model_index]; model_id < loaded_model_first_ids[curr_model_index] + loaded_model_num_ids[curr_model_index]; model_id++)
@@ -952,8 +1006,34 @@ int main()
 
         LARGE_INTEGER before_raster, after_raster;
         QueryPerformanceCounter(&before_raster);
+        if (ImGui::Begin("Renderer"))
+        {
+            ImGui::Checkbox("Cull clusters", &cull_clusters);
+
+            ImGui::Checkbox("Filter triangles", &filter_triangles);
+            ImGui::SliderInt("Filter Triangle 0", &filter_triangle_ids[0], -1, 1000);
+            ImGui::SliderInt("Filter Triangle 1", &filter_triangle_ids[1], -1, 1000);
+            ImGui::SliderInt("Filter Triangle 2", &filter_triangle_ids[2], -1, 1000);
+
+            ImGui::Checkbox("Filter instances", &filter_instances);
+            ImGui::SliderInt("Filter Instance 0", &filter_instance_index, -1, (int)curr_instances.size() - 1);
+        }
+        ImGui::End();
+
+        renderer_set_triangle_filter(rd, filter_triangles, filter_triangle_ids[0], filter_triangle_ids[1], filter_triangle_ids[2]);
+        renderer_set_instance_filter(rd, filter_instances, filter_instance_index);
+        renderer_set_cluster_culling(rd, cull_clusters);
+
         renderer_reset_perfcounters(rd);
+        if (requested_trace)
+        {
+            renderer_begin_trace_capture(rd);
+        }
         renderer_render_scene(rd, sc);
+        if (requested_trace)
+        {
+            renderer_end_trace_capture(rd, trace_filename.c_str());
+        }
         QueryPerformanceCounter(&after_raster);
 
         glClear(GL_COLOR_BUFFER_BIT);
@@ -961,11 +1041,25 @@ int main()
         // render rasterization to screen
         {
             framebuffer_t* fb = renderer_get_framebuffer(rd);
-            framebuffer_pack_row_major(fb, attachment_depth, 0, 0, fbwidth, fbheight, pixelformat_r32_unorm, d32_pixels);
-            framebuffer_pack_row_major(fb, attachment_color0, 0, 0, fbwidth, fbheight, pixelformat_r8g8b8a8_unorm, rgba8_pixels);
+
+            // the presented image is bottom-up, to appease the OpenGL gods
+            uint8_t* present_pixels = rgba8_pixels_dirty;
+            if (present_pbo_pixels)
+            {
+                // the GPU has to be done reading the previous frame out of the buffer before it gets overwritten
+                if (present_pbo_fence)
+                {
+                    glClientWaitSync(present_pbo_fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+                    glDeleteSync(present_pbo_fence);
+                    present_pbo_fence = 0;
+                }
+                present_pixels = present_pbo_pixels;
+            }
 
             if (show_depth)
             {
+                framebuffer_pack_row_major(fb, attachment_depth, 0, 0, fbwidth, fbheight, pixelformat_r32_unorm, d32_pixels);
+
                 // map depth values to a visually meaningful range while ignoring the background
                 uint32_t min_depth = -1, max_depth = -1;
                 for (int32_t i = 0; i < fbwidth * fbheight; i++)
@@ -999,21 +1093,26 @@ int main()
                         *dst = 0xFF000000 | (d << 16) | (d << 8) | d;
                     }
                 }
+
+                for (int32_t row = 0; row < fbheight; row++)
+                {
+                    memcpy(&present_pixels[(fbheight - row - 1) * fbwidth * 4], &rgba8_pixels[row * fbwidth * 4], fbwidth * 4);
+                }
             }
-            
-            if (requested_screenshot)
+            else
             {
-                stbi_write_png(screenshot_filename.c_str(), fbwidth, fbheight, 4, rgba8_pixels, fbwidth * 4);
+                // flipped while packing, by starting from the last row and going backwards
+                framebuffer_pack_row_major_pitched(fb, attachment_color0, 0, 0, fbwidth, fbheight, pixelformat_r8g8b8a8_unorm, &present_pixels[(fbheight - 1) * fbwidth * 4], -fbwidth * 4);
+
+                if (requested_screenshot)
+                {
+                    framebuffer_pack_row_major(fb, attachment_color0, 0, 0, fbwidth, fbheight, pixelformat_r8g8b8a8_unorm, rgba8_pixels);
+                }
             }
             
-            // flip the rows to appease the OpenGL gods
-            for (int32_t row = 0; row < fbheight / 2; row++)
+            if (requested_screenshot)
             {
-                for (int32_t col = 0; col < fbwidth; col++)
-                {
-                    *(uint32_t*)&rgba8_pixels_dirty[(row * fbwidth + col) * 4] = *(uint32_t*)&rgba8_pixels[((fbheight - row - 1) * fbwidth + col) * 4];
-                    *(uint32_t*)&rgba8_pixels_dirty[((fbheight - row - 1) * fbwidth + col) * 4] = *(uint32_t*)&rgba8_pixels[(row * fbwidth + col) * 4];
-                }
+                stbi_write_png(screenshot_filename.c_str(), fbwidth, fbheight, 4, rgba8_pixels, fbwidth * 4);
             }
 
             // Render box around zoom quad
@@ -1026,13 +1125,23 @@ int main()
                         if (y == cursor.y - 1 || y == cursor.y - 1 + kZoomTextureWidth + 1 ||
                             x == cursor.x - 1 || x == cursor.x - 1 + kZoomTextureWidth + 1)
                         {
-                            *(uint32_t*)&rgba8_pixels_dirty[((fbheight - y - 1) * fbwidth + x) * 4] = 0xFFFFFFFF;
+                            *(uint32_t*)&present_pixels[((fbheight - y - 1) * fbwidth + x) * 4] = 0xFFFFFFFF;
                         }
                     }
                 }
             }
 
-            glDrawPixels(fbwidth, fbheight, GL_RGBA, GL_UNSIGNED_BYTE, rgba8_pixels_dirty);
+            if (present_pbo_pixels)
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, present_pbo);
+                glDrawPixels(fbwidth, fbheight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                present_pbo_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
+            else
+            {
+                glDrawPixels(fbwidth, fbheight, GL_RGBA, GL_UNSIGNED_BYTE, present_pixels);
+            }
         }
 
         if (show_perfheatmap)
@@ -1060,11 +1169,12 @@ int main()
             glEnable(GL_BLEND);
             glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
             glUseProgram(0);
-            for (int32_t tile_y = 0; tile_y < (fbheight + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS; tile_y++)
+            int32_t tile_width = framebuffer_get_tile_width(fb);
+            for (int32_t tile_y = 0; tile_y < (fbheight + tile_width - 1) / tile_width; tile_y++)
             {
-                for (int32_t tile_x = 0; tile_x < (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS; tile_x++)
+                for (int32_t tile_x = 0; tile_x < (fbwidth + tile_width - 1) / tile_width; tile_x++)
                 {
-                    int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                    int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                     int tile_i = tile_y * width_in_tiles + tile_x;
 
                     glMatrixMode(GL_PROJECTION);
@@ -1075,10 +1185,10 @@ int main()
 
                     glColor4d((double)tile_summedticks[tile_i] / perf_max * 0.5, 0.0, 0.0, 0.5);
                     glBegin(GL_QUADS);
-                    glVertex2d(tile_x * TILE_WIDTH_IN_PIXELS, tile_y * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d(tile_x * TILE_WIDTH_IN_PIXELS, (tile_y + 1) * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d((tile_x + 1) * TILE_WIDTH_IN_PIXELS, (tile_y + 1) * TILE_WIDTH_IN_PIXELS);
-                    glVertex2d((tile_x + 1) * TILE_WIDTH_IN_PIXELS, tile_y * TILE_WIDTH_IN_PIXELS);
+                    glVertex2d(tile_x * tile_width, tile_y * tile_width);
+                    glVertex2d(tile_x * tile_width, (tile_y + 1) * tile_width);
+                    glVertex2d((tile_x + 1) * tile_width, (tile_y + 1) * tile_width);
+                    glVertex2d((tile_x + 1) * tile_width, tile_y * tile_width);
                     glEnd();
                 }
             }
@@ -1115,25 +1225,41 @@ int main()
             memcpy(cpuname + 32, cpuInfo, sizeof(cpuInfo));
 
             ImGui::Text("CPU: %s", cpuname);
+            ImGui::Text("Instruction set: %s", instruction_set_name(framebuffer_get_instruction_set(fb)));
+
+            float acmr_before, acmr_after;
+            scene_get_model_acmr(sc, loaded_model_first_ids[curr_model_index], loaded_model_num_ids[curr_model_index], &acmr_before, &acmr_after);
+            ImGui::Text("ACMR: %.3f (%.3f before reordering)", acmr_after, acmr_before);
 
             if (cursor.x >= 0 && cursor.x < fbwidth && cursor.y >= 0 && cursor.y < fbheight)
             {
                 ImGui::Text("CursorPos: (%d, %d)", cursor.x, cursor.y);
                 
-                int tile_y = cursor.y / TILE_WIDTH_IN_PIXELS;
-                int tile_x = cursor.x / TILE_WIDTH_IN_PIXELS;
-                int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                int32_t tile_width = framebuffer_get_tile_width(fb);
+                int tile_y = cursor.y / tile_width;
+                int tile_x = cursor.x / tile_width;
+                int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                 int tile_i = tile_y * width_in_tiles + tile_x;
                 ImGui::Text("TileID: %d", tile_i);
-                int tile_start = tile_i * TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS;
-                int swizzled = pdep_u32(cursor.x, 0x55555555 & (TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS - 1));
-                swizzled |= pdep_u32(cursor.y, 0xAAAAAAAA & (TILE_WIDTH_IN_PIXELS * TILE_WIDTH_IN_PIXELS - 1));
+                int tile_start = tile_i * tile_width * tile_width;
+                int swizzled = pdep_u32(cursor.x, 0x55555555 & (tile_width * tile_width - 1));
+                swizzled |= pdep_u32(cursor.y, 0xAAAAAAAA & (tile_width * tile_width - 1));
                 ImGui::Text("Swizzled pixel: %d + %d = %d", tile_start, swizzled, tile_start + swizzled);
 
-                uint8_t r = rgba8_pixels[(cursor.y * fbwidth + cursor.x) * 4 + 0];
-                uint8_t g = rgba8_pixels[(cursor.y * fbwidth + cursor.x) * 4 + 1];
-                uint8_t b = rgba8_pixels[(cursor.y * fbwidth + cursor.x) * 4 + 2];
-                uint8_t a = rgba8_pixels[(cursor.y * fbwidth + cursor.x) * 4 + 3];
+                // only the pixels under the cursor are packed, since the presented image isn't kept around on the CPU
+                for (int i = 0; i < kZoomTextureWidth * kZoomTextureWidth; i++)
+                {
+                    *(uint32_t*)&zoomImagePixels[i * 4] = 0xFF000000;
+                }
+
+                int zoom_width = fbwidth - cursor.x < kZoomTextureWidth ? fbwidth - cursor.x : kZoomTextureWidth;
+                int zoom_height = fbheight - cursor.y < kZoomTextureWidth ? fbheight - cursor.y : kZoomTextureWidth;
+                framebuffer_pack_row_major_pitched(fb, attachment_color0, cursor.x, cursor.y, zoom_width, zoom_height, pixelformat_r8g8b8a8_unorm, zoomImagePixels, kZoomTextureWidth * 4);
+
+                uint8_t r = zoomImagePixels[0];
+                uint8_t g = zoomImagePixels[1];
+                uint8_t b = zoomImagePixels[2];
+                uint8_t a = zoomImagePixels[3];
                 ImGui::Text("Pixel color (ARGB): 0x%08X", (a << 24) | (r << 16) | (g << 8) | b);
                 ImGui::SameLine();
 
@@ -1144,33 +1270,10 @@ int main()
                 fCol.w = (float)(a / 255.0f);
                 ImGui::ColorButton(fCol, true);
 
-                uint32_t d32 = d32_pixels[cursor.y * fbwidth + cursor.x];
+                uint32_t d32;
+                framebuffer_pack_row_major(fb, attachment_depth, cursor.x, cursor.y, 1, 1, pixelformat_r32_unorm, &d32);
                 ImGui::Text("Pixel depth: 0x%X", d32);
 
-                for (int y = 0; y < kZoomTextureWidth; y++)
-                {
-                    for (int x = 0; x < kZoomTextureWidth; x++)
-                    {
-                        uint8_t* dst = &zoomImagePixels[(y * kZoomTextureWidth + x) * 4];
-
-                        if ((cursor.y + y) >= 0 && (cursor.y + y) < fbheight && (cursor.x + x) >= 0 && (cursor.x + x) < fbwidth)
-                        {
-                            uint8_t* src = &rgba8_pixels[((cursor.y + y) * fbwidth + (cursor.x + x)) * 4];
-                            dst[0] = src[0];
-                            dst[1] = src[1];
-                            dst[2] = src[2];
-                            dst[3] = src[3];
-                        }
-                        else
-                        {
-                            dst[0] = 0;
-                            dst[1] = 0;
-                            dst[2] = 0;
-                            dst[3] = 0xFF;
-                        }
-                    }
-                }
-
                 glBindTexture(GL_TEXTURE_2D, zoomTexture);
                 glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kZoomTextureWidth, kZoomTextureWidth, GL_RGBA, GL_UNSIGNED_BYTE, zoomImagePixels);
                 glBindTexture(GL_TEXTURE_2D, 0);
@@ -1235,6 +1338,27 @@ int main()
                     }
                 }
 
+                if (ImGui::CollapsingHeader("Stats", ImGuiTreeNodeFlags_DefaultOpen))
+                {
+                    std::vector<uint64_t> renderer_stats(renderer_get_num_stats(rd));
+                    std::vector<const char*> renderer_stat_names(renderer_get_num_stats(rd));
+                    renderer_get_stats(rd, renderer_stats.data());
+                    renderer_get_stat_names(rd, renderer_stat_names.data());
+                    for (size_t i = 0; i < renderer_stats.size(); i++)
+                    {
+                        ImGui::Text("%s: %llu", renderer_stat_names[i], renderer_stats[i]);
+                    }
+
+                    std::vector<uint64_t> stats(framebuffer_get_num_stats(fb));
+                    std::vector<const char*> stat_names(framebuffer_get_num_stats(fb));
+                    framebuffer_get_stats(fb, stats.data());
+                    framebuffer_get_stat_names(fb, stat_names.data());
+                    for (size_t i = 0; i < stats.size(); i++)
+                    {
+                        ImGui::Text("%s: %llu", stat_names[i], stats[i]);
+                    }
+                }
+
                 if (ImGui::CollapsingHeader("Summed per-tile counters", ImGuiTreeNodeFlags_DefaultOpen))
                 {
                     std::vector<uint64_t> summed_tpcs(framebuffer_get_num_tile_perfcounters(fb));
@@ -1260,9 +1384,10 @@ int main()
                         if (cursorpos.x >= 0 && cursorpos.x < fbwidth &&
                             cursorpos.y >= 0 && cursorpos.y < fbheight)
                         {
-                            int tile_y = cursorpos.y / TILE_WIDTH_IN_PIXELS;
-                            int tile_x = cursorpos.x / TILE_WIDTH_IN_PIXELS;
-                            int width_in_tiles = (fbwidth + TILE_WIDTH_IN_PIXELS - 1) / TILE_WIDTH_IN_PIXELS;
+                            int32_t tile_width = framebuffer_get_tile_width(fb);
+                            int tile_y = cursorpos.y / tile_width;
+                            int tile_x = cursorpos.x / tile_width;
+                            int width_in_tiles = (fbwidth + tile_width - 1) / tile_width;
                             int tile_i = tile_y * width_in_tiles + tile_x;
 
                             ImGui::Text("Tile %d perfcounters:", tile_i);
@@ -1306,7 +1431,20 @@ int main()
         oldcursor = cursor;
     }
 
+    if (present_pbo)
+    {
+        if (present_pbo_fence)
+        {
+            glDeleteSync(present_pbo_fence);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, present_pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &present_pbo);
+    }
+
     free(rgba8_pixels);
+    free(rgba8_pixels_dirty);
     free(d32_pixels);
     free(zoomImagePixels);
 